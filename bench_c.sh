@@ -8,6 +8,10 @@
 #   ./bench_c.sh --large --runs=10         # Test with larger files
 #   ./bench_c.sh --scan-threads=4,6,8,12   # Test different thread counts
 #   ./bench_c.sh --pin=0-5                 # Pin to specific CPUs
+#   ./bench_c.sh --io-compare --cold       # mmap vs io_uring, cold page cache
+#   ./bench_c.sh --table-compare           # linear probing vs swiss table
+#   ./bench_c.sh --shared-compare          # private vs shared table, + RSS
+#   ./bench_c.sh --size-sweep              # 16K..64M inputs, threads vs size
 
 export LC_ALL=C LANG=C
 
@@ -20,6 +24,13 @@ SCAN_THREADS=""
 LARGE_MODE=0
 NO_CLEANUP=0
 VALIDATE_MODE=0
+IO_COMPARE=0
+TABLE_COMPARE=0
+SHARED_COMPARE=0
+COLD_CACHE=0
+URING_QD=8
+SIZE_SWEEP=""
+DEFAULT_SWEEP="16K,64K,256K,1M,4M,16M,64M"
 
 # File names
 REF_FILE="wordcount.c"
@@ -37,6 +48,13 @@ for arg in "$@"; do
         --large)        LARGE_MODE=1 ;;
         --no-cleanup)   NO_CLEANUP=1 ;;
         --validate)     VALIDATE_MODE=1 ;;
+        --io-compare)   IO_COMPARE=1 ;;
+        --table-compare) TABLE_COMPARE=1 ;;
+        --shared-compare) SHARED_COMPARE=1 ;;
+        --qd=*)         URING_QD="${arg#*=}" ;;
+        --cold)         COLD_CACHE=1 ;;
+        --size-sweep)   SIZE_SWEEP="$DEFAULT_SWEEP" ;;
+        --size-sweep=*) SIZE_SWEEP="${arg#*=}" ;;
         --help)
             cat <<EOF
 Usage: $0 [OPTIONS]
@@ -49,6 +67,16 @@ Options:
   --scan-threads=CSV  Test multiple thread counts (e.g., 4,6,8,12)
   --large             Create and test 5x and 25x larger files
   --validate          Show word count output
+  --io-compare        Run each hyperopt build with --io=mmap and --io=uring
+  --qd=N              io_uring queue depth for --io-compare (default: 8)
+  --table-compare     Run each hyperopt build with --table=linear and swiss
+  --shared-compare    Run each hyperopt build with private tables and
+                      --table=shared, reporting peak RSS too
+  --cold              Drop the page cache before every run (needs root)
+  --size-sweep[=CSV]  Cut the input to each size (K/M suffix, default
+                      $DEFAULT_SWEEP) and time every build on
+                      each, plus hyperopt with its own thread choice; the
+                      summary shows where more threads start to pay
   --no-cleanup        Keep binaries after run
 
 Files tested:
@@ -59,6 +87,10 @@ Files tested:
 Examples:
   $0 --large --runs=10
   $0 --hyperonly --scan-threads=4,6,8,12 --pin=0-5
+  $0 --hyperonly --large --io-compare --cold
+  $0 --hyperonly --large --table-compare
+  $0 --hyperonly --large --scan-threads=1,4,8 --shared-compare
+  $0 --size-sweep --scan-threads=1,2,4,8 --runs=20
 EOF
             exit 0
             ;;
@@ -69,6 +101,25 @@ EOF
     esac
 done
 
+if [ $((IO_COMPARE + TABLE_COMPARE + SHARED_COMPARE)) -gt 1 ]; then
+    echo "Use only one of --io-compare, --table-compare and --shared-compare"
+    exit 1
+fi
+
+# A/B variants of each hyperopt build: tag and extra arguments
+VARIANT_TAGS=()
+VARIANT_ARGS=()
+if [ $IO_COMPARE -eq 1 ]; then
+    VARIANT_TAGS=("mmap" "uring")
+    VARIANT_ARGS=("--io=mmap" "--io=uring --qd=$URING_QD")
+elif [ $TABLE_COMPARE -eq 1 ]; then
+    VARIANT_TAGS=("linear" "swiss")
+    VARIANT_ARGS=("--table=linear" "--table=swiss")
+elif [ $SHARED_COMPARE -eq 1 ]; then
+    VARIANT_TAGS=("private" "shared")
+    VARIANT_ARGS=("--table=linear" "--table=shared")
+fi
+
 echo "========================================="
 echo "C Word Counter Benchmark"
 echo "========================================="
@@ -157,6 +208,36 @@ if [ $LARGE_MODE -eq 1 ]; then
     echo ""
 fi
 
+# Size sweep: the input repeated as needed and cut to each size
+to_bytes() {
+    case $1 in
+        *K) echo $((${1%K} * 1024)) ;;
+        *M) echo $((${1%M} * 1048576)) ;;
+        *)  echo "$1" ;;
+    esac
+}
+
+SWEEP_FILES=()
+if [ -n "$SIZE_SWEEP" ]; then
+    echo "Creating size sweep files..."
+    IFS=',' read -ra sizes <<< "$SIZE_SWEEP"
+    for sz in "${sizes[@]}"; do
+        bytes=$(to_bytes "$sz")
+        out="sweep_${sz}.txt"
+        if [ ! -f "$out" ]; then
+            in_bytes=$(stat -c%s "$INPUT_FILE")
+            reps=$((bytes / in_bytes + 1))
+            for _ in $(seq 1 "$reps"); do
+                cat "$INPUT_FILE"
+            done | head -c "$bytes" > "$out"
+        fi
+        SWEEP_FILES+=("$out")
+    done
+    INPUT_FILES=("${SWEEP_FILES[@]}")
+    echo "✓ ${#SWEEP_FILES[@]} sizes: $SIZE_SWEEP"
+    echo ""
+fi
+
 # Show all test files
 echo "Test files:"
 for f in "${INPUT_FILES[@]}"; do
@@ -171,7 +252,8 @@ echo ""
 
 # Results file
 RESULTS_FILE="/tmp/bench_c_results_$$.txt"
-rm -f "$RESULTS_FILE"
+RSS_FILE="/tmp/bench_c_rss_$$.txt"
+rm -f "$RESULTS_FILE" "$RSS_FILE"
 
 # ============================================================================
 # Build Functions
@@ -190,20 +272,19 @@ build_reference() {
     fi
 }
 
+# Thread count is a runtime option (--threads=N), so one binary covers the scan
 build_hyperopt_new() {
-    local threads=$1
-    local output="wordcount_hopt_t${threads}"
+    local output="wordcount_hopt"
     
-    echo "Building $HYPEROPT_FILE (${threads} threads)..."
+    echo "Building $HYPEROPT_FILE..."
     if gcc -O3 $MARCH_FLAGS -flto -fomit-frame-pointer -funroll-loops -pthread \
-           -DNUM_THREADS="$threads" \
-           "$HYPEROPT_FILE" -o "$output" 2>/dev/null; then
-        echo "✓ New hyperopt ${threads}-thread build successful"
+           "$HYPEROPT_FILE" -o "$output" -lm 2>/dev/null; then
+        echo "✓ New hyperopt build successful"
         return 0
     else
-        echo "✗ New hyperopt ${threads}-thread build failed"
-        gcc -O3 $MARCH_FLAGS -pthread -DNUM_THREADS="$threads" \
-            "$HYPEROPT_FILE" -o "$output" 2>&1 | head -5
+        echo "✗ New hyperopt build failed"
+        gcc -O3 $MARCH_FLAGS -pthread \
+            "$HYPEROPT_FILE" -o "$output" -lm 2>&1 | head -5
         return 1
     fi
 }
@@ -231,10 +312,19 @@ build_hyperopt_old() {
 # Benchmark Function
 # ============================================================================
 
+drop_caches() {
+    sync
+    if ! echo 3 > /proc/sys/vm/drop_caches 2>/dev/null; then
+        echo "Warning: cannot drop page cache (not root?), disabling --cold"
+        COLD_CACHE=0
+    fi
+}
+
 run_bench() {
     local name="$1"
     local cmd="$2"
     local file="$3"
+    local args="$4"
     
     if [ ! -f "$file" ]; then
         echo "Skipping: $file not found"
@@ -275,8 +365,10 @@ run_bench() {
     local run
     for ((run = 1; run <= NUM_RUNS; run++)); do
         local start_ns end_ns elapsed
+        [ $COLD_CACHE -eq 1 ] && drop_caches
         start_ns=$(date +%s%N)
-        $runner "$cmd" "$file" > /dev/null 2>&1
+        # shellcheck disable=SC2086
+        $runner "$cmd" $args "$file" > /dev/null 2>&1
         end_ns=$(date +%s%N)
         
         elapsed=$(echo "scale=6; ($end_ns - $start_ns) / 1000000000" | bc)
@@ -318,6 +410,18 @@ run_bench() {
     printf "  Average: %.3fs | Best: %.3fs | p50: %.3fs | p95: %.3fs\n" \
         "$avg" "$min" "$p50" "$p95"
     printf "  Throughput: %.2f MB/s\n" "$throughput"
+
+    # Peak RSS from one more run, as reported by hyperopt --stats
+    if [ $SHARED_COMPARE -eq 1 ] && [[ "$name" == "New Hyperopt"* ]]; then
+        local rss
+        # shellcheck disable=SC2086
+        rss=$($runner "$cmd" $args --stats "$file" 2>&1 |
+            sed -n 's/^Peak RSS: *\([0-9.]*\).*/\1/p')
+        if [ -n "$rss" ]; then
+            printf "  Peak RSS: %s MB\n" "$rss"
+            echo "${name}[${shortf}]|$rss" >> "$RSS_FILE"
+        fi
+    fi
     echo ""
     
     # Record results
@@ -335,32 +439,53 @@ echo ""
 
 declare -a BUILDS=()
 declare -a BUILD_NAMES=()
+declare -a BUILD_ARGS=()
 
 # Build reference if not hyper-only
 if [ $HYPER_ONLY -eq 0 ] && [ -f "$REF_FILE" ]; then
     if build_reference; then
         BUILDS+=("./wordcount_ref")
         BUILD_NAMES+=("Reference")
+        BUILD_ARGS+=("")
     fi
 fi
 
 # Determine thread counts to test
 THREAD_COUNTS=(6 12)  # Default
+if [ -n "$SIZE_SWEEP" ]; then
+    THREAD_COUNTS=(1)
+    [ "$(nproc)" -gt 1 ] && THREAD_COUNTS+=("$(nproc)")
+fi
 
 if [ -n "$SCAN_THREADS" ]; then
     IFS=',' read -ra THREAD_COUNTS <<< "$SCAN_THREADS"
 fi
 
-# Build NEW hyperopt variants
+# Build NEW hyperopt once, one variant per thread count
 if [ -f "$HYPEROPT_FILE" ]; then
     echo ""
-    for t in "${THREAD_COUNTS[@]}"; do
-        t=$(echo "$t" | tr -d ' ')
-        if build_hyperopt_new "$t"; then
-            BUILDS+=("./wordcount_hopt_t${t}")
-            BUILD_NAMES+=("New Hyperopt (${t}T)")
+    if build_hyperopt_new; then
+        for t in "${THREAD_COUNTS[@]}"; do
+            t=$(echo "$t" | tr -d ' ')
+            if [ ${#VARIANT_TAGS[@]} -gt 0 ]; then
+                for v in "${!VARIANT_TAGS[@]}"; do
+                    BUILDS+=("./wordcount_hopt")
+                    BUILD_NAMES+=("New Hyperopt (${t}T ${VARIANT_TAGS[$v]})")
+                    BUILD_ARGS+=("--threads=$t ${VARIANT_ARGS[$v]}")
+                done
+            else
+                BUILDS+=("./wordcount_hopt")
+                BUILD_NAMES+=("New Hyperopt (${t}T)")
+                BUILD_ARGS+=("--threads=$t")
+            fi
+        done
+        # Threads and table sizes chosen from the input
+        if [ -n "$SIZE_SWEEP" ]; then
+            BUILDS+=("./wordcount_hopt")
+            BUILD_NAMES+=("New Hyperopt (auto)")
+            BUILD_ARGS+=("")
         fi
-    done
+    fi
 else
     echo "Note: $HYPEROPT_FILE not found"
 fi
@@ -374,6 +499,7 @@ if [ -f "$HYPEROPT_OLD_FILE" ]; then
         if build_hyperopt_old "$t"; then
             BUILDS+=("./wordcount_hopt_old_t${t}")
             BUILD_NAMES+=("Old Hyperopt (${t}T)")
+            BUILD_ARGS+=("")
         fi
     done
 else
@@ -390,10 +516,12 @@ echo "========================================="
 echo "Warming Up"
 echo "========================================="
 
-# Warm filesystem cache
-for f in "${INPUT_FILES[@]}"; do
-    [ -f "$f" ] && cat "$f" > /dev/null
-done
+# Warm filesystem cache (pointless when every run starts cold)
+if [ $COLD_CACHE -eq 0 ]; then
+    for f in "${INPUT_FILES[@]}"; do
+        [ -f "$f" ] && cat "$f" > /dev/null
+    done
+fi
 
 # Warm CPU with first build
 if [ -f "$INPUT_FILE" ]; then
@@ -410,7 +538,8 @@ echo ""
 # Run all benchmarks
 for idx in "${!BUILDS[@]}"; do
     for f in "${INPUT_FILES[@]}"; do
-        run_bench "${BUILD_NAMES[$idx]}" "${BUILDS[$idx]}" "$f"
+        run_bench "${BUILD_NAMES[$idx]}" "${BUILDS[$idx]}" "$f" \
+            "${BUILD_ARGS[$idx]}"
     done
 done
 
@@ -433,7 +562,7 @@ if [ $VALIDATE_MODE -eq 1 ]; then
                 ;;
             "New Hyperopt (6T)")
                 echo "--- New Hyperopt ---"
-                "${BUILDS[$idx]}" "$INPUT_FILE" 2>&1 | head -20
+                "${BUILDS[$idx]}" ${BUILD_ARGS[$idx]} "$INPUT_FILE" 2>&1 | head -20
                 echo ""
                 ;;
             "Old Hyperopt (6T)")
@@ -557,6 +686,73 @@ if (( $(echo "$new_best > 0 && $old_best > 0" | bc -l) )); then
     echo ""
 fi
 
+# Compare the two variants per build and file if both were run
+if [ ${#VARIANT_TAGS[@]} -eq 2 ]; then
+    a="${VARIANT_TAGS[0]}"
+    b="${VARIANT_TAGS[1]}"
+    echo "$a vs $b (avg time, lower is better):"
+    for f in "${INPUT_FILES[@]}"; do
+        shortf=$(basename "$f")
+        while IFS='|' read -r name avg _ _; do
+            [[ "$name" == *" $a)[$shortf]" ]] || continue
+            b_name="${name/ $a)/ $b)}"
+            b_avg=$(grep -F "${b_name}|" "$RESULTS_FILE" | cut -d'|' -f2)
+            [ -n "$b_avg" ] || continue
+            ratio=$(echo "scale=2; $avg / $b_avg" | bc)
+            printf "  %-36s %s %.3fs  %s %.3fs  → %s %sx\n" \
+                "${name%% $a)*})[$shortf]" "$a" "$avg" "$b" "$b_avg" "$b" "$ratio"
+        done < "$RESULTS_FILE"
+    done
+    echo ""
+fi
+
+# Best time per build and size, and the fastest build at each size
+if [ ${#SWEEP_FILES[@]} -gt 0 ]; then
+    echo "Size sweep (best ms, lower is better):"
+    printf "  %-8s" "size"
+    for idx in "${!BUILD_NAMES[@]}"; do
+        label="${BUILD_NAMES[$idx]#New Hyperopt }"
+        printf " %12s" "${label:0:12}"
+    done
+    printf "  %s\n" "fastest"
+    for f in "${SWEEP_FILES[@]}"; do
+        sz="${f#sweep_}"
+        printf "  %-8s" "${sz%.txt}"
+        best_ms=""
+        best_name=""
+        for idx in "${!BUILD_NAMES[@]}"; do
+            name="${BUILD_NAMES[$idx]}"
+            min=$(grep -F "${name}[${f}]|" "$RESULTS_FILE" | head -1 |
+                cut -d'|' -f3)
+            if [ -z "$min" ]; then
+                printf " %12s" "-"
+                continue
+            fi
+            ms=$(echo "scale=2; $min * 1000" | bc)
+            printf " %12.2f" "$ms"
+            if [ -z "$best_ms" ] || (( $(echo "$ms < $best_ms" | bc -l) )); then
+                best_ms=$ms
+                best_name=$name
+            fi
+        done
+        printf "  %s\n" "$best_name"
+    done
+    echo ""
+fi
+
+# Peak RSS of the two variants (--shared-compare)
+if [ -s "$RSS_FILE" ]; then
+    echo "$a vs $b (peak RSS):"
+    while IFS='|' read -r name rss; do
+        [[ "$name" == *" $a)["* ]] || continue
+        b_rss=$(grep -F "${name/ $a)/ $b)}|" "$RSS_FILE" | cut -d'|' -f2)
+        [ -n "$b_rss" ] || continue
+        printf "  %-36s %s %8s MB  %s %8s MB\n" \
+            "${name/ $a)/)}" "$a" "$rss" "$b" "$b_rss"
+    done < "$RSS_FILE"
+    echo ""
+fi
+
 # ============================================================================
 # Cleanup
 # ============================================================================
@@ -569,7 +765,8 @@ if [ $NO_CLEANUP -eq 0 ]; then
     fi
     
     if [[ "$response" =~ ^[Yy]$ ]]; then
-        rm -f wordcount_ref wordcount_hopt_t* wordcount_hopt_old_t* "$RESULTS_FILE"
+        rm -f wordcount_ref wordcount_hopt wordcount_hopt_old_t* "$RESULTS_FILE" \
+            "$RSS_FILE"
         rm -f *_c-hopt_results.txt  # Old hyperopt writes these
         
         if [ $LARGE_MODE -eq 1 ]; then
@@ -578,6 +775,7 @@ if [ $NO_CLEANUP -eq 0 ]; then
                 rm -f book2.txt book3.txt
             fi
         fi
+        [ ${#SWEEP_FILES[@]} -gt 0 ] && rm -f "${SWEEP_FILES[@]}"
         echo "✓ Cleaned up"
     fi
 else
@@ -0,0 +1,570 @@
+#!/bin/bash
+# bench_regress.sh - Regression benchmark for wordcount_hyperopt
+#
+# Records every run (engine time, wall time, throughput, phase times,
+# hardware counters, peak RSS) with the git SHA and the host state (CPU
+# model, governor, THP) as JSON, checks the output against the reference
+# wordcount.c, and compares the timings with a baseline using a
+# Mann-Whitney U test and a Hodges-Lehmann 95% confidence interval.
+#
+# Usage:
+#   ./bench_regress.sh --out=base.json                # record a baseline
+#   ./bench_regress.sh --baseline=base.json           # compare with it
+#   ./bench_regress.sh --against=HEAD~1 --runs=15     # A/B against a commit
+#   ./bench_regress.sh --file=big.txt --args="--threads=4" --threshold=2
+#
+# The JSON holds one object per line in "runs" (each with its variant and
+# file), which is what --baseline reads back without any JSON tool.
+# Exit status: 0, 1 on a flagged regression, 2 on an output mismatch.
+
+export LC_ALL=C LANG=C
+
+# Defaults
+NUM_RUNS=11
+INPUT_FILES=()
+HOPT_ARGS=""
+OUT_FILE=""
+BASELINE=""
+AGAINST=""
+THRESHOLD=3
+ALPHA=0.05
+METRIC="ms"
+PIN_MASK=""
+VALIDATE=1
+CFLAGS="-O3 -march=native -mtune=native -flto -fomit-frame-pointer -funroll-loops"
+
+REF_FILE="wordcount.c"
+HYPEROPT_FILE="wordcount_hyperopt.c"
+WORK_DIR="/tmp/bench_regress_$$"
+
+# Parse arguments
+for arg in "$@"; do
+    case $arg in
+        --runs=*)       NUM_RUNS="${arg#*=}" ;;
+        --file=*)       INPUT_FILES+=("${arg#*=}") ;;
+        --args=*)       HOPT_ARGS="${arg#*=}" ;;
+        --out=*)        OUT_FILE="${arg#*=}" ;;
+        --baseline=*)   BASELINE="${arg#*=}" ;;
+        --against=*)    AGAINST="${arg#*=}" ;;
+        --threshold=*)  THRESHOLD="${arg#*=}" ;;
+        --alpha=*)      ALPHA="${arg#*=}" ;;
+        --metric=*)     METRIC="${arg#*=}" ;;
+        --pin=*)        PIN_MASK="${arg#*=}" ;;
+        --cflags=*)     CFLAGS="${arg#*=}" ;;
+        --no-validate)  VALIDATE=0 ;;
+        --help)
+            cat <<EOF
+Usage: $0 [OPTIONS]
+
+Options:
+  --runs=N            Timed runs per file and build (default: 11)
+  --file=PATH         Input file, repeatable (default: book.txt)
+  --args="ARGS"       Extra wordcount_hyperopt arguments for every run
+  --out=PATH          Write the results as JSON (default:
+                      bench_runs/<sha>-<time>.json)
+  --baseline=PATH     Compare with the runs recorded in a JSON file
+  --against=REV       Build wordcount_hyperopt.c from git revision REV
+                      and run it interleaved with the working tree; the
+                      comparison then uses these runs
+  --threshold=PCT     Smallest slowdown reported as a regression (default: 3)
+  --alpha=P           Significance level of the U test (default: 0.05)
+  --metric=NAME       Compared timing: ms (engine time, default), wall_ms
+                      (process wall time) or scan (scan phase)
+  --pin=MASK          CPU affinity mask (e.g., 0-5, 0,2,4)
+  --cflags="FLAGS"    Compiler flags for the hyperopt builds
+  --no-validate       Skip the output check against $REF_FILE
+
+A build is only flagged when the U test rejects "same distribution" at
+--alpha AND the estimated shift exceeds --threshold percent of the
+baseline median; at least 8 runs a side are needed for the interval.
+The output check compares every (word, count) row with the reference and
+is skipped when --args change the word definition (--word, --utf8,
+--approx).
+
+Examples:
+  $0 --runs=21 --out=base.json && $0 --runs=21 --baseline=base.json
+  $0 --against=main --file=book.txt --file=big.txt
+  $0 --against=HEAD --args="--table=swiss" --metric=scan
+EOF
+            exit 0
+            ;;
+        *)
+            echo "Unknown option: $arg (use --help)"
+            exit 1
+            ;;
+    esac
+done
+
+[ ${#INPUT_FILES[@]} -eq 0 ] && INPUT_FILES=("book.txt")
+
+if ! [[ "$NUM_RUNS" =~ ^[0-9]+$ ]] || [ "$NUM_RUNS" -lt 2 ]; then
+    echo "--runs must be at least 2"
+    exit 1
+fi
+case $METRIC in
+    ms|wall_ms|scan) ;;
+    *) echo "Unknown --metric: $METRIC (ms, wall_ms or scan)"; exit 1 ;;
+esac
+if [ -n "$BASELINE" ] && [ ! -f "$BASELINE" ]; then
+    echo "Baseline not found: $BASELINE"
+    exit 1
+fi
+
+for f in "${INPUT_FILES[@]}"; do
+    if [ "$f" = "book.txt" ] && [ ! -f "$f" ]; then
+        echo "Downloading test file..."
+        curl -sL "https://www.gutenberg.org/files/2701/2701-0.txt" -o "$f"
+    fi
+    if [ ! -f "$f" ]; then
+        echo "Input not found: $f"
+        exit 1
+    fi
+done
+
+mkdir -p "$WORK_DIR" || exit 1
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+runner=""
+if [ -n "$PIN_MASK" ] && command -v taskset >/dev/null 2>&1; then
+    runner="taskset -c $PIN_MASK"
+fi
+
+# ============================================================================
+# Environment
+# ============================================================================
+
+json_str() {
+    local s="${1//\\/\\\\}"
+    printf '"%s"' "${s//\"/\\\"}"
+}
+
+GIT_SHA=$(git rev-parse --short=12 HEAD 2>/dev/null || echo "unknown")
+GIT_DIRTY=false
+if [ -n "$(git status --porcelain -- "$HYPEROPT_FILE" 2>/dev/null)" ]; then
+    GIT_DIRTY=true
+fi
+CPU_MODEL=$(sed -n 's/^model name[[:space:]]*: //p' /proc/cpuinfo 2>/dev/null |
+    head -1)
+[ -z "$CPU_MODEL" ] && CPU_MODEL=$(uname -m)
+GOVERNOR=$(cat /sys/devices/system/cpu/cpu0/cpufreq/scaling_governor \
+    2>/dev/null || echo "n/a")
+THP=$(sed -n 's/.*\[\(.*\)\].*/\1/p' \
+    /sys/kernel/mm/transparent_hugepage/enabled 2>/dev/null)
+[ -z "$THP" ] && THP="n/a"
+CC_VER=$(gcc -dumpfullversion -dumpversion 2>/dev/null)
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+
+echo "========================================="
+echo "Hyperopt Regression Benchmark"
+echo "========================================="
+echo ""
+echo "Commit:   $GIT_SHA$([ "$GIT_DIRTY" = true ] && echo " (modified)")"
+echo "CPU:      $CPU_MODEL ($(nproc) CPUs)"
+echo "Governor: $GOVERNOR, THP: $THP"
+[ "$GOVERNOR" != "performance" ] && [ "$GOVERNOR" != "n/a" ] &&
+    echo "Warning: governor is not 'performance', expect more noise"
+[ -n "$PIN_MASK" ] && echo "CPU pin mask: $PIN_MASK"
+echo ""
+
+# ============================================================================
+# Build
+# ============================================================================
+
+build_hyperopt() {
+    local src="$1"
+    local output="$2"
+    # shellcheck disable=SC2086
+    if ! gcc $CFLAGS -D_GNU_SOURCE -pthread "$src" -o "$output" -lm \
+           2> "$WORK_DIR/build.log"; then
+        echo "✗ Build of $src failed"
+        head -5 "$WORK_DIR/build.log"
+        return 1
+    fi
+}
+
+echo "Building..."
+HOPT_TEST="$WORK_DIR/hopt_test"
+build_hyperopt "$HYPEROPT_FILE" "$HOPT_TEST" || exit 1
+echo "✓ $HYPEROPT_FILE (working tree)"
+
+VARIANTS=("test")
+BINS=("$HOPT_TEST")
+if [ -n "$AGAINST" ]; then
+    base_sha=$(git rev-parse --short=12 "$AGAINST" 2>/dev/null)
+    if [ -z "$base_sha" ] ||
+       ! git show "$base_sha:$HYPEROPT_FILE" > "$WORK_DIR/hopt_base.c"; then
+        echo "✗ Cannot read $HYPEROPT_FILE at $AGAINST"
+        exit 1
+    fi
+    # The old source may include its header from the tree
+    git show "$base_sha:wordcount_hyperopt.h" > "$WORK_DIR/wordcount_hyperopt.h" \
+        2>/dev/null
+    build_hyperopt "$WORK_DIR/hopt_base.c" "$WORK_DIR/hopt_base" || exit 1
+    echo "✓ $HYPEROPT_FILE at $AGAINST ($base_sha)"
+    VARIANTS+=("base")
+    BINS+=("$WORK_DIR/hopt_base")
+fi
+
+case " $HOPT_ARGS " in
+    *" --word"*|*" --utf8"*|*" --approx"*)
+        if [ $VALIDATE -eq 1 ]; then
+            echo "Note: --args change the word definition, skipping validation"
+            VALIDATE=0
+        fi
+        ;;
+esac
+if [ $VALIDATE -eq 1 ]; then
+    if ! gcc -O2 -std=c11 -pthread "$REF_FILE" -o "$WORK_DIR/ref" \
+           2> "$WORK_DIR/build.log"; then
+        echo "✗ Reference build failed"
+        head -5 "$WORK_DIR/build.log"
+        exit 1
+    fi
+    echo "✓ $REF_FILE (reference)"
+fi
+echo ""
+
+# ============================================================================
+# Validation
+# ============================================================================
+
+# Both sides cut words to the reference's MAX_WORD_LEN: hyperopt keeps up
+# to 99 letters, and the reference hashes the whole run but stores only
+# the cut word, so runs that differ past it are separate rows. Rows that
+# coincide once cut are summed.
+REF_WORD_MAX=$(grep -o 'MAX_WORD_LEN = [0-9]*' "$REF_FILE" | grep -o '[0-9]*$')
+clip_rows() {
+    awk -F '\t' -v max="${REF_WORD_MAX:-63}" '
+        { c[substr($1, 1, max)] += $2 }
+        END { for (w in c) printf "%s\t%.0f\n", w, c[w] }' |
+        sort
+}
+
+# Every (word, count) row, sorted by word
+ref_rows() {
+    "$WORK_DIR/ref" "$1" all |
+        awk 'NF == 4 && $1 ~ /^[0-9]+$/ && $4 ~ /%$/ { print $2 "\t" $3 }' |
+        clip_rows
+}
+
+hopt_rows() {
+    # shellcheck disable=SC2086
+    "$1" $HOPT_ARGS --all --format=tsv --sort=word "$2" 2>/dev/null |
+        clip_rows
+}
+
+declare -A FILE_VALID
+MISMATCH=0
+if [ $VALIDATE -eq 1 ]; then
+    echo "Validating against $REF_FILE..."
+    for f in "${INPUT_FILES[@]}"; do
+        ref_rows "$f" > "$WORK_DIR/ref.tsv"
+        FILE_VALID["$f"]=true
+        for v in "${!VARIANTS[@]}"; do
+            hopt_rows "${BINS[$v]}" "$f" > "$WORK_DIR/hopt.tsv"
+            if cmp -s "$WORK_DIR/ref.tsv" "$WORK_DIR/hopt.tsv"; then
+                printf "  %-20s %-5s ✓ %s rows\n" "$(basename "$f")" \
+                    "${VARIANTS[$v]}" "$(wc -l < "$WORK_DIR/ref.tsv")"
+            else
+                printf "  %-20s %-5s ✗ results differ from the reference:\n" \
+                    "$(basename "$f")" "${VARIANTS[$v]}"
+                diff "$WORK_DIR/ref.tsv" "$WORK_DIR/hopt.tsv" | head -6 |
+                    sed 's/^/      /'
+                FILE_VALID["$f"]=false
+                MISMATCH=1
+            fi
+        done
+    done
+    echo ""
+fi
+
+# ============================================================================
+# Benchmark
+# ============================================================================
+
+# One run's --stats (stderr with --format=tsv) as JSON members
+parse_stats() {
+    awk -v wall="$2" '
+        /^Total words:/ { words = $3 }
+        /^Unique words:/ { unique = $3 }
+        /^Time:/ { ms = $2 }
+        /^Throughput:/ { mbps = $2 }
+        /^Peak RSS:/ { rss = $3 }
+        /^=== Phases ===/ { inph = 1; next }
+        inph && /^phase/ { ncol = NF; next }
+        inph && NF == 0 { inph = 0 }
+        inph && $2 ~ /^[0-9.]+$/ {
+            phases = phases (phases ? ", " : "") "\"" $1 "\": " $2
+            if (ncol >= 5) { cyc += $3; ins += $4; llc += $5; ctr = 1 }
+        }
+        END {
+            printf "\"ms\": %s, \"wall_ms\": %s, \"mbps\": %s, ", \
+                ms ? ms : "null", wall, mbps ? mbps : "null"
+            printf "\"words\": %s, \"unique\": %s, ", \
+                words ? words : "null", unique ? unique : "null"
+            printf "\"phases\": {%s}, ", phases
+            if (ctr)
+                printf "\"cycles\": %.0f, \"instr\": %.0f, \"llc_miss\": %.0f, ",
+                    cyc, ins, llc
+            else
+                printf "\"cycles\": null, \"instr\": null, \"llc_miss\": null, "
+            printf "\"rss_mb\": %s", rss ? rss : "null"
+        }' "$1"
+}
+
+RUNS_FILE="$WORK_DIR/runs.jsonl"
+: > "$RUNS_FILE"
+
+# Warm the page cache and the binaries
+for f in "${INPUT_FILES[@]}"; do
+    cat "$f" > /dev/null
+    for b in "${BINS[@]}"; do
+        # shellcheck disable=SC2086
+        $runner "$b" $HOPT_ARGS "$f" > /dev/null 2>&1
+    done
+done
+
+echo "Benchmarking ($NUM_RUNS runs each)..."
+for f in "${INPUT_FILES[@]}"; do
+    shortf=$(basename "$f")
+    for ((run = 1; run <= NUM_RUNS; run++)); do
+        # Alternate the order so drift (thermal, frequency) hits both builds
+        order=("${!VARIANTS[@]}")
+        if [ ${#VARIANTS[@]} -eq 2 ] && [ $((run % 2)) -eq 0 ]; then
+            order=(1 0)
+        fi
+        for v in "${order[@]}"; do
+            start_ns=$(date +%s%N)
+            # shellcheck disable=SC2086
+            $runner "${BINS[$v]}" $HOPT_ARGS --stats --format=tsv "$f" \
+                > /dev/null 2> "$WORK_DIR/stats.txt"
+            end_ns=$(date +%s%N)
+            wall=$(awk -v a="$start_ns" -v b="$end_ns" \
+                'BEGIN { printf "%.3f", (b - a) / 1e6 }')
+            printf '    {"variant": "%s", "file": %s, "run": %d, %s},\n' \
+                "${VARIANTS[$v]}" "$(json_str "$shortf")" "$run" \
+                "$(parse_stats "$WORK_DIR/stats.txt" "$wall")" >> "$RUNS_FILE"
+        done
+        [ -t 1 ] && printf "\r  %-20s run %d/%d\033[K" "$shortf" "$run" \
+            "$NUM_RUNS"
+    done
+    [ -t 1 ] && printf "\r\033[K"
+    printf "  %-20s done\n" "$shortf"
+done
+echo ""
+
+# ============================================================================
+# JSON Output
+# ============================================================================
+
+if [ -z "$OUT_FILE" ]; then
+    mkdir -p bench_runs
+    OUT_FILE="bench_runs/${GIT_SHA}-$(date -u +%Y%m%dT%H%M%S).json"
+fi
+
+{
+    echo "{"
+    echo "  \"schema\": 1,"
+    echo "  \"date\": \"$DATE\","
+    echo "  \"git\": {\"sha\": \"$GIT_SHA\", \"dirty\": $GIT_DIRTY$(
+        [ -n "$AGAINST" ] && echo ", \"base\": \"$base_sha\"")},"
+    echo "  \"host\": {\"cpu\": $(json_str "$CPU_MODEL"), \"cpus\": $(nproc)," \
+         "\"governor\": $(json_str "$GOVERNOR"), \"thp\": $(json_str "$THP")," \
+         "\"kernel\": $(json_str "$(uname -r)")},"
+    echo "  \"build\": {\"cc\": $(json_str "gcc $CC_VER")," \
+         "\"cflags\": $(json_str "$CFLAGS")},"
+    echo "  \"args\": $(json_str "$HOPT_ARGS"),"
+    echo "  \"pin\": $(json_str "$PIN_MASK"),"
+    echo "  \"files\": ["
+    n=0
+    for f in "${INPUT_FILES[@]}"; do
+        n=$((n + 1))
+        sep=","
+        [ $n -eq ${#INPUT_FILES[@]} ] && sep=""
+        printf '    {"file": %s, "bytes": %s, "valid": %s}%s\n' \
+            "$(json_str "$(basename "$f")")" "$(stat -c%s "$f")" \
+            "${FILE_VALID[$f]:-null}" "$sep"
+    done
+    echo "  ],"
+    echo "  \"runs\": ["
+    sed '$ s/,$//' "$RUNS_FILE"
+    echo "  ]"
+    echo "}"
+} > "$OUT_FILE"
+echo "Results: $OUT_FILE"
+echo ""
+
+# ============================================================================
+# Comparison
+# ============================================================================
+
+# Samples of the metric as "file<TAB>value" for one variant
+samples() {
+    local key="\"$METRIC\": "
+    grep -F "\"variant\": \"$2\"" "$1" |
+        sed -n "s/.*\"file\": \"\\([^\"]*\\)\".*${key}\\([0-9.]*\\).*/\\1\t\\2/p"
+}
+
+COMPARE_FILE=""
+BASE_VARIANT=""
+if [ -n "$AGAINST" ]; then
+    COMPARE_FILE="$OUT_FILE"
+    BASE_VARIANT="base"
+    BASE_LABEL="$AGAINST ($base_sha)"
+elif [ -n "$BASELINE" ]; then
+    COMPARE_FILE="$BASELINE"
+    BASE_VARIANT="test"
+    BASE_LABEL="$BASELINE ($(sed -n 's/.*"sha": "\([^"]*\)".*/\1/p' \
+        "$BASELINE" | head -1))"
+    base_cpu=$(sed -n 's/.*"cpu": "\([^"]*\)".*/\1/p' "$BASELINE" | head -1)
+    [ "$base_cpu" != "$CPU_MODEL" ] &&
+        echo "Warning: baseline was recorded on '$base_cpu'"
+    base_args=$(sed -n 's/^  "args": "\(.*\)",$/\1/p' "$BASELINE")
+    [ "$base_args" != "$HOPT_ARGS" ] &&
+        echo "Warning: baseline was recorded with --args=\"$base_args\""
+fi
+
+REGRESSED=0
+if [ -n "$COMPARE_FILE" ]; then
+    samples "$COMPARE_FILE" "$BASE_VARIANT" > "$WORK_DIR/a.tsv"
+    samples "$OUT_FILE" "test" > "$WORK_DIR/b.tsv"
+
+    echo "========================================="
+    echo "Comparison ($METRIC, lower is better)"
+    echo "========================================="
+    echo ""
+    echo "Baseline: $BASE_LABEL"
+    echo "Test:     working tree ($GIT_SHA)"
+    echo ""
+
+    # Mann-Whitney U (normal approximation with tie and continuity
+    # corrections) and the Hodges-Lehmann shift with its distribution-free
+    # 95% interval, both relative to the baseline median
+    awk -F'\t' -v alpha="$ALPHA" -v thr="$THRESHOLD" '
+        function isort(v, n,    i, j, t) {
+            for (i = 2; i <= n; i++) {
+                t = v[i]
+                for (j = i - 1; j >= 1 && v[j] > t; j--)
+                    v[j + 1] = v[j]
+                v[j + 1] = t
+            }
+        }
+        function median(v, n) {
+            isort(v, n)
+            return n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2
+        }
+        # erfc(x) for x >= 0, Abramowitz and Stegun 7.1.26
+        function erfc(x,    t, y) {
+            t = 1 / (1 + 0.3275911 * x)
+            y = -1.453152027 + t * 1.061405429
+            y = 0.254829592 + t * (-0.284496736 + t * (1.421413741 + t * y))
+            return t * y * exp(-x * x)
+        }
+        FNR == NR { na[$1]++; a[$1, na[$1]] = $2; next }
+        { if (!($1 in nb)) order[++nf] = $1; nb[$1]++; b[$1, nb[$1]] = $2 }
+        END {
+            printf "%-20s %10s %10s %8s %18s %8s  %s\n", "file", "base",
+                "test", "change", "95% CI", "p", "verdict"
+            for (k = 1; k <= nf; k++) {
+                f = order[k]; m = na[f]; n = nb[f]
+                if (m < 2 || n < 2) {
+                    printf "%-20s %10s (no baseline runs)\n", f, "-"
+                    continue
+                }
+                # Ranks over both samples, ties get the mean rank
+                N = 0
+                for (i = 1; i <= m; i++) { N++; val[N] = a[f, i]; grp[N] = 0 }
+                for (i = 1; i <= n; i++) { N++; val[N] = b[f, i]; grp[N] = 1 }
+                for (i = 2; i <= N; i++) {
+                    tv = val[i]; tg = grp[i]
+                    for (j = i - 1; j >= 1 && val[j] > tv; j--) {
+                        val[j + 1] = val[j]; grp[j + 1] = grp[j]
+                    }
+                    val[j + 1] = tv; grp[j + 1] = tg
+                }
+                r1 = 0; ties = 0
+                for (i = 1; i <= N; i = j) {
+                    for (j = i; j <= N && val[j] == val[i]; j++)
+                        ;
+                    t = j - i
+                    ties += t * t * t - t
+                    for (q = i; q < j; q++)
+                        if (!grp[q])
+                            r1 += (i + j - 1) / 2
+                }
+                u = r1 - m * (m + 1) / 2
+                sd = sqrt(m * n / 12 * ((N + 1) - ties / (N * (N - 1))))
+                p = 1
+                if (sd > 0) {
+                    z = (u - m * n / 2); if (z < 0) z = -z
+                    z = z > 0.5 ? (z - 0.5) / sd : 0
+                    p = erfc(z / sqrt(2))
+                }
+
+                # Pairwise differences test - base
+                nd = 0
+                for (i = 1; i <= m; i++)
+                    for (j = 1; j <= n; j++)
+                        d[++nd] = b[f, j] - a[f, i]
+                shift = median(d, nd)
+                for (i = 1; i <= m; i++) va[i] = a[f, i]
+                for (j = 1; j <= n; j++) vb[j] = b[f, j]
+                ma = median(va, m); mb = median(vb, n)
+                c = int(m * n / 2 - 1.96 * sqrt(m * n * (m + n + 1) / 12))
+                ci = "-"
+                if (c >= 1 && ma > 0)
+                    ci = sprintf("[%+.1f%%, %+.1f%%]", 100 * d[c] / ma,
+                                 100 * d[nd - c + 1] / ma)
+                pct = ma > 0 ? 100 * shift / ma : 0
+
+                verdict = "same"
+                if (p < alpha && pct > thr) {
+                    verdict = "REGRESSION"; bad = 1
+                } else if (p < alpha && pct < -thr) {
+                    verdict = "faster"
+                } else if (p < alpha) {
+                    verdict = "within threshold"
+                }
+                printf "%-20s %10.2f %10.2f %+7.1f%% %18s %8.4f  %s\n", f, ma,
+                    mb, pct, ci, p, verdict
+            }
+            exit bad
+        }' "$WORK_DIR/a.tsv" "$WORK_DIR/b.tsv"
+    REGRESSED=$?
+    echo ""
+    if [ $REGRESSED -ne 0 ]; then
+        echo "✗ Regression above ${THRESHOLD}% (alpha $ALPHA)"
+    else
+        echo "✓ No regression above ${THRESHOLD}% (alpha $ALPHA)"
+    fi
+else
+    # Summary of this run alone: median and spread per file
+    samples "$OUT_FILE" "test" | awk -F'\t' -v metric="$METRIC" '
+        { if (!($1 in n)) order[++nf] = $1; n[$1]++; v[$1, n[$1]] = $2 }
+        END {
+            printf "%-20s %10s %10s %10s %7s\n", "file", metric " median",
+                "min", "max", "cv%"
+            for (k = 1; k <= nf; k++) {
+                f = order[k]; c = n[f]; s = 0; ss = 0
+                for (i = 1; i <= c; i++) {
+                    x[i] = v[f, i]; s += x[i]; ss += x[i] * x[i]
+                }
+                for (i = 2; i <= c; i++) {
+                    t = x[i]
+                    for (j = i - 1; j >= 1 && x[j] > t; j--)
+                        x[j + 1] = x[j]
+                    x[j + 1] = t
+                }
+                med = c % 2 ? x[(c + 1) / 2] : (x[c / 2] + x[c / 2 + 1]) / 2
+                mean = s / c; var = ss / c - mean * mean
+                cv = (mean > 0 && var > 0) ? 100 * sqrt(var) / mean : 0
+                printf "%-20s %10.2f %10.2f %10.2f %7.1f\n", f, med, x[1],
+                    x[c], cv
+            }
+        }'
+fi
+echo ""
+
+[ $MISMATCH -ne 0 ] && exit 2
+[ $REGRESSED -ne 0 ] && exit 1
+exit 0
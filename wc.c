@@ -5,10 +5,11 @@
  *
  * Hash table with chaining. Words stored inline via flexible array member.
  * Single pass over mmap'd input: lowercase, hash, and insert in one loop.
- * Output sorted by frequency, then alphabetically for ties.
+ * Output sorted by frequency, then alphabetically for ties; the top rows
+ * come from a bounded heap, the full list ("all") from a sort.
  *
  * Build: cc -O2 -std=c11 wc.c -o wc
- * Usage: ./wc <file>
+ * Usage: ./wc <file> [top|all]   (default: top 10)
  */
 
 #include <fcntl.h>
@@ -136,23 +137,55 @@ static int cmp(const void *a, const void *b)
     return strcmp(x->w, y->w);
 }
 
-static void output(void)
+/* bounded min-heap of the k best entries, weakest at h[0] */
+static void offer(E **h, size_t *n, size_t k, E *e)
 {
-    E **arr = malloc(G.n * sizeof(E *));
+    size_t i;
+    if (*n < k) {
+        for (i = (*n)++; i > 0 && cmp(&h[(i - 1) / 2], &e) < 0; i = (i - 1) / 2)
+            h[i] = h[(i - 1) / 2];
+        h[i] = e;
+        return;
+    }
+    if (cmp(&e, &h[0]) >= 0)
+        return;
+    for (i = 0;;) {
+        size_t c = 2 * i + 1;
+        if (c >= k)
+            break;
+        if (c + 1 < k && cmp(&h[c + 1], &h[c]) > 0)
+            c++;
+        if (cmp(&h[c], &e) <= 0)
+            break;
+        h[i] = h[c];
+        i = c;
+    }
+    h[i] = e;
+}
+
+/* top k rows; k == 0 sorts everything */
+static void output(size_t k)
+{
+    if (k == 0 || k > G.n)
+        k = G.n;
+    E **arr = malloc(k * sizeof(E *));
     if (!arr)
         die("out of memory");
 
     size_t j = 0;
     for (size_t i = 0; i < G.cap; i++)
-        for (E *e = G.tab[i]; e; e = e->next)
-            arr[j++] = e;
+        for (E *e = G.tab[i]; e; e = e->next) {
+            if (k == G.n)
+                arr[j++] = e;
+            else
+                offer(arr, &j, k, e);
+        }
 
-    qsort(arr, G.n, sizeof(E *), cmp);
+    qsort(arr, j, sizeof(E *), cmp);
 
-    size_t top = G.n < 10 ? G.n : 10;
     printf("\n%7s  %-20s  %s\n", "count", "word", "%%");
     printf("-------  --------------------  ------\n");
-    for (size_t i = 0; i < top; i++) {
+    for (size_t i = 0; i < j; i++) {
         E *e = arr[i];
         printf("%7zu  %-20s  %5.2f\n", e->cnt, e->w, 100.0 * e->cnt / G.tot);
     }
@@ -164,11 +197,17 @@ static void output(void)
 
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        (void)fprintf(stderr, "usage: %s <file>\n", argv[0]);
+    if (argc < 2 || argc > 3) {
+        (void)fprintf(stderr, "usage: %s <file> [top|all]\n", argv[0]);
         return 1;
     }
 
+    size_t top = 10;
+    if (argc == 3 && !strcmp(argv[2], "all"))
+        top = 0;
+    else if (argc == 3 && (top = strtoul(argv[2], NULL, 10)) == 0)
+        die("bad top count");
+
     G.fd = open(argv[1], O_RDONLY);
     if (G.fd < 0)
         die("cannot open file");
@@ -188,7 +227,7 @@ int main(int argc, char **argv)
 
     scan();
     if (G.n > 0)
-        output();
+        output(top);
 
     munmap(G.mem, G.len);
     close(G.fd);
@@ -2,7 +2,7 @@
  * wordcount.c — Parallel word frequency counter
  *
  * Build:  cc -std=c11 -O2 -pthread wordcount.c -o wordcount
- * Usage:  ./wordcount <file>
+ * Usage:  ./wordcount <file> [top_n|all]   (default: top 10)
  *
  * Design: Memory-mapped I/O, per-thread hash tables with arena-allocated
  * strings, embarrassingly parallel (no shared mutable state in hot path).
@@ -43,6 +43,8 @@ enum {
     MAX_THREADS = 32,
     INITIAL_CAP = 1 << 12,
     MAX_WORD_LEN = 63,
+    INLINE_KEY = 8, /* words shorter than this live in the Entry */
+    SAMPLE_BYTES = 1 << 16, /* prefix tokenized before pre-sizing */
     TOP_N = 10,
 };
 
@@ -171,35 +173,63 @@ static int ncpu(void)
  * Arena Allocator
  *
  * Bump allocator for string storage. No individual frees—entire arena
- * released at once. Alignment handled via pointer arithmetic.
+ * released at once. Alignment handled via pointer arithmetic. When a block
+ * fills up, a block twice its size is chained in front; earlier blocks stay
+ * put, so returned pointers remain valid.
  * ═══════════════════════════════════════════════════════════════════════════*/
 
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+} ArenaBlock;
+
 typedef struct {
-    char *buf, *ptr, *end;
+    ArenaBlock *head;
+    char *ptr, *end;
+    size_t next_cap;
 } Arena;
 
-static int arena_init(Arena *a, size_t cap)
+static int arena_push(Arena *a, size_t min_size)
 {
-    a->buf = malloc(cap);
-    if (!a->buf)
+    size_t cap = a->next_cap;
+    while (cap < min_size + sizeof(ArenaBlock))
+        cap *= 2;
+
+    ArenaBlock *b = malloc(cap);
+    if (!b)
         return -1;
-    a->ptr = a->buf;
-    a->end = a->buf + cap;
+    b->prev = a->head;
+    a->head = b;
+    a->ptr = (char *)(b + 1);
+    a->end = (char *)b + cap;
+    a->next_cap = cap * 2;
     return 0;
 }
 
+static int arena_init(Arena *a, size_t cap)
+{
+    *a = (Arena){ .next_cap = cap };
+    return arena_push(a, 0);
+}
+
 static void arena_free(Arena *a)
 {
-    free(a->buf);
-    a->buf = NULL;
+    while (a->head) {
+        ArenaBlock *prev = a->head->prev;
+        free(a->head);
+        a->head = prev;
+    }
 }
 
 static void *arena_alloc(Arena *a, size_t size, size_t align)
 {
     uintptr_t p = (uintptr_t)a->ptr;
     uintptr_t aligned = (p + align - 1) & ~(align - 1);
-    if (aligned + size > (uintptr_t)a->end)
-        return NULL;
+    if (aligned + size > (uintptr_t)a->end) {
+        if (arena_push(a, size + align) < 0)
+            return NULL;
+        p = (uintptr_t)a->ptr;
+        aligned = (p + align - 1) & ~(align - 1);
+    }
     a->ptr = (char *)(aligned + size);
     return (void *)aligned;
 }
@@ -214,12 +244,48 @@ static void *arena_alloc(Arena *a, size_t size, size_t align)
 #define FNV_OFFSET 14695981039346656037ULL
 #define FNV_PRIME 1099511628211ULL
 
+/*
+ * Words of up to INLINE_KEY - 1 bytes are stored NUL-padded in the entry
+ * and compared as one integer, so probes never chase into the arena for
+ * them. Longer words point into the arena. len == 0 marks an empty slot.
+ */
 typedef struct {
-    char *key;
+    union {
+        char *ptr;
+        char inl[INLINE_KEY];
+        uint64_t bits;
+    } key;
     size_t count;
     uint64_t hash;
+    size_t len;
 } Entry;
 
+static inline const char *entry_key(const Entry *e)
+{
+    return e->len < INLINE_KEY ? e->key.inl : e->key.ptr;
+}
+
+/* Inline key of a word shorter than INLINE_KEY; reads 8 bytes of word */
+static inline uint64_t key_bits(const char *word, size_t len)
+{
+    uint64_t v;
+    memcpy(&v, word, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return v & ~(~0ULL >> (8 * len));
+#else
+    return v & ((1ULL << (8 * len)) - 1);
+#endif
+}
+
+static inline bool entry_eq(const Entry *a, const Entry *b)
+{
+    if (a->hash != b->hash || a->len != b->len)
+        return false;
+    if (a->len < INLINE_KEY)
+        return a->key.bits == b->key.bits;
+    return memcmp(a->key.ptr, b->key.ptr, a->len) == 0;
+}
+
 typedef struct {
     Entry *entries;
     size_t cap, len, total;
@@ -250,19 +316,18 @@ static void table_free(Table *t)
     arena_free(&t->strings);
 }
 
-static int table_grow(Table *t)
+static int table_rehash(Table *t, size_t new_cap)
 {
-    size_t new_cap = t->cap * 2;
     Entry *new_ent = calloc(new_cap, sizeof(Entry));
     if (!new_ent)
         return -1;
 
     for (size_t i = 0; i < t->cap; i++) {
         const Entry *e = &t->entries[i];
-        if (!e->key)
+        if (!e->len)
             continue;
         size_t idx = e->hash & (new_cap - 1);
-        while (new_ent[idx].key)
+        while (new_ent[idx].len)
             idx = (idx + 1) & (new_cap - 1);
         new_ent[idx] = *e;
     }
@@ -272,26 +337,49 @@ static int table_grow(Table *t)
     return 0;
 }
 
+static int table_grow(Table *t)
+{
+    return table_rehash(t, t->cap * 2);
+}
+
+/* Size t for n unique words in one rehash instead of a chain of doublings */
+static int table_reserve(Table *t, size_t n)
+{
+    size_t cap = t->cap;
+    while (n * 10 >= cap * 7)
+        cap *= 2;
+    return cap == t->cap ? 0 : table_rehash(t, cap);
+}
+
+/* word must have 8 readable bytes (see key_bits) */
 static int table_add(Table *t, const char *word, size_t len, uint64_t hash)
 {
     if (t->len * 10 >= t->cap * 7 && table_grow(t) < 0)
         return -1;
 
+    bool inl = len < INLINE_KEY;
+    uint64_t bits = inl ? key_bits(word, len) : 0;
     size_t idx = hash & (t->cap - 1);
     for (;;) {
         Entry *e = &t->entries[idx];
-        if (!e->key) {
-            char *s = arena_alloc(&t->strings, len + 1, 1);
-            if (!s)
-                return -1;
-            memcpy(s, word, len);
-            s[len] = '\0';
-            *e = (Entry){ .key = s, .count = 1, .hash = hash };
+        if (!e->len) {
+            *e = (Entry){ .count = 1, .hash = hash, .len = len };
+            if (inl) {
+                e->key.bits = bits;
+            } else {
+                char *s = arena_alloc(&t->strings, len + 1, 1);
+                if (!s)
+                    return -1;
+                memcpy(s, word, len);
+                s[len] = '\0';
+                e->key.ptr = s;
+            }
             t->len++;
             t->total++;
             return 0;
         }
-        if (e->hash == hash && memcmp(e->key, word, len) == 0 && !e->key[len]) {
+        if (e->hash == hash && e->len == len &&
+            (inl ? e->key.bits == bits : memcmp(e->key.ptr, word, len) == 0)) {
             e->count++;
             t->total++;
             return 0;
@@ -350,9 +438,35 @@ typedef struct {
     int err;
 } Worker;
 
+/*
+ * Pre-size from a sample: count the first SAMPLE_BYTES of the chunk, then
+ * extrapolate its vocabulary to the whole chunk with Heaps' law (V ~ n^0.5)
+ * and reserve once, so the table rarely stops to double mid-chunk. The
+ * sample is real work, not a separate pass; the estimate errs low, and any
+ * shortfall is still covered by table_grow.
+ */
 static void process_chunk(Worker *w)
 {
-    w->err = tokenize(&w->table, w->data, w->len);
+    size_t head = w->len;
+    if (head > 2 * SAMPLE_BYTES) {
+        head = SAMPLE_BYTES;
+        while (head < w->len && is_alpha((unsigned char)w->data[head]))
+            head++;
+    }
+
+    w->err = tokenize(&w->table, w->data, head);
+    if (w->err || head == w->len)
+        return;
+
+    /* Every 4x more text, about 2x more distinct words */
+    size_t est = w->table.len;
+    for (size_t r = w->len / head; r >= 4; r /= 4)
+        est *= 2;
+    if (table_reserve(&w->table, est) < 0) {
+        w->err = -1;
+        return;
+    }
+    w->err = tokenize(&w->table, w->data + head, w->len - head);
 }
 
 #ifdef PLATFORM_WINDOWS
@@ -409,7 +523,7 @@ static int merge_into(Table *dst, Worker *workers, int n)
         Table *src = &workers[w].table;
         for (size_t i = 0; i < src->cap; i++) {
             const Entry *e = &src->entries[i];
-            if (!e->key)
+            if (!e->len)
                 continue;
 
             if (dst->len * 10 >= dst->cap * 7 && table_grow(dst) < 0)
@@ -418,13 +532,13 @@ static int merge_into(Table *dst, Worker *workers, int n)
             size_t idx = e->hash & (dst->cap - 1);
             for (;;) {
                 Entry *d = &dst->entries[idx];
-                if (!d->key) {
+                if (!d->len) {
                     *d = *e;
                     dst->len++;
                     dst->total += e->count;
                     break;
                 }
-                if (d->hash == e->hash && strcmp(d->key, e->key) == 0) {
+                if (entry_eq(d, e)) {
                     d->count += e->count;
                     dst->total += e->count;
                     break;
@@ -442,33 +556,86 @@ static int cmp_count_desc(const void *a, const void *b)
     const Entry *eb = b;
     if (ea->count != eb->count)
         return ea->count < eb->count ? 1 : -1;
-    return strcmp(ea->key, eb->key);
+    return strcmp(entry_key(ea), entry_key(eb));
+}
+
+/* Same order as cmp_count_desc: a ranks ahead of b */
+static bool entry_before(const Entry *a, const Entry *b)
+{
+    if (a->count != b->count)
+        return a->count > b->count;
+    return strcmp(entry_key(a), entry_key(b)) < 0;
+}
+
+static void heap_swap(Entry *heap, size_t i, size_t j)
+{
+    Entry tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
 }
 
+/* Bounded min-heap of the k best entries, weakest at heap[0] */
+static void heap_offer(Entry *heap, size_t *len, size_t k, const Entry *e)
+{
+    if (*len < k) {
+        size_t i = (*len)++;
+        heap[i] = *e;
+        while (i > 0 && entry_before(&heap[(i - 1) / 2], &heap[i])) {
+            heap_swap(heap, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+    if (!entry_before(e, &heap[0]))
+        return;
+
+    heap[0] = *e;
+    for (size_t i = 0;;) {
+        size_t w = i;
+        size_t l = 2 * i + 1;
+        if (l < k && entry_before(&heap[w], &heap[l]))
+            w = l;
+        if (l + 1 < k && entry_before(&heap[w], &heap[l + 1]))
+            w = l + 1;
+        if (w == i)
+            break;
+        heap_swap(heap, i, w);
+        i = w;
+    }
+}
+
+/* Print the n most frequent words; n == 0 prints all of them */
 static void print_top(const Table *t, size_t n)
 {
     if (t->len == 0)
         return;
 
-    Entry *sorted = malloc(t->len * sizeof(Entry));
+    size_t k = (n == 0 || n > t->len) ? t->len : n;
+    Entry *sorted = malloc(k * sizeof(Entry));
     if (!sorted)
         return;
 
+    /* Full sort only for the complete list; otherwise keep a k-heap */
     size_t j = 0;
-    for (size_t i = 0; i < t->cap && j < t->len; i++)
-        if (t->entries[i].key)
-            sorted[j++] = t->entries[i];
+    if (k == t->len) {
+        for (size_t i = 0; i < t->cap && j < t->len; i++)
+            if (t->entries[i].len)
+                sorted[j++] = t->entries[i];
+    } else {
+        for (size_t i = 0; i < t->cap; i++)
+            if (t->entries[i].len)
+                heap_offer(sorted, &j, k, &t->entries[i]);
+    }
 
     qsort(sorted, j, sizeof(Entry), cmp_count_desc);
 
     printf("\n%-4s  %-20s  %10s  %6s\n", "Rank", "Word", "Count", "%");
     printf("────  ────────────────────  ──────────  ──────\n");
 
-    size_t top = n < j ? n : j;
-    for (size_t i = 0; i < top; i++)
+    for (size_t i = 0; i < j; i++)
         printf("%4zu  %-20s  %10zu  %5.2f%%\n",
                i + 1,
-               sorted[i].key,
+               entry_key(&sorted[i]),
                sorted[i].count,
                100.0 * (double)sorted[i].count / (double)t->total);
 
@@ -481,11 +648,23 @@ static void print_top(const Table *t, size_t n)
 
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        (void)fprintf(stderr, "usage: %s <file>\n", argv[0]);
+    if (argc < 2 || argc > 3) {
+        (void)fprintf(stderr, "usage: %s <file> [top_n|all]\n", argv[0]);
         return 1;
     }
 
+    size_t top_n = TOP_N;
+    if (argc == 3 && strcmp(argv[2], "all") == 0) {
+        top_n = 0;
+    } else if (argc == 3) {
+        char *end;
+        top_n = strtoul(argv[2], &end, 10);
+        if (end == argv[2] || *end || top_n == 0) {
+            (void)fprintf(stderr, "error: bad top_n '%s'\n", argv[2]);
+            return 1;
+        }
+    }
+
     int rc = 1;
     MappedFile mf = { 0 };
     Worker *workers = NULL;
@@ -557,7 +736,7 @@ int main(int argc, char **argv)
     printf("File:   %s\n", argv[1]);
     printf("Size:   %.2f MB\n", (double)mf.size / (1024.0 * 1024.0));
     printf("Words:  %zu total, %zu unique\n", merged.total, merged.len);
-    print_top(&merged, TOP_N);
+    print_top(&merged, top_n);
 
     rc = 0;
 
@@ -2,63 +2,172 @@
  * wordcount_hyperopt.c - High-performance word frequency counter
  *
  * Build:
- *   gcc -O3 -march=native -pthread wordcount_hyperopt.c -o wc
+ *   gcc -O3 -pthread wordcount_hyperopt.c -o wc -lm  (portable, runtime
+ *   dispatch)
+ *   gcc -O3 -march=native -pthread wordcount_hyperopt.c -o wc -lm
  *   gcc -O3 -march=znver5 -mtune=znver5 -mavx512f -mavx512bw -mavx512vl
  * -msse4.2 \ -flto -fomit-frame-pointer -funroll-loops -pthread
- * wordcount_hyperopt.c -o wc
+ * wordcount_hyperopt.c -o wc -lm
  *
  * Design:
- *   - AVX-512 SIMD tokenization with scalar fallback
+ *   - SIMD tokenization picked at runtime (AVX-512BW / AVX2 / SSE4.2 /
+ *     NEON) with scalar fallback; WORDCOUNT_SIMD caps the choice
  *   - CRC32C hardware hashing (FNV-1a fallback)
- *   - Per-thread hash tables with arena allocation
- *   - V-Cache aware thread pinning (AMD Zen 4+)
+ *   - Per-thread hash tables with arena allocation: linear probing, or a
+ *     swiss table with SIMD-probed 7-bit tags (--table=swiss)
+ *   - Optional shared table (--table=shared): one copy of the vocabulary
+ *     in lock-striped shards, fed a chunk at a time from per-thread front
+ *     caches, so memory stays flat as threads are added
+ *   - --approx[=SIZE]: bounded memory on endless streams; per-worker
+ *     Count-Min sketch, top-K candidates and HyperLogLog, merged in place
+ *     of the tables, with the error bounds printed
+ *   - --dedup[=SIZE]: duplicated text (mirrors, boilerplate) is cut into
+ *     content-defined blocks fingerprinted with CRC32C, and a block seen
+ *     before adds its cached word counts instead of being tokenized
+ *   - Optional incremental resize (--resize=incremental): a growing linear
+ *     table drains into its doubled array a few slots per insert
+ *   - Words of up to 8 bytes stored inline in the entry and compared as one
+ *     integer; only longer words live in the pool
+ *   - mmap input cut into ~2 MB letter-aligned chunks, scheduled over
+ *     per-thread work-stealing ranges (--chunk=SIZE)
+ *   - Runtime thread count (affinity mask / cgroup quota) and V-Cache aware
+ *     pinning (AMD Zen 4+), overridable with --cpus=LIST
+ *   - Sized to the input: small files run on the main thread, larger ones
+ *     get a worker per THREAD_MIN_BYTES, and tables and pools are sized
+ *     from a Heaps' law fit over the first SAMPLE_BYTES
+ *   - NUMA placement on multi-node hosts: workers interleaved over nodes,
+ *     tables first-touched by their worker, node-local chunk ranges and
+ *     steals, and a merge that folds each node before crossing nodes
  *   - No shared mutable state in hot path
- *   - Huge page hints for hash tables and string pools
- *   - Prefetch hints in hash table insert path
+ *   - Parallel merge: entries partitioned by high hash bits, one shard per
+ *     worker, shards laid out back to back as the global table
+ *   - Top-K via bounded heaps per shard, reduced on the main thread
+ *     (--top=K); only --all sorts every unique word
+ *   - Hash tables and string pools on 2 MB-aligned huge-page mappings
+ *     (THP or hugetlb via --huge), coverage read back from smaps
+ *   - --word rules (digits, inner apostrophes and hyphens, extra bytes,
+ *     a minimum length) through a byte class table compiled to nibble
+ *     lookups; the default letters keep the constant-compare kernels
+ *   - --utf8 words: Unicode letters and marks with simple case folding
+ *     from range tables; all-ASCII blocks stay on the SIMD path and only
+ *     runs holding non-ASCII bytes are decoded
+ *   - Batched inserts: once a table outgrows the cache, the kernels emit
+ *     INSERT_BATCH words with their home slots prefetched before inserting
+ *     any, so the misses overlap
+ *   - Streaming mode for stdin/pipes: fixed ring of read buffers, partial
+ *     words carried across buffer edges (zcat big.gz | wc -)
+ *   - Optional io_uring reader (--io=uring) with registered buffers and a
+ *     tunable queue depth, as an alternative to mmap page faults
+ *   - Batch mode for many FILEs, directories or --files-from: one worker
+ *     pool and one merge; small files are whole chunks read by workers
+ *   - --format=tsv|json|binary rows through one buffered writer, ordered
+ *     by --sort=count|word|none
+ *   - --stats: phase and per-thread timings, table figures, and perf
+ *     counters (cycles, instructions, LLC misses) where permitted
+ *   - Saved tables (--save / --load): merged counts written sorted by word
+ *     in an mmap-ready file, merged back in parallel with new input
+ *   - --serve: a resident server for many small texts over a Unix socket
+ *     or stdin, reusing one pinned pool and cleared tables (p50/p99 kept)
  */
 
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
 
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sched.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
-#ifdef __SSE4_2__
-#include <nmmintrin.h>
-#endif
-#ifdef __SSE2__
-#include <emmintrin.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+
+#include "wordcount_hyperopt.h"
+
+#ifdef WORDCOUNT_LIB
+/* Only the engine is built; the CLI helpers main() uses go unused */
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#pragma GCC diagnostic ignored "-Wunused-const-variable"
 #endif
-#ifdef __AVX512BW__
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ARCH_X86 1
 #include <immintrin.h>
+#elif defined(__aarch64__)
+#define ARCH_ARM64 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
 #endif
 
 /*===========================================================================
  * Configuration (overridable via -D flags)
  *===========================================================================*/
 
+/* Default worker count; 0 = CPUs in the affinity mask, capped by the cgroup
+ * CPU quota. --threads=N overrides either. */
 #ifndef NUM_THREADS
-#define NUM_THREADS 6
+#define NUM_THREADS 0
+#endif
+
+#ifndef MAX_THREADS
+#define MAX_THREADS 256
 #endif
 
+#define MAX_CPUS 1024
+
+/* Table slots when the input size is unknown (streams, io_uring) */
 #ifndef INITIAL_CAP
 #define INITIAL_CAP 65536
 #endif
 
+/* Floor for tables sized from a known input length and its sampled
+ * vocabulary; they grow if the sample guessed low */
+#ifndef SIZED_MIN_CAP
+#define SIZED_MIN_CAP 1024
+#endif
+
+/* Without --threads, a regular file gets one worker per THREAD_MIN_BYTES
+ * (at least one, at most the default count); inputs up to twice this run
+ * on the main thread alone. bench_c.sh --size-sweep measures the
+ * crossover. */
+#ifndef THREAD_MIN_BYTES
+#define THREAD_MIN_BYTES (2 << 20)
+#endif
+
+/* Prefix of a mapped file tokenized to fit its vocabulary growth */
+#ifndef SAMPLE_BYTES
+#define SAMPLE_BYTES (256 << 10)
+#endif
+
+/* String pool blocks: the first is sized from the thread's share of the
+ * input, each next one doubles, up to POOL_SIZE */
 #ifndef POOL_SIZE
 #define POOL_SIZE (32 << 20)
 #endif
 
+#define POOL_MIN_BLOCK (64 << 10)
+
 #ifndef MAX_WORD
 #define MAX_WORD 100
 #endif
@@ -73,43 +182,301 @@
  * Hash Table Entry
  *===========================================================================*/
 
+/*
+ * Words of up to ENTRY_INLINE bytes are stored in the entry itself, zero
+ * padded, and compared as one 64-bit integer, so a probe never chases a
+ * pointer into the pool for them. Longer words point to a NUL-terminated
+ * pool copy. Words are never empty, so len == 0 marks a free slot. The
+ * count is 64 bits (it fills what would be padding) so that merging many
+ * saved tables cannot wrap it.
+ */
+#define ENTRY_INLINE 8
+
 typedef struct {
-    char *word;
-    uint32_t count;
+    union {
+        char *ptr; /* len > ENTRY_INLINE */
+        char inl[ENTRY_INLINE];
+        uint64_t inl64;
+    } key;
+    uint64_t count;
     uint32_t hash;
     uint16_t len;
     uint16_t fp16;
 } Entry;
 
+_Static_assert(sizeof(Entry) == 24, "Entry must stay 24 bytes");
+
+static inline const char *entry_word(const Entry *e)
+{
+    return e->len <= ENTRY_INLINE ? e->key.inl : e->key.ptr;
+}
+
+/* Zero-padded integer form of a 1..8 byte word; reads 8 bytes of @word */
+static inline uint64_t key_inline(const char *word, size_t len)
+{
+    uint64_t v;
+    memcpy(&v, word, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return v & (~0ULL << (64 - 8 * len));
+#else
+    return v & (~0ULL >> (64 - 8 * len));
+#endif
+}
+
+/* Same key as @e; @key is key_inline(word, len) for short words */
+static inline int entry_matches(const Entry *e,
+                                const char *word,
+                                size_t len,
+                                uint64_t key,
+                                uint32_t hash)
+{
+    if (e->hash != hash || e->len != len)
+        return 0;
+    if (len <= ENTRY_INLINE)
+        return e->key.inl64 == key;
+    return memcmp(e->key.ptr, word, len) == 0;
+}
+
+static inline int entry_same(const Entry *a, const Entry *b)
+{
+    return entry_matches(a, entry_word(b), b->len, b->key.inl64, b->hash);
+}
+
 /*===========================================================================
  * Per-Thread Table with Arena
  *===========================================================================*/
 
+/* Header at the start of every mmapped pool block */
+typedef struct PoolBlock {
+    struct PoolBlock *next;
+    size_t size;
+} PoolBlock;
+
 typedef struct __attribute__((aligned(CACHELINE))) {
     Entry *entries;
-    char *pool;
-    size_t pool_used;
+    uint8_t *ctrl; /* swiss control bytes; NULL for linear probing */
+    char *pool_ptr; /* bump pointer into the newest block */
+    char *pool_end;
+    PoolBlock *pool;  /* newest block first */
+    size_t pool_next; /* size of the next block to map */
+    Entry *old;         /* array being drained by an incremental resize */
+    size_t old_cap;
+    size_t migrate_pos; /* next old slot to move */
     size_t cap;
     size_t len;
     size_t total;
+    size_t extra_probes; /* slots (swiss: groups) past the first, --stats */
+    unsigned grows;
+    unsigned pool_blocks;
+    int incremental; /* grow with table_grow_start() */
     int id;
-    /* Overflow for when pool exhausts */
-    char **overflow;
-    size_t overflow_count;
-    size_t overflow_cap;
 } Table;
 
 /*===========================================================================
  * Globals
  *===========================================================================*/
 
-static Table tables[NUM_THREADS];
-static pthread_t threads[NUM_THREADS];
+static Table tables[MAX_THREADS];
+static pthread_t threads[MAX_THREADS];
 static pthread_barrier_t barrier;
+static int nthreads = NUM_THREADS;
 
-static int vcache_cpus[256];
+static int vcache_cpus[MAX_CPUS];
 static int vcache_count = 0;
 
+/* Worker i runs on pin_cpus[i % pin_count]; pin_count == 0 leaves the
+ * scheduler free to place threads. */
+static int pin_cpus[MAX_CPUS];
+static int pin_count = 0;
+
+/*===========================================================================
+ * CPU Lists ("0-3,8,10-11" as in sysfs and taskset)
+ *===========================================================================*/
+
+/* Parse a CPU list into @out; returns the count, or -1 if malformed */
+static int parse_cpu_list(const char *p, int *out, int max)
+{
+    int cnt = 0;
+
+    while (*p && *p != '\n') {
+        char *endp = NULL;
+        long start = strtol(p, &endp, 10);
+        if (endp == p || start < 0)
+            return -1;
+
+        long end = start;
+        p = endp;
+        if (*p == '-') {
+            end = strtol(p + 1, &endp, 10);
+            if (endp == p + 1 || end < start)
+                return -1;
+            p = endp;
+        }
+        for (long i = start; i <= end && cnt < max; i++)
+            out[cnt++] = (int)i;
+
+        if (*p == ',')
+            p++;
+        else if (*p && *p != '\n')
+            return -1;
+    }
+    return cnt;
+}
+
+/* CPUs this process may run on (taskset, cpuset cgroup) */
+static int allowed_cpus(int *out, int max)
+{
+    cpu_set_t set;
+    int cnt = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int i = 0; i < n && cnt < max; i++)
+            out[cnt++] = i;
+        return cnt;
+    }
+    for (int i = 0; i < CPU_SETSIZE && cnt < max; i++)
+        if (CPU_ISSET((size_t)i, &set))
+            out[cnt++] = i;
+    return cnt;
+}
+
+/* CPUs granted by the quota set in cgroup directory dir, rounded up; 0 if
+ * it sets none */
+static int cgroup_dir_limit(const char *dir, int v2)
+{
+    long long quota = -1;
+    long long period = 0;
+    char path[PATH_MAX + 64];
+    char buf[64];
+    FILE *f;
+
+    if (v2) {
+        (void)snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        f = fopen(path, "r");
+        if (f) {
+            if (fgets(buf, (int)sizeof(buf), f) && strncmp(buf, "max", 3) != 0)
+                (void)sscanf(buf, "%lld %lld", &quota, &period);
+            (void)fclose(f);
+        }
+    } else {
+        (void)snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        f = fopen(path, "r");
+        if (f) {
+            if (fscanf(f, "%lld", &quota) != 1)
+                quota = -1;
+            (void)fclose(f);
+        }
+        (void)snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+        f = fopen(path, "r");
+        if (f) {
+            if (fscanf(f, "%lld", &period) != 1)
+                period = 0;
+            (void)fclose(f);
+        }
+    }
+
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return (int)((quota + period - 1) / period);
+}
+
+/*
+ * This process's cgroup path from /proc/self/cgroup: the "0::" line for
+ * v2, else the v1 line whose controllers include cpu. "/" if not listed.
+ */
+static void cgroup_self_path(int v2, char *out, size_t n)
+{
+    char line[PATH_MAX + 64];
+    FILE *f = fopen("/proc/self/cgroup", "r");
+
+    (void)snprintf(out, n, "/");
+    if (!f)
+        return;
+    while (fgets(line, (int)sizeof(line), f)) {
+        char *ctl = strchr(line, ':');
+        char *path = ctl ? strchr(ctl + 1, ':') : NULL;
+        if (!path)
+            continue;
+        *ctl++ = '\0';
+        *path++ = '\0';
+        path[strcspn(path, "\n")] = '\0';
+
+        char list[128];
+        (void)snprintf(list, sizeof(list), ",%s,", ctl);
+        int match = v2 ? strcmp(line, "0") == 0 && *ctl == '\0'
+                       : strstr(list, ",cpu,") != NULL;
+        if (match && *path == '/') {
+            (void)snprintf(out, n, "%s", path);
+            break;
+        }
+    }
+    (void)fclose(f);
+}
+
+/*
+ * CPU quota from cgroup v2 cpu.max or v1 cfs_quota_us, rounded up; 0 if
+ * unlimited or unknown. Systemd slices and containers without a cgroup
+ * namespace set it on the process's own cgroup or a parent, so every
+ * directory from there up to the mount root is read and the smallest
+ * quota wins.
+ */
+static int cgroup_cpu_limit(void)
+{
+    struct stat st;
+    int v2 = stat("/sys/fs/cgroup/cgroup.controllers", &st) == 0;
+    const char *root = v2 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/cpu";
+    char self[PATH_MAX];
+    char dir[PATH_MAX + 32];
+    int limit = 0;
+
+    cgroup_self_path(v2, self, sizeof(self));
+    (void)snprintf(dir, sizeof(dir), "%s%s", root, self);
+    for (;;) {
+        size_t len = strlen(dir);
+        while (len > strlen(root) && dir[len - 1] == '/')
+            dir[--len] = '\0';
+
+        int n = cgroup_dir_limit(dir, v2);
+        if (n > 0 && (limit == 0 || n < limit))
+            limit = n;
+        if (len <= strlen(root))
+            break;
+
+        char *slash = strrchr(dir, '/');
+        *slash = '\0';
+    }
+    return limit;
+}
+
+static int default_threads(void)
+{
+    int cpus[MAX_CPUS];
+    int n = allowed_cpus(cpus, MAX_CPUS);
+    int quota = cgroup_cpu_limit();
+
+    if (quota > 0 && quota < n)
+        n = quota;
+    if (n < 1)
+        n = 1;
+    return n < MAX_THREADS ? n : MAX_THREADS;
+}
+
+/* Workers for the regular file at path: one per THREAD_MIN_BYTES, at most
+ * max. A thread, its table and its merge share cost more than counting a
+ * small file on one core. Other inputs get max. */
+static int input_threads(const char *path, int max)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return max;
+    size_t n = (size_t)st.st_size / (size_t)THREAD_MIN_BYTES;
+    if (n < 1)
+        n = 1;
+    return n < (size_t)max ? (int)n : max;
+}
+
 /*===========================================================================
  * V-Cache Detection (AMD Zen 4+ with 3D V-Cache)
  *===========================================================================*/
@@ -123,7 +490,7 @@ static void detect_vcache(void)
     size_t best_l3 = 0;
     int best_count = 0;
 
-    for (int cpu = 0; cpu < ncpus && cpu < 256; cpu++) {
+    for (int cpu = 0; cpu < ncpus && cpu < MAX_CPUS; cpu++) {
         (void)snprintf(path,
                        sizeof(path),
                        "/sys/devices/system/cpu/cpu%d/cache/index3/size",
@@ -165,42 +532,202 @@ static void detect_vcache(void)
         }
         (void)fclose(f);
 
-        int list[256];
-        int cnt = 0;
-        const char *p = buf;
-        while (*p && cnt < 256) {
-            char *endp = NULL;
-            long start = strtol(p, &endp, 10);
-            if (endp == p)
-                break;
-
-            if (*endp == '-') {
-                char *endp2 = NULL;
-                long end = strtol(endp + 1, &endp2, 10);
-                for (long i = start; i <= end && cnt < 256; i++)
-                    list[cnt++] = (int)i;
-                p = endp2;
-            } else {
-                list[cnt++] = (int)start;
-                p = endp;
-            }
-
-            while (*p && *p != ',')
-                p++;
-            if (*p == ',')
-                p++;
-        }
+        int list[MAX_CPUS];
+        int cnt = parse_cpu_list(buf, list, MAX_CPUS);
+        if (cnt <= 0)
+            continue;
 
         if (l3_bytes > best_l3 || (l3_bytes == best_l3 && cnt > best_count)) {
             best_l3 = l3_bytes;
             best_count = cnt;
-            for (int j = 0; j < cnt && j < 256; j++)
+            for (int j = 0; j < cnt; j++)
                 vcache_cpus[j] = list[j];
             vcache_count = cnt;
         }
     }
 }
 
+/*===========================================================================
+ * NUMA Topology
+ *
+ * Nodes and their CPUs come from sysfs; placement relies on first touch
+ * rather than libnuma. Each worker allocates and clears its own table
+ * after it is pinned, and pools and grown arrays are only ever mapped by
+ * their owner, so a table lives on its worker's node. Workers of one node
+ * get adjacent chunk ranges and steal from each other before going remote,
+ * and the merge folds each node's tables together before anything crosses
+ * the interconnect.
+ *===========================================================================*/
+
+#ifndef NUMA_SYSFS
+#define NUMA_SYSFS "/sys/devices/system/node"
+#endif
+
+#ifndef MAX_NODES
+#define MAX_NODES 64
+#endif
+
+static int cpu_node[MAX_CPUS];       /* sysfs node of each CPU, -1 unknown */
+static int worker_node[MAX_THREADS]; /* dense node index of each worker */
+static int worker_nodes = 1;         /* distinct nodes among the workers */
+
+static void detect_numa(void)
+{
+    char path[256];
+    char buf[4096];
+    int list[MAX_CPUS];
+
+    for (int c = 0; c < MAX_CPUS; c++)
+        cpu_node[c] = -1;
+    for (int n = 0; n < MAX_NODES; n++) {
+        (void)snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", n);
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+        if (!fgets(buf, (int)sizeof(buf), f)) {
+            (void)fclose(f);
+            continue;
+        }
+        (void)fclose(f);
+
+        int cnt = parse_cpu_list(buf, list, MAX_CPUS);
+        for (int j = 0; j < cnt; j++) {
+            if (list[j] >= 0 && list[j] < MAX_CPUS)
+                cpu_node[list[j]] = n;
+        }
+    }
+}
+
+static inline int node_of(int cpu)
+{
+    return cpu >= 0 && cpu < MAX_CPUS ? cpu_node[cpu] : -1;
+}
+
+/* Distinct known nodes among cpus[0..n) */
+static int count_nodes(const int *cpus, int n)
+{
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        int node = node_of(cpus[i]);
+        int j = 0;
+        while (j < i && node_of(cpus[j]) != node)
+            j++;
+        count += node >= 0 && j == i;
+    }
+    return count;
+}
+
+typedef struct {
+    int rank; /* position among the CPUs of its node */
+    int node;
+    int cpu;
+} NodeSlot;
+
+static int cmp_node_slot(const void *a, const void *b)
+{
+    const NodeSlot *x = a;
+    const NodeSlot *y = b;
+    if (x->rank != y->rank)
+        return x->rank - y->rank;
+    if (x->node != y->node)
+        return x->node - y->node;
+    return x->cpu - y->cpu;
+}
+
+/* cpus reordered into out so consecutive workers land on different nodes */
+static int numa_interleave(const int *cpus, int n, int *out)
+{
+    NodeSlot slots[MAX_CPUS];
+
+    for (int i = 0; i < n; i++) {
+        slots[i].node = node_of(cpus[i]);
+        slots[i].cpu = cpus[i];
+        slots[i].rank = 0;
+        for (int j = 0; j < i; j++)
+            slots[i].rank += slots[j].node == slots[i].node;
+    }
+    qsort(slots, (size_t)n, sizeof(slots[0]), cmp_node_slot);
+    for (int i = 0; i < n; i++)
+        out[i] = slots[i].cpu;
+    return n;
+}
+
+/* Dense node index of every worker from its pinned CPU; one if unpinned */
+static void numa_assign(void)
+{
+    int seen[MAX_NODES];
+    int nseen = 0;
+
+    for (int i = 0; i < nthreads; i++) {
+        int node = pin_count > 0 ? node_of(pin_cpus[i % pin_count]) : -1;
+        int d = 0;
+        if (node >= 0) {
+            while (d < nseen && seen[d] != node)
+                d++;
+            if (d == nseen && nseen < MAX_NODES)
+                seen[nseen++] = node;
+        }
+        worker_node[i] = d < nseen ? d : 0;
+    }
+    worker_nodes = nseen > 0 ? nseen : 1;
+}
+
+/*===========================================================================
+ * Pinning Policy
+ *
+ *   vcache  largest-L3 domain (the V-Cache CCD on X3D parts), restricted to
+ *           the affinity mask; falls back to the whole mask (default). On
+ *           hosts whose mask spans several NUMA nodes one L3 domain would
+ *           idle the other sockets, so numa is used instead
+ *   numa    every CPU in the affinity mask, interleaved across nodes
+ *   all     every CPU in the affinity mask, one worker per CPU
+ *   none    no pinning
+ *   --cpus  explicit list, used as given
+ *===========================================================================*/
+
+typedef enum { PIN_VCACHE, PIN_ALL, PIN_NONE, PIN_LIST, PIN_NUMA } PinPolicy;
+
+static const char *const pin_names[] = { "vcache", "all", "none", "cpus",
+                                         "numa" };
+
+/* Fill pin_cpus for @policy; returns the policy actually applied */
+static PinPolicy setup_pinning(PinPolicy policy)
+{
+    int allowed[MAX_CPUS];
+    int nallowed;
+
+    if (policy != PIN_NONE)
+        detect_numa();
+    switch (policy) {
+        case PIN_LIST: /* pin_cpus already filled by --cpus */
+        case PIN_NONE:
+            return policy;
+        case PIN_VCACHE:
+            nallowed = allowed_cpus(allowed, MAX_CPUS);
+            if (count_nodes(allowed, nallowed) > 1) {
+                pin_count = numa_interleave(allowed, nallowed, pin_cpus);
+                return PIN_NUMA;
+            }
+            detect_vcache();
+            pin_count = 0;
+            for (int i = 0; i < vcache_count; i++)
+                for (int j = 0; j < nallowed; j++)
+                    if (vcache_cpus[i] == allowed[j])
+                        pin_cpus[pin_count++] = vcache_cpus[i];
+            if (pin_count > 0)
+                return PIN_VCACHE;
+            /* fall through */
+        case PIN_ALL:
+            pin_count = allowed_cpus(pin_cpus, MAX_CPUS);
+            return PIN_ALL;
+        case PIN_NUMA:
+            nallowed = allowed_cpus(allowed, MAX_CPUS);
+            pin_count = numa_interleave(allowed, nallowed, pin_cpus);
+            return PIN_NUMA;
+    }
+    return policy;
+}
+
 /*===========================================================================
  * Power of 2 Helper
  *===========================================================================*/
@@ -221,9 +748,18 @@ static inline size_t next_pow2(size_t x)
 
 /*===========================================================================
  * Hash Functions
+ *
+ * Tokenizers hash incrementally while copying a word, so each kernel pairs
+ * with the matching one-shot function below. CRC32C is used whenever the
+ * selected kernel can issue the crc32 instruction; hash_crc32c() consumes
+ * 8 bytes per step and yields the same value as the per-byte accumulation.
  *===========================================================================*/
 
-#ifdef __SSE4_2__
+#ifdef ARCH_X86
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2,sse4.2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,sse4.2")))
+
 static inline uint32_t crc32c_finalize(uint64_t h)
 {
     h ^= h >> 33;
@@ -234,7 +770,7 @@ static inline uint32_t crc32c_finalize(uint64_t h)
     return (uint32_t)h;
 }
 
-static inline uint32_t hash_word(const char *s, size_t len)
+TARGET_SSE42 static inline uint32_t hash_crc32c(const char *s, size_t len)
 {
     uint64_t h = 0;
     const uint8_t *p = (const uint8_t *)s;
@@ -257,8 +793,9 @@ static inline uint32_t hash_word(const char *s, size_t len)
     }
     return crc32c_finalize(h);
 }
-#else
-static inline uint32_t hash_word(const char *s, size_t len)
+#endif
+
+static inline uint32_t hash_fnv1a(const char *s, size_t len)
 {
     uint32_t h = 2166136261u;
     for (size_t i = 0; i < len; i++) {
@@ -267,739 +804,7607 @@ static inline uint32_t hash_word(const char *s, size_t len)
     }
     return h;
 }
-#endif
-
-/*===========================================================================
- * Pool Allocator (8-byte aligned, with overflow to malloc)
- *===========================================================================*/
-
-static inline char *pool_alloc(Table *t, size_t len)
-{
-    size_t needed = (len + 1 + 7) & ~(size_t)7; /* 8-byte alignment */
 
-    if (t->pool_used + needed > POOL_SIZE) {
-        /* Overflow: use malloc */
-        char *p = malloc(len + 1);
-        if (!p) {
-            perror("malloc");
-            exit(1);
-        }
+/*
+ * Forms used by the tokenizer kernels: INIT, STEP(h, c) per copied byte and
+ * DONE(h, word, len) at emit. CRCW skips the per-byte steps and hashes the
+ * finished word 8 bytes at a time, for kernels that copy runs wholesale.
+ */
+#define CRC_INIT 0
+#define CRC_STEP(h, c) ((h) = _mm_crc32_u8((uint32_t)(h), (uint8_t)(c)))
+#define CRC_DONE(h, w, n) crc32c_finalize(h)
 
-        if (t->overflow_count == t->overflow_cap) {
-            size_t cap = t->overflow_cap ? t->overflow_cap * 2 : 64;
-            char **tmp = realloc(t->overflow, cap * sizeof(char *));
-            if (!tmp) {
-                free(p);
-                perror("realloc");
-                exit(1);
-            }
-            t->overflow = tmp;
-            t->overflow_cap = cap;
-        }
-        t->overflow[t->overflow_count++] = p;
-        return p;
-    }
+#define CRCW_INIT 0
+#define CRCW_STEP(h, c) ((void)(c))
+#define CRCW_DONE(h, w, n) ((void)(h), hash_crc32c((w), (n)))
 
-    char *ptr = t->pool + t->pool_used;
-    t->pool_used += needed;
-    return ptr;
-}
+#define FNV_INIT 2166136261u
+#define FNV_STEP(h, c) ((h) = ((uint32_t)(h) ^ (uint8_t)(c)) * 16777619u)
+#define FNV_DONE(h, w, n) ((uint32_t)(h))
 
 /*===========================================================================
- * Hash Table Operations
+ * Huge-Page Allocator (--huge)
+ *
+ * Tables, pool blocks, the merged table and the sketches all come from
+ * huge_alloc(). Regions below HUGE_2M are plain anonymous mappings. Larger
+ * ones are rounded up to whole huge pages and, depending on --huge:
+ *   thp      2 MB-aligned mapping with MADV_HUGEPAGE (default)
+ *   hugetlb  MAP_HUGETLB 2 MB pages from the reserved pool (vm.nr_hugepages)
+ *   1g       as hugetlb, with 1 GB pages for regions of at least 1 GB
+ *   off      MADV_NOHUGEPAGE, the 4 KB baseline
+ * A failed MAP_HUGETLB falls back to the THP path and is counted, with the
+ * first error reported once. Live huge regions are kept in a small list so
+ * that --stats can read back from /proc/self/smaps how much of them the
+ * kernel actually backs with huge pages. Fresh mappings are zero-filled.
  *===========================================================================*/
 
-static void table_grow(Table *t)
-{
-    size_t new_cap = t->cap * 2;
-    Entry *new_ent = aligned_alloc(CACHELINE, new_cap * sizeof(Entry));
-    if (!new_ent) {
-        perror("aligned_alloc");
-        exit(1);
-    }
-    memset(new_ent, 0, new_cap * sizeof(Entry));
+#define HUGE_2M ((size_t)2 << 20)
+#define HUGE_1G ((size_t)1 << 30)
 
-    size_t mask = new_cap - 1;
-    for (size_t i = 0; i < t->cap; i++) {
-        const Entry *e = &t->entries[i];
-        if (!e->word)
-            continue;
-        size_t idx = e->hash & mask;
-        while (new_ent[idx].word)
-            idx = (idx + 1) & mask;
-        new_ent[idx] = *e;
-    }
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
 
-    free(t->entries);
-    t->entries = new_ent;
-    t->cap = new_cap;
+typedef enum { HUGE_THP, HUGE_TLB, HUGE_TLB_1G, HUGE_OFF } HugeMode;
 
-    /* Huge page hint for new table */
-    (void)madvise(new_ent, new_cap * sizeof(Entry), MADV_HUGEPAGE);
-}
+typedef enum { REGION_THP, REGION_TLB_2M, REGION_TLB_1G } RegionKind;
 
-static inline void
-table_insert(Table *t, const char *word, size_t len, uint32_t hash, uint16_t fp)
-{
-    if (len == 0 || len >= MAX_WORD)
-        return;
+static HugeMode huge_mode = HUGE_THP;
 
-    size_t mask = t->cap - 1;
-    size_t idx = hash & mask;
+typedef struct {
+    char *addr;
+    size_t len;
+    RegionKind kind;
+} HugeRegion;
 
-    for (;;) {
-        Entry *e = &t->entries[idx];
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+static HugeRegion *huge_regions;
+static size_t huge_nregions;
+static size_t huge_regions_cap;
 
-        if (!e->word) {
-            /* New entry */
-            char *s = pool_alloc(t, len);
-            memcpy(s, word, len);
-            s[len] = '\0';
-            e->word = s;
-            e->count = 1;
-            e->hash = hash;
-            e->len = (uint16_t)len;
-            e->fp16 = fp;
-            t->len++;
-            t->total++;
+/* Totals over the run, under huge_lock */
+static size_t huge_mapped[3];     /* regions by RegionKind */
+static size_t huge_mapped_mb[3];  /* their size in MB */
+static size_t huge_fallbacks;     /* MAP_HUGETLB refused, THP used */
+static int huge_errno;            /* first MAP_HUGETLB error */
 
-            /* Prefetch next slots for future inserts */
-#ifdef __SSE2__
-            _mm_prefetch((const char *)&t->entries[(idx + 1) & mask],
-                         _MM_HINT_T0);
-            _mm_prefetch((const char *)&t->entries[(idx + 8) & mask],
-                         _MM_HINT_T2);
-#endif
-            /* Grow if load factor > 0.7 */
-            if (t->len * 10 > t->cap * 7)
-                table_grow(t);
-            return;
-        }
+/* Mapped length: whole huge pages for every region huge_alloc() tracks */
+static size_t huge_span(size_t size)
+{
+    size_t page = huge_mode == HUGE_TLB_1G && size >= HUGE_1G ? HUGE_1G
+                                                              : HUGE_2M;
+    if (size < HUGE_2M)
+        return size;
+    return (size + page - 1) & ~(page - 1);
+}
 
-        /* Check for match: hash + len + fingerprint + memcmp */
-        if (e->hash == hash && e->len == len && e->fp16 == fp &&
-            memcmp(e->word, word, len) == 0) {
-            e->count++;
-            t->total++;
-            return;
-        }
+/* Anonymous mapping of span bytes starting on a 2 MB boundary */
+static void *huge_map_aligned(size_t span)
+{
+    char *p = mmap(NULL,
+                   span + HUGE_2M,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1,
+                   0);
+    if (p == MAP_FAILED)
+        return NULL;
 
-        idx = (idx + 1) & mask;
-    }
+    uintptr_t mask = HUGE_2M - 1;
+    char *a = (char *)(((uintptr_t)p + mask) & ~mask);
+    if (a > p)
+        (void)munmap(p, (size_t)(a - p));
+    (void)munmap(a + span, (size_t)(p + HUGE_2M - a));
+    return a;
 }
 
-/*===========================================================================
- * Character Classification
- *===========================================================================*/
-
-static inline int is_letter(unsigned char c)
+static void *huge_map_tlb(size_t span, int page_flag)
 {
-    return ((c | 32u) - 'a') < 26u;
+    void *p = mmap(NULL,
+                   span,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | page_flag,
+                   -1,
+                   0);
+    return p == MAP_FAILED ? NULL : p;
 }
 
-/*===========================================================================
- * Scalar Tokenizer (with inline CRC accumulation)
- *===========================================================================*/
+static void huge_track(char *addr, size_t len, RegionKind kind, int fell_back)
+{
+    pthread_mutex_lock(&huge_lock);
+    if (huge_nregions == huge_regions_cap) {
+        size_t cap = huge_regions_cap ? huge_regions_cap * 2 : 64;
+        HugeRegion *r = realloc(huge_regions, cap * sizeof(*r));
+        if (!r) {
+            perror("realloc");
+            exit(1);
+        }
+        huge_regions = r;
+        huge_regions_cap = cap;
+    }
+    huge_regions[huge_nregions++] = (HugeRegion){ addr, len, kind };
+    huge_mapped[kind]++;
+    huge_mapped_mb[kind] += len >> 20;
+    if (fell_back && huge_fallbacks++ == 0) {
+        huge_errno = errno;
+        (void)fprintf(stderr,
+                      "MAP_HUGETLB failed (%s), using transparent huge "
+                      "pages; see vm.nr_hugepages\n",
+                      strerror(huge_errno));
+    }
+    pthread_mutex_unlock(&huge_lock);
+}
 
-#ifndef __AVX512BW__
-static void
-process_scalar(Table *t, const char *data, size_t size, int drop_leading)
+/* Zeroed memory for size bytes, or NULL with errno set */
+static void *huge_alloc(size_t size)
 {
-    char word[MAX_WORD];
-    size_t word_len = 0;
-#ifdef __SSE4_2__
-    uint64_t crc = 0;
-#endif
+    size_t span = huge_span(size);
 
-    for (size_t i = 0; i < size; i++) {
-        unsigned char c = (unsigned char)data[i];
+    /* Small tables are hashed into everywhere: fault them in up front */
+    if (size < HUGE_2M) {
+        void *p = mmap(NULL,
+                       size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                       -1,
+                       0);
+        return p == MAP_FAILED ? NULL : p;
+    }
 
-        if (drop_leading) {
-            if (!is_letter(c))
-                drop_leading = 0;
-            else
-                continue;
+    int fell_back = 0;
+    if (huge_mode == HUGE_TLB_1G && span >= HUGE_1G) {
+        char *p = huge_map_tlb(span, MAP_HUGE_1GB);
+        if (p) {
+            huge_track(p, span, REGION_TLB_1G, 0);
+            return p;
+        }
+    }
+    if (huge_mode == HUGE_TLB || huge_mode == HUGE_TLB_1G) {
+        char *p = huge_map_tlb(span, MAP_HUGE_2MB);
+        if (p) {
+            huge_track(p, span, REGION_TLB_2M, 0);
+            return p;
+        }
+        fell_back = 1;
+    }
+
+    char *p = huge_map_aligned(span);
+    if (!p)
+        return NULL;
+    (void)madvise(p,
+                  span,
+                  huge_mode == HUGE_OFF ? MADV_NOHUGEPAGE : MADV_HUGEPAGE);
+    huge_track(p, span, REGION_THP, fell_back);
+    return p;
+}
+
+/* Release a huge_alloc() region of the same size; NULL is ignored */
+static void huge_free(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+    size_t span = huge_span(size);
+
+    if (size >= HUGE_2M) {
+        pthread_mutex_lock(&huge_lock);
+        for (size_t i = 0; i < huge_nregions; i++) {
+            if (huge_regions[i].addr == ptr) {
+                huge_regions[i] = huge_regions[--huge_nregions];
+                break;
+            }
+        }
+        pthread_mutex_unlock(&huge_lock);
+    }
+    (void)munmap(ptr, span);
+}
+
+typedef struct {
+    size_t rss_kb;      /* resident in live huge_alloc() regions */
+    size_t huge_kb;     /* of which on THP or hugetlb pages */
+    size_t file_pmd_kb; /* file mappings (the input) on huge pages */
+} HugeCoverage;
+
+static int huge_tracked(uintptr_t lo, uintptr_t hi)
+{
+    for (size_t i = 0; i < huge_nregions; i++) {
+        uintptr_t a = (uintptr_t)huge_regions[i].addr;
+        if (a < hi && a + huge_regions[i].len > lo)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Sum /proc/self/smaps over the mappings that overlap a live region. The
+ * kernel merges adjacent anonymous mappings, so a neighbouring small one
+ * may be counted too. Returns -1 if smaps cannot be read.
+ */
+static int huge_coverage(HugeCoverage *c)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return -1;
+
+    char line[256];
+    int ours = 0;
+    *c = (HugeCoverage){ 0 };
+    pthread_mutex_lock(&huge_lock);
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long lo;
+        unsigned long hi;
+        size_t kb;
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            ours = huge_tracked(lo, hi);
+        } else if (sscanf(line, "FilePmdMapped: %zu kB", &kb) == 1) {
+            c->file_pmd_kb += kb;
+        } else if (!ours) {
+            continue;
+        } else if (sscanf(line, "Rss: %zu kB", &kb) == 1) {
+            c->rss_kb += kb;
+        } else if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            c->huge_kb += kb;
+        } else if (sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1) {
+            /* hugetlb pages are not part of Rss */
+            c->rss_kb += kb;
+            c->huge_kb += kb;
+        }
+    }
+    pthread_mutex_unlock(&huge_lock);
+    (void)fclose(f);
+    return 0;
+}
+
+/* huge_alloc() or exit, for callers that cannot fail */
+static void *huge_xalloc(size_t size)
+{
+    void *p = huge_alloc(size);
+    if (!p) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+/*===========================================================================
+ * Pool Allocator (8-byte aligned bump pointer over chained mmap blocks)
+ *
+ * Blocks are mapped on first use and never moved, so word pointers stay
+ * valid; the tail of a block too small for the next word is abandoned.
+ * Teardown is one huge_free per block.
+ *===========================================================================*/
+
+static __attribute__((noinline)) void pool_grow(Table *t, size_t needed)
+{
+    size_t size = t->pool_next;
+    while (size < needed + sizeof(PoolBlock))
+        size *= 2;
+
+    PoolBlock *b = huge_xalloc(size);
+
+    b->next = t->pool;
+    b->size = size;
+    t->pool = b;
+    t->pool_blocks++;
+    t->pool_ptr = (char *)b + sizeof(PoolBlock);
+    t->pool_end = (char *)b + size;
+    if (t->pool_next < POOL_SIZE)
+        t->pool_next *= 2;
+}
+
+static inline char *pool_alloc(Table *t, size_t len)
+{
+    size_t needed = (len + 1 + 7) & ~(size_t)7; /* 8-byte alignment */
+
+    if ((size_t)(t->pool_end - t->pool_ptr) < needed)
+        pool_grow(t, needed);
+
+    char *ptr = t->pool_ptr;
+    t->pool_ptr += needed;
+    return ptr;
+}
+
+/* Fill a free slot; only words longer than ENTRY_INLINE touch the pool */
+static inline void entry_fill(Table *t,
+                              Entry *e,
+                              const char *word,
+                              size_t len,
+                              uint64_t key,
+                              uint32_t hash,
+                              uint16_t fp)
+{
+    if (len <= ENTRY_INLINE) {
+        e->key.inl64 = key;
+    } else {
+        char *s = pool_alloc(t, len);
+        memcpy(s, word, len);
+        s[len] = '\0';
+        e->key.ptr = s;
+    }
+    e->count = 1;
+    e->hash = hash;
+    e->len = (uint16_t)len;
+    e->fp16 = fp;
+    t->len++;
+    t->total++;
+}
+
+/*===========================================================================
+ * Hash Table Operations
+ *===========================================================================*/
+
+static void table_grow(Table *t)
+{
+    size_t new_cap = t->cap * 2;
+    Entry *new_ent = huge_xalloc(new_cap * sizeof(Entry));
+
+    size_t mask = new_cap - 1;
+    for (size_t i = 0; i < t->cap; i++) {
+        const Entry *e = &t->entries[i];
+        if (!e->len)
+            continue;
+        size_t idx = e->hash & mask;
+        while (new_ent[idx].len)
+            idx = (idx + 1) & mask;
+        new_ent[idx] = *e;
+    }
+
+    huge_free(t->entries, t->cap * sizeof(Entry));
+    t->entries = new_ent;
+    t->cap = new_cap;
+    t->grows++;
+}
+
+/*
+ * Incremental resize (--resize=incremental, linear tables only)
+ *
+ * table_grow() stops the thread for a full rehash, and with a doubling
+ * table that pause lands on whichever chunk crosses the threshold. Instead,
+ * table_grow_start() swaps in the doubled array and keeps the old one as
+ * t->old; each insert then moves the next MIGRATE_STEP old slots across.
+ * A word lives in exactly one array, so lookups probe the old array first
+ * and fall through to the new one, where all new words go. Moved slots
+ * keep their len with count = 0, which keeps the old probe chains intact.
+ * One step per insert drains the old array long before the new one can
+ * reach its own threshold.
+ */
+typedef enum { RESIZE_FULL, RESIZE_INCREMENTAL } ResizeMode;
+
+static ResizeMode resize_mode = RESIZE_FULL;
+
+#ifndef MIGRATE_STEP
+#define MIGRATE_STEP 64
+#endif
+
+static void table_migrate(Table *t, size_t n)
+{
+    size_t end = t->old_cap - t->migrate_pos > n ? t->migrate_pos + n
+                                                 : t->old_cap;
+    size_t mask = t->cap - 1;
+
+    for (size_t i = t->migrate_pos; i < end; i++) {
+        Entry *e = &t->old[i];
+        if (!e->len || !e->count)
+            continue;
+        size_t idx = e->hash & mask;
+        while (t->entries[idx].len)
+            idx = (idx + 1) & mask;
+        t->entries[idx] = *e;
+        e->count = 0;
+    }
+    t->migrate_pos = end;
+
+    if (end == t->old_cap) {
+        huge_free(t->old, t->old_cap * sizeof(Entry));
+        t->old = NULL;
+        t->old_cap = 0;
+    }
+}
+
+/* Finish any pending migration; merge and output only read t->entries */
+static void table_settle(Table *t)
+{
+    if (t->old)
+        table_migrate(t, t->old_cap);
+}
+
+static void table_grow_start(Table *t)
+{
+    table_settle(t);
+
+    size_t new_cap = t->cap * 2;
+    Entry *new_ent = huge_xalloc(new_cap * sizeof(Entry));
+
+    t->old = t->entries;
+    t->old_cap = t->cap;
+    t->migrate_pos = 0;
+    t->entries = new_ent;
+    t->cap = new_cap;
+    t->grows++;
+}
+
+/* Count word n times if it is still in the old array; returns 1 if found */
+static int table_bump_old(Table *t,
+                          const char *word,
+                          size_t len,
+                          uint64_t key,
+                          uint32_t hash,
+                          uint64_t n)
+{
+    size_t mask = t->old_cap - 1;
+    size_t idx = hash & mask;
+
+    for (;;) {
+        Entry *e = &t->old[idx];
+        if (!e->len)
+            return 0;
+        if (e->count && entry_matches(e, word, len, key, hash)) {
+            e->count += n;
+            t->total += n;
+            return 1;
         }
+        idx = (idx + 1) & mask;
+    }
+}
+
+/*===========================================================================
+ * Swiss Table (--table=swiss)
+ *
+ * The same Entry array plus one control byte per slot: SWISS_EMPTY or the
+ * top 7 hash bits. Slots are probed in aligned groups of 16 control bytes
+ * with one SSE2 compare per group, so a probe usually reads one control
+ * line and only the entries whose tag matches. Nothing is ever deleted, so
+ * the first group with an empty byte ends the probe and the 7/8 load factor
+ * needs no tombstones. Free entries keep len == 0, so merge and output
+ * walk both layouts the same way.
+ *===========================================================================*/
 
-        /* Handle UTF-8 multibyte sequences */
-        if (c >= 0x80) {
-            while (i + 1 < size && (data[i + 1] & 0xC0) == 0x80)
-                i++;
-            if (word_len > 0) {
-                word[word_len] = '\0';
-#ifdef __SSE4_2__
-                uint32_t h = crc32c_finalize(crc);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
-                crc = 0;
+#define SWISS_GROUP 16
+#define SWISS_EMPTY 0x80
+
+typedef enum { TABLE_LINEAR, TABLE_SWISS } TableKind;
+
+static TableKind table_kind = TABLE_LINEAR;
+
+static inline uint8_t swiss_tag(uint32_t hash)
+{
+    return (uint8_t)(hash >> 25);
+}
+
+/* Bit i set iff ctrl[i] == b, over the 16-byte group at ctrl */
+static inline uint32_t swiss_match(const uint8_t *ctrl, uint8_t b)
+{
+#ifdef __SSE2__
+    __m128i g = _mm_load_si128((const __m128i *)(const void *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(g, _mm_set1_epi8((char)b)));
 #else
-                uint32_t h = hash_word(word, word_len);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
+    uint32_t m = 0;
+    for (int i = 0; i < SWISS_GROUP; i++)
+        m |= (uint32_t)(ctrl[i] == b) << i;
+    return m;
 #endif
-                word_len = 0;
-            }
+}
+
+/* First empty slot on @hash's probe sequence (triangular over groups) */
+static inline size_t
+swiss_find_empty(const uint8_t *ctrl, size_t mask, uint32_t hash)
+{
+    size_t g = hash & mask & ~(size_t)(SWISS_GROUP - 1);
+    for (size_t stride = SWISS_GROUP;; stride += SWISS_GROUP) {
+        uint32_t empty = swiss_match(ctrl + g, SWISS_EMPTY);
+        if (empty)
+            return g + (unsigned)__builtin_ctz(empty);
+        g = (g + stride) & mask;
+    }
+}
+
+static void swiss_grow(Table *t)
+{
+    size_t new_cap = t->cap * 2;
+    Entry *new_ent = huge_xalloc(new_cap * sizeof(Entry));
+    uint8_t *new_ctrl = huge_xalloc(new_cap);
+    memset(new_ctrl, SWISS_EMPTY, new_cap);
+
+    size_t mask = new_cap - 1;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->ctrl[i] == SWISS_EMPTY)
             continue;
+        const Entry *e = &t->entries[i];
+        size_t idx = swiss_find_empty(new_ctrl, mask, e->hash);
+        new_ctrl[idx] = t->ctrl[i];
+        new_ent[idx] = *e;
+    }
+
+    huge_free(t->entries, t->cap * sizeof(Entry));
+    huge_free(t->ctrl, t->cap);
+    t->entries = new_ent;
+    t->ctrl = new_ctrl;
+    t->cap = new_cap;
+    t->grows++;
+}
+
+static inline void swiss_insert(Table *t,
+                                const char *word,
+                                size_t len,
+                                uint64_t key,
+                                uint32_t hash,
+                                uint16_t fp,
+                                uint64_t n)
+{
+    size_t mask = t->cap - 1;
+    uint8_t tag = swiss_tag(hash);
+    size_t g = hash & mask & ~(size_t)(SWISS_GROUP - 1);
+
+    for (size_t stride = SWISS_GROUP;; stride += SWISS_GROUP) {
+        const uint8_t *ctrl = t->ctrl + g;
+
+        for (uint32_t m = swiss_match(ctrl, tag); m; m &= m - 1) {
+            Entry *e = &t->entries[g + (unsigned)__builtin_ctz(m)];
+            if (entry_matches(e, word, len, key, hash)) {
+                e->count += n;
+                t->total += n;
+                return;
+            }
+        }
+
+        uint32_t empty = swiss_match(ctrl, SWISS_EMPTY);
+        if (empty) {
+            size_t idx = g + (unsigned)__builtin_ctz(empty);
+            entry_fill(t, &t->entries[idx], word, len, key, hash, fp);
+            t->entries[idx].count = n;
+            t->total += n - 1;
+            t->ctrl[idx] = tag;
+
+            if (t->len * 8 > t->cap * 7)
+                swiss_grow(t);
+            return;
+        }
+
+        g = (g + stride) & mask;
+        t->extra_probes++;
+    }
+}
+
+/*===========================================================================
+ * Insert (dispatches on the table layout)
+ *===========================================================================*/
+
+/* Count word n times under its key (key_inline() for short words) */
+static inline void table_count(Table *t,
+                               const char *word,
+                               size_t len,
+                               uint64_t key,
+                               uint32_t hash,
+                               uint16_t fp,
+                               uint64_t n)
+{
+    if (t->ctrl) {
+        swiss_insert(t, word, len, key, hash, fp, n);
+        return;
+    }
+
+    if (t->old) {
+        if (table_bump_old(t, word, len, key, hash, n))
+            return;
+        table_migrate(t, MIGRATE_STEP);
+    }
+
+    size_t mask = t->cap - 1;
+    size_t idx = hash & mask;
+
+    for (;;) {
+        Entry *e = &t->entries[idx];
+
+        if (!e->len) {
+            entry_fill(t, e, word, len, key, hash, fp);
+            e->count = n;
+            t->total += n - 1;
+
+            /* Prefetch next slots for future inserts */
+#ifdef __SSE2__
+            _mm_prefetch((const char *)&t->entries[(idx + 1) & mask],
+                         _MM_HINT_T0);
+            _mm_prefetch((const char *)&t->entries[(idx + 8) & mask],
+                         _MM_HINT_T2);
+#endif
+            /* Grow if load factor > 0.7 */
+            if (t->len * 10 > t->cap * 7) {
+                if (t->incremental)
+                    table_grow_start(t);
+                else
+                    table_grow(t);
+            }
+            return;
+        }
+
+        /* Check for match: hash + len, then inline key or memcmp */
+        if (entry_matches(e, word, len, key, hash)) {
+            e->count += n;
+            t->total += n;
+            return;
         }
 
-        if (is_letter(c)) {
-            if (word_len < MAX_WORD - 1) {
-                char lc = (char)(c | 0x20);
-                word[word_len++] = lc;
-#ifdef __SSE4_2__
-                crc = _mm_crc32_u8((uint32_t)crc, (uint8_t)lc);
-#endif
-            }
-        } else if (word_len > 0) {
-            word[word_len] = '\0';
-#ifdef __SSE4_2__
-            uint32_t h = crc32c_finalize(crc);
-            uint16_t fp = (uint16_t)(h ^ (h >> 16));
-            table_insert(t, word, word_len, h, fp);
-            crc = 0;
-#else
-            uint32_t h = hash_word(word, word_len);
-            uint16_t fp = (uint16_t)(h ^ (h >> 16));
-            table_insert(t, word, word_len, h, fp);
-#endif
-            word_len = 0;
+        idx = (idx + 1) & mask;
+        t->extra_probes++;
+    }
+}
+
+/* @word must have 8 readable bytes (key_inline); the kernels' word buffer
+ * has the slack */
+static inline void
+table_insert(Table *t, const char *word, size_t len, uint32_t hash, uint16_t fp)
+{
+    if (len == 0 || len >= MAX_WORD)
+        return;
+
+    uint64_t key = len <= ENTRY_INLINE ? key_inline(word, len) : 0;
+    table_count(t, word, len, key, hash, fp, 1);
+}
+
+/* Add the count of *e, an entry of another table, to t of any layout */
+static inline void table_add(Table *t, const Entry *e)
+{
+    table_count(t,
+                entry_word(e),
+                e->len,
+                e->key.inl64,
+                e->hash,
+                e->fp16,
+                e->count);
+}
+
+/*
+ * Batched inserts. In a table larger than the cache every lookup is a miss
+ * that one insert cannot hide, as the kernel waits for the slot before it
+ * scans on. So the kernels collect INSERT_BATCH words, prefetching each
+ * one's home slot when it is emitted, and then insert the batch in order:
+ * by the time the first word is resolved the others' slots are in flight.
+ * The order is unchanged, so the table ends up exactly as with one insert
+ * per word. While a table holds fewer than INSERT_BATCH_MIN words its
+ * lines mostly stay in cache and the bookkeeping would cost more than the
+ * misses, so the kernels decide per chunk; -DINSERT_BATCH=1 never batches.
+ */
+#ifndef INSERT_BATCH
+#define INSERT_BATCH 16
+#endif
+
+#ifndef INSERT_BATCH_MIN
+#define INSERT_BATCH_MIN (128u << 10)
+#endif
+_Static_assert(INSERT_BATCH >= 1 && INSERT_BATCH <= 256, "INSERT_BATCH range");
+
+/* Start loading the slots the lookup of @hash reads first */
+static inline void table_prefetch(const Table *t, uint32_t hash)
+{
+    size_t idx = hash & (t->cap - 1);
+
+    if (t->ctrl) {
+        idx &= ~(size_t)(SWISS_GROUP - 1);
+        __builtin_prefetch(t->ctrl + idx, 0, 3);
+    } else if (t->old) {
+        __builtin_prefetch(&t->old[hash & (t->old_cap - 1)], 1, 3);
+    }
+    __builtin_prefetch(&t->entries[idx], 1, 3);
+}
+
+/* Insert n words stored stride bytes apart, prefetched by table_prefetch */
+static inline void table_insert_batch(Table *t,
+                                      const char *words,
+                                      size_t stride,
+                                      const uint32_t *hash,
+                                      const uint16_t *len,
+                                      int n)
+{
+    for (int k = 0; k < n; k++)
+        table_insert(t,
+                     words + (size_t)k * stride,
+                     len[k],
+                     hash[k],
+                     (uint16_t)(hash[k] ^ (hash[k] >> 16)));
+}
+
+/* Allocate t for about estimated_unique words, at least min_cap slots */
+static int table_create(Table *t,
+                        int id,
+                        size_t estimated_unique,
+                        size_t min_cap,
+                        TableKind kind,
+                        ResizeMode resize)
+{
+    /* Room for the estimate below the grow threshold (0.7 vs 7/8) */
+    if (kind == TABLE_SWISS)
+        t->cap = next_pow2(estimated_unique + estimated_unique / 7 + 1);
+    else
+        t->cap = next_pow2(estimated_unique * 2);
+    if (t->cap < min_cap)
+        t->cap = min_cap;
+
+    t->entries = huge_alloc(t->cap * sizeof(Entry));
+    if (!t->entries) {
+        perror("mmap");
+        return -1;
+    }
+
+    t->ctrl = NULL;
+    t->old = NULL;
+    t->old_cap = 0;
+    t->migrate_pos = 0;
+    t->incremental = kind == TABLE_LINEAR && resize == RESIZE_INCREMENTAL;
+    if (kind == TABLE_SWISS) {
+        t->ctrl = huge_alloc(t->cap);
+        if (!t->ctrl) {
+            perror("mmap");
+            return -1;
+        }
+        memset(t->ctrl, SWISS_EMPTY, t->cap);
+    }
+
+    /* Pool: ~16 bytes per expected unique word, mapped on first use */
+    t->pool = NULL;
+    t->pool_ptr = NULL;
+    t->pool_end = NULL;
+    t->pool_next = next_pow2(estimated_unique * 16);
+    if (t->pool_next < POOL_MIN_BLOCK)
+        t->pool_next = POOL_MIN_BLOCK;
+    if (t->pool_next > POOL_SIZE)
+        t->pool_next = POOL_SIZE;
+
+    t->len = 0;
+    t->total = 0;
+    t->extra_probes = 0;
+    t->grows = 0;
+    t->pool_blocks = 0;
+    t->id = id;
+    return 0;
+}
+
+static int
+table_init(Table *t, int id, size_t bytes, TableKind kind, ResizeMode resize)
+{
+    size_t estimated_words = bytes / 5;
+    size_t estimated_unique = estimated_words / 10;
+
+    return table_create(t, id, estimated_unique, INITIAL_CAP, kind, resize);
+}
+
+static void table_free(Table *t)
+{
+    while (t->pool) {
+        PoolBlock *next = t->pool->next;
+        huge_free(t->pool, t->pool->size);
+        t->pool = next;
+    }
+    huge_free(t->entries, t->cap * sizeof(Entry));
+    huge_free(t->ctrl, t->cap);
+    huge_free(t->old, t->old_cap * sizeof(Entry));
+    t->entries = NULL;
+    t->ctrl = NULL;
+    t->old = NULL;
+    t->pool_ptr = NULL;
+    t->pool_end = NULL;
+}
+
+/*===========================================================================
+ * Shared Table (--table=shared)
+ *
+ * Private tables keep one copy of the vocabulary per worker, so memory and
+ * merge work grow with the thread count. In shared mode a single table,
+ * split by the top hash bits into SHARED_SHARDS shards with a lock each,
+ * holds the only copy. Workers still count into their own table, which
+ * becomes a front cache: after every chunk its entries are grouped by
+ * shard, added to the shared table under one lock acquisition per shard,
+ * and the front is cleared. A frequent word costs one shared update per
+ * chunk rather than one per occurrence, and each lock is held briefly.
+ *===========================================================================*/
+
+#ifndef SHARED_BITS
+#define SHARED_BITS 8
+#endif
+#define SHARED_SHARDS (1 << SHARED_BITS)
+_Static_assert(SHARED_BITS >= 1 && SHARED_BITS <= 12, "SHARED_BITS: 1 to 12");
+#define SHARD_MIN_CAP 1024
+
+typedef struct {
+    pthread_mutex_t lock;
+    Table table;
+} Shard;
+
+static int shared_table = 0;
+static Shard *shards; /* SHARED_SHARDS of them while shared_table is set */
+
+static inline int shared_shard(uint32_t hash)
+{
+    return (int)(hash >> (32 - SHARED_BITS));
+}
+
+static int shared_init(void)
+{
+    shards = aligned_alloc(CACHELINE, SHARED_SHARDS * sizeof(Shard));
+    if (!shards) {
+        perror("aligned_alloc");
+        return -1;
+    }
+    memset(shards, 0, SHARED_SHARDS * sizeof(Shard));
+    for (int s = 0; s < SHARED_SHARDS; s++) {
+        (void)pthread_mutex_init(&shards[s].lock, NULL);
+        if (table_create(&shards[s].table,
+                         s,
+                         0,
+                         SHARD_MIN_CAP,
+                         TABLE_LINEAR,
+                         RESIZE_FULL) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void shared_free(void)
+{
+    if (!shards)
+        return;
+    for (int s = 0; s < SHARED_SHARDS; s++) {
+        table_free(&shards[s].table);
+        (void)pthread_mutex_destroy(&shards[s].lock);
+    }
+    free(shards);
+    shards = NULL;
+}
+
+/* Add the count of *e, an entry of another table, to the linear table t */
+static void shard_add(Table *t, const Entry *e)
+{
+    size_t mask = t->cap - 1;
+    size_t idx = e->hash & mask;
+
+    for (;;) {
+        Entry *s = &t->entries[idx];
+        if (!s->len) {
+            entry_fill(t,
+                       s,
+                       entry_word(e),
+                       e->len,
+                       e->key.inl64,
+                       e->hash,
+                       e->fp16);
+            s->count = e->count;
+            t->total += e->count - 1;
+            if (t->len * 10 > t->cap * 7)
+                table_grow(t);
+            return;
+        }
+        if (entry_same(s, e)) {
+            s->count += e->count;
+            t->total += e->count;
+            return;
+        }
+        idx = (idx + 1) & mask;
+    }
+}
+
+/* Empty t for reuse, keeping its arrays and newest pool block; total stays */
+static void table_clear(Table *t)
+{
+    memset(t->entries, 0, t->cap * sizeof(Entry));
+    if (t->ctrl)
+        memset(t->ctrl, SWISS_EMPTY, t->cap);
+    t->len = 0;
+
+    PoolBlock *b = t->pool;
+    if (b) {
+        while (b->next) {
+            PoolBlock *next = b->next->next;
+            huge_free(b->next, b->next->size);
+            b->next = next;
+        }
+        t->pool_ptr = (char *)b + sizeof(PoolBlock);
+        t->pool_end = (char *)b + b->size;
+    }
+}
+
+/*
+ * Move the entries of front cache t into the shards and clear it. Workers
+ * start at evenly spaced shards so that fronts flushed at the same time do
+ * not all queue on the same lock.
+ */
+static void shared_flush(Table *t, Entry **spill, size_t *spill_cap)
+{
+    size_t offs[SHARED_SHARDS + 1];
+
+    table_settle(t);
+    if (t->len == 0)
+        return;
+    if (*spill_cap < t->len) {
+        free(*spill);
+        *spill_cap = next_pow2(t->len);
+        *spill = malloc(*spill_cap * sizeof(Entry));
+        if (!*spill) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    memset(offs, 0, sizeof(offs));
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->entries[i].len)
+            offs[shared_shard(t->entries[i].hash) + 1]++;
+    }
+    for (int s = 0; s < SHARED_SHARDS; s++)
+        offs[s + 1] += offs[s];
+
+    /* Scatter with offs[s] as the cursor; it ends as the end of run s */
+    for (size_t i = 0; i < t->cap; i++) {
+        const Entry *e = &t->entries[i];
+        if (e->len)
+            (*spill)[offs[shared_shard(e->hash)]++] = *e;
+    }
+
+    int first = t->id * SHARED_SHARDS / nthreads;
+    for (int k = 0; k < SHARED_SHARDS; k++) {
+        int s = (first + k) & (SHARED_SHARDS - 1);
+        size_t lo = s ? offs[s - 1] : 0;
+        if (lo == offs[s])
+            continue;
+        Shard *sh = &shards[s];
+        (void)pthread_mutex_lock(&sh->lock);
+        for (size_t i = lo; i < offs[s]; i++)
+            shard_add(&sh->table, &(*spill)[i]);
+        (void)pthread_mutex_unlock(&sh->lock);
+    }
+    table_clear(t);
+}
+
+/*===========================================================================
+ * Character Classification
+ *===========================================================================*/
+
+static inline int is_letter(unsigned char c)
+{
+    return ((c | 32u) - 'a') < 26u;
+}
+
+/*===========================================================================
+ * Word Rules (--word)
+ *
+ * A word is a maximal run of CLASS_WORD bytes, which may also hold
+ * CLASS_INNER bytes that sit between two word bytes (the apostrophe of
+ * "don't", the hyphen of "well-known"), counted only if it has at least
+ * min_len bytes. Bytes A-Z fold to a-z; every other byte is kept as is.
+ *
+ * The default rules, ASCII letters, are the ones the plain kernels
+ * hard-code as constant compares. Any other rules switch process_chunk()
+ * to the *_rules kernels, which classify bytes through a 256-entry class
+ * table compiled to nibble lookups for pshufb / vqtbl1q: byte c is in a
+ * class iff lo[c & 15] & hi[c >> 4] is nonzero. Each distinct row (the
+ * low nibbles in the class under one high nibble) takes one of the 8
+ * bits, so any class confined to 8 high nibbles, such as every ASCII
+ * class, compiles exactly.
+ *===========================================================================*/
+
+enum { CLASS_WORD = 1, CLASS_INNER = 2 };
+
+typedef struct {
+    int custom; /* 0 = the default rules and the plain kernels */
+    int utf8;   /* --utf8: the *_utf8 kernels, see UTF-8 Words */
+    size_t min_len;
+    uint8_t cls[256];
+    uint8_t word_lo[16];
+    uint8_t word_hi[16];
+    uint8_t inner_lo[16];
+    uint8_t inner_hi[16];
+} WordRules;
+
+static WordRules word_rules = { .min_len = 1 };
+
+/* May c be part of a word? Outside --utf8, input is cut between workers,
+ * buffers and feeds only at a byte that is not (see word_end()). */
+static inline int is_joinable(unsigned char c)
+{
+    return word_rules.custom ? word_rules.cls[c] != 0 : is_letter(c);
+}
+
+static int nibble_compile(uint8_t bit, uint8_t lo[16], uint8_t hi[16])
+{
+    uint16_t rows[8];
+    int nrows = 0;
+
+    memset(lo, 0, 16);
+    memset(hi, 0, 16);
+    for (int h = 0; h < 16; h++) {
+        uint16_t row = 0;
+        for (int l = 0; l < 16; l++) {
+            if (word_rules.cls[h << 4 | l] & bit)
+                row |= (uint16_t)(1u << l);
+        }
+        if (!row)
+            continue;
+        int r = 0;
+        while (r < nrows && rows[r] != row)
+            r++;
+        if (r == nrows) {
+            if (nrows == 8)
+                return -1;
+            rows[nrows++] = row;
+        }
+        hi[h] = (uint8_t)(1u << r);
+        for (int l = 0; l < 16; l++) {
+            if (row >> l & 1)
+                lo[l] |= (uint8_t)(1u << r);
+        }
+    }
+    return 0;
+}
+
+/* Add the bytes of list (up to a comma) to class bit */
+static const char *rules_add(const char *list, uint8_t bit)
+{
+    for (; *list && *list != ','; list++) {
+        unsigned char c = (unsigned char)*list;
+        if (c <= ' ' || c >= 0x7f)
+            return NULL;
+        if (!(word_rules.cls[c] & CLASS_WORD))
+            word_rules.cls[c] = bit;
+    }
+    return list;
+}
+
+/*
+ * Parse a comma-separated --word spec: letters, digits, apostrophe (as
+ * inner=') and hyphen (inner=-), chars=LIST for more word bytes,
+ * inner=LIST, min=N. Returns 0, or -1 with the bad item reported.
+ */
+static int rules_parse(const char *spec)
+{
+    const char *p = spec;
+
+    memset(word_rules.cls, 0, sizeof(word_rules.cls));
+    word_rules.min_len = 1;
+    while (*p) {
+        const char *item = p;
+        size_t n = strcspn(p, ",");
+        if (n == 7 && strncmp(p, "letters", n) == 0) {
+            for (int c = 'a'; c <= 'z'; c++)
+                word_rules.cls[c] = word_rules.cls[c - 32] = CLASS_WORD;
+            p += n;
+        } else if (n == 6 && strncmp(p, "digits", n) == 0) {
+            for (int c = '0'; c <= '9'; c++)
+                word_rules.cls[c] = CLASS_WORD;
+            p += n;
+        } else if (n == 10 && strncmp(p, "apostrophe", n) == 0) {
+            (void)rules_add("'", CLASS_INNER);
+            p += n;
+        } else if (n == 6 && strncmp(p, "hyphen", n) == 0) {
+            (void)rules_add("-", CLASS_INNER);
+            p += n;
+        } else if (strncmp(p, "chars=", 6) == 0 && n > 6) {
+            p = rules_add(p + 6, CLASS_WORD);
+        } else if (strncmp(p, "inner=", 6) == 0 && n > 6) {
+            p = rules_add(p + 6, CLASS_INNER);
+        } else if (strncmp(p, "min=", 4) == 0) {
+            char *end;
+            unsigned long v = strtoul(p + 4, &end, 10);
+            word_rules.min_len = v;
+            p = end == p + n && v >= 1 && v < MAX_WORD ? end : NULL;
+        } else {
+            p = NULL;
+        }
+        if (!p) {
+            (void)fprintf(stderr,
+                          "bad --word item: %.*s\n",
+                          (int)strcspn(item, ","),
+                          item);
+            return -1;
+        }
+        if (*p == ',')
+            p++;
+    }
+
+    /* An inner byte that is also a word byte is just a word byte */
+    int letters = 1;
+    int any = 0;
+    for (int c = 0; c < 256; c++) {
+        if (word_rules.cls[c] & CLASS_WORD)
+            any = 1;
+        if (word_rules.cls[c] != (is_letter((unsigned char)c) ? CLASS_WORD : 0))
+            letters = 0;
+    }
+    if (!any) {
+        (void)fprintf(stderr, "--word=%s: no word bytes\n", spec);
+        return -1;
+    }
+    word_rules.custom = !letters || word_rules.min_len > 1;
+    if (nibble_compile(CLASS_WORD, word_rules.word_lo, word_rules.word_hi) <
+                0 ||
+        nibble_compile(CLASS_INNER, word_rules.inner_lo, word_rules.inner_hi) <
+                0) {
+        (void)fprintf(stderr, "--word=%s: too many byte classes\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+/*===========================================================================
+ * UTF-8 Words (--utf8)
+ *
+ * Under --utf8 the input is read as UTF-8: a code point is a word
+ * character if it is a Unicode letter or mark, or a Unicode digit when
+ * '0' is a word byte, and U+2019 (the typographic apostrophe) takes the
+ * class of '\''. ASCII keeps the --word classes. Words fold through the
+ * simple case folding of each code point (A-Z, and e.g. Ä to ä, Σ to σ,
+ * Ж to ж; no expansions such as ß to ss); min=N counts code points, and
+ * a word is cut to the longest run of whole code points that fits in
+ * WORD_KEEP bytes.
+ *
+ * The tables are ranges of the Unicode 14.0 Character Database (a gap of
+ * unassigned code points inside a range is absorbed into it) and runs of
+ * folds sharing a delta every step code points, so a lookup is a binary
+ * search over a few hundred entries. Ill-formed input (stray continuation
+ * bytes, overlong forms, surrogates, truncated sequences) is not an
+ * error: each byte that does not start a well-formed sequence is a
+ * separator, decoded on its own.
+ *
+ * The *_utf8 kernels take an all-ASCII 64-byte block down the plain (or
+ * rules) kernel's path unchanged. In any other block the bytes >= 0x80
+ * join the word mask, and only the runs holding one are decoded code
+ * point by code point, so the cost follows the share of words with a
+ * non-ASCII letter, not the share of blocks. A letter cut by the end of
+ * a block moves the next block up to start after it.
+ *===========================================================================*/
+
+#define UTF8_BAD 0x110000u /* decoded from an ill-formed byte */
+
+typedef struct {
+    uint32_t lo;
+    uint32_t hi;
+    int32_t delta; /* folded = cp + delta for cp = lo, lo + step, ... hi */
+    uint32_t step;
+} FoldRun;
+
+static const uint32_t utf8_letters[][2] = {
+    { 0x00aa, 0x00aa }, { 0x00b5, 0x00b5 }, { 0x00ba, 0x00ba },
+    { 0x00c0, 0x00d6 }, { 0x00d8, 0x00f6 }, { 0x00f8, 0x02c1 },
+    { 0x02c6, 0x02d1 }, { 0x02e0, 0x02e4 }, { 0x02ec, 0x02ec },
+    { 0x02ee, 0x02ee }, { 0x0300, 0x0374 }, { 0x0376, 0x037d },
+    { 0x037f, 0x037f }, { 0x0386, 0x0386 }, { 0x0388, 0x03f5 },
+    { 0x03f7, 0x0481 }, { 0x0483, 0x0559 }, { 0x0560, 0x0588 },
+    { 0x0591, 0x05bd }, { 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 },
+    { 0x05c4, 0x05c5 }, { 0x05c7, 0x05f2 }, { 0x0610, 0x061a },
+    { 0x0620, 0x065f }, { 0x066e, 0x06d3 }, { 0x06d5, 0x06dc },
+    { 0x06df, 0x06e8 }, { 0x06ea, 0x06ef }, { 0x06fa, 0x06fc },
+    { 0x06ff, 0x06ff }, { 0x0710, 0x07b1 }, { 0x07ca, 0x07f5 },
+    { 0x07fa, 0x07fd }, { 0x0800, 0x082d }, { 0x0840, 0x085b },
+    { 0x0860, 0x0887 }, { 0x0889, 0x088e }, { 0x0898, 0x08e1 },
+    { 0x08e3, 0x0963 }, { 0x0971, 0x09e3 }, { 0x09f0, 0x09f1 },
+    { 0x09fc, 0x09fc }, { 0x09fe, 0x0a5e }, { 0x0a70, 0x0a75 },
+    { 0x0a81, 0x0ae3 }, { 0x0af9, 0x0b63 }, { 0x0b71, 0x0b71 },
+    { 0x0b82, 0x0bd7 }, { 0x0c00, 0x0c63 }, { 0x0c80, 0x0c83 },
+    { 0x0c85, 0x0ce3 }, { 0x0cf1, 0x0d4e }, { 0x0d54, 0x0d57 },
+    { 0x0d5f, 0x0d63 }, { 0x0d7a, 0x0ddf }, { 0x0df2, 0x0df3 },
+    { 0x0e01, 0x0e3a }, { 0x0e40, 0x0e4e }, { 0x0e81, 0x0ecd },
+    { 0x0edc, 0x0f00 }, { 0x0f18, 0x0f19 }, { 0x0f35, 0x0f35 },
+    { 0x0f37, 0x0f37 }, { 0x0f39, 0x0f39 }, { 0x0f3e, 0x0f84 },
+    { 0x0f86, 0x0fbc }, { 0x0fc6, 0x0fc6 }, { 0x1000, 0x103f },
+    { 0x1050, 0x108f }, { 0x109a, 0x109d }, { 0x10a0, 0x10fa },
+    { 0x10fc, 0x135f }, { 0x1380, 0x138f }, { 0x13a0, 0x13fd },
+    { 0x1401, 0x166c }, { 0x166f, 0x167f }, { 0x1681, 0x169a },
+    { 0x16a0, 0x16ea }, { 0x16f1, 0x1734 }, { 0x1740, 0x17d3 },
+    { 0x17d7, 0x17d7 }, { 0x17dc, 0x17dd }, { 0x180b, 0x180d },
+    { 0x180f, 0x180f }, { 0x1820, 0x193b }, { 0x1950, 0x19c9 },
+    { 0x1a00, 0x1a1b }, { 0x1a20, 0x1a7f }, { 0x1aa7, 0x1aa7 },
+    { 0x1ab0, 0x1b4c }, { 0x1b6b, 0x1b73 }, { 0x1b80, 0x1baf },
+    { 0x1bba, 0x1bf3 }, { 0x1c00, 0x1c37 }, { 0x1c4d, 0x1c4f },
+    { 0x1c5a, 0x1c7d }, { 0x1c80, 0x1cbf }, { 0x1cd0, 0x1cd2 },
+    { 0x1cd4, 0x1fbc }, { 0x1fbe, 0x1fbe }, { 0x1fc2, 0x1fcc },
+    { 0x1fd0, 0x1fdb }, { 0x1fe0, 0x1fec }, { 0x1ff2, 0x1ffc },
+    { 0x2071, 0x2071 }, { 0x207f, 0x207f }, { 0x2090, 0x209c },
+    { 0x20d0, 0x20f0 }, { 0x2102, 0x2102 }, { 0x2107, 0x2107 },
+    { 0x210a, 0x2113 }, { 0x2115, 0x2115 }, { 0x2119, 0x211d },
+    { 0x2124, 0x2124 }, { 0x2126, 0x2126 }, { 0x2128, 0x2128 },
+    { 0x212a, 0x212d }, { 0x212f, 0x2139 }, { 0x213c, 0x213f },
+    { 0x2145, 0x2149 }, { 0x214e, 0x214e }, { 0x2183, 0x2184 },
+    { 0x2c00, 0x2ce4 }, { 0x2ceb, 0x2cf3 }, { 0x2d00, 0x2d6f },
+    { 0x2d7f, 0x2dff }, { 0x2e2f, 0x2e2f }, { 0x3005, 0x3006 },
+    { 0x302a, 0x302f }, { 0x3031, 0x3035 }, { 0x303b, 0x303c },
+    { 0x3041, 0x309a }, { 0x309d, 0x309f }, { 0x30a1, 0x30fa },
+    { 0x30fc, 0x318e }, { 0x31a0, 0x31bf }, { 0x31f0, 0x31ff },
+    { 0x3400, 0x4dbf }, { 0x4e00, 0xa48c }, { 0xa4d0, 0xa4fd },
+    { 0xa500, 0xa60c }, { 0xa610, 0xa61f }, { 0xa62a, 0xa672 },
+    { 0xa674, 0xa67d }, { 0xa67f, 0xa6e5 }, { 0xa6f0, 0xa6f1 },
+    { 0xa717, 0xa71f }, { 0xa722, 0xa788 }, { 0xa78b, 0xa827 },
+    { 0xa82c, 0xa82c }, { 0xa840, 0xa873 }, { 0xa880, 0xa8c5 },
+    { 0xa8e0, 0xa8f7 }, { 0xa8fb, 0xa8fb }, { 0xa8fd, 0xa8ff },
+    { 0xa90a, 0xa92d }, { 0xa930, 0xa953 }, { 0xa960, 0xa9c0 },
+    { 0xa9cf, 0xa9cf }, { 0xa9e0, 0xa9ef }, { 0xa9fa, 0xaa4d },
+    { 0xaa60, 0xaa76 }, { 0xaa7a, 0xaadd }, { 0xaae0, 0xaaef },
+    { 0xaaf2, 0xab5a }, { 0xab5c, 0xab69 }, { 0xab70, 0xabea },
+    { 0xabec, 0xabed }, { 0xac00, 0xd7fb }, { 0xf900, 0xfb28 },
+    { 0xfb2a, 0xfbb1 }, { 0xfbd3, 0xfd3d }, { 0xfd50, 0xfdc7 },
+    { 0xfdf0, 0xfdfb }, { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f },
+    { 0xfe70, 0xfefc }, { 0xff21, 0xff3a }, { 0xff41, 0xff5a },
+    { 0xff66, 0xffdc }, { 0x10000, 0x100fa }, { 0x101fd, 0x102e0 },
+    { 0x10300, 0x1031f }, { 0x1032d, 0x10340 }, { 0x10342, 0x10349 },
+    { 0x10350, 0x1039d }, { 0x103a0, 0x103cf }, { 0x10400, 0x1049d },
+    { 0x104b0, 0x10563 }, { 0x10570, 0x10855 }, { 0x10860, 0x10876 },
+    { 0x10880, 0x1089e }, { 0x108e0, 0x108f5 }, { 0x10900, 0x10915 },
+    { 0x10920, 0x10939 }, { 0x10980, 0x109b7 }, { 0x109be, 0x109bf },
+    { 0x10a00, 0x10a3f }, { 0x10a60, 0x10a7c }, { 0x10a80, 0x10a9c },
+    { 0x10ac0, 0x10ac7 }, { 0x10ac9, 0x10ae6 }, { 0x10b00, 0x10b35 },
+    { 0x10b40, 0x10b55 }, { 0x10b60, 0x10b72 }, { 0x10b80, 0x10b91 },
+    { 0x10c00, 0x10cf2 }, { 0x10d00, 0x10d27 }, { 0x10e80, 0x10eac },
+    { 0x10eb0, 0x10f1c }, { 0x10f27, 0x10f50 }, { 0x10f70, 0x10f85 },
+    { 0x10fb0, 0x10fc4 }, { 0x10fe0, 0x11046 }, { 0x11070, 0x110ba },
+    { 0x110c2, 0x110c2 }, { 0x110d0, 0x110e8 }, { 0x11100, 0x11134 },
+    { 0x11144, 0x11173 }, { 0x11176, 0x111c4 }, { 0x111c9, 0x111cc },
+    { 0x111ce, 0x111cf }, { 0x111da, 0x111da }, { 0x111dc, 0x111dc },
+    { 0x11200, 0x11237 }, { 0x1123e, 0x112a8 }, { 0x112b0, 0x112ea },
+    { 0x11300, 0x1144a }, { 0x1145e, 0x114c5 }, { 0x114c7, 0x114c7 },
+    { 0x11580, 0x115c0 }, { 0x115d8, 0x11640 }, { 0x11644, 0x11644 },
+    { 0x11680, 0x116b8 }, { 0x11700, 0x1172b }, { 0x11740, 0x1183a },
+    { 0x118a0, 0x118df }, { 0x118ff, 0x11943 }, { 0x119a0, 0x119e1 },
+    { 0x119e3, 0x11a3e }, { 0x11a47, 0x11a99 }, { 0x11a9d, 0x11a9d },
+    { 0x11ab0, 0x11c40 }, { 0x11c72, 0x11d47 }, { 0x11d60, 0x11d98 },
+    { 0x11ee0, 0x11ef6 }, { 0x11fb0, 0x11fb0 }, { 0x12000, 0x12399 },
+    { 0x12480, 0x12ff0 }, { 0x13000, 0x1342e }, { 0x14400, 0x16a5e },
+    { 0x16a70, 0x16abe }, { 0x16ad0, 0x16af4 }, { 0x16b00, 0x16b36 },
+    { 0x16b40, 0x16b43 }, { 0x16b63, 0x16e7f }, { 0x16f00, 0x16fe1 },
+    { 0x16fe3, 0x1bc99 }, { 0x1bc9d, 0x1bc9e }, { 0x1cf00, 0x1cf46 },
+    { 0x1d165, 0x1d169 }, { 0x1d16d, 0x1d172 }, { 0x1d17b, 0x1d182 },
+    { 0x1d185, 0x1d18b }, { 0x1d1aa, 0x1d1ad }, { 0x1d242, 0x1d244 },
+    { 0x1d400, 0x1d6c0 }, { 0x1d6c2, 0x1d6da }, { 0x1d6dc, 0x1d6fa },
+    { 0x1d6fc, 0x1d714 }, { 0x1d716, 0x1d734 }, { 0x1d736, 0x1d74e },
+    { 0x1d750, 0x1d76e }, { 0x1d770, 0x1d788 }, { 0x1d78a, 0x1d7a8 },
+    { 0x1d7aa, 0x1d7c2 }, { 0x1d7c4, 0x1d7cb }, { 0x1da00, 0x1da36 },
+    { 0x1da3b, 0x1da6c }, { 0x1da75, 0x1da75 }, { 0x1da84, 0x1da84 },
+    { 0x1da9b, 0x1e13d }, { 0x1e14e, 0x1e14e }, { 0x1e290, 0x1e2ef },
+    { 0x1e7e0, 0x1e8c4 }, { 0x1e8d0, 0x1e94b }, { 0x1ee00, 0x1eebb },
+    { 0x20000, 0x3134a }, { 0xe0100, 0xe01ef },
+};
+
+static const uint32_t utf8_digits[][2] = {
+    { 0x0660, 0x0669 }, { 0x06f0, 0x06f9 }, { 0x07c0, 0x07c9 },
+    { 0x0966, 0x096f }, { 0x09e6, 0x09ef }, { 0x0a66, 0x0a6f },
+    { 0x0ae6, 0x0aef }, { 0x0b66, 0x0b6f }, { 0x0be6, 0x0bef },
+    { 0x0c66, 0x0c6f }, { 0x0ce6, 0x0cef }, { 0x0d66, 0x0d6f },
+    { 0x0de6, 0x0def }, { 0x0e50, 0x0e59 }, { 0x0ed0, 0x0ed9 },
+    { 0x0f20, 0x0f29 }, { 0x1040, 0x1049 }, { 0x1090, 0x1099 },
+    { 0x17e0, 0x17e9 }, { 0x1810, 0x1819 }, { 0x1946, 0x194f },
+    { 0x19d0, 0x19d9 }, { 0x1a80, 0x1a99 }, { 0x1b50, 0x1b59 },
+    { 0x1bb0, 0x1bb9 }, { 0x1c40, 0x1c49 }, { 0x1c50, 0x1c59 },
+    { 0xa620, 0xa629 }, { 0xa8d0, 0xa8d9 }, { 0xa900, 0xa909 },
+    { 0xa9d0, 0xa9d9 }, { 0xa9f0, 0xa9f9 }, { 0xaa50, 0xaa59 },
+    { 0xabf0, 0xabf9 }, { 0xff10, 0xff19 }, { 0x104a0, 0x104a9 },
+    { 0x10d30, 0x10d39 }, { 0x11066, 0x1106f }, { 0x110f0, 0x110f9 },
+    { 0x11136, 0x1113f }, { 0x111d0, 0x111d9 }, { 0x112f0, 0x112f9 },
+    { 0x11450, 0x11459 }, { 0x114d0, 0x114d9 }, { 0x11650, 0x11659 },
+    { 0x116c0, 0x116c9 }, { 0x11730, 0x11739 }, { 0x118e0, 0x118e9 },
+    { 0x11950, 0x11959 }, { 0x11c50, 0x11c59 }, { 0x11d50, 0x11d59 },
+    { 0x11da0, 0x11da9 }, { 0x16a60, 0x16a69 }, { 0x16ac0, 0x16ac9 },
+    { 0x16b50, 0x16b59 }, { 0x1d7ce, 0x1d7ff }, { 0x1e140, 0x1e149 },
+    { 0x1e2f0, 0x1e2f9 }, { 0x1e950, 0x1e959 }, { 0x1fbf0, 0x1fbf9 },
+};
+
+static const FoldRun utf8_folds[] = {
+    { 0x00b5, 0x00b5, 775, 1 }, { 0x00c0, 0x00d6, 32, 1 },
+    { 0x00d8, 0x00de, 32, 1 }, { 0x0100, 0x012e, 1, 2 },
+    { 0x0132, 0x0136, 1, 2 }, { 0x0139, 0x0147, 1, 2 },
+    { 0x014a, 0x0176, 1, 2 }, { 0x0178, 0x0178, -121, 1 },
+    { 0x0179, 0x017d, 1, 2 }, { 0x017f, 0x017f, -268, 1 },
+    { 0x0181, 0x0181, 210, 1 }, { 0x0182, 0x0184, 1, 2 },
+    { 0x0186, 0x0186, 206, 1 }, { 0x0187, 0x0187, 1, 1 },
+    { 0x0189, 0x018a, 205, 1 }, { 0x018b, 0x018b, 1, 1 },
+    { 0x018e, 0x018e, 79, 1 }, { 0x018f, 0x018f, 202, 1 },
+    { 0x0190, 0x0190, 203, 1 }, { 0x0191, 0x0191, 1, 1 },
+    { 0x0193, 0x0193, 205, 1 }, { 0x0194, 0x0194, 207, 1 },
+    { 0x0196, 0x0196, 211, 1 }, { 0x0197, 0x0197, 209, 1 },
+    { 0x0198, 0x0198, 1, 1 }, { 0x019c, 0x019c, 211, 1 },
+    { 0x019d, 0x019d, 213, 1 }, { 0x019f, 0x019f, 214, 1 },
+    { 0x01a0, 0x01a4, 1, 2 }, { 0x01a6, 0x01a6, 218, 1 },
+    { 0x01a7, 0x01a7, 1, 1 }, { 0x01a9, 0x01a9, 218, 1 },
+    { 0x01ac, 0x01ac, 1, 1 }, { 0x01ae, 0x01ae, 218, 1 },
+    { 0x01af, 0x01af, 1, 1 }, { 0x01b1, 0x01b2, 217, 1 },
+    { 0x01b3, 0x01b5, 1, 2 }, { 0x01b7, 0x01b7, 219, 1 },
+    { 0x01b8, 0x01b8, 1, 1 }, { 0x01bc, 0x01bc, 1, 1 },
+    { 0x01c4, 0x01c4, 2, 1 }, { 0x01c5, 0x01c5, 1, 1 },
+    { 0x01c7, 0x01c7, 2, 1 }, { 0x01c8, 0x01c8, 1, 1 },
+    { 0x01ca, 0x01ca, 2, 1 }, { 0x01cb, 0x01db, 1, 2 },
+    { 0x01de, 0x01ee, 1, 2 }, { 0x01f1, 0x01f1, 2, 1 },
+    { 0x01f2, 0x01f4, 1, 2 }, { 0x01f6, 0x01f6, -97, 1 },
+    { 0x01f7, 0x01f7, -56, 1 }, { 0x01f8, 0x021e, 1, 2 },
+    { 0x0220, 0x0220, -130, 1 }, { 0x0222, 0x0232, 1, 2 },
+    { 0x023a, 0x023a, 10795, 1 }, { 0x023b, 0x023b, 1, 1 },
+    { 0x023d, 0x023d, -163, 1 }, { 0x023e, 0x023e, 10792, 1 },
+    { 0x0241, 0x0241, 1, 1 }, { 0x0243, 0x0243, -195, 1 },
+    { 0x0244, 0x0244, 69, 1 }, { 0x0245, 0x0245, 71, 1 },
+    { 0x0246, 0x024e, 1, 2 }, { 0x0345, 0x0345, 116, 1 },
+    { 0x0370, 0x0372, 1, 2 }, { 0x0376, 0x0376, 1, 1 },
+    { 0x037f, 0x037f, 116, 1 }, { 0x0386, 0x0386, 38, 1 },
+    { 0x0388, 0x038a, 37, 1 }, { 0x038c, 0x038c, 64, 1 },
+    { 0x038e, 0x038f, 63, 1 }, { 0x0391, 0x03a1, 32, 1 },
+    { 0x03a3, 0x03ab, 32, 1 }, { 0x03c2, 0x03c2, 1, 1 },
+    { 0x03cf, 0x03cf, 8, 1 }, { 0x03d0, 0x03d0, -30, 1 },
+    { 0x03d1, 0x03d1, -25, 1 }, { 0x03d5, 0x03d5, -15, 1 },
+    { 0x03d6, 0x03d6, -22, 1 }, { 0x03d8, 0x03ee, 1, 2 },
+    { 0x03f0, 0x03f0, -54, 1 }, { 0x03f1, 0x03f1, -48, 1 },
+    { 0x03f4, 0x03f4, -60, 1 }, { 0x03f5, 0x03f5, -64, 1 },
+    { 0x03f7, 0x03f7, 1, 1 }, { 0x03f9, 0x03f9, -7, 1 },
+    { 0x03fa, 0x03fa, 1, 1 }, { 0x03fd, 0x03ff, -130, 1 },
+    { 0x0400, 0x040f, 80, 1 }, { 0x0410, 0x042f, 32, 1 },
+    { 0x0460, 0x0480, 1, 2 }, { 0x048a, 0x04be, 1, 2 },
+    { 0x04c0, 0x04c0, 15, 1 }, { 0x04c1, 0x04cd, 1, 2 },
+    { 0x04d0, 0x052e, 1, 2 }, { 0x0531, 0x0556, 48, 1 },
+    { 0x10a0, 0x10c5, 7264, 1 }, { 0x10c7, 0x10c7, 7264, 1 },
+    { 0x10cd, 0x10cd, 7264, 1 }, { 0x13f8, 0x13fd, -8, 1 },
+    { 0x1c80, 0x1c80, -6222, 1 }, { 0x1c81, 0x1c81, -6221, 1 },
+    { 0x1c82, 0x1c82, -6212, 1 }, { 0x1c83, 0x1c84, -6210, 1 },
+    { 0x1c85, 0x1c85, -6211, 1 }, { 0x1c86, 0x1c86, -6204, 1 },
+    { 0x1c87, 0x1c87, -6180, 1 }, { 0x1c88, 0x1c88, 35267, 1 },
+    { 0x1c90, 0x1cba, -3008, 1 }, { 0x1cbd, 0x1cbf, -3008, 1 },
+    { 0x1e00, 0x1e94, 1, 2 }, { 0x1e9b, 0x1e9b, -58, 1 },
+    { 0x1e9e, 0x1e9e, -7615, 1 }, { 0x1ea0, 0x1efe, 1, 2 },
+    { 0x1f08, 0x1f0f, -8, 1 }, { 0x1f18, 0x1f1d, -8, 1 },
+    { 0x1f28, 0x1f2f, -8, 1 }, { 0x1f38, 0x1f3f, -8, 1 },
+    { 0x1f48, 0x1f4d, -8, 1 }, { 0x1f59, 0x1f5f, -8, 2 },
+    { 0x1f68, 0x1f6f, -8, 1 }, { 0x1f88, 0x1f8f, -8, 1 },
+    { 0x1f98, 0x1f9f, -8, 1 }, { 0x1fa8, 0x1faf, -8, 1 },
+    { 0x1fb8, 0x1fb9, -8, 1 }, { 0x1fba, 0x1fbb, -74, 1 },
+    { 0x1fbc, 0x1fbc, -9, 1 }, { 0x1fbe, 0x1fbe, -7173, 1 },
+    { 0x1fc8, 0x1fcb, -86, 1 }, { 0x1fcc, 0x1fcc, -9, 1 },
+    { 0x1fd8, 0x1fd9, -8, 1 }, { 0x1fda, 0x1fdb, -100, 1 },
+    { 0x1fe8, 0x1fe9, -8, 1 }, { 0x1fea, 0x1feb, -112, 1 },
+    { 0x1fec, 0x1fec, -7, 1 }, { 0x1ff8, 0x1ff9, -128, 1 },
+    { 0x1ffa, 0x1ffb, -126, 1 }, { 0x1ffc, 0x1ffc, -9, 1 },
+    { 0x2126, 0x2126, -7517, 1 }, { 0x212a, 0x212a, -8383, 1 },
+    { 0x212b, 0x212b, -8262, 1 }, { 0x2132, 0x2132, 28, 1 },
+    { 0x2160, 0x216f, 16, 1 }, { 0x2183, 0x2183, 1, 1 },
+    { 0x24b6, 0x24cf, 26, 1 }, { 0x2c00, 0x2c2f, 48, 1 },
+    { 0x2c60, 0x2c60, 1, 1 }, { 0x2c62, 0x2c62, -10743, 1 },
+    { 0x2c63, 0x2c63, -3814, 1 }, { 0x2c64, 0x2c64, -10727, 1 },
+    { 0x2c67, 0x2c6b, 1, 2 }, { 0x2c6d, 0x2c6d, -10780, 1 },
+    { 0x2c6e, 0x2c6e, -10749, 1 }, { 0x2c6f, 0x2c6f, -10783, 1 },
+    { 0x2c70, 0x2c70, -10782, 1 }, { 0x2c72, 0x2c72, 1, 1 },
+    { 0x2c75, 0x2c75, 1, 1 }, { 0x2c7e, 0x2c7f, -10815, 1 },
+    { 0x2c80, 0x2ce2, 1, 2 }, { 0x2ceb, 0x2ced, 1, 2 },
+    { 0x2cf2, 0x2cf2, 1, 1 }, { 0xa640, 0xa66c, 1, 2 },
+    { 0xa680, 0xa69a, 1, 2 }, { 0xa722, 0xa72e, 1, 2 },
+    { 0xa732, 0xa76e, 1, 2 }, { 0xa779, 0xa77b, 1, 2 },
+    { 0xa77d, 0xa77d, -35332, 1 }, { 0xa77e, 0xa786, 1, 2 },
+    { 0xa78b, 0xa78b, 1, 1 }, { 0xa78d, 0xa78d, -42280, 1 },
+    { 0xa790, 0xa792, 1, 2 }, { 0xa796, 0xa7a8, 1, 2 },
+    { 0xa7aa, 0xa7aa, -42308, 1 }, { 0xa7ab, 0xa7ab, -42319, 1 },
+    { 0xa7ac, 0xa7ac, -42315, 1 }, { 0xa7ad, 0xa7ad, -42305, 1 },
+    { 0xa7ae, 0xa7ae, -42308, 1 }, { 0xa7b0, 0xa7b0, -42258, 1 },
+    { 0xa7b1, 0xa7b1, -42282, 1 }, { 0xa7b2, 0xa7b2, -42261, 1 },
+    { 0xa7b3, 0xa7b3, 928, 1 }, { 0xa7b4, 0xa7c2, 1, 2 },
+    { 0xa7c4, 0xa7c4, -48, 1 }, { 0xa7c5, 0xa7c5, -42307, 1 },
+    { 0xa7c6, 0xa7c6, -35384, 1 }, { 0xa7c7, 0xa7c9, 1, 2 },
+    { 0xa7d0, 0xa7d0, 1, 1 }, { 0xa7d6, 0xa7d8, 1, 2 },
+    { 0xa7f5, 0xa7f5, 1, 1 }, { 0xab70, 0xabbf, -38864, 1 },
+    { 0xff21, 0xff3a, 32, 1 }, { 0x10400, 0x10427, 40, 1 },
+    { 0x104b0, 0x104d3, 40, 1 }, { 0x10570, 0x1057a, 39, 1 },
+    { 0x1057c, 0x1058a, 39, 1 }, { 0x1058c, 0x10592, 39, 1 },
+    { 0x10594, 0x10595, 39, 1 }, { 0x10c80, 0x10cb2, 64, 1 },
+    { 0x118a0, 0x118bf, 32, 1 }, { 0x16e40, 0x16e5f, 32, 1 },
+    { 0x1e900, 0x1e921, 34, 1 },
+};
+
+#define UTF8_RANGES(r) (sizeof(r) / sizeof((r)[0]))
+
+/*
+ * Built from the tables by utf8_init(), so the common code points need no
+ * search: the word bits of the BMP, the fold deltas below U+0800 (the
+ * 2-byte sequences: Latin, Greek, Cyrillic, ...) and the BMP pages
+ * (cp >> 8) holding any fold at all.
+ */
+static uint64_t utf8_bmp[0x10000 / 64];
+static int16_t utf8_delta[0x800];
+static uint64_t utf8_fold_pages[4];
+
+static void utf8_init(void)
+{
+    for (size_t r = 0; r < UTF8_RANGES(utf8_letters); r++) {
+        for (uint32_t cp = utf8_letters[r][0];
+             cp <= utf8_letters[r][1] && cp < 0x10000;
+             cp++)
+            utf8_bmp[cp >> 6] |= 1ULL << (cp & 63);
+    }
+    for (size_t r = 0; r < UTF8_RANGES(utf8_folds); r++) {
+        const FoldRun *f = &utf8_folds[r];
+        for (uint32_t cp = f->lo; cp <= f->hi && cp < 0x10000; cp += f->step) {
+            if (cp < 0x800)
+                utf8_delta[cp] = (int16_t)f->delta;
+            utf8_fold_pages[cp >> 14] |= 1ULL << (cp >> 8 & 63);
+        }
+    }
+}
+
+/* Is cp in one of the count sorted ranges r? First range ending at or
+ * after cp, then its start */
+static int utf8_in(const uint32_t (*r)[2], size_t count, uint32_t cp)
+{
+    size_t lo = 0;
+    size_t n = count;
+
+    while (n > 0) {
+        size_t half = n / 2;
+        if (r[lo + half][1] < cp) {
+            lo += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return lo < count && r[lo][0] <= cp;
+}
+
+/*
+ * The code point at s (n > 0 bytes readable) and its length. Anything but
+ * a well-formed sequence yields UTF8_BAD, length 1.
+ */
+static inline size_t utf8_decode(const char *s, size_t n, uint32_t *cp)
+{
+    static const uint32_t least[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    const unsigned char *u = (const unsigned char *)s;
+    uint32_t c = u[0];
+
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+    *cp = UTF8_BAD;
+    if (c < 0xc2 || c > 0xf4)
+        return 1;
+    size_t len = c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+    if (n < len)
+        return 1;
+    uint32_t v = c & (0x7fu >> len);
+    for (size_t k = 1; k < len; k++) {
+        if ((u[k] & 0xc0) != 0x80)
+            return 1;
+        v = v << 6 | (u[k] & 0x3fu);
+    }
+    if (v < least[len] || (v >= 0xd800 && v < 0xe000) || v > 0x10ffff)
+        return 1;
+    *cp = v;
+    return len;
+}
+
+static inline size_t utf8_encode(char *out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xc0 | cp >> 6);
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xe0 | cp >> 12);
+        out[1] = (char)(0x80 | (cp >> 6 & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | cp >> 18);
+    out[1] = (char)(0x80 | (cp >> 12 & 0x3f));
+    out[2] = (char)(0x80 | (cp >> 6 & 0x3f));
+    out[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+/* CLASS_WORD, CLASS_INNER or 0 for a decoded code point */
+static inline int utf8_class(uint32_t cp)
+{
+    if (cp < 0x80)
+        return word_rules.cls[cp];
+    if (cp == 0x2019)
+        return word_rules.cls['\''];
+    if (cp < 0x10000 ? (int)(utf8_bmp[cp >> 6] >> (cp & 63) & 1)
+                     : utf8_in(utf8_letters, UTF8_RANGES(utf8_letters), cp))
+        return CLASS_WORD;
+    if ((word_rules.cls['0'] & CLASS_WORD) &&
+        utf8_in(utf8_digits, UTF8_RANGES(utf8_digits), cp))
+        return CLASS_WORD;
+    return 0;
+}
+
+static inline uint32_t utf8_fold(uint32_t cp)
+{
+    if (cp < 0x80)
+        return cp - 'A' < 26u ? cp | 0x20 : cp;
+    if (cp < 0x800)
+        return (uint32_t)((int32_t)cp + utf8_delta[cp]);
+    if (cp < 0x10000 && !(utf8_fold_pages[cp >> 14] >> (cp >> 8 & 63) & 1))
+        return cp;
+
+    /* Last run starting at or before cp */
+    size_t lo = 0;
+    size_t n = UTF8_RANGES(utf8_folds);
+    while (n > 1) {
+        size_t half = n / 2;
+        if (utf8_folds[lo + half].lo <= cp) {
+            lo += half;
+            n -= half;
+        } else {
+            n = half;
+        }
+    }
+    const FoldRun *f = &utf8_folds[lo];
+    if (cp <= f->hi && (cp - f->lo) % f->step == 0)
+        return (uint32_t)((int32_t)cp + f->delta);
+    return cp;
+}
+
+/* Code points in a word (min=N counts these) */
+static inline size_t utf8_chars(const char *s, size_t len)
+{
+    size_t n = 0;
+
+    for (size_t k = 0; k < len; k++)
+        n += ((unsigned char)s[k] & 0xc0) != 0x80;
+    return n;
+}
+
+/* Does a word code point start at pos? (none at size) */
+static inline int utf8_word_at(const char *data, size_t size, size_t pos)
+{
+    uint32_t cp;
+
+    if (pos >= size)
+        return 0;
+    (void)utf8_decode(data + pos, size - pos, &cp);
+    return utf8_class(cp) == CLASS_WORD;
+}
+
+/*
+ * Cut points. Input is split between workers, buffers and feeds only
+ * where no word can span the cut: word_end() moves pos forward to the
+ * first separator at or after it, word_start() moves end back past the
+ * word (and under --utf8 any code point cut short) that ends there.
+ * Under --utf8 a separator is a whole code point of class 0, so a cut
+ * never falls inside a sequence.
+ */
+static size_t word_end(const char *data, size_t size, size_t pos)
+{
+    if (!word_rules.utf8) {
+        while (pos < size && is_joinable((unsigned char)data[pos]))
+            pos++;
+        return pos;
+    }
+    while (pos < size && ((unsigned char)data[pos] & 0xc0) == 0x80)
+        pos++;
+    while (pos < size) {
+        uint32_t cp;
+        size_t n = utf8_decode(data + pos, size - pos, &cp);
+        if (!utf8_class(cp))
+            break;
+        pos += n;
+    }
+    return pos;
+}
+
+/* Do the n bytes at s begin a sequence that the input cut short? */
+static int utf8_partial(const char *s, size_t n)
+{
+    unsigned c = (unsigned char)s[0];
+
+    if (c < 0xc2 || c > 0xf4 || n >= (c < 0xe0 ? 2u : c < 0xf0 ? 3u : 4u))
+        return 0;
+    for (size_t k = 1; k < n; k++) {
+        if (((unsigned char)s[k] & 0xc0) != 0x80)
+            return 0;
+    }
+    return 1;
+}
+
+static size_t word_start(const char *data, size_t end)
+{
+    size_t p = end;
+
+    if (!word_rules.utf8) {
+        while (p > 0 && is_joinable((unsigned char)data[p - 1]))
+            p--;
+        return p;
+    }
+    while (p > 0) {
+        /* Back to the lead byte of the code point before p */
+        size_t q = p - 1;
+        while (q > 0 && p - q < 4 && ((unsigned char)data[q] & 0xc0) == 0x80)
+            q--;
+        uint32_t cp;
+        if (p == end && utf8_partial(data + q, p - q)) {
+            p = q; /* the rest is in the next buffer */
+            continue;
+        }
+        /* If [q, p) is not one code point, data[p - 1] is ill-formed */
+        size_t n = utf8_decode(data + q, p - q, &cp);
+        if (q + n != p || !utf8_class(cp))
+            break;
+        p = q;
+    }
+    return p;
+}
+
+/*===========================================================================
+ * Tokenizer Kernels
+ *
+ * Each kernel is stamped out from the macros below, specialized at compile
+ * time on H, the hash family (CRC, CRCW or FNV), COPY, how a run of
+ * letters is appended to the word buffer, and W, the most letters a word
+ * keeps (longer runs are truncated). Block kernels classify 64 input bytes
+ * into a letter bitmask with ISA-specific compares, then walk the runs of
+ * set bits; the remainder and the scalar kernel walk runs byte by byte.
+ *
+ * The loops carry no flags. Leading letters that belong to the previous
+ * chunk (drop_leading) are skipped once before them, a word continuing
+ * into the next block or the tail is the only state kept across steps, and
+ * the block loop applies the W limit per run rather than per byte. Every
+ * word leaves through the one TOKEN_EMIT in each loop, so the hash state
+ * and word_len stay in registers.
+ *
+ * Words are built in place in a batch of INSERT_BATCH slots: when the
+ * chunk starts on a large table, TOKEN_EMIT hashes the word, prefetches
+ * its table slot and moves on to the next slot, and a full batch (or the
+ * end of the chunk) goes to the table in one table_insert_batch().
+ * Otherwise every word is inserted from slot 0 as it ends.
+ *===========================================================================*/
+
+/* Each slot has 64 bytes of slack for COPY_AVX512's full-width store */
+#define WORD_STRIDE(W) ((((W) + 1 + 64) + 63) & ~63)
+
+#define TOKEN_LOCALS(H, W)                                                     \
+    char batch[INSERT_BATCH][WORD_STRIDE(W)] __attribute__((aligned(64)));     \
+    uint32_t batch_hash[INSERT_BATCH];                                         \
+    uint16_t batch_len[INSERT_BATCH];                                          \
+    int batch_n = 0;                                                           \
+    const int batching = INSERT_BATCH > 1 && t->len >= INSERT_BATCH_MIN;       \
+    char *word = batch[0];                                                     \
+    size_t word_len = 0;                                                       \
+    size_t i = 0;                                                              \
+    uint64_t hs = H##_INIT
+
+#define TOKEN_PUSH(H, ch)                                                      \
+    do {                                                                       \
+        char lc_ = (char)((ch) | 0x20);                                        \
+        word[word_len++] = lc_;                                                \
+        H##_STEP(hs, lc_);                                                     \
+    } while (0)
+
+#define TOKEN_DRAIN()                                                          \
+    do {                                                                       \
+        table_insert_batch(t,                                                  \
+                           batch[0],                                           \
+                           sizeof(batch[0]),                                   \
+                           batch_hash,                                         \
+                           batch_len,                                          \
+                           batch_n);                                           \
+        batch_n = 0;                                                           \
+    } while (0)
+
+#define TOKEN_EMIT(H)                                                          \
+    do {                                                                       \
+        uint32_t h_ = H##_DONE(hs, word, word_len);                            \
+        if (batching) {                                                        \
+            table_prefetch(t, h_);                                             \
+            batch_hash[batch_n] = h_;                                          \
+            batch_len[batch_n] = (uint16_t)word_len;                           \
+            if (++batch_n == INSERT_BATCH)                                     \
+                TOKEN_DRAIN();                                                 \
+            word = batch[batch_n];                                             \
+        } else {                                                               \
+            table_insert(                                                      \
+                    t, word, word_len, h_, (uint16_t)(h_ ^ (h_ >> 16)));       \
+        }                                                                      \
+        hs = H##_INIT;                                                         \
+        word_len = 0;                                                          \
+    } while (0)
+
+#define TOKEN_FLUSH(H)                                                         \
+    do {                                                                       \
+        if (word_len > 0)                                                      \
+            TOKEN_EMIT(H);                                                     \
+    } while (0)
+
+/* The chunk starts inside a word counted with the previous chunk */
+#define TOKEN_SKIP_LEADING()                                                   \
+    if (drop_leading)                                                          \
+        i = word_end(data, size, 0);
+
+/*
+ * Bytes [i, size) one at a time; also the block kernels' tail, where a
+ * word may be pending from the last block. Bytes >= 0x80 (UTF-8 sequences
+ * included) are separators like any non-letter; see UTF-8 Words.
+ */
+#define TOKEN_SCALAR_LOOP(H, W)                                                \
+    for (; i < size; i++) {                                                    \
+        unsigned char c = (unsigned char)data[i];                              \
+        if (is_letter(c)) {                                                    \
+            if (word_len < (W))                                                \
+                TOKEN_PUSH(H, c);                                              \
+        } else if (word_len > 0) {                                             \
+            TOKEN_EMIT(H);                                                     \
+        }                                                                      \
+    }
+
+/* Append n letters from src, lowercased, up to W in the word */
+#define COPY_BYTES(H, W, src, n)                                               \
+    do {                                                                       \
+        size_t room_ = (W) - word_len;                                         \
+        size_t n_ = (size_t)(n) < room_ ? (size_t)(n) : room_;                 \
+        for (size_t k_ = 0; k_ < n_; k_++)                                     \
+            TOKEN_PUSH(H, (src)[k_]);                                          \
+    } while (0)
+
+/*
+ * Whole run in one masked load, OR and store. The load never reads past the
+ * run, so it is safe at the end of the mapping; the store is a full 64 bytes
+ * into the word buffer's slack, because a masked store cannot forward to
+ * the 8-byte loads of hash_crc32c() and costs a stall per word. Only CRCW
+ * (no per-byte hash step) pairs with it.
+ */
+#define COPY_AVX512(H, W, src, n)                                              \
+    do {                                                                       \
+        size_t room_ = (W) - word_len;                                         \
+        size_t n_ = (size_t)(n) < room_ ? (size_t)(n) : room_;                 \
+        __mmask64 k_ = n_ >= 64 ? ~0ULL : (1ULL << n_) - 1;                    \
+        __m512i v_ = _mm512_maskz_loadu_epi8(k_, (const void *)(src));         \
+        v_ = _mm512_or_si512(v_, _mm512_set1_epi8(0x20));                      \
+        _mm512_storeu_si512((void *)(word + word_len), v_);                    \
+        word_len += n_;                                                        \
+    } while (0)
+
+/*
+ * The runs of set bits in m, the word bytes of the block at data + i. A
+ * word pending from the previous block ends unless bit 0 continues it;
+ * a run reaching bit 63 stays pending for the next block.
+ */
+#define TOKEN_RUNS(H, W, m, COPY, EMIT)                                        \
+    if (!((m) & 1ULL) && word_len > 0)                                         \
+        EMIT(H);                                                               \
+    while (m) {                                                                \
+        unsigned start = (unsigned)__builtin_ctzll(m);                         \
+        uint64_t tail = ~((m) >> start);                                       \
+        unsigned end = tail ? start + (unsigned)__builtin_ctzll(tail) : 64;    \
+                                                                               \
+        COPY(H, W, data + i + start, end - start);                             \
+        if (end == 64)                                                         \
+            break;                                                             \
+        EMIT(H);                                                               \
+        (m) &= ~0ULL << end;                                                   \
+    }
+
+/* 64-byte blocks while a whole block remains; LETTERS(p) yields the mask */
+#define TOKEN_BLOCK_LOOP(H, W, LETTERS, COPY)                                  \
+    for (; i + 64 <= size; i += 64) {                                          \
+        uint64_t m = LETTERS(data + i);                                        \
+        TOKEN_RUNS(H, W, m, COPY, TOKEN_EMIT)                                  \
+    }
+
+#define DEFINE_SCALAR_KERNEL(NAME, ATTR, H, W)                                 \
+    ATTR static void NAME(                                                     \
+            Table *t, const char *data, size_t size, int drop_leading)         \
+    {                                                                          \
+        TOKEN_LOCALS(H, W);                                                    \
+        TOKEN_SKIP_LEADING()                                                   \
+        TOKEN_SCALAR_LOOP(H, W)                                                \
+        TOKEN_FLUSH(H);                                                        \
+        TOKEN_DRAIN();                                                         \
+    }
+
+#define DEFINE_BLOCK_KERNEL(NAME, ATTR, H, W, LETTERS, COPY)                   \
+    ATTR static void NAME(                                                     \
+            Table *t, const char *data, size_t size, int drop_leading)         \
+    {                                                                          \
+        TOKEN_LOCALS(H, W);                                                    \
+        TOKEN_SKIP_LEADING()                                                   \
+        TOKEN_BLOCK_LOOP(H, W, LETTERS, COPY)                                  \
+        TOKEN_SCALAR_LOOP(H, W)                                                \
+        TOKEN_FLUSH(H);                                                        \
+        TOKEN_DRAIN();                                                         \
+    }
+
+/*
+ * The same loops under --word rules. A word byte folds only if it is A-Z,
+ * a word shorter than min_len is dropped, and an inner byte joins the run
+ * when the bytes on both sides are word bytes: CLASSES(p, &inner) yields
+ * the word and inner masks of a block, and prev carries the word bit of
+ * the byte before it. The byte after a block is looked up directly; past
+ * the end of the chunk there is none.
+ */
+#define RULES_WORD(c) (word_rules.cls[(unsigned char)(c)] & CLASS_WORD)
+
+#define RULES_LOCALS()                                                         \
+    const size_t min_len = word_rules.min_len;                                 \
+    uint64_t prev = i > 0 && RULES_WORD(data[i - 1])
+
+#define RULES_PUSH(H, ch)                                                      \
+    do {                                                                       \
+        unsigned c_ = (unsigned char)(ch);                                     \
+        char lc_ = (char)(c_ - 'A' < 26u ? c_ | 0x20 : c_);                    \
+        word[word_len++] = lc_;                                                \
+        H##_STEP(hs, lc_);                                                     \
+    } while (0)
+
+#define RULES_EMIT(H)                                                          \
+    do {                                                                       \
+        if (word_len >= min_len) {                                             \
+            TOKEN_EMIT(H);                                                     \
+        } else {                                                               \
+            hs = H##_INIT;                                                     \
+            word_len = 0;                                                      \
+        }                                                                      \
+    } while (0)
+
+#define RULES_SCALAR_LOOP(H, W)                                                \
+    for (; i < size; i++) {                                                    \
+        unsigned char c = (unsigned char)data[i];                              \
+        if (RULES_WORD(c) ||                                                   \
+            (word_rules.cls[c] && i > 0 && i + 1 < size &&                     \
+             RULES_WORD(data[i - 1]) && RULES_WORD(data[i + 1]))) {            \
+            if (word_len < (W))                                                \
+                RULES_PUSH(H, c);                                              \
+        } else if (word_len > 0) {                                             \
+            RULES_EMIT(H);                                                     \
+        }                                                                      \
+    }
+
+#define COPY_RULES_BYTES(H, W, src, n)                                         \
+    do {                                                                       \
+        size_t room_ = (W) - word_len;                                         \
+        size_t n_ = (size_t)(n) < room_ ? (size_t)(n) : room_;                 \
+        for (size_t k_ = 0; k_ < n_; k_++)                                     \
+            RULES_PUSH(H, (src)[k_]);                                          \
+    } while (0)
+
+/* COPY_AVX512, adding 0x20 to the A-Z bytes only */
+#define COPY_RULES_AVX512(H, W, src, n)                                        \
+    do {                                                                       \
+        size_t room_ = (W) - word_len;                                         \
+        size_t n_ = (size_t)(n) < room_ ? (size_t)(n) : room_;                 \
+        __mmask64 k_ = n_ >= 64 ? ~0ULL : (1ULL << n_) - 1;                    \
+        __m512i v_ = _mm512_maskz_loadu_epi8(k_, (const void *)(src));         \
+        __mmask64 up_ = _mm512_cmplt_epu8_mask(                                \
+                _mm512_sub_epi8(v_, _mm512_set1_epi8('A')),                    \
+                _mm512_set1_epi8(26));                                         \
+        v_ = _mm512_mask_add_epi8(v_, up_, v_, _mm512_set1_epi8(0x20));        \
+        _mm512_storeu_si512((void *)(word + word_len), v_);                    \
+        word_len += n_;                                                        \
+    } while (0)
+
+/* Word bits w of a block with the inner bits in that sit between two */
+#define RULES_JOIN(w, in, next)                                                \
+    ((w) | ((in) & ((w) << 1 | prev) & ((w) >> 1 | (next) << 63)))
+
+#define RULES_BLOCK_LOOP(H, W, CLASSES, COPY)                                  \
+    for (; i + 64 <= size; i += 64) {                                          \
+        uint64_t in;                                                           \
+        uint64_t w = CLASSES(data + i, &in);                                   \
+        uint64_t next = i + 64 < size && RULES_WORD(data[i + 64]);             \
+        uint64_t m = RULES_JOIN(w, in, next);                                  \
+        prev = w >> 63;                                                        \
+        TOKEN_RUNS(H, W, m, COPY, RULES_EMIT)                                  \
+    }
+
+#define DEFINE_RULES_SCALAR_KERNEL(NAME, ATTR, H, W)                           \
+    ATTR static void NAME(                                                     \
+            Table *t, const char *data, size_t size, int drop_leading)         \
+    {                                                                          \
+        TOKEN_LOCALS(H, W);                                                    \
+        TOKEN_SKIP_LEADING()                                                   \
+        const size_t min_len = word_rules.min_len;                             \
+        RULES_SCALAR_LOOP(H, W)                                                \
+        if (word_len > 0)                                                      \
+            RULES_EMIT(H);                                                     \
+        TOKEN_DRAIN();                                                         \
+    }
+
+#define DEFINE_RULES_BLOCK_KERNEL(NAME, ATTR, H, W, CLASSES, COPY)             \
+    ATTR static void NAME(                                                     \
+            Table *t, const char *data, size_t size, int drop_leading)         \
+    {                                                                          \
+        TOKEN_LOCALS(H, W);                                                    \
+        TOKEN_SKIP_LEADING()                                                   \
+        RULES_LOCALS();                                                        \
+        RULES_BLOCK_LOOP(H, W, CLASSES, COPY)                                  \
+        RULES_SCALAR_LOOP(H, W)                                                \
+        if (word_len > 0)                                                      \
+            RULES_EMIT(H);                                                     \
+        TOKEN_DRAIN();                                                         \
+    }
+
+/*
+ * The loops under --utf8 (see UTF-8 Words), for the default and the rules
+ * classes alike. cap stands in for W: a code point that does not fit in
+ * the word lowers it to word_len, so nothing later in the run is added,
+ * and UTF8_EMIT restores it. prev is the word bit of the code point before
+ * the one at hand.
+ */
+#define UTF8_LOCALS(W)                                                         \
+    const size_t min_len = word_rules.min_len;                                 \
+    const size_t keep = (W);                                                   \
+    size_t cap = (W);                                                          \
+    uint64_t prev = 0
+
+#define UTF8_PUSH(H, cp)                                                       \
+    do {                                                                       \
+        char u_[4];                                                            \
+        size_t n_ = utf8_encode(u_, (cp));                                     \
+        if (word_len + n_ > cap) {                                             \
+            cap = word_len;                                                    \
+        } else {                                                               \
+            for (size_t k_ = 0; k_ < n_; k_++) {                               \
+                word[word_len++] = u_[k_];                                     \
+                H##_STEP(hs, u_[k_]);                                          \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+#define UTF8_EMIT(H)                                                           \
+    do {                                                                       \
+        if (min_len <= 1 || utf8_chars(word, word_len) >= min_len) {           \
+            TOKEN_EMIT(H);                                                     \
+        } else {                                                               \
+            hs = H##_INIT;                                                     \
+            word_len = 0;                                                      \
+        }                                                                      \
+        cap = keep;                                                            \
+    } while (0)
+
+/* The code point at p, which moves past it */
+#define UTF8_STEP(H, p)                                                        \
+    do {                                                                       \
+        uint32_t cp_;                                                          \
+        size_t len_ = utf8_decode(data + (p), size - (p), &cp_);               \
+        int cls_ = utf8_class(cp_);                                            \
+        if (cls_ == CLASS_INNER &&                                             \
+            !(prev && utf8_word_at(data, size, (p) + len_)))                   \
+            cls_ = 0;                                                          \
+        if (cls_)                                                              \
+            UTF8_PUSH(H, utf8_fold(cp_));                                      \
+        else if (word_len > 0)                                                 \
+            UTF8_EMIT(H);                                                      \
+        prev = cls_ == CLASS_WORD;                                             \
+        (p) += len_;                                                           \
+    } while (0)
+
+/* The code points from p while p < end; the last one may end past it */
+#define UTF8_LOOP(H, p, end)                                                   \
+    while ((p) < (end))                                                        \
+        UTF8_STEP(H, p);
+
+/*
+ * The runs of a block with bytes >= 0x80 (hi), which m counts as word
+ * bytes, so every run ends at an ASCII separator or the end of the block.
+ * Runs without one are copied as in TOKEN_RUNS. In the others the ASCII
+ * word bytes (w) are still copied a stretch at a time and the rest is
+ * decoded; a run at the end of the block may finish past it, at next_i.
+ */
+#define UTF8_RUNS(H, m, w, hi, COPY)                                           \
+    if (!((m) & 1ULL) && word_len > 0)                                         \
+        UTF8_EMIT(H);                                                          \
+    while (m) {                                                                \
+        unsigned start = (unsigned)__builtin_ctzll(m);                         \
+        uint64_t tail = ~((m) >> start);                                       \
+        unsigned end = tail ? start + (unsigned)__builtin_ctzll(tail) : 64;    \
+        uint64_t run = end == 64 ? (m) : (m) & ((1ULL << end) - 1);            \
+                                                                               \
+        if ((hi) & run) {                                                      \
+            size_t p = i + start;                                              \
+            if (start)                                                         \
+                prev = 0;                                                      \
+            while (p < i + end) {                                              \
+                uint64_t f_ = ((w) & run) >> (p - i);                          \
+                if (f_ & 1) {                                                  \
+                    unsigned ascii_ = ~f_ ? (unsigned)__builtin_ctzll(~f_)     \
+                                          : 64;                                \
+                    COPY(H, cap, data + p, ascii_);                            \
+                    p += ascii_;                                               \
+                    prev = 1;                                                  \
+                } else {                                                       \
+                    UTF8_STEP(H, p);                                           \
+                }                                                              \
+            }                                                                  \
+            if (end == 64)                                                     \
+                next_i = p;                                                    \
+        } else {                                                               \
+            COPY(H, cap, data + i + start, end - start);                       \
+        }                                                                      \
+        if (end == 64)                                                         \
+            break;                                                             \
+        if (word_len > 0)                                                      \
+            UTF8_EMIT(H);                                                      \
+        (m) &= ~0ULL << end;                                                   \
+    }
+
+/*
+ * One block: w its word bits, hi its bytes >= 0x80 and m the run mask.
+ * An all-ASCII block takes the plain path; prev of a block ending inside
+ * a code point is left by the decoder.
+ */
+#define UTF8_BLOCK(H, m, w, hi, COPY)                                          \
+    {                                                                          \
+        size_t next_i = i + 64;                                                \
+        if (!(hi)) {                                                           \
+            TOKEN_RUNS(H, cap, m, COPY, UTF8_EMIT)                             \
+        } else {                                                               \
+            UTF8_RUNS(H, m, w, hi, COPY)                                       \
+        }                                                                      \
+        if (!((hi) >> 63))                                                     \
+            prev = (w) >> 63;                                                  \
+        i = next_i;                                                            \
+    }
+
+#define UTF8_BLOCK_LOOP(H, LETTERS, HIGH, COPY)                                \
+    while (i + 64 <= size) {                                                   \
+        uint64_t hi = HIGH(data + i);                                          \
+        uint64_t w = LETTERS(data + i);                                        \
+        uint64_t m = w | hi;                                                   \
+        UTF8_BLOCK(H, m, w, hi, COPY)                                          \
+    }
+
+/* Inner bytes next to a byte >= 0x80 are settled when that run is decoded */
+#define UTF8_RULES_BLOCK_LOOP(H, CLASSES, HIGH, COPY)                          \
+    while (i + 64 <= size) {                                                   \
+        uint64_t in;                                                           \
+        uint64_t hi = HIGH(data + i);                                          \
+        uint64_t w = CLASSES(data + i, &in);                                   \
+        uint64_t next = (in >> 63) && utf8_word_at(data, size, i + 64);        \
+        uint64_t m = RULES_JOIN(w | hi, in, next);                             \
+        UTF8_BLOCK(H, m, w, hi, COPY)                                          \
+    }
+
+#define DEFINE_UTF8_SCALAR_KERNEL(NAME, ATTR, H, W)                            \
+    ATTR static void NAME(                                                     \
+            Table *t, const char *data, size_t size, int drop_leading)         \
+    {                                                                          \
+        TOKEN_LOCALS(H, W);                                                    \
+        TOKEN_SKIP_LEADING()                                                   \
+        UTF8_LOCALS(W);                                                        \
+        UTF8_LOOP(H, i, size)                                                  \
+        if (word_len > 0)                                                      \
+            UTF8_EMIT(H);                                                      \
+        TOKEN_DRAIN();                                                         \
+    }
+
+#define DEFINE_UTF8_BLOCK_KERNEL(NAME, ATTR, H, W, LOOP, MASK, HIGH, COPY)     \
+    ATTR static void NAME(                                                     \
+            Table *t, const char *data, size_t size, int drop_leading)         \
+    {                                                                          \
+        TOKEN_LOCALS(H, W);                                                    \
+        TOKEN_SKIP_LEADING()                                                   \
+        UTF8_LOCALS(W);                                                        \
+        LOOP(H, MASK, HIGH, COPY)                                              \
+        UTF8_LOOP(H, i, size)                                                  \
+        if (word_len > 0)                                                      \
+            UTF8_EMIT(H);                                                      \
+        TOKEN_DRAIN();                                                         \
+    }
+
+/*===========================================================================
+ * Letter Masks (64 bytes -> 64-bit mask, bit i set iff byte i is a letter)
+ *===========================================================================*/
+
+#ifdef ARCH_X86
+TARGET_AVX512 static inline uint64_t letters_avx512(const char *p)
+{
+    __m512i chunk = _mm512_loadu_si512((const void *)p);
+    __mmask64 ascii =
+            _mm512_cmplt_epu8_mask(chunk, _mm512_set1_epi8((char)0x80));
+    __m512i up = _mm512_sub_epi8(chunk, _mm512_set1_epi8('A'));
+    __m512i lo = _mm512_sub_epi8(chunk, _mm512_set1_epi8('a'));
+    __mmask64 m_up = _mm512_cmplt_epu8_mask(up, _mm512_set1_epi8(26));
+    __mmask64 m_lo = _mm512_cmplt_epu8_mask(lo, _mm512_set1_epi8(26));
+    return (uint64_t)((m_up | m_lo) & ascii);
+}
+
+/* (c | 0x20) - 'a' <= 25, as an unsigned min/compare on each byte */
+TARGET_AVX2 static inline uint32_t letters32_avx2(const char *p)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+    __m256i x = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)),
+                                _mm256_set1_epi8('a'));
+    __m256i le = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(25)),
+                                   x);
+    return (uint32_t)_mm256_movemask_epi8(le);
+}
+
+TARGET_AVX2 static inline uint64_t letters_avx2(const char *p)
+{
+    return (uint64_t)letters32_avx2(p) |
+           ((uint64_t)letters32_avx2(p + 32) << 32);
+}
+
+TARGET_SSE42 static inline uint64_t letters16_sse42(const char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)(const void *)p);
+    __m128i x = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)),
+                             _mm_set1_epi8('a'));
+    __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(25)), x);
+    return (uint64_t)(uint16_t)_mm_movemask_epi8(le);
+}
+
+TARGET_SSE42 static inline uint64_t letters_sse42(const char *p)
+{
+    return letters16_sse42(p) | (letters16_sse42(p + 16) << 16) |
+           (letters16_sse42(p + 32) << 32) | (letters16_sse42(p + 48) << 48);
+}
+#endif
+
+/*===========================================================================
+ * Class Masks (--word rules: word and inner bytes through nibble lookups)
+ *===========================================================================*/
+
+#ifdef ARCH_X86
+TARGET_AVX512 static inline __mmask64 nibble_avx512(__m512i lo,
+                                                    __m512i hi,
+                                                    const uint8_t *tlo,
+                                                    const uint8_t *thi)
+{
+    __m512i a = _mm512_shuffle_epi8(
+            _mm512_broadcast_i32x4(
+                    _mm_loadu_si128((const __m128i *)(const void *)tlo)),
+            lo);
+    __m512i b = _mm512_shuffle_epi8(
+            _mm512_broadcast_i32x4(
+                    _mm_loadu_si128((const __m128i *)(const void *)thi)),
+            hi);
+    return _mm512_test_epi8_mask(a, b);
+}
+
+TARGET_AVX512 static inline uint64_t classes_avx512(const char *p,
+                                                    uint64_t *inner)
+{
+    __m512i v = _mm512_loadu_si512((const void *)p);
+    __m512i lo = _mm512_and_si512(v, _mm512_set1_epi8(0x0f));
+    __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4),
+                                  _mm512_set1_epi8(0x0f));
+    *inner = (uint64_t)nibble_avx512(
+            lo, hi, word_rules.inner_lo, word_rules.inner_hi);
+    return (uint64_t)nibble_avx512(
+            lo, hi, word_rules.word_lo, word_rules.word_hi);
+}
+
+TARGET_AVX2 static inline uint32_t nibble_avx2(__m256i lo,
+                                               __m256i hi,
+                                               const uint8_t *tlo,
+                                               const uint8_t *thi)
+{
+    __m256i a = _mm256_shuffle_epi8(
+            _mm256_broadcastsi128_si256(
+                    _mm_loadu_si128((const __m128i *)(const void *)tlo)),
+            lo);
+    __m256i b = _mm256_shuffle_epi8(
+            _mm256_broadcastsi128_si256(
+                    _mm_loadu_si128((const __m128i *)(const void *)thi)),
+            hi);
+    __m256i zero = _mm256_cmpeq_epi8(_mm256_and_si256(a, b),
+                                     _mm256_setzero_si256());
+    return ~(uint32_t)_mm256_movemask_epi8(zero);
+}
+
+TARGET_AVX2 static inline uint32_t classes32_avx2(const char *p,
+                                                  uint32_t *inner)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+    __m256i lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0f));
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                  _mm256_set1_epi8(0x0f));
+    *inner = nibble_avx2(lo, hi, word_rules.inner_lo, word_rules.inner_hi);
+    return nibble_avx2(lo, hi, word_rules.word_lo, word_rules.word_hi);
+}
+
+TARGET_AVX2 static inline uint64_t classes_avx2(const char *p,
+                                                uint64_t *inner)
+{
+    uint32_t in0, in1;
+    uint64_t w = (uint64_t)classes32_avx2(p, &in0) |
+                 ((uint64_t)classes32_avx2(p + 32, &in1) << 32);
+    *inner = (uint64_t)in0 | ((uint64_t)in1 << 32);
+    return w;
+}
+
+TARGET_SSE42 static inline uint64_t nibble_sse42(__m128i lo,
+                                                 __m128i hi,
+                                                 const uint8_t *tlo,
+                                                 const uint8_t *thi)
+{
+    __m128i a = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)(const void *)tlo), lo);
+    __m128i b = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)(const void *)thi), hi);
+    __m128i zero = _mm_cmpeq_epi8(_mm_and_si128(a, b), _mm_setzero_si128());
+    return (uint64_t)(uint16_t)~_mm_movemask_epi8(zero);
+}
+
+TARGET_SSE42 static inline uint64_t classes_sse42(const char *p,
+                                                  uint64_t *inner)
+{
+    uint64_t w = 0;
+
+    *inner = 0;
+    for (int k = 0; k < 64; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + k));
+        __m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+        *inner |= nibble_sse42(
+                          lo, hi, word_rules.inner_lo, word_rules.inner_hi)
+                  << k;
+        w |= nibble_sse42(lo, hi, word_rules.word_lo, word_rules.word_hi)
+             << k;
+    }
+    return w;
+}
+#endif
+
+#ifdef ARCH_ARM64
+static inline uint64_t movemask16_neon(uint8x16_t is)
+{
+    static const uint8_t bit_weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                             1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t bits = vandq_u8(is, vld1q_u8(bit_weights));
+    return (uint64_t)vaddv_u8(vget_low_u8(bits)) |
+           ((uint64_t)vaddv_u8(vget_high_u8(bits)) << 8);
+}
+
+static inline uint64_t classes_neon(const char *p, uint64_t *inner)
+{
+    uint8x16_t wlo = vld1q_u8(word_rules.word_lo);
+    uint8x16_t whi = vld1q_u8(word_rules.word_hi);
+    uint8x16_t ilo = vld1q_u8(word_rules.inner_lo);
+    uint8x16_t ihi = vld1q_u8(word_rules.inner_hi);
+    uint64_t w = 0;
+
+    *inner = 0;
+    for (int k = 0; k < 64; k += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)p + k);
+        uint8x16_t lo = vandq_u8(v, vdupq_n_u8(0x0f));
+        uint8x16_t hi = vshrq_n_u8(v, 4);
+        *inner |= movemask16_neon(vtstq_u8(vqtbl1q_u8(ilo, lo),
+                                           vqtbl1q_u8(ihi, hi)))
+                  << k;
+        w |= movemask16_neon(vtstq_u8(vqtbl1q_u8(wlo, lo),
+                                      vqtbl1q_u8(whi, hi)))
+             << k;
+    }
+    return w;
+}
+#endif
+
+#ifdef ARCH_ARM64
+static inline uint64_t letters16_neon(const char *p)
+{
+    static const uint8_t bit_weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                             1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    uint8x16_t x = vsubq_u8(vorrq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t is = vcltq_u8(x, vdupq_n_u8(26));
+    uint8x16_t bits = vandq_u8(is, vld1q_u8(bit_weights));
+    return (uint64_t)vaddv_u8(vget_low_u8(bits)) |
+           ((uint64_t)vaddv_u8(vget_high_u8(bits)) << 8);
+}
+
+static inline uint64_t letters_neon(const char *p)
+{
+    return letters16_neon(p) | (letters16_neon(p + 16) << 16) |
+           (letters16_neon(p + 32) << 32) | (letters16_neon(p + 48) << 48);
+}
+#endif
+
+/*===========================================================================
+ * Non-ASCII Masks (--utf8: bit i set iff byte i is >= 0x80)
+ *===========================================================================*/
+
+#ifdef ARCH_X86
+TARGET_AVX512 static inline uint64_t high_avx512(const char *p)
+{
+    return (uint64_t)_mm512_movepi8_mask(_mm512_loadu_si512((const void *)p));
+}
+
+TARGET_AVX2 static inline uint64_t high_avx2(const char *p)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i *)(const void *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(const void *)(p + 32));
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(a) |
+           ((uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32);
+}
+
+TARGET_SSE42 static inline uint64_t high_sse42(const char *p)
+{
+    uint64_t m = 0;
+
+    for (int k = 0; k < 64; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + k));
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) << k;
+    }
+    return m;
+}
+#endif
+
+#ifdef ARCH_ARM64
+static inline uint64_t high_neon(const char *p)
+{
+    uint64_t m = 0;
+
+    for (int k = 0; k < 64; k += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)p + k);
+        m |= movemask16_neon(vcgeq_u8(v, vdupq_n_u8(0x80))) << k;
+    }
+    return m;
+}
+#endif
+
+/*===========================================================================
+ * Kernel Instances
+ *===========================================================================*/
+
+/* Longest word kept: MAX_WORD - 1 letters, the rest of a run is dropped */
+#define WORD_KEEP (MAX_WORD - 1)
+
+#ifdef ARCH_X86
+DEFINE_BLOCK_KERNEL(process_avx512,
+                    TARGET_AVX512,
+                    CRCW,
+                    WORD_KEEP,
+                    letters_avx512,
+                    COPY_AVX512)
+DEFINE_BLOCK_KERNEL(
+        process_avx2, TARGET_AVX2, CRC, WORD_KEEP, letters_avx2, COPY_BYTES)
+DEFINE_BLOCK_KERNEL(
+        process_sse42, TARGET_SSE42, CRC, WORD_KEEP, letters_sse42, COPY_BYTES)
+#endif
+#ifdef ARCH_ARM64
+DEFINE_BLOCK_KERNEL(process_neon, , FNV, WORD_KEEP, letters_neon, COPY_BYTES)
+#endif
+DEFINE_SCALAR_KERNEL(process_scalar, , FNV, WORD_KEEP)
+
+#ifdef ARCH_X86
+DEFINE_RULES_BLOCK_KERNEL(process_avx512_rules,
+                          TARGET_AVX512,
+                          CRCW,
+                          WORD_KEEP,
+                          classes_avx512,
+                          COPY_RULES_AVX512)
+DEFINE_RULES_BLOCK_KERNEL(process_avx2_rules,
+                          TARGET_AVX2,
+                          CRC,
+                          WORD_KEEP,
+                          classes_avx2,
+                          COPY_RULES_BYTES)
+DEFINE_RULES_BLOCK_KERNEL(process_sse42_rules,
+                          TARGET_SSE42,
+                          CRC,
+                          WORD_KEEP,
+                          classes_sse42,
+                          COPY_RULES_BYTES)
+#endif
+#ifdef ARCH_ARM64
+DEFINE_RULES_BLOCK_KERNEL(
+        process_neon_rules, , FNV, WORD_KEEP, classes_neon, COPY_RULES_BYTES)
+#endif
+DEFINE_RULES_SCALAR_KERNEL(process_scalar_rules, , FNV, WORD_KEEP)
+
+#ifdef ARCH_X86
+DEFINE_UTF8_BLOCK_KERNEL(process_avx512_utf8,
+                         TARGET_AVX512,
+                         CRCW,
+                         WORD_KEEP,
+                         UTF8_BLOCK_LOOP,
+                         letters_avx512,
+                         high_avx512,
+                         COPY_AVX512)
+DEFINE_UTF8_BLOCK_KERNEL(process_avx512_utf8_rules,
+                         TARGET_AVX512,
+                         CRCW,
+                         WORD_KEEP,
+                         UTF8_RULES_BLOCK_LOOP,
+                         classes_avx512,
+                         high_avx512,
+                         COPY_RULES_AVX512)
+DEFINE_UTF8_BLOCK_KERNEL(process_avx2_utf8,
+                         TARGET_AVX2,
+                         CRC,
+                         WORD_KEEP,
+                         UTF8_BLOCK_LOOP,
+                         letters_avx2,
+                         high_avx2,
+                         COPY_BYTES)
+DEFINE_UTF8_BLOCK_KERNEL(process_avx2_utf8_rules,
+                         TARGET_AVX2,
+                         CRC,
+                         WORD_KEEP,
+                         UTF8_RULES_BLOCK_LOOP,
+                         classes_avx2,
+                         high_avx2,
+                         COPY_RULES_BYTES)
+DEFINE_UTF8_BLOCK_KERNEL(process_sse42_utf8,
+                         TARGET_SSE42,
+                         CRC,
+                         WORD_KEEP,
+                         UTF8_BLOCK_LOOP,
+                         letters_sse42,
+                         high_sse42,
+                         COPY_BYTES)
+DEFINE_UTF8_BLOCK_KERNEL(process_sse42_utf8_rules,
+                         TARGET_SSE42,
+                         CRC,
+                         WORD_KEEP,
+                         UTF8_RULES_BLOCK_LOOP,
+                         classes_sse42,
+                         high_sse42,
+                         COPY_RULES_BYTES)
+#endif
+#ifdef ARCH_ARM64
+DEFINE_UTF8_BLOCK_KERNEL(process_neon_utf8,
+                         ,
+                         FNV,
+                         WORD_KEEP,
+                         UTF8_BLOCK_LOOP,
+                         letters_neon,
+                         high_neon,
+                         COPY_BYTES)
+DEFINE_UTF8_BLOCK_KERNEL(process_neon_utf8_rules,
+                         ,
+                         FNV,
+                         WORD_KEEP,
+                         UTF8_RULES_BLOCK_LOOP,
+                         classes_neon,
+                         high_neon,
+                         COPY_RULES_BYTES)
+#endif
+/* The scalar loop is the same with or without custom rules */
+DEFINE_UTF8_SCALAR_KERNEL(process_scalar_utf8, , FNV, WORD_KEEP)
+
+/*===========================================================================
+ * Runtime Dispatch
+ *
+ * The best kernel the CPU supports is picked once at startup. WORDCOUNT_SIMD
+ * caps the choice: "0" or "scalar" disables SIMD, and a kernel name
+ * ("avx512", "avx2", "sse42", "neon") selects that kernel or the best one
+ * below it.
+ *===========================================================================*/
+
+typedef void (*ProcessFn)(Table *t,
+                          const char *data,
+                          size_t size,
+                          int drop_leading);
+
+typedef struct {
+    const char *id;   /* WORDCOUNT_SIMD value */
+    const char *name; /* shown in the "Mode:" line */
+    ProcessFn process;
+    ProcessFn process_rules;      /* under custom --word rules */
+    ProcessFn process_utf8;       /* --utf8 */
+    ProcessFn process_utf8_rules; /* --utf8 with custom --word rules */
+    uint32_t (*hash)(const char *s, size_t len);
+    int (*supported)(void);
+} Kernel;
+
+static int cpu_always(void)
+{
+    return 1;
+}
+
+#ifdef ARCH_X86
+static int cpu_has_avx512(void)
+{
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw");
+}
+
+static int cpu_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2");
+}
+
+static int cpu_has_sse42(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+#ifdef ARCH_ARM64
+static int cpu_has_neon(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+}
+#endif
+
+static const Kernel kernels[] = {
+#ifdef ARCH_X86
+    { "avx512", "AVX-512 + CRC32C", process_avx512, process_avx512_rules,
+      process_avx512_utf8, process_avx512_utf8_rules, hash_crc32c,
+      cpu_has_avx512 },
+    { "avx2", "AVX2 + CRC32C", process_avx2, process_avx2_rules,
+      process_avx2_utf8, process_avx2_utf8_rules, hash_crc32c, cpu_has_avx2 },
+    { "sse42", "SSE4.2 + CRC32C", process_sse42, process_sse42_rules,
+      process_sse42_utf8, process_sse42_utf8_rules, hash_crc32c,
+      cpu_has_sse42 },
+#endif
+#ifdef ARCH_ARM64
+    { "neon", "NEON + FNV-1a", process_neon, process_neon_rules,
+      process_neon_utf8, process_neon_utf8_rules, hash_fnv1a, cpu_has_neon },
+#endif
+    { "scalar", "Scalar + FNV-1a", process_scalar, process_scalar_rules,
+      process_scalar_utf8, process_scalar_utf8, hash_fnv1a, cpu_always },
+};
+
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static const Kernel *kernel = &kernels[NUM_KERNELS - 1];
+
+static void select_kernel(void)
+{
+    const char *want = getenv("WORDCOUNT_SIMD");
+    size_t first = 0;
+
+#ifdef ARCH_X86
+    __builtin_cpu_init();
+#endif
+
+    if (want && *want) {
+        if (strcmp(want, "0") == 0)
+            want = "scalar";
+        while (first < NUM_KERNELS && strcmp(kernels[first].id, want) != 0)
+            first++;
+        if (first == NUM_KERNELS) {
+            (void)fprintf(stderr,
+                          "WORDCOUNT_SIMD=%s not recognized, ignoring\n",
+                          want);
+            first = 0;
+        }
+    }
+
+    for (size_t k = first; k < NUM_KERNELS; k++) {
+        if (kernels[k].supported()) {
+            kernel = &kernels[k];
+            return;
+        }
+    }
+}
+
+static void
+process_chunk(Table *t, const char *data, size_t size, int drop_leading)
+{
+    if (word_rules.utf8 && word_rules.custom)
+        kernel->process_utf8_rules(t, data, size, drop_leading);
+    else if (word_rules.utf8)
+        kernel->process_utf8(t, data, size, drop_leading);
+    else if (word_rules.custom)
+        kernel->process_rules(t, data, size, drop_leading);
+    else
+        kernel->process(t, data, size, drop_leading);
+}
+
+/*===========================================================================
+ * Approximate Counting (--approx)
+ *
+ * Exact tables grow with the vocabulary, which on an endless log stream
+ * has no bound. With --approx every worker keeps a fixed-size summary:
+ *   - a Count-Min sketch of APPROX_DEPTH rows of width 64-bit counters,
+ *     with conservative update. A word's estimate, the least of its
+ *     counters, never undercounts and overcounts by at most e / width of
+ *     all words with probability 1 - e^-depth;
+ *   - the APPROX_SLACK * K words with the highest estimates so far, so
+ *     the heavy hitters are known by name;
+ *   - a HyperLogLog of APPROX_HLL_REGS registers for the number of
+ *     distinct words, standard error 1.04 / sqrt(registers).
+ * As with --table=shared the worker's table is only a front cache: after
+ * every chunk each of its words updates the summary once, with its chunk
+ * count, and the front is cleared. Summaries hash words with their own
+ * 64-bit hash rather than the kernel's, so that they merge by adding
+ * counters and taking register maxima, and the candidates of all workers
+ * are then re-estimated from the merged sketch.
+ *===========================================================================*/
+
+#ifndef APPROX_BUDGET
+#define APPROX_BUDGET (16u << 20) /* Count-Min bytes over all workers */
+#endif
+
+#ifndef APPROX_DEPTH
+#define APPROX_DEPTH 4
+#endif
+
+#ifndef APPROX_SLACK
+#define APPROX_SLACK 4
+#endif
+
+#ifndef APPROX_HLL_BITS
+#define APPROX_HLL_BITS 14
+#endif
+#define APPROX_HLL_REGS (1u << APPROX_HLL_BITS)
+
+#define APPROX_MIN_WIDTH 1024
+/* The least --approx budget per worker */
+#define APPROX_MIN_BYTES (APPROX_DEPTH * APPROX_MIN_WIDTH * sizeof(uint64_t))
+
+typedef struct {
+    uint64_t *cm; /* APPROX_DEPTH rows of width counters */
+    size_t width; /* power of two */
+    unsigned shift; /* 64 - log2(width) */
+    uint8_t *hll;
+    Entry *cand; /* count = estimate when last updated */
+    char *cand_words; /* MAX_WORD bytes per candidate, for long words */
+    Entry *cand_next; /* reselection targets, swapped with cand */
+    char *cand_next_words;
+    size_t ncand;
+    size_t max_cand;
+    uint32_t *index; /* candidate + 1 by kernel hash; 0 = free */
+    size_t index_cap;
+    Entry *pend; /* candidates-to-be of one flush */
+    size_t pend_cap;
+} Sketch;
+
+static size_t approx_budget = 0; /* --approx; 0 = exact counting */
+static size_t approx_keep;       /* candidates per worker, K * slack */
+static Sketch sketches[MAX_THREADS];
+
+/*
+ * Word hash for the summaries, 8 zero-padded bytes at a time (one step
+ * for inline words, straight from the key) and a murmur3 finalizer, whose
+ * high bits the HyperLogLog needs well mixed
+ */
+static inline uint64_t approx_hash(const Entry *e)
+{
+    uint64_t h = e->len * 0x9e3779b97f4a7c15ULL;
+
+    if (e->len <= ENTRY_INLINE) {
+        h = (h ^ e->key.inl64) * 0xbf58476d1ce4e5b9ULL;
+    } else {
+        for (size_t i = 0; i < e->len; i += 8) {
+            uint64_t v = 0;
+            memcpy(&v, e->key.ptr + i, e->len - i < 8 ? e->len - i : 8);
+            h = (h ^ v) * 0xbf58476d1ce4e5b9ULL;
+            h ^= h >> 29;
+        }
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Count-Min width every worker uses: its share of the budget, as a power
+ * of two. main() sizes the threads so the share is APPROX_MIN_BYTES or
+ * more, so the sketches never exceed the budget */
+static size_t approx_width(void)
+{
+    size_t per = approx_budget / (size_t)nthreads /
+                 (APPROX_DEPTH * sizeof(uint64_t));
+    size_t w = APPROX_MIN_WIDTH;
+    while (w * 2 <= per)
+        w *= 2;
+    return w;
+}
+
+static void *approx_alloc(size_t n)
+{
+    void *p = calloc(1, n);
+    if (!p) {
+        perror("calloc");
+        exit(1);
+    }
+    return p;
+}
+
+/* Called by the worker, so the counters are first touched on its node */
+static void sketch_init(Sketch *s)
+{
+    size_t k = approx_keep;
+
+    s->width = approx_width();
+    s->shift = 64 - (unsigned)__builtin_ctzll(s->width);
+    s->cm = huge_xalloc(APPROX_DEPTH * s->width * sizeof(uint64_t));
+    s->hll = approx_alloc(APPROX_HLL_REGS);
+    s->max_cand = k;
+    s->cand = approx_alloc(k * sizeof(Entry));
+    s->cand_next = approx_alloc(k * sizeof(Entry));
+    s->cand_words = approx_alloc(k * MAX_WORD);
+    s->cand_next_words = approx_alloc(k * MAX_WORD);
+    s->index_cap = next_pow2(k * 2);
+    s->index = approx_alloc(s->index_cap * sizeof(uint32_t));
+    s->ncand = 0;
+    s->pend = NULL;
+    s->pend_cap = 0;
+}
+
+static void sketch_free(Sketch *s)
+{
+    huge_free(s->cm, APPROX_DEPTH * s->width * sizeof(uint64_t));
+    free(s->hll);
+    free(s->cand);
+    free(s->cand_next);
+    free(s->cand_words);
+    free(s->cand_next_words);
+    free(s->index);
+    free(s->pend);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Row multipliers: multiply-shift gives each row its own index */
+static const uint64_t cm_seed[] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL,
+    0xd6e8feb86659fd93ULL, 0xff51afd7ed558ccdULL, 0xc4ceb9fe1a85ec53ULL,
+    0x94d049bb133111ebULL, 0xbf58476d1ce4e5b9ULL,
+};
+_Static_assert(APPROX_DEPTH >= 1 &&
+                       APPROX_DEPTH <= sizeof(cm_seed) / sizeof(cm_seed[0]),
+               "APPROX_DEPTH: 1 to 8");
+
+static inline uint64_t *cm_cell(const Sketch *s, size_t r, uint64_t h)
+{
+    return &s->cm[r * s->width + (size_t)((h * cm_seed[r]) >> s->shift)];
+}
+
+static inline void cm_prefetch(const Sketch *s, uint64_t h)
+{
+    for (size_t r = 0; r < APPROX_DEPTH; r++)
+        __builtin_prefetch(cm_cell(s, r, h), 1, 3);
+}
+
+static inline uint64_t cm_query(const Sketch *s, uint64_t h)
+{
+    uint64_t est = UINT64_MAX;
+    for (size_t r = 0; r < APPROX_DEPTH; r++) {
+        uint64_t c = *cm_cell(s, r, h);
+        if (c < est)
+            est = c;
+    }
+    return est;
+}
+
+/*
+ * Add n to the word with hash h and return its new estimate. Conservative
+ * update: only counters below the new estimate are raised to it, which
+ * keeps every counter an upper bound (so sums of sketches still are) while
+ * overcounting far less than adding n to all of them.
+ */
+static inline uint64_t cm_add(Sketch *s, uint64_t h, uint64_t n)
+{
+    uint64_t est = cm_query(s, h) + n;
+    for (size_t r = 0; r < APPROX_DEPTH; r++) {
+        uint64_t *c = cm_cell(s, r, h);
+        if (*c < est)
+            *c = est;
+    }
+    return est;
+}
+
+static inline void hll_add(uint8_t *hll, uint64_t h)
+{
+    size_t reg = (size_t)(h >> (64 - APPROX_HLL_BITS));
+    uint64_t rest = (h << APPROX_HLL_BITS) | (1ULL << (APPROX_HLL_BITS - 1));
+    uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+    if (rank > hll[reg])
+        hll[reg] = rank;
+}
+
+/*
+ * Cardinality from the register histogram with Ertl's improved estimator
+ * ("New cardinality estimation algorithms for HyperLogLog sketches"),
+ * which stays unbiased from a few words up without correction tables.
+ * Registers hold 0 .. HLL_Q + 1.
+ */
+#define HLL_Q (64 - APPROX_HLL_BITS)
+
+static double hll_sigma(double x)
+{
+    if (x == 1.0)
+        return INFINITY;
+    double y = 1.0, z = x, prev;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (z != prev);
+    return z;
+}
+
+static double hll_tau(double x)
+{
+    if (x == 0.0 || x == 1.0)
+        return 0.0;
+    double y = 1.0, z = 1.0 - x, prev;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= (1.0 - x) * (1.0 - x) * y;
+    } while (z != prev);
+    return z / 3.0;
+}
+
+static double hll_estimate(const uint8_t *hll)
+{
+    double m = APPROX_HLL_REGS;
+    size_t hist[HLL_Q + 2] = { 0 };
+
+    for (size_t i = 0; i < APPROX_HLL_REGS; i++)
+        hist[hll[i]]++;
+    double z = m * hll_tau((m - (double)hist[HLL_Q + 1]) / m);
+    for (int k = HLL_Q; k >= 1; k--)
+        z = 0.5 * (z + (double)hist[k]);
+    z += m * hll_sigma((double)hist[0] / m);
+    return 0.5 / M_LN2 * m * m / z;
+}
+
+/* Candidate holding the word of e, or -1; s->index is current */
+static inline long cand_find(const Sketch *s, const Entry *e)
+{
+    size_t mask = s->index_cap - 1;
+    for (size_t i = e->hash & mask; s->index[i]; i = (i + 1) & mask) {
+        const Entry *c = &s->cand[s->index[i] - 1];
+        if (entry_same(c, e))
+            return (long)s->index[i] - 1;
+    }
+    return -1;
+}
+
+static int cmp_estimate(const void *a, const void *b)
+{
+    uint64_t x = ((const Entry *)a)->count;
+    uint64_t y = ((const Entry *)b)->count;
+    return (x < y) - (x > y);
+}
+
+/* Count one front entry; a non-candidate that beats floor is pending */
+static inline void approx_count(Sketch *s,
+                                const Entry *e,
+                                uint64_t h,
+                                uint64_t floor,
+                                size_t *npend)
+{
+    uint64_t est = cm_add(s, h, e->count);
+    hll_add(s->hll, h);
+    long c = s->ncand ? cand_find(s, e) : -1;
+    if (c >= 0) {
+        s->cand[c].count = est;
+    } else if (est > floor) {
+        s->pend[*npend] = *e;
+        s->pend[(*npend)++].count = est;
+    }
+}
+
+/* Words in flight between prefetching their counters and counting them */
+#define APPROX_AHEAD 8
+
+/*
+ * Fold front t into s and clear it. A word of the chunk that is not a
+ * candidate joins the pending ones if its estimate beats the weakest
+ * candidate; the best max_cand of both sets then become the candidates,
+ * with long words copied out of the front's pool before it is cleared.
+ * Counters, which miss the cache on a large sketch, are prefetched
+ * APPROX_AHEAD words before they are updated.
+ */
+static void approx_flush(Sketch *s, Table *t)
+{
+    table_settle(t);
+    if (t->len == 0)
+        return;
+
+    uint64_t floor = 0;
+    size_t imask = s->index_cap - 1;
+    memset(s->index, 0, s->index_cap * sizeof(uint32_t));
+    for (size_t c = 0; c < s->ncand; c++) {
+        size_t i = s->cand[c].hash & imask;
+        while (s->index[i])
+            i = (i + 1) & imask;
+        s->index[i] = (uint32_t)c + 1;
+        if (c == 0 || s->cand[c].count < floor)
+            floor = s->cand[c].count;
+    }
+    if (s->ncand < s->max_cand)
+        floor = 0;
+
+    if (s->pend_cap < t->len + s->max_cand) {
+        free(s->pend);
+        s->pend_cap = next_pow2(t->len + s->max_cand);
+        s->pend = malloc(s->pend_cap * sizeof(Entry));
+        if (!s->pend) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    const Entry *ring[APPROX_AHEAD];
+    uint64_t ring_hash[APPROX_AHEAD];
+    size_t in = 0, out = 0;
+    size_t npend = 0;
+    for (size_t i = 0; i < t->cap; i++) {
+        const Entry *e = &t->entries[i];
+        if (!e->len)
+            continue;
+        uint64_t h = approx_hash(e);
+        cm_prefetch(s, h);
+        ring[in % APPROX_AHEAD] = e;
+        ring_hash[in++ % APPROX_AHEAD] = h;
+        if (in - out == APPROX_AHEAD) {
+            approx_count(s,
+                         ring[out % APPROX_AHEAD],
+                         ring_hash[out % APPROX_AHEAD],
+                         floor,
+                         &npend);
+            out++;
+        }
+    }
+    for (; out < in; out++)
+        approx_count(s,
+                     ring[out % APPROX_AHEAD],
+                     ring_hash[out % APPROX_AHEAD],
+                     floor,
+                     &npend);
+
+    if (npend) {
+        memcpy(s->pend + npend, s->cand, s->ncand * sizeof(Entry));
+        npend += s->ncand;
+        qsort(s->pend, npend, sizeof(Entry), cmp_estimate);
+        s->ncand = npend < s->max_cand ? npend : s->max_cand;
+        for (size_t c = 0; c < s->ncand; c++) {
+            Entry *e = &s->cand_next[c];
+            *e = s->pend[c];
+            if (e->len > ENTRY_INLINE) {
+                char *w = s->cand_next_words + c * MAX_WORD;
+                memcpy(w, e->key.ptr, e->len);
+                w[e->len] = '\0';
+                e->key.ptr = w;
+            }
+        }
+        Entry *ce = s->cand;
+        char *cw = s->cand_words;
+        s->cand = s->cand_next;
+        s->cand_words = s->cand_next_words;
+        s->cand_next = ce;
+        s->cand_next_words = cw;
+    }
+    table_clear(t);
+}
+
+/*===========================================================================
+ * Block Dedup Cache (--dedup)
+ *
+ * Crawled and mirrored corpora repeat whole pages, boilerplate and log
+ * lines, and every copy is tokenized again. With --dedup each chunk is cut
+ * into content-defined blocks, and a block that has been seen twice adds
+ * its saved (word, count) entries instead of being scanned:
+ *   - a block ends at the first newline at least DEDUP_MIN bytes in whose
+ *     preceding 8 bytes hash to 0 in the top DEDUP_CUT_BITS bits, so the
+ *     same text is cut the same way wherever it sits; with no such newline
+ *     before DEDUP_MAX bytes it ends at the first separator there. Every
+ *     end is a word_end() cut, so no word spans two blocks;
+ *   - a block is known by its length and a 64-bit fingerprint: two CRC32C
+ *     chains, over its 8-byte words and over their odd multiples, when the
+ *     kernel hashes with CRC32C, and a multiply-xorshift hash otherwise.
+ *     It is taken in the pass that finds the block's end, which brings
+ *     the block into cache for the kernel;
+ *   - the first time a block is seen only its fingerprint is kept and it
+ *     is counted as usual. The second time it is counted into a scratch
+ *     table whose entries, long words included, are copied to the cache
+ *     with the block's bytes and then added to the worker's table. After
+ *     that each copy costs a memcmp() against the cached bytes, so a
+ *     fingerprint collision is counted as usual rather than trusted, and
+ *     one table_add() per distinct word of the block.
+ * Each worker has its own cache of DEDUP_BUDGET / threads bytes, an eighth
+ * for fingerprints and the rest for entries and block copies. A full
+ * cache is emptied and starts over, which bounds memory and lets the
+ * cache follow the input. Blocks only change how the worker's table is
+ * filled, so --table=shared and --approx still flush it after every chunk.
+ *===========================================================================*/
+
+#ifndef DEDUP_BUDGET
+#define DEDUP_BUDGET (64u << 20) /* cache bytes over all workers */
+#endif
+
+#ifndef DEDUP_MIN
+#define DEDUP_MIN (2u << 10)
+#endif
+
+#ifndef DEDUP_MAX
+#define DEDUP_MAX (64u << 10)
+#endif
+
+/* One newline in 2^bits ends a block: with 60-byte lines, 2K + 4K */
+#ifndef DEDUP_CUT_BITS
+#define DEDUP_CUT_BITS 6
+#endif
+_Static_assert(DEDUP_MIN >= 8 && DEDUP_MIN < DEDUP_MAX, "DEDUP_MIN range");
+
+#define DEDUP_MIN_SLOTS 1024
+#define DEDUP_SCRATCH_CAP 4096
+
+/* Entries added ahead of their home slot loads on a hit */
+#define DEDUP_AHEAD 8
+
+typedef struct {
+    uint64_t fp; /* 0 = free slot */
+    size_t len;  /* block bytes */
+    Entry *ent;  /* the block's counts; NULL until its second sighting */
+    size_t nent;
+    const char *text; /* copy of the block, compared on every hit */
+} DedupSlot;
+
+typedef struct {
+    DedupSlot *slots;
+    size_t nslots; /* power of two */
+    size_t used;
+    char *arena; /* entry arrays, each followed by its long words and text */
+    size_t arena_size;
+    size_t arena_used;
+    Table scratch; /* counts of a block being stored */
+    /* --stats */
+    size_t blocks;
+    size_t bytes;
+    size_t hits;
+    size_t hit_bytes;
+    size_t stored;
+    size_t resets;
+    size_t collisions; /* fingerprint and length matched, bytes did not */
+} Dedup;
+
+static size_t dedup_budget = 0; /* --dedup; 0 = off */
+static Dedup dedups[MAX_THREADS];
+
+static inline int dedup_anchor(const char *nl)
+{
+    uint64_t v;
+    memcpy(&v, nl - 7, 8);
+    return (v * 0x9e3779b97f4a7c15ULL) >> (64 - DEDUP_CUT_BITS) == 0;
+}
+
+/*
+ * Find the end of the block at pos and fingerprint it in the same pass:
+ * STEP folds in the block 8 bytes at a time from pos, the last word zero
+ * padded, and from DEDUP_MIN bytes in each word holding a newline byte
+ * (a SWAR zero-byte test) is searched for an anchored one. The rest of a
+ * block cut at DEDUP_MAX is folded in after its word_end().
+ */
+#define DEDUP_BYTES(c) (0x0101010101010101ULL * (c))
+
+#define DEFINE_DEDUP_SCAN(NAME, ATTR, INIT, STEP, DONE)                       \
+    ATTR static size_t NAME(const char *data,                                 \
+                            size_t size,                                      \
+                            size_t pos,                                       \
+                            uint64_t *fp)                                     \
+    {                                                                         \
+        const char *p = data + pos;                                           \
+        const char *min = data + (size - pos > DEDUP_MIN ? pos + DEDUP_MIN    \
+                                                         : size);             \
+        const char *lim = data + (size - pos > DEDUP_MAX ? pos + DEDUP_MAX    \
+                                                         : size);             \
+        size_t end = size;                                                    \
+        uint64_t v;                                                           \
+        INIT;                                                                 \
+        for (; min - p >= 8; p += 8) {                                        \
+            memcpy(&v, p, 8);                                                 \
+            STEP(v);                                                          \
+        }                                                                     \
+        for (; lim - p >= 8; p += 8) {                                        \
+            memcpy(&v, p, 8);                                                 \
+            uint64_t x = v ^ DEDUP_BYTES('\n');                               \
+            if ((x - DEDUP_BYTES(1)) & ~x & DEDUP_BYTES(0x80)) {              \
+                for (size_t k = 0; k < 8; k++) {                              \
+                    size_t q = (size_t)(p + k - data);                        \
+                    if (p[k] != '\n' || p + k < min ||                        \
+                        !dedup_anchor(p + k) || word_end(data, size, q) != q) \
+                        continue;                                             \
+                    v = 0;                                                    \
+                    memcpy(&v, p, k);                                         \
+                    STEP(v);                                                  \
+                    DONE;                                                     \
+                    return q;                                                 \
+                }                                                             \
+            }                                                                 \
+            STEP(v);                                                          \
+        }                                                                     \
+        if (lim < data + size)                                                \
+            end = word_end(data, size, (size_t)(lim - data));                 \
+        for (; data + end - p >= 8; p += 8) {                                 \
+            memcpy(&v, p, 8);                                                 \
+            STEP(v);                                                          \
+        }                                                                     \
+        v = 0;                                                                \
+        memcpy(&v, p, (size_t)(data + end - p));                              \
+        STEP(v);                                                              \
+        DONE;                                                                 \
+        return end;                                                           \
+    }
+
+#define DEDUP_CRC_INIT uint64_t a_ = 0, b_ = ~0ULL
+#define DEDUP_CRC_STEP(v)                                                     \
+    (a_ = _mm_crc32_u64(a_, (v)),                                              \
+     b_ = _mm_crc32_u64(b_, (v) * 0x9e3779b97f4a7c15ULL))
+#define DEDUP_CRC_DONE (*fp = a_ << 32 | (uint32_t)b_)
+
+#define DEDUP_MIX_INIT uint64_t h_ = 0
+#define DEDUP_MIX_STEP(v)                                                     \
+    (h_ = (h_ ^ (v)) * 0xbf58476d1ce4e5b9ULL, h_ ^= h_ >> 29)
+#define DEDUP_MIX_DONE (*fp = h_ ^ (h_ >> 32))
+
+#ifdef ARCH_X86
+DEFINE_DEDUP_SCAN(dedup_scan_crc32c,
+                  TARGET_SSE42,
+                  DEDUP_CRC_INIT,
+                  DEDUP_CRC_STEP,
+                  DEDUP_CRC_DONE)
+#endif
+DEFINE_DEDUP_SCAN(dedup_scan_mix,
+                  ,
+                  DEDUP_MIX_INIT,
+                  DEDUP_MIX_STEP,
+                  DEDUP_MIX_DONE)
+
+/* End of the block at pos, and its fingerprint (never 0) in *fp */
+static inline size_t
+dedup_scan(const char *data, size_t size, size_t pos, uint64_t *fp)
+{
+    size_t end;
+#ifdef ARCH_X86
+    if (kernel->hash == hash_crc32c)
+        end = dedup_scan_crc32c(data, size, pos, fp);
+    else
+#endif
+        end = dedup_scan_mix(data, size, pos, fp);
+    *fp |= !*fp;
+    return end;
+}
+
+/* Called by the worker, so the cache is first touched on its node */
+static void dedup_init(Dedup *d, int id)
+{
+    size_t per = dedup_budget / (size_t)nthreads;
+    size_t n = DEDUP_MIN_SLOTS;
+
+    while (n * 2 * sizeof(DedupSlot) <= per / 8)
+        n *= 2;
+    memset(d, 0, sizeof(*d));
+    d->nslots = n;
+    d->slots = huge_xalloc(n * sizeof(DedupSlot));
+    d->arena_size = per > n * sizeof(DedupSlot) * 2
+                            ? per - n * sizeof(DedupSlot)
+                            : n * sizeof(DedupSlot);
+    d->arena = huge_xalloc(d->arena_size);
+    if (table_create(&d->scratch,
+                     id,
+                     0,
+                     DEDUP_SCRATCH_CAP,
+                     TABLE_LINEAR,
+                     RESIZE_FULL) < 0)
+        exit(1);
+}
+
+static void dedup_free(Dedup *d)
+{
+    if (!d->slots)
+        return;
+    huge_free(d->slots, d->nslots * sizeof(DedupSlot));
+    huge_free(d->arena, d->arena_size);
+    table_free(&d->scratch);
+    d->slots = NULL;
+    d->arena = NULL;
+}
+
+static void dedup_reset(Dedup *d)
+{
+    memset(d->slots, 0, d->nslots * sizeof(DedupSlot));
+    d->used = 0;
+    d->arena_used = 0;
+    d->resets++;
+}
+
+/* The slot of block (fp, len), or the free slot where it belongs */
+static DedupSlot *dedup_find(Dedup *d, uint64_t fp, size_t len)
+{
+    size_t mask = d->nslots - 1;
+
+    for (size_t i = (size_t)fp & mask;; i = (i + 1) & mask) {
+        DedupSlot *s = &d->slots[i];
+        if (!s->fp || (s->fp == fp && s->len == len))
+            return s;
+    }
+}
+
+/* Claim a free slot for block (fp, len), emptying a cache at 3/4 load */
+static DedupSlot *dedup_claim(Dedup *d, DedupSlot *s, uint64_t fp, size_t len)
+{
+    if ((d->used + 1) * 4 > d->nslots * 3) {
+        dedup_reset(d);
+        s = dedup_find(d, fp, len);
+    }
+    s->fp = fp;
+    s->len = len;
+    s->ent = NULL;
+    s->nent = 0;
+    s->text = NULL;
+    d->used++;
+    return s;
+}
+
+/*
+ * Copy the entries of d->scratch, the counts of block s, and the block's
+ * bytes into the arena. A cache without room for them is emptied first;
+ * blocks too big for the whole arena are not kept.
+ */
+static void dedup_store(Dedup *d, DedupSlot *s, const char *data)
+{
+    const Table *t = &d->scratch;
+    size_t words = 0;
+
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->entries[i].len > ENTRY_INLINE)
+            words += t->entries[i].len + 1u;
+    }
+    size_t need = t->len * sizeof(Entry) + ((words + 7) & ~(size_t)7) +
+                  ((s->len + 7) & ~(size_t)7);
+    if (need > d->arena_size)
+        return;
+    if (d->arena_used + need > d->arena_size) {
+        uint64_t fp = s->fp;
+        size_t len = s->len;
+        dedup_reset(d);
+        s = dedup_claim(d, dedup_find(d, fp, len), fp, len);
+    }
+
+    Entry *out = (Entry *)(void *)(d->arena + d->arena_used);
+    char *w = (char *)(out + t->len);
+    size_t k = 0;
+    for (size_t i = 0; i < t->cap; i++) {
+        const Entry *e = &t->entries[i];
+        if (!e->len)
+            continue;
+        out[k] = *e;
+        if (e->len > ENTRY_INLINE) {
+            memcpy(w, e->key.ptr, e->len);
+            w[e->len] = '\0';
+            out[k].key.ptr = w;
+            w += e->len + 1u;
+        }
+        k++;
+    }
+    char *text = (char *)(out + t->len) + ((words + 7) & ~(size_t)7);
+    memcpy(text, data, s->len);
+    d->arena_used += need;
+    s->ent = out;
+    s->nent = k;
+    s->text = text;
+    d->stored++;
+}
+
+/* Add the saved counts of block s to t */
+static void dedup_apply(Table *t, const DedupSlot *s)
+{
+    for (size_t i = 0; i < s->nent; i++) {
+        if (i + DEDUP_AHEAD < s->nent)
+            table_prefetch(t, s->ent[i + DEDUP_AHEAD].hash);
+        table_add(t, &s->ent[i]);
+    }
+}
+
+static void
+dedup_block(Dedup *d, Table *t, const char *data, size_t len, uint64_t fp)
+{
+    DedupSlot *s = dedup_find(d, fp, len);
+
+    d->blocks++;
+    d->bytes += len;
+    if (s->ent && memcmp(s->text, data, len) == 0) {
+        dedup_apply(t, s);
+        d->hits++;
+        d->hit_bytes += len;
+    } else if (s->ent) {
+        /* Another block with the same fingerprint: count it as usual */
+        d->collisions++;
+        process_chunk(t, data, len, 0);
+    } else if (s->fp) {
+        /* Second sighting: count it apart and keep the counts */
+        Table *sc = &d->scratch;
+        process_chunk(sc, data, len, 0);
+        dedup_store(d, s, data);
+        for (size_t i = 0; i < sc->cap; i++) {
+            if (sc->entries[i].len)
+                table_add(t, &sc->entries[i]);
+        }
+        table_clear(sc);
+    } else {
+        (void)dedup_claim(d, s, fp, len);
+        process_chunk(t, data, len, 0);
+    }
+}
+
+/* process_chunk() through the cache d */
+static void dedup_chunk(Dedup *d,
+                        Table *t,
+                        const char *data,
+                        size_t size,
+                        int drop_leading)
+{
+    size_t pos = drop_leading ? word_end(data, size, 0) : 0;
+
+    while (pos < size) {
+        uint64_t fp;
+        size_t end = dedup_scan(data, size, pos, &fp);
+        dedup_block(d, t, data + pos, end - pos, fp);
+        pos = end;
+    }
+}
+
+/*===========================================================================
+ * Worker Thread
+ *===========================================================================*/
+
+typedef struct {
+    Table *table;
+    size_t table_unique; /* expected words the table will hold; 0 unknown */
+    char *buf;          /* whole-file reads in batch mode */
+    size_t buf_cap;
+    Entry *spill; /* front entries by shard, --table=shared */
+    size_t spill_cap;
+    Table file_table; /* one chunk's counts, --per-file */
+    /* Per-thread figures for --stats; gathered unconditionally */
+    double wall_ms; /* start to exit, including waits */
+    double busy_ms; /* inside process_chunk */
+    size_t bytes;
+    size_t chunks;
+    size_t steals;
+    int id;
+} WorkUnit;
+
+static WorkUnit units[MAX_THREADS];
+
+static inline double ms_between(const struct timespec *a,
+                                const struct timespec *b)
+{
+    return (double)(b->tv_sec - a->tv_sec) * 1000.0 +
+           (double)(b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+/*
+ * --per-file: the counts of one chunk, long words stored after them. The
+ * chunks of a large input may be counted by several workers, so each one
+ * pushes its own block onto the input's list; print_per_file() merges them.
+ */
+typedef struct FileRows {
+    struct FileRows *next;
+    size_t n;
+    Entry rows[];
+} FileRows;
+
+static int per_file = 0; /* --per-file in batch mode */
+
+/* Keep the counts of t on *list, add them to into and clear t */
+static void file_rows_keep(FileRows **list, Table *t, Table *into)
+{
+    size_t words = 0;
+
+    if (!t->len)
+        return;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->entries[i].len > ENTRY_INLINE)
+            words += t->entries[i].len + 1u;
+    }
+    FileRows *b = malloc(sizeof(FileRows) + t->len * sizeof(Entry) + words);
+    if (!b) {
+        perror("malloc");
+        exit(1);
+    }
+
+    char *w = (char *)(b->rows + t->len);
+    size_t k = 0;
+    for (size_t i = 0; i < t->cap; i++) {
+        const Entry *e = &t->entries[i];
+        if (!e->len)
+            continue;
+        table_add(into, e);
+        b->rows[k] = *e;
+        if (e->len > ENTRY_INLINE) {
+            memcpy(w, e->key.ptr, e->len);
+            w[e->len] = '\0';
+            b->rows[k].key.ptr = w;
+            w += e->len + 1u;
+        }
+        k++;
+    }
+    b->n = k;
+    b->next = __atomic_load_n(list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(
+            list, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    table_clear(t);
+}
+
+/* process_chunk, timed and counted into u; with keep, the chunk's counts
+ * are also kept on that list for --per-file */
+static void unit_process(WorkUnit *u,
+                         const char *data,
+                         size_t size,
+                         int drop_leading,
+                         FileRows **keep)
+{
+    Table *t = keep ? &u->file_table : u->table;
+    struct timespec a, b;
+    (void)clock_gettime(CLOCK_MONOTONIC, &a);
+    if (dedup_budget)
+        dedup_chunk(&dedups[u->id], t, data, size, drop_leading);
+    else
+        process_chunk(t, data, size, drop_leading);
+    if (keep)
+        file_rows_keep(keep, t, u->table);
+    if (shards)
+        shared_flush(u->table, &u->spill, &u->spill_cap);
+    else if (approx_budget)
+        approx_flush(&sketches[u->id], u->table);
+    (void)clock_gettime(CLOCK_MONOTONIC, &b);
+    u->busy_ms += ms_between(&a, &b);
+    u->bytes += size;
+    u->chunks++;
+}
+
+static void pin_thread(int id)
+{
+    if (pin_count > 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        int cpu = pin_cpus[id % pin_count];
+        CPU_SET((size_t)cpu, &cpuset);
+        (void)pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+}
+
+/* Pin, then allocate and clear the table (and sketch) here so they are
+ * first touched on this worker's node */
+static void unit_start(WorkUnit *u)
+{
+    pin_thread(u->id);
+    if (table_create(u->table,
+                     u->id,
+                     u->table_unique,
+                     u->table_unique ? SIZED_MIN_CAP : INITIAL_CAP,
+                     table_kind,
+                     resize_mode) < 0)
+        exit(1);
+    if (approx_budget)
+        sketch_init(&sketches[u->id]);
+    if (dedup_budget)
+        dedup_init(&dedups[u->id], u->id);
+    if (per_file && table_create(&u->file_table,
+                                 u->id,
+                                 0,
+                                 INITIAL_CAP,
+                                 TABLE_LINEAR,
+                                 RESIZE_FULL) < 0)
+        exit(1);
+}
+
+/*===========================================================================
+ * Chunk Scheduler (work stealing)
+ *
+ * The mapped file is cut at letter boundaries into chunks of about
+ * chunk_size bytes. Each worker owns a contiguous range of chunk indices
+ * packed into one word (lo | hi << 32): the owner claims from the front,
+ * an idle worker steals the back half of a victim's range into its own.
+ * Both sides move the range with a single CAS. Chunks only ever move
+ * between ranges, so a worker that finds every range empty can exit.
+ *
+ * Chunks index into inputs[]: one file normally, many in batch mode. Files
+ * of up to chunk_size bytes are one chunk with no mapping (data == NULL);
+ * the worker that claims it reads the whole file into its own buffer.
+ *===========================================================================*/
+
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE (2u << 20)
+#endif
+#define CHUNK_MIN 4096
+
+typedef struct {
+    const char *path;
+    char *data; /* mapping, or NULL when read whole by a worker */
+    size_t size;
+    size_t words;   /* counted words, for --per-file */
+    FileRows *rows; /* their counts by chunk, for --per-file */
+} InputFile;
+
+typedef struct {
+    size_t start;
+    size_t end;
+    uint32_t file; /* index into inputs */
+    int drop_leading;
+} Chunk;
+
+typedef struct __attribute__((aligned(CACHELINE))) {
+    uint64_t range;
+} Deque;
+
+static InputFile *inputs;
+static Chunk *chunks;
+static Deque deques[MAX_THREADS];
+static size_t chunk_size = CHUNK_SIZE;
+static int input_errors = 0;
+
+static inline uint64_t range_pack(uint32_t lo, uint32_t hi)
+{
+    return (uint64_t)lo | ((uint64_t)hi << 32);
+}
+
+/* Claim the front chunk of our own range; -1 when it is empty */
+static int64_t deque_take(Deque *d)
+{
+    uint64_t r = __atomic_load_n(&d->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t lo = (uint32_t)r;
+        uint32_t hi = (uint32_t)(r >> 32);
+        if (lo >= hi)
+            return -1;
+        if (__atomic_compare_exchange_n(&d->range,
+                                        &r,
+                                        range_pack(lo + 1, hi),
+                                        0,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+            return lo;
+    }
+}
+
+/* Move the back half of a victim's range to @self; returns the first stolen
+ * chunk (the rest lands in @self) or -1 if every range is empty. Victims
+ * on our own node are tried first. */
+static int64_t deque_steal(int self)
+{
+    for (int remote = 0; remote < 2; remote++) {
+        for (int k = 1; k < nthreads; k++) {
+            int victim = (self + k) % nthreads;
+            if ((worker_node[victim] != worker_node[self]) != remote)
+                continue;
+            Deque *v = &deques[victim];
+            uint64_t r = __atomic_load_n(&v->range, __ATOMIC_ACQUIRE);
+            for (;;) {
+                uint32_t lo = (uint32_t)r;
+                uint32_t hi = (uint32_t)(r >> 32);
+                if (lo >= hi)
+                    break;
+                uint32_t mid = hi - (hi - lo + 1) / 2;
+                if (__atomic_compare_exchange_n(&v->range,
+                                                &r,
+                                                range_pack(lo, mid),
+                                                0,
+                                                __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE)) {
+                    /* Our range is empty, so nobody else writes it now */
+                    __atomic_store_n(&deques[self].range,
+                                     range_pack(mid + 1, hi),
+                                     __ATOMIC_RELEASE);
+                    return mid;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+/* Read a small input whole into u->buf; NULL (and reported) on failure */
+static const char *read_input(WorkUnit *u, const InputFile *in)
+{
+    if (u->buf_cap < in->size) {
+        free(u->buf);
+        u->buf_cap = in->size > chunk_size ? in->size : chunk_size;
+        u->buf = malloc(u->buf_cap);
+        if (!u->buf) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    int fd = open(in->path, O_RDONLY);
+    if (fd < 0) {
+        perror(in->path);
+        __atomic_store_n(&input_errors, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    size_t got = 0;
+    while (got < in->size) {
+        ssize_t n = read(fd, u->buf + got, in->size - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += (size_t)n;
+    }
+    (void)close(fd);
+    if (got != in->size) {
+        (void)fprintf(stderr, "%s: short read\n", in->path);
+        __atomic_store_n(&input_errors, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return u->buf;
+}
+
+static void *worker(void *arg)
+{
+    WorkUnit *u = arg;
+
+    struct timespec t0, t1;
+
+    unit_start(u);
+    (void)pthread_barrier_wait(&barrier);
+    (void)clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (;;) {
+        int64_t c = deque_take(&deques[u->id]);
+        if (c < 0) {
+            c = deque_steal(u->id);
+            u->steals += c >= 0;
+        }
+        if (c < 0)
+            break;
+        const Chunk *ch = &chunks[c];
+        InputFile *in = &inputs[ch->file];
+        const char *data = in->data ? in->data : read_input(u, in);
+        if (!data)
+            continue;
+
+        size_t before = u->table->total;
+        unit_process(u,
+                     data + ch->start,
+                     ch->end - ch->start,
+                     ch->drop_leading,
+                     per_file ? &in->rows : NULL);
+        __atomic_fetch_add(&in->words,
+                           u->table->total - before,
+                           __ATOMIC_RELAXED);
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &t1);
+    u->wall_ms = ms_between(&t0, &t1);
+    return NULL;
+}
+
+/*===========================================================================
+ * Streaming Input (stdin, pipes, FIFOs, sockets)
+ *
+ * A fixed ring of STREAM_BUFS buffers cycles between the reader (main
+ * thread) and the workers, so memory stays constant for any input length.
+ * Each filled buffer is cut after its last non-letter and the partial word
+ * behind the cut is carried in front of the next buffer's data; a carry that
+ * already reached MAX_WORD - 1 letters is emitted as-is and the rest of the
+ * run is dropped via drop_leading, exactly as at the mmap partition edges.
+ *===========================================================================*/
+
+#ifndef STREAM_BUF_SIZE
+#define STREAM_BUF_SIZE (8 << 20)
+#endif
+
+#ifndef STREAM_BUFS
+#define STREAM_BUFS (nthreads + 2)
+#endif
+
+/*
+ * Buffers and their data regions are page aligned (O_DIRECT-safe); the page
+ * in front of the data holds the carried-in partial word.
+ */
+#define STREAM_ALIGN 4096
+#define STREAM_CARRY STREAM_ALIGN
+#define STREAM_DATA_CAP                                                        \
+    ((STREAM_BUF_SIZE + STREAM_ALIGN - 1) / STREAM_ALIGN * STREAM_ALIGN)
+
+_Static_assert(MAX_WORD <= STREAM_CARRY, "carry must fit in front of data");
+
+typedef struct {
+    char *base; /* STREAM_CARRY bytes of carry space, then the data */
+    char *unit; /* bytes handed to the worker */
+    size_t len;
+    int drop_leading;
+} StreamBuf;
+
+typedef struct {
+    StreamBuf *bufs;
+    int nbufs;
+    int *free_list;
+    int nfree;
+    int *ready;
+    int ready_head;
+    int ready_count;
+    int done;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t has_free;
+    pthread_cond_t has_ready;
+
+    /* Reader-side boundary state */
+    char carry[MAX_WORD];
+    size_t carry_len;
+    int skipping; /* inside an over-long run: drop leading letters */
+} Stream;
+
+static inline char *stream_data(const Stream *s, int b)
+{
+    return s->bufs[b].base + STREAM_CARRY;
+}
+
+static Stream stream;
+
+static int stream_acquire(Stream *s)
+{
+    (void)pthread_mutex_lock(&s->lock);
+    while (s->nfree == 0)
+        (void)pthread_cond_wait(&s->has_free, &s->lock);
+    int b = s->free_list[--s->nfree];
+    (void)pthread_mutex_unlock(&s->lock);
+    return b;
+}
+
+static void stream_release(Stream *s, int b)
+{
+    (void)pthread_mutex_lock(&s->lock);
+    s->free_list[s->nfree++] = b;
+    (void)pthread_cond_signal(&s->has_free);
+    (void)pthread_mutex_unlock(&s->lock);
+}
+
+static void stream_push(Stream *s, int b)
+{
+    (void)pthread_mutex_lock(&s->lock);
+    s->ready[(s->ready_head + s->ready_count) % s->nbufs] = b;
+    s->ready_count++;
+    (void)pthread_cond_signal(&s->has_ready);
+    (void)pthread_mutex_unlock(&s->lock);
+}
+
+/* Returns the next filled buffer, or -1 once the reader is done */
+static int stream_pop(Stream *s)
+{
+    (void)pthread_mutex_lock(&s->lock);
+    while (s->ready_count == 0 && !s->done)
+        (void)pthread_cond_wait(&s->has_ready, &s->lock);
+    int b = -1;
+    if (s->ready_count > 0) {
+        b = s->ready[s->ready_head];
+        s->ready_head = (s->ready_head + 1) % s->nbufs;
+        s->ready_count--;
+    }
+    (void)pthread_mutex_unlock(&s->lock);
+    return b;
+}
+
+static void stream_close(Stream *s)
+{
+    (void)pthread_mutex_lock(&s->lock);
+    s->done = 1;
+    (void)pthread_cond_broadcast(&s->has_ready);
+    (void)pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Hand buffer b, holding n freshly read bytes, to the workers. The previous
+ * carry is placed in front of the data and the new trailing partial word is
+ * saved for the next buffer (unless this is the last one).
+ */
+static void stream_submit(Stream *s, int b, size_t n, int last)
+{
+    StreamBuf *sb = &s->bufs[b];
+    char *data = stream_data(s, b);
+    size_t carry_in = s->carry_len;
+    size_t keep = n;
+    int drop = s->skipping;
+
+    memcpy(data - carry_in, s->carry, carry_in);
+    s->carry_len = 0;
+    s->skipping = 0;
+
+    if (!last) {
+        size_t cut = word_start(data, n);
+        size_t tail = n - cut;
+        /* Letters of the word still open at the end of the buffer */
+        size_t run = (cut == 0 && !drop) ? carry_in + tail : tail;
+
+        if (cut == 0 && drop) {
+            /* Still inside an over-long run: nothing to count here */
+            keep = 0;
+            s->skipping = 1;
+        } else if (run < MAX_WORD - 1) {
+            keep = cut;
+            memcpy(s->carry, data + cut - (run - tail), run);
+            s->carry_len = run;
+            if (cut == 0)
+                carry_in = 0; /* whole buffer joined the carry */
+        } else {
+            /* Stored prefix is already full length: emit it, skip the rest */
+            s->skipping = 1;
+        }
+    }
+
+    sb->unit = data - carry_in;
+    sb->len = carry_in + keep;
+    sb->drop_leading = drop;
+
+    if (sb->len == 0)
+        stream_release(s, b);
+    else
+        stream_push(s, b);
+}
+
+static void *stream_worker(void *arg)
+{
+    WorkUnit *u = arg;
+    Stream *s = &stream;
+    struct timespec t0, t1;
+
+    unit_start(u);
+    (void)clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (;;) {
+        int b = stream_pop(s);
+        if (b < 0)
+            break;
+        const StreamBuf *sb = &s->bufs[b];
+        unit_process(u, sb->unit, sb->len, sb->drop_leading, NULL);
+        stream_release(s, b);
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &t1);
+    u->wall_ms = ms_between(&t0, &t1);
+    return NULL;
+}
+
+/* read() until the buffer is full or EOF; returns bytes read or -1 */
+static ssize_t read_full(int fd, char *buf, size_t cap)
+{
+    size_t got = 0;
+    while (got < cap) {
+        ssize_t r = read(fd, buf + got, cap - got);
+        if (r == 0)
+            break;
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+/* Allocate the buffer ring, set up tables and start the stream workers */
+static int stream_begin(Stream *s, int nbufs)
+{
+    memset(s, 0, offsetof(Stream, lock));
+    (void)pthread_mutex_init(&s->lock, NULL);
+    (void)pthread_cond_init(&s->has_free, NULL);
+    (void)pthread_cond_init(&s->has_ready, NULL);
+
+    s->bufs = calloc((size_t)nbufs, sizeof(*s->bufs));
+    s->free_list = calloc((size_t)nbufs, sizeof(int));
+    s->ready = calloc((size_t)nbufs, sizeof(int));
+    if (!s->bufs || !s->free_list || !s->ready) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (; s->nbufs < nbufs; s->nbufs++) {
+        s->bufs[s->nbufs].base =
+                aligned_alloc(STREAM_ALIGN, STREAM_CARRY + STREAM_DATA_CAP);
+        if (!s->bufs[s->nbufs].base) {
+            perror("aligned_alloc");
+            return -1;
+        }
+        s->free_list[s->nfree++] = s->nbufs;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        units[i].table = &tables[i];
+        units[i].table_unique = 0;
+        units[i].id = i;
+    }
+
+    for (; s->started < nthreads; s->started++) {
+        if (pthread_create(&threads[s->started],
+                           NULL,
+                           stream_worker,
+                           &units[s->started])) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Let the workers drain the ring, join them and free the buffers */
+static void stream_end(Stream *s)
+{
+    stream_close(s);
+    for (int i = 0; i < s->started; i++) {
+        (void)pthread_join(threads[i], NULL);
+        free(units[i].spill);
+        units[i].spill = NULL;
+        units[i].spill_cap = 0;
+    }
+    for (int i = 0; i < s->nbufs; i++)
+        free(s->bufs[i].base);
+    free(s->bufs);
+    free(s->free_list);
+    free(s->ready);
+    (void)pthread_cond_destroy(&s->has_ready);
+    (void)pthread_cond_destroy(&s->has_free);
+    (void)pthread_mutex_destroy(&s->lock);
+}
+
+static int run_stream(int fd, size_t *bytes_read)
+{
+    Stream *s = &stream;
+    int rc = -1;
+
+    if (stream_begin(s, STREAM_BUFS) < 0)
+        goto out;
+
+    *bytes_read = 0;
+    for (;;) {
+        int b = stream_acquire(s);
+        ssize_t n = read_full(fd, stream_data(s, b), STREAM_DATA_CAP);
+        if (n < 0) {
+            perror("read");
+            stream_release(s, b);
+            goto out;
+        }
+        *bytes_read += (size_t)n;
+
+        int last = (size_t)n < STREAM_DATA_CAP;
+        stream_submit(s, b, (size_t)n, last);
+        if (last)
+            break;
+    }
+    rc = 0;
+
+out:
+    stream_end(s);
+    return rc;
+}
+
+/*===========================================================================
+ * io_uring Reader (--io=uring)
+ *
+ * A minimal raw-syscall ring (no liburing dependency). The stream buffers
+ * are registered once and up to --qd READ_FIXED requests run ahead of the
+ * workers, so cold-cache reads overlap with tokenizing instead of stalling
+ * in page faults. Completions are handed on in file order, so the stream
+ * carry logic sees exactly the byte sequence read() would.
+ *===========================================================================*/
+
+#ifndef URING_MAX_QD
+#define URING_MAX_QD 64
+#endif
+
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_sz;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+} Uring;
+
+static void uring_exit(Uring *u)
+{
+    if (u->sqes && u->sqes != MAP_FAILED)
+        (void)munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        (void)munmap(u->cq_ring, u->cq_ring_sz);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        (void)munmap(u->sq_ring, u->sq_ring_sz);
+    if (u->fd >= 0)
+        (void)close(u->fd);
+}
+
+static int uring_init(Uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz =
+            p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_sz > u->sq_ring_sz)
+            u->sq_ring_sz = u->cq_ring_sz;
+        u->cq_ring_sz = u->sq_ring_sz;
+    }
+
+    u->sq_ring = mmap(NULL,
+                      u->sq_ring_sz,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      u->fd,
+                      IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL,
+                          u->cq_ring_sz,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE,
+                          u->fd,
+                          IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL,
+                   u->sqes_sz,
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE,
+                   u->fd,
+                   IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = u->sq_ring;
+    char *cq = u->cq_ring;
+    u->sq_head = (unsigned *)(void *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(void *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(void *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(void *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(void *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(void *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(void *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    uring_exit(u);
+    u->fd = -1;
+    return -1;
+}
+
+/* Queue one read; buf_index < 0 selects a plain (unregistered) READ */
+static void uring_queue_read(Uring *u,
+                             int fd,
+                             char *buf,
+                             unsigned len,
+                             uint64_t off,
+                             int buf_index,
+                             uint64_t tag)
+{
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)(buf_index >= 0 ? IORING_OP_READ_FIXED
+                                           : IORING_OP_READ);
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = (uint16_t)(buf_index >= 0 ? buf_index : 0);
+    sqe->user_data = tag;
+
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(Uring *u, unsigned to_submit, unsigned min_complete)
+{
+    for (;;) {
+        long r = syscall(__NR_io_uring_enter,
+                         u->fd,
+                         to_submit,
+                         min_complete,
+                         min_complete ? IORING_ENTER_GETEVENTS : 0,
+                         NULL,
+                         0);
+        if (r >= 0)
+            return 0;
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+/* Pop one completion if available; returns 1 and fills tag/res */
+static int uring_reap(Uring *u, uint64_t *tag, int *res)
+{
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    *tag = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+typedef struct {
+    int buf;
+    uint64_t off;
+    size_t want;
+    int res;
+    int done;
+} UringSlot;
+
+static int
+run_uring(int fd, size_t file_size, int qd, size_t *bytes_read)
+{
+    Stream *s = &stream;
+    Uring u = { .fd = -1 };
+    UringSlot slots[URING_MAX_QD];
+    int rc = -1;
+    int fixed = 0;
+    size_t head = 0; /* oldest in-flight request (sequence number) */
+    size_t next = 0; /* next sequence number to issue */
+    uint64_t off = 0;
+
+    if (uring_init(&u, (unsigned)qd) < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (stream_begin(s, STREAM_BUFS + qd) < 0)
+        goto out;
+
+    /* Register every ring buffer once; fall back to plain READ if refused */
+    struct iovec *iov = calloc((size_t)s->nbufs, sizeof(*iov));
+    if (iov) {
+        for (int i = 0; i < s->nbufs; i++) {
+            iov[i].iov_base = stream_data(s, i);
+            iov[i].iov_len = STREAM_DATA_CAP;
+        }
+        fixed = syscall(__NR_io_uring_register,
+                        u.fd,
+                        IORING_REGISTER_BUFFERS,
+                        iov,
+                        (unsigned)s->nbufs) == 0;
+        free(iov);
+    }
+    if (!fixed)
+        (void)fprintf(stderr, "io_uring: buffer registration failed, "
+                              "using unregistered reads\n");
+
+    *bytes_read = 0;
+    while (head < next || off < file_size) {
+        /* Keep the queue full */
+        unsigned queued = 0;
+        while (next - head < (size_t)qd && off < file_size) {
+            UringSlot *sl = &slots[next % (size_t)qd];
+            sl->buf = stream_acquire(s);
+            sl->off = off;
+            sl->want = file_size - off < STREAM_DATA_CAP ? file_size - off
+                                                         : STREAM_DATA_CAP;
+            sl->done = 0;
+            uring_queue_read(&u,
+                             fd,
+                             stream_data(s, sl->buf),
+                             (unsigned)STREAM_DATA_CAP,
+                             off,
+                             fixed ? sl->buf : -1,
+                             next);
+            off += sl->want;
+            next++;
+            queued++;
+        }
+
+        /* Wait until the oldest request completes, collecting others */
+        UringSlot *hd = &slots[head % (size_t)qd];
+        if (uring_enter(&u, queued, hd->done ? 0 : 1) < 0) {
+            perror("io_uring_enter");
+            goto out;
+        }
+        uint64_t tag;
+        int res;
+        while (uring_reap(&u, &tag, &res)) {
+            slots[tag % (uint64_t)qd].res = res;
+            slots[tag % (uint64_t)qd].done = 1;
+        }
+
+        while (head < next && hd->done) {
+            if (hd->res < 0) {
+                errno = -hd->res;
+                perror("io_uring read");
+                goto out;
+            }
+            /* Finish short reads synchronously; the carry needs all bytes */
+            size_t got = (size_t)hd->res;
+            char *data = stream_data(s, hd->buf);
+            while (got < hd->want) {
+                ssize_t r = pread(fd,
+                                  data + got,
+                                  hd->want - got,
+                                  (off_t)(hd->off + got));
+                if (r <= 0) {
+                    if (r < 0 && errno == EINTR)
+                        continue;
+                    perror("pread");
+                    goto out;
+                }
+                got += (size_t)r;
+            }
+
+            *bytes_read += hd->want;
+            stream_submit(s,
+                          hd->buf,
+                          hd->want,
+                          hd->off + hd->want >= file_size);
+            head++;
+            hd = &slots[head % (size_t)qd];
+        }
+    }
+    rc = 0;
+
+out:
+    uring_exit(&u);
+    stream_end(s);
+    return rc;
+}
+
+/*===========================================================================
+ * Memory-Mapped Input
+ *===========================================================================*/
+
+static size_t chunks_for(size_t size)
+{
+    return (size + chunk_size - 1) / chunk_size;
+}
+
+/*
+ * Cut inputs[f] into chunks at out, just past the first non-letter at or
+ * after each nominal offset so no word straddles two chunks. Returns the
+ * number written, chunks_for(size); an unmapped input is one chunk.
+ */
+
+static size_t cut_chunks(uint32_t f, Chunk *out)
+{
+    const char *data = inputs[f].data;
+    size_t size = inputs[f].size;
+    size_t nchunks = chunks_for(size);
+    size_t prev = 0;
+
+    for (size_t i = 0; i < nchunks; i++) {
+        size_t c = (i + 1) * chunk_size;
+        if (c >= size || !data) {
+            c = size;
+        } else {
+            if (c < prev)
+                c = prev;
+            c = word_end(data, size, c);
+        }
+        out[i].start = prev;
+        out[i].end = c;
+        out[i].file = f;
+        out[i].drop_leading = 0;
+        prev = c;
+    }
+    return nchunks;
+}
+
+/*
+ * Vocabulary growth of the mapped input, fitted to Heaps' law over its
+ * first SAMPLE_BYTES: doubling the text multiplies the distinct words by
+ * 2^beta. Prose runs at beta 0.4-0.7 and random tokens near 1, so the
+ * fixed table_init() guess of one new word per 50 bytes oversizes a
+ * novel's tables and undersizes a dump of identifiers. A vocabulary that
+ * is running out shows as a falling beta; the fall is carried on past
+ * the sample, so a few thousand words drawn over and over do not get a
+ * table sized as if every word were new.
+ */
+typedef struct {
+    double words_per_byte; /* 0 = not sampled, use table_init()'s guess */
+    double w;              /* words in the sample */
+    double v;              /* distinct words in the sample */
+    double beta;           /* over the second half of the sample */
+    double decay;          /* fall of beta per doubling, >= 0 */
+} VocabFit;
+
+static VocabFit vocab_fit;
+
+static double clamp_beta(double beta)
+{
+    return beta < 0.1 ? 0.1 : beta > 1 ? 1 : beta;
+}
+
+/* Three points of the growth curve, at a quarter, half and all of the
+ * sample; inputs too short to show a curve keep the fixed guess */
+static void vocab_sample(const char *data, size_t size)
+{
+    Table t;
+    double w[3];
+    double v[3];
+    size_t pos = 0;
+
+    vocab_fit.words_per_byte = 0;
+    if (size < 2 * (size_t)SAMPLE_BYTES)
+        return;
+    if (table_create(&t,
+                     0,
+                     SAMPLE_BYTES / 32,
+                     SIZED_MIN_CAP,
+                     TABLE_LINEAR,
+                     RESIZE_FULL) < 0)
+        return;
+    for (int i = 0; i < 3; i++) {
+        size_t end = word_end(data, size, (size_t)SAMPLE_BYTES >> (2 - i));
+        process_chunk(&t, data + pos, end - pos, 0);
+        pos = end;
+        w[i] = (double)t.total;
+        v[i] = (double)t.len;
+    }
+    table_free(&t);
+    if (v[0] < 1 || w[1] <= w[0] * 1.5 || w[2] <= w[1] * 1.5)
+        return;
+
+    double b1 = clamp_beta(log(v[1] / v[0]) / log(w[1] / w[0]));
+    double b2 = clamp_beta(log(v[2] / v[1]) / log(w[2] / w[1]));
+    vocab_fit.beta = b2;
+    vocab_fit.decay = b1 > b2 ? b1 - b2 : 0;
+    vocab_fit.w = w[2];
+    vocab_fit.v = v[2];
+    vocab_fit.words_per_byte = w[2] / (double)pos;
+}
+
+/* Expected distinct words in bytes of the sampled input */
+static size_t vocab_estimate(size_t bytes)
+{
+    if (vocab_fit.words_per_byte == 0)
+        return bytes / 50 + 1;
+    double n = (double)bytes * vocab_fit.words_per_byte;
+    double w = vocab_fit.w;
+    double v = vocab_fit.v;
+    double beta = vocab_fit.beta;
+
+    if (n < w)
+        v *= pow(n / w, beta);
+    while (w < n && beta > 0) {
+        double step = n / w < 2 ? n / w : 2;
+        beta -= vocab_fit.decay;
+        v *= pow(step, beta > 0 ? beta : 0);
+        w *= step;
+    }
+    return (size_t)(v < n ? v : n) + 1;
+}
+
+/*
+ * Deal nchunks contiguous chunk ranges over the workers and run them.
+ * Ranges go out in node-major worker order, so each node reads one
+ * contiguous part of the input.
+ */
+static int run_chunks(size_t nchunks, size_t bytes)
+{
+    for (int i = 0; i < nthreads; i++) {
+        size_t pos = 0;
+        for (int t = 0; t < nthreads; t++)
+            pos += worker_node[t] < worker_node[i] ||
+                   (worker_node[t] == worker_node[i] && t < i);
+
+        deques[i].range = range_pack(
+                (uint32_t)(nchunks * pos / (size_t)nthreads),
+                (uint32_t)(nchunks * (pos + 1) / (size_t)nthreads));
+        units[i].table = &tables[i];
+        /* A front cache only ever holds one chunk's words */
+        units[i].table_unique = shards || approx_budget
+                                        ? 0
+                                        : vocab_estimate(bytes /
+                                                       (size_t)nthreads);
+        units[i].buf = NULL;
+        units[i].buf_cap = 0;
+        units[i].id = i;
+    }
+
+    /* Launch workers; a single one runs on this thread */
+    if (nthreads == 1) {
+        (void)pthread_barrier_init(&barrier, NULL, 1);
+        (void)worker(&units[0]);
+    } else {
+        (void)pthread_barrier_init(&barrier, NULL, (unsigned)nthreads + 1);
+        for (int i = 0; i < nthreads; i++) {
+            (void)pthread_create(&threads[i], NULL, worker, &units[i]);
+        }
+        (void)pthread_barrier_wait(&barrier);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        if (nthreads > 1)
+            (void)pthread_join(threads[i], NULL);
+        free(units[i].buf);
+        units[i].buf = NULL;
+        free(units[i].spill);
+        units[i].spill = NULL;
+        units[i].spill_cap = 0;
+        if (per_file)
+            table_free(&units[i].file_table);
+    }
+    (void)pthread_barrier_destroy(&barrier);
+    return 0;
+}
+
+static int run_mapped(int fd, size_t file_size)
+{
+    char *data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    (void)madvise(data, file_size, MADV_SEQUENTIAL);
+    (void)madvise(data, file_size, MADV_WILLNEED);
+
+    InputFile in = { .data = data, .size = file_size };
+    inputs = &in;
+    chunks = malloc(chunks_for(file_size) * sizeof(*chunks));
+    if (!chunks) {
+        perror("malloc");
+        (void)munmap(data, file_size);
+        return -1;
+    }
+    vocab_sample(data, file_size);
+    int rc = run_chunks(cut_chunks(0, chunks), file_size);
+
+    free(chunks);
+    chunks = NULL;
+    inputs = NULL;
+    (void)munmap(data, file_size);
+    return rc;
+}
+
+/*===========================================================================
+ * Batch Input (several FILEs, directories, --files-from)
+ *
+ * All inputs share one worker pool, one set of tables and one merge. Files
+ * larger than a chunk are mapped and split as usual; smaller ones are whole
+ * chunks read by whichever worker claims them, so a directory of small
+ * documents costs an open and a read per file instead of a process each.
+ * Directories are walked recursively in name order; hidden entries and
+ * symlinked directories are skipped. Unreadable inputs are reported and
+ * skipped, and make the exit status 1.
+ *===========================================================================*/
+
+typedef struct {
+    char **paths;
+    size_t len;
+    size_t cap;
+} PathList;
+
+static void path_push(PathList *l, const char *path)
+{
+    if (l->len == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 64;
+        l->paths = realloc(l->paths, l->cap * sizeof(*l->paths));
+        if (!l->paths) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    l->paths[l->len] = strdup(path);
+    if (!l->paths[l->len]) {
+        perror("strdup");
+        exit(1);
+    }
+    l->len++;
+}
+
+static void path_list_free(PathList *l)
+{
+    for (size_t i = 0; i < l->len; i++)
+        free(l->paths[i]);
+    free(l->paths);
+    l->paths = NULL;
+    l->len = l->cap = 0;
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void input_error(const char *path, const char *what)
+{
+    (void)fprintf(stderr, "%s: %s\n", path, what);
+    input_errors = 1;
+}
+
+/* Add path, or every regular file below it; top-level paths follow links */
+static void path_walk(PathList *l, const char *path, int top)
+{
+    struct stat st;
+    if ((top ? stat(path, &st) : lstat(path, &st)) < 0) {
+        input_error(path, strerror(errno));
+        return;
+    }
+    if (S_ISLNK(st.st_mode) && (stat(path, &st) < 0 || S_ISDIR(st.st_mode)))
+        return;
+    if (S_ISREG(st.st_mode)) {
+        path_push(l, path);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (top)
+            input_error(path, "not a regular file or directory");
+        return;
+    }
+
+    DIR *d = opendir(path);
+    if (!d) {
+        input_error(path, strerror(errno));
+        return;
+    }
+    PathList kids = { 0 };
+    char buf[4096];
+    const struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        int n = snprintf(buf, sizeof(buf), "%s/%s", path, de->d_name);
+        if (n < 0 || (size_t)n >= sizeof(buf)) {
+            input_error(de->d_name, "path too long");
+            continue;
+        }
+        path_push(&kids, buf);
+    }
+    (void)closedir(d);
+
+    qsort(kids.paths, kids.len, sizeof(*kids.paths), cmp_path);
+    for (size_t i = 0; i < kids.len; i++)
+        path_walk(l, kids.paths[i], 0);
+    path_list_free(&kids);
+}
+
+/* One path per line from list ('-' = stdin); blank lines are ignored */
+static int path_read_list(PathList *l, const char *list)
+{
+    FILE *f = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (!f) {
+        perror(list);
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, f)) >= 0) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+            line[--n] = '\0';
+        if (n > 0)
+            path_walk(l, line, 1);
+    }
+    free(line);
+    if (f != stdin)
+        (void)fclose(f);
+    return 0;
+}
+
+/* Count every path in one pass; inputs[] stays valid for --per-file */
+static int run_batch(char **paths, size_t n, size_t *out_bytes)
+{
+    if (n > UINT32_MAX) {
+        (void)fprintf(stderr, "too many input files\n");
+        return -1;
+    }
+    inputs = calloc(n, sizeof(*inputs));
+    if (!inputs) {
+        perror("calloc");
+        exit(1);
+    }
+
+    size_t nchunks = 0;
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        InputFile *in = &inputs[i];
+        in->path = paths[i];
+
+        int fd = open(in->path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            input_error(in->path, strerror(errno));
+            if (fd >= 0)
+                (void)close(fd);
+            continue;
+        }
+        in->size = (size_t)st.st_size;
+        if (in->size > chunk_size) {
+            in->data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (in->data == MAP_FAILED) {
+                in->data = NULL;
+                in->size = 0;
+                input_error(in->path, strerror(errno));
+            } else {
+                (void)madvise(in->data, in->size, MADV_SEQUENTIAL);
+            }
+        }
+        (void)close(fd);
+        nchunks += chunks_for(in->size);
+        bytes += in->size;
+    }
+
+    chunks = malloc((nchunks ? nchunks : 1) * sizeof(*chunks));
+    if (!chunks) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t c = 0;
+    for (size_t i = 0; i < n; i++)
+        c += cut_chunks((uint32_t)i, chunks + c);
+
+    int rc = run_chunks(nchunks, bytes);
+    free(chunks);
+    chunks = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (inputs[i].data)
+            (void)munmap(inputs[i].data, inputs[i].size);
+        inputs[i].data = NULL;
+    }
+    *out_bytes = bytes;
+    return rc;
+}
+
+/*===========================================================================
+ * Top-K Selection
+ *
+ * A bounded min-heap keeps the best top_k entries seen so far with the
+ * weakest at heap[0], so most candidates cost one comparison. Each merge
+ * shard keeps its own heap; the shard heaps are then reduced into one. Only
+ * --all (top_k == 0) sorts the full table.
+ *===========================================================================*/
+
+static size_t top_k = TOP_N;
+
+/* strcmp order; inline keys of length 8 carry no NUL */
+static inline int word_cmp(const Entry *a, const Entry *b)
+{
+    size_t n = a->len < b->len ? a->len : b->len;
+    int c = memcmp(entry_word(a), entry_word(b), n);
+    return c ? c : (int)a->len - (int)b->len;
+}
+
+static int cmp_count_desc(const void *a, const void *b)
+{
+    const Entry *ea = a;
+    const Entry *eb = b;
+    if (ea->count != eb->count)
+        return (eb->count > ea->count) ? 1 : -1;
+    return word_cmp(ea, eb);
+}
+
+/* Same order as cmp_count_desc: a ranks ahead of b */
+static inline int entry_before(const Entry *a, const Entry *b)
+{
+    if (a->count != b->count)
+        return a->count > b->count;
+    return word_cmp(a, b) < 0;
+}
+
+static void heap_sift_down(Entry *heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
+        size_t w = i;
+        if (l < n && entry_before(&heap[w], &heap[l]))
+            w = l;
+        if (r < n && entry_before(&heap[w], &heap[r]))
+            w = r;
+        if (w == i)
+            return;
+        Entry tmp = heap[i];
+        heap[i] = heap[w];
+        heap[w] = tmp;
+        i = w;
+    }
+}
+
+static void topk_offer(Entry *heap, size_t *n, size_t k, const Entry *e)
+{
+    if (*n < k) {
+        size_t i = (*n)++;
+        heap[i] = *e;
+        while (i > 0 && entry_before(&heap[(i - 1) / 2], &heap[i])) {
+            Entry tmp = heap[i];
+            heap[i] = heap[(i - 1) / 2];
+            heap[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+    } else if (entry_before(e, &heap[0])) {
+        heap[0] = *e;
+        heap_sift_down(heap, k, 0);
+    }
+}
+
+/*===========================================================================
+ * Saved Tables (--save / --load)
+ *
+ * A saved table is the merged result in a form that is used straight from
+ * mmap: a SaveHeader, then `unique` SaveRecords sorted by word, then one
+ * blob of NUL-terminated words longer than ENTRY_INLINE. Short words sit in
+ * the record as the same zero-padded key the tables use, long ones as a
+ * blob offset, so a loaded record becomes an Entry without copying and
+ * pointing into the mapping. Fields are in host byte order. The header
+ * keeps the writer's hash of a fixed probe word; if that differs from the
+ * running kernel's (CRC32C vs FNV-1a) the hashes are recomputed on load.
+ *
+ * Loaded tables join the merge as extra sources: merge unit t also
+ * partitions the t-th slice of every loaded table's records, so they are
+ * combined in parallel with the counts of the input.
+ *===========================================================================*/
+
+#define SAVE_MAGIC "WCTABLE\0"
+#define SAVE_VERSION 1
+#define SAVE_PROBE "wordcount"
+
+#ifndef MAX_LOADS
+#define MAX_LOADS 64
+#endif
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t probe_hash; /* writer's hash of SAVE_PROBE */
+    uint64_t unique;     /* records */
+    uint64_t total;      /* sum of counts */
+    uint64_t blob_bytes;
+} SaveHeader;
+
+typedef struct {
+    uint64_t count;
+    uint64_t key; /* inline key, or blob offset if len > ENTRY_INLINE */
+    uint32_t hash;
+    uint32_t len;
+} SaveRecord;
+
+typedef struct {
+    const char *path;
+    void *map;
+    size_t map_size;
+    const SaveHeader *hdr;
+    const SaveRecord *rec;
+    const char *blob;
+    int rehash;
+} Saved;
+
+static Saved saved[MAX_LOADS];
+static int saved_count = 0;
+
+static uint32_t probe_hash(void)
+{
+    return kernel->hash(SAVE_PROBE, sizeof(SAVE_PROBE) - 1);
+}
+
+static int saved_open(Saved *s, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SaveHeader)) {
+        (void)fprintf(stderr, "%s: not a saved table\n", path);
+        (void)close(fd);
+        return -1;
+    }
+    s->path = path;
+    s->map_size = (size_t)st.st_size;
+    s->map = mmap(NULL, s->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (s->map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    s->hdr = s->map;
+    s->rec = (const SaveRecord *)(s->hdr + 1);
+    uint64_t hdr_unique = s->hdr->unique;
+    size_t body = s->map_size - sizeof(SaveHeader);
+    if (memcmp(s->hdr->magic, SAVE_MAGIC, 8) != 0 ||
+        s->hdr->version != SAVE_VERSION ||
+        hdr_unique > body / sizeof(SaveRecord) ||
+        s->hdr->blob_bytes != body - hdr_unique * sizeof(SaveRecord)) {
+        (void)fprintf(stderr, "%s: not a saved table\n", path);
+        (void)munmap(s->map, s->map_size);
+        return -1;
+    }
+    s->blob = (const char *)(s->rec + hdr_unique);
+    s->rehash = s->hdr->probe_hash != probe_hash();
+
+    (void)madvise(s->map, s->map_size, MADV_WILLNEED);
+    return 0;
+}
+
+static void saved_close(Saved *s)
+{
+    if (s->map)
+        (void)munmap(s->map, s->map_size);
+    s->map = NULL;
+}
+
+/* Entry for record i, words pointing into the mapping */
+static Entry saved_entry(const Saved *s, size_t i)
+{
+    const SaveRecord *r = &s->rec[i];
+    Entry e;
+
+    if (r->len == 0 || r->len >= MAX_WORD ||
+        (r->len > ENTRY_INLINE &&
+         (s->hdr->blob_bytes < r->len + 1u ||
+          r->key > s->hdr->blob_bytes - r->len - 1u ||
+          s->blob[r->key + r->len] != '\0'))) {
+        (void)fprintf(stderr, "%s: corrupt record %zu\n", s->path, i);
+        exit(1);
+    }
+    e.len = (uint16_t)r->len;
+    if (e.len <= ENTRY_INLINE)
+        e.key.inl64 = r->key;
+    else
+        e.key.ptr = (char *)(uintptr_t)(s->blob + r->key);
+    e.count = r->count;
+    e.hash = s->rehash ? kernel->hash(entry_word(&e), e.len) : r->hash;
+    e.fp16 = 0;
+    return e;
+}
+
+static int cmp_word(const void *a, const void *b)
+{
+    return word_cmp(a, b);
+}
+
+/*
+ * Write the merged table to path: the entries sorted by word, then their
+ * long words. Goes through path.tmp and a rename, so an interrupted save
+ * never leaves a truncated table behind.
+ */
+static int save_table(const char *path,
+                      const Entry *entries,
+                      size_t cap,
+                      size_t unique,
+                      size_t total)
+{
+    int rc = -1;
+    FILE *f = NULL;
+    char tmp[4096];
+    Entry *arr = malloc((unique ? unique : 1) * sizeof(Entry));
+    if (!arr) {
+        perror("malloc");
+        exit(1);
+    }
+
+    size_t n = 0;
+    uint64_t blob = 0;
+    for (size_t i = 0; i < cap && n < unique; i++) {
+        if (!entries[i].len)
+            continue;
+        arr[n++] = entries[i];
+        if (entries[i].len > ENTRY_INLINE)
+            blob += entries[i].len + 1u;
+    }
+    qsort(arr, n, sizeof(Entry), cmp_word);
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+        (void)fprintf(stderr, "--save path too long\n");
+        goto cleanup;
+    }
+    f = fopen(tmp, "wb");
+    if (!f) {
+        perror(tmp);
+        goto cleanup;
+    }
+    (void)setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    SaveHeader hdr = { .version = SAVE_VERSION,
+                       .probe_hash = probe_hash(),
+                       .unique = n,
+                       .total = total,
+                       .blob_bytes = blob };
+    memcpy(hdr.magic, SAVE_MAGIC, 8);
+    (void)fwrite(&hdr, sizeof(hdr), 1, f);
+
+    uint64_t off = 0;
+    for (size_t i = 0; i < n; i++) {
+        SaveRecord r = { .count = arr[i].count,
+                         .hash = arr[i].hash,
+                         .len = arr[i].len };
+        if (arr[i].len <= ENTRY_INLINE) {
+            r.key = arr[i].key.inl64;
+        } else {
+            r.key = off;
+            off += arr[i].len + 1u;
+        }
+        (void)fwrite(&r, sizeof(r), 1, f);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (arr[i].len > ENTRY_INLINE)
+            (void)fwrite(arr[i].key.ptr, arr[i].len + 1u, 1, f);
+    }
+
+    if (ferror(f) | fclose(f)) {
+        f = NULL;
+        perror(tmp);
+        (void)unlink(tmp);
+        goto cleanup;
+    }
+    f = NULL;
+    if (rename(tmp, path) < 0) {
+        perror(path);
+        (void)unlink(tmp);
+        goto cleanup;
+    }
+    rc = 0;
+
+cleanup:
+    if (f) {
+        (void)fclose(f);
+        (void)unlink(tmp);
+    }
+    free(arr);
+    return rc;
+}
+
+/*===========================================================================
+ * Merge Tables (parallel, hash-partitioned)
+ *
+ * Phase 1: worker t groups the live entries of tables[t] into nthreads
+ * shard runs, shard = (hash * nthreads) >> 32, i.e. the high hash bits
+ * (slots use the low ones); with --table=shared it reads every nthreads-th
+ * shard of the shared table instead. Phase 2: worker s merges shard s of
+ * every table into its own slice of one global array. Slices are disjoint
+ * open-addressing tables, so their concatenation is the merged table and
+ * no worker ever touches another's slice.
+ *
+ * With workers on several NUMA nodes a fold step runs between the phases:
+ * shard s of all tables on one node is combined by a worker of that node
+ * into a deduplicated run, so phase 2 reads one run per node and shard
+ * instead of one per table, and a word common to every table crosses the
+ * interconnect once per node rather than once per thread.
+ *===========================================================================*/
+
+typedef struct {
+    Entry *part;  /* tables[id] entries grouped by shard */
+    size_t *offs; /* nthreads + 1 run offsets into part */
+    Entry *slice; /* shard id of the global array */
+    size_t slice_cap;
+    size_t slice_len;
+    Entry *top; /* top_k heap over the slice */
+    size_t top_len;
+    int id;
+} MergeUnit;
+
+typedef struct {
+    Entry *run;
+    size_t len;
+} Fold;
+
+static MergeUnit merge_units[MAX_THREADS];
+static Entry *merge_global;
+static size_t merge_cap;
+static Fold *merge_folds; /* [node * nthreads + shard]; NULL on one node */
+
+static inline int shard_of(uint32_t hash)
+{
+    return (int)(((uint64_t)hash * (uint64_t)nthreads) >> 32);
+}
+
+/* This unit's share [*lo, *hi) of saved table s */
+static void saved_slice(const Saved *s, int id, size_t *lo, size_t *hi)
+{
+    uint64_t n = s->hdr->unique;
+    *lo = (size_t)(n * (uint64_t)id / (uint64_t)nthreads);
+    *hi = (size_t)(n * ((uint64_t)id + 1) / (uint64_t)nthreads);
+}
+
+/* Tables unit id partitions: its own, or with --table=shared its share of
+ * the shards (the fronts are empty after their last flush) */
+static int merge_sources(int id, Table **src)
+{
+    int n = 0;
+
+    if (!shards) {
+        src[n++] = &tables[id];
+        return n;
+    }
+    for (int s = id; s < SHARED_SHARDS; s += nthreads)
+        src[n++] = &shards[s].table;
+    return n;
+}
+
+static void merge_partition(MergeUnit *m)
+{
+    Table *src[SHARED_SHARDS];
+    int nsrc = merge_sources(m->id, src);
+    size_t *offs = m->offs;
+    size_t lo, hi;
+
+    size_t n = 0;
+    for (int t = 0; t < nsrc; t++) {
+        table_settle(src[t]);
+        n += src[t]->len;
+    }
+    for (int f = 0; f < saved_count; f++) {
+        saved_slice(&saved[f], m->id, &lo, &hi);
+        n += hi - lo;
+    }
+    m->part = malloc((n ? n : 1) * sizeof(Entry));
+    if (!m->part) {
+        perror("malloc");
+        exit(1);
+    }
+
+    memset(offs, 0, ((size_t)nthreads + 1) * sizeof(size_t));
+    for (int t = 0; t < nsrc; t++) {
+        const Table *tbl = src[t];
+        for (size_t i = 0; i < tbl->cap; i++) {
+            if (tbl->entries[i].len)
+                offs[shard_of(tbl->entries[i].hash) + 1]++;
+        }
+    }
+    for (int f = 0; f < saved_count; f++) {
+        const Saved *s = &saved[f];
+        saved_slice(s, m->id, &lo, &hi);
+        for (size_t i = lo; i < hi; i++) {
+            uint32_t h = s->rehash ? saved_entry(s, i).hash : s->rec[i].hash;
+            offs[shard_of(h) + 1]++;
+        }
+    }
+    for (int sh = 0; sh < nthreads; sh++)
+        offs[sh + 1] += offs[sh];
+
+    /* Scatter with offs[sh] as the cursor, then shift back */
+    for (int t = 0; t < nsrc; t++) {
+        const Table *tbl = src[t];
+        for (size_t i = 0; i < tbl->cap; i++) {
+            const Entry *e = &tbl->entries[i];
+            if (e->len)
+                m->part[offs[shard_of(e->hash)]++] = *e;
+        }
+    }
+    for (int f = 0; f < saved_count; f++) {
+        saved_slice(&saved[f], m->id, &lo, &hi);
+        for (size_t i = lo; i < hi; i++) {
+            Entry e = saved_entry(&saved[f], i);
+            m->part[offs[shard_of(e.hash)]++] = e;
+        }
+    }
+    for (int sh = nthreads; sh > 0; sh--)
+        offs[sh] = offs[sh - 1];
+    offs[0] = 0;
+}
+
+/* Add *e to the open-addressing array at slice; returns 1 if it was new */
+static inline size_t slice_add(Entry *slice, size_t mask, const Entry *e)
+{
+    size_t idx = e->hash & mask;
+    while (slice[idx].len) {
+        if (entry_same(&slice[idx], e)) {
+            slice[idx].count += e->count;
+            return 0;
+        }
+        idx = (idx + 1) & mask;
+    }
+    slice[idx] = *e;
+    return 1;
+}
+
+/* Fold the shards this worker takes for its node (see above) */
+static void merge_fold(MergeUnit *m)
+{
+    int node = worker_node[m->id];
+    int members[MAX_THREADS];
+    int nmembers = 0;
+    int rank = 0;
+
+    for (int t = 0; t < nthreads; t++) {
+        if (worker_node[t] != node)
+            continue;
+        if (t == m->id)
+            rank = nmembers;
+        members[nmembers++] = t;
+    }
+
+    for (int sh = rank; sh < nthreads; sh += nmembers) {
+        size_t n = 0;
+        for (int i = 0; i < nmembers; i++) {
+            const MergeUnit *src = &merge_units[members[i]];
+            n += src->offs[sh + 1] - src->offs[sh];
+        }
+        size_t cap = next_pow2(n * 2);
+        if (cap < 16)
+            cap = 16;
+        Entry *run = calloc(cap, sizeof(Entry));
+        if (!run) {
+            perror("calloc");
+            exit(1);
+        }
+
+        size_t mask = cap - 1;
+        for (int i = 0; i < nmembers; i++) {
+            const MergeUnit *src = &merge_units[members[i]];
+            for (size_t e = src->offs[sh]; e < src->offs[sh + 1]; e++)
+                (void)slice_add(run, mask, &src->part[e]);
+        }
+
+        /* Compact, so the other nodes read only live entries */
+        size_t len = 0;
+        for (size_t i = 0; i < cap; i++) {
+            if (run[i].len)
+                run[len++] = run[i];
+        }
+        merge_folds[(size_t)node * (size_t)nthreads + (size_t)sh].run = run;
+        merge_folds[(size_t)node * (size_t)nthreads + (size_t)sh].len = len;
+    }
+}
+
+/* Serial step between the phases: size every slice and carve the array */
+static void merge_allocate(void)
+{
+    size_t caps[MAX_THREADS];
+
+    merge_cap = 0;
+    for (int sh = 0; sh < nthreads; sh++) {
+        size_t est = 0;
+        if (merge_folds) {
+            for (int n = 0; n < worker_nodes; n++)
+                est += merge_folds[(size_t)n * (size_t)nthreads + (size_t)sh]
+                               .len;
+        } else {
+            for (int t = 0; t < nthreads; t++)
+                est += merge_units[t].offs[sh + 1] - merge_units[t].offs[sh];
+        }
+        caps[sh] = next_pow2(est * 2);
+        if (caps[sh] < 16)
+            caps[sh] = 16; /* keeps the total a multiple of CACHELINE */
+        merge_cap += caps[sh];
+    }
+
+    merge_global = huge_xalloc(merge_cap * sizeof(Entry));
+
+    size_t off = 0;
+    for (int sh = 0; sh < nthreads; sh++) {
+        merge_units[sh].slice = merge_global + off;
+        merge_units[sh].slice_cap = caps[sh];
+        off += caps[sh];
+    }
+}
+
+static void merge_shard(MergeUnit *m)
+{
+    Entry *slice = m->slice;
+    size_t mask = m->slice_cap - 1;
+    size_t len = 0;
+
+    memset(slice, 0, m->slice_cap * sizeof(Entry));
+    if (merge_folds) {
+        for (int n = 0; n < worker_nodes; n++) {
+            const Fold *f =
+                    &merge_folds[(size_t)n * (size_t)nthreads + (size_t)m->id];
+            for (size_t i = 0; i < f->len; i++)
+                len += slice_add(slice, mask, &f->run[i]);
+        }
+    } else {
+        for (int t = 0; t < nthreads; t++) {
+            const MergeUnit *src = &merge_units[t];
+            for (size_t i = src->offs[m->id]; i < src->offs[m->id + 1]; i++)
+                len += slice_add(slice, mask, &src->part[i]);
+        }
+    }
+    m->slice_len = len;
+
+    if (top_k == 0)
+        return;
+    size_t k = top_k < len ? top_k : len;
+    m->top = malloc((k ? k : 1) * sizeof(Entry));
+    if (!m->top) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i <= mask; i++) {
+        if (slice[i].len)
+            topk_offer(m->top, &m->top_len, k, &slice[i]);
+    }
+}
+
+static void *merge_worker(void *arg)
+{
+    MergeUnit *m = arg;
+
+    pin_thread(m->id);
+    merge_partition(m);
+    if (merge_folds) {
+        (void)pthread_barrier_wait(&barrier);
+        merge_fold(m);
+    }
+    if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+        merge_allocate();
+    (void)pthread_barrier_wait(&barrier);
+    merge_shard(m);
+    return NULL;
+}
+
+/* merge_tables() returned tables[0].entries, which the table still owns */
+static int merge_borrowed;
+
+/* A lone private table already is the merged one: only its top_k heap is
+ * built, and the result reads the table in place */
+static Entry *
+merge_single(size_t *out_unique, size_t *out_total, size_t *out_cap)
+{
+    Table *t = &tables[0];
+    MergeUnit *m = &merge_units[0];
+
+    table_settle(t);
+    m->top_len = 0;
+    if (top_k) {
+        size_t k = top_k < t->len ? top_k : t->len;
+        m->top = malloc((k ? k : 1) * sizeof(Entry));
+        if (!m->top) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < t->cap; i++) {
+            if (t->entries[i].len)
+                topk_offer(m->top, &m->top_len, k, &t->entries[i]);
+        }
+    }
+
+    merge_borrowed = 1;
+    *out_unique = t->len;
+    *out_total = t->total;
+    *out_cap = t->cap;
+    return t->entries;
+}
+
+static Entry *
+merge_tables(size_t *out_unique, size_t *out_total, size_t *out_cap)
+{
+    if (nthreads == 1 && !shards && saved_count == 0)
+        return merge_single(out_unique, out_total, out_cap);
+
+    size_t *offs = malloc((size_t)nthreads * ((size_t)nthreads + 1) *
+                          sizeof(size_t));
+    if (!offs) {
+        perror("malloc");
+        exit(1);
+    }
+    if (worker_nodes > 1) {
+        merge_folds = calloc((size_t)worker_nodes * (size_t)nthreads,
+                             sizeof(Fold));
+        if (!merge_folds) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+
+    (void)pthread_barrier_init(&barrier, NULL, (unsigned)nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        merge_units[i].offs = offs + (size_t)i * ((size_t)nthreads + 1);
+        merge_units[i].id = i;
+        (void)pthread_create(&threads[i], NULL, merge_worker, &merge_units[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        (void)pthread_join(threads[i], NULL);
+    }
+    (void)pthread_barrier_destroy(&barrier);
+
+    size_t glen = 0;
+    size_t gtotal = 0;
+    for (int i = 0; i < nthreads; i++) {
+        glen += merge_units[i].slice_len;
+        gtotal += tables[i].total;
+        free(merge_units[i].part);
+    }
+    for (int f = 0; f < saved_count; f++)
+        gtotal += saved[f].hdr->total;
+    free(offs);
+    if (merge_folds) {
+        for (size_t i = 0; i < (size_t)worker_nodes * (size_t)nthreads; i++)
+            free(merge_folds[i].run);
+        free(merge_folds);
+        merge_folds = NULL;
+    }
+
+    *out_unique = glen;
+    *out_total = gtotal;
+    *out_cap = merge_cap;
+    return merge_global;
+}
+
+/*===========================================================================
+ * Output
+ *===========================================================================*/
+
+/* Row order for --all and the machine formats (--sort) */
+typedef enum { SORT_COUNT, SORT_WORD, SORT_NONE } SortOrder;
+
+static SortOrder sort_order = SORT_COUNT;
+
+/*
+ * Rows to print: the shard heaps reduced to the top_k best, or with --all
+ * every entry. Rows come in sort_order; a top-K selection is always by
+ * count, SORT_NONE then leaves it best first.
+ */
+static Entry *
+select_top(const Entry *entries, size_t cap, size_t unique, size_t *out_n)
+{
+    size_t n = 0;
+    Entry *rows;
+
+    if (top_k == 0) {
+        rows = malloc((unique ? unique : 1) * sizeof(Entry));
+        if (!rows) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < cap && n < unique; i++) {
+            if (entries[i].len)
+                rows[n++] = entries[i];
+        }
+        if (sort_order == SORT_COUNT)
+            qsort(rows, n, sizeof(Entry), cmp_count_desc);
+    } else {
+        size_t k = top_k < unique ? top_k : unique;
+        rows = malloc((k ? k : 1) * sizeof(Entry));
+        if (!rows) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < nthreads; i++) {
+            MergeUnit *m = &merge_units[i];
+            for (size_t j = 0; j < m->top_len; j++)
+                topk_offer(rows, &n, k, &m->top[j]);
+            free(m->top);
+            m->top = NULL;
+        }
+        if (sort_order != SORT_WORD)
+            qsort(rows, n, sizeof(Entry), cmp_count_desc);
+    }
+    if (sort_order == SORT_WORD)
+        qsort(rows, n, sizeof(Entry), cmp_word);
+
+    *out_n = n;
+    return rows;
+}
+
+static void print_summary(FILE *f,
+                          size_t unique,
+                          size_t total,
+                          size_t file_size,
+                          double ms)
+{
+    double size_mb = (double)file_size / (1024.0 * 1024.0);
+    (void)fprintf(f, "\nFile size:       %.2f MB\n", size_mb);
+    (void)fprintf(f, "Total words:     %zu\n", total);
+    (void)fprintf(f, "Unique words:    %zu\n", unique);
+    (void)fprintf(f, "Time:            %.2f ms\n", ms);
+    (void)fprintf(f, "Throughput:      %.2f MB/s\n", size_mb / (ms / 1000.0));
+}
+
+static void print_row(FILE *f, size_t i, const Entry *e, size_t total)
+{
+    const char *word = entry_word(e);
+    /* Pad to 15 code points, so UTF-8 words line up too */
+    size_t wide = e->len - utf8_chars(word, e->len);
+    (void)fprintf(f,
+                  "%2zu. %-*.*s %9" PRIu64 "  (%5.2f%%)\n",
+                  i + 1,
+                  (int)(15 + wide),
+                  (int)e->len,
+                  word,
+                  e->count,
+                  100.0 * (double)e->count / (double)total);
+}
+
+static void print_top(const Entry *rows,
+                      size_t n,
+                      size_t unique,
+                      size_t total,
+                      size_t file_size,
+                      double ms)
+{
+    if (top_k)
+        printf("\n=== Top %zu Words ===\n", top_k);
+    else
+        printf("\n=== All Words ===\n");
+    for (size_t i = 0; i < n; i++)
+        print_row(stdout, i, &rows[i], total);
+    print_summary(stdout, unique, total, file_size, ms);
+}
+
+static void file_rows_free(FileRows *b)
+{
+    while (b) {
+        FileRows *next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+/*
+ * The rows of one batch input, chosen and ordered as select_top() does
+ * for the whole batch. An input counted in several chunks is merged into
+ * m first, which the rows then point into.
+ */
+static Entry *file_rows_select(const FileRows *list, Table *m, size_t *out_n)
+{
+    const Entry *entries = list ? list->rows : NULL;
+    size_t cap = list ? list->n : 0;
+    size_t unique = cap;
+    size_t n = 0;
+
+    if (list && list->next) {
+        if (table_create(m, 0, 0, INITIAL_CAP, TABLE_LINEAR, RESIZE_FULL) < 0)
+            exit(1);
+        for (const FileRows *b = list; b; b = b->next) {
+            for (size_t i = 0; i < b->n; i++)
+                table_add(m, &b->rows[i]);
+        }
+        entries = m->entries;
+        cap = m->cap;
+        unique = m->len;
+    }
+
+    size_t k = top_k && top_k < unique ? top_k : unique;
+    Entry *rows = malloc((k ? k : 1) * sizeof(Entry));
+    if (!rows) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < cap; i++) {
+        if (!entries[i].len)
+            continue;
+        if (top_k)
+            topk_offer(rows, &n, k, &entries[i]);
+        else
+            rows[n++] = entries[i];
+    }
+    if (sort_order == SORT_WORD)
+        qsort(rows, n, sizeof(Entry), cmp_word);
+    else if (top_k || sort_order == SORT_COUNT)
+        qsort(rows, n, sizeof(Entry), cmp_count_desc);
+    *out_n = n;
+    return rows;
+}
+
+/* Each batch input's word total and its own top K (or every) rows */
+static void print_per_file(FILE *f, size_t n)
+{
+    (void)fprintf(f, "\n=== Per File ===\n");
+    for (size_t i = 0; i < n; i++) {
+        const InputFile *in = &inputs[i];
+        Table m = { 0 };
+        size_t nrows;
+        Entry *rows = file_rows_select(in->rows, &m, &nrows);
+
+        (void)fprintf(f, "\n%s: %zu words\n", in->path, in->words);
+        for (size_t r = 0; r < nrows; r++)
+            print_row(f, r, &rows[r], in->words);
+        free(rows);
+        if (m.entries)
+            table_free(&m);
+    }
+}
+
+/*===========================================================================
+ * Machine-Readable Output (--format=tsv|json|binary)
+ *
+ * Rows go through one OUT_BUF buffer flushed with write(2) and numbers are
+ * formatted by hand, so dumping millions of rows costs little more than
+ * copying them. Words are written unescaped (under --utf8 they are valid
+ * UTF-8, which JSON takes as is). The run summary goes to stderr instead
+ * of stdout.
+ *
+ *   tsv     word TAB count, one row per line
+ *   json    {"file_size":..,"total":..,"unique":..,"time_ms":..,
+ *            "words":[["word",count],...]}
+ *   binary  "WCROWS1\0", u64 rows, u64 total, then per row a u8 length,
+ *           the word and a u64 count; host byte order
+ *===========================================================================*/
+
+typedef enum { FORMAT_TEXT, FORMAT_TSV, FORMAT_JSON, FORMAT_BINARY } Format;
+
+#define OUT_BUF (1 << 20)
+#define ROWS_MAGIC "WCROWS1\0"
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap; /* at least OUT_BUF */
+    int fd;     /* -1: collect in memory, growing buf (--serve) */
+    int err;
+} Writer;
+
+static void out_flush(Writer *w)
+{
+    if (w->fd < 0) {
+        char *grown = realloc(w->buf, w->cap * 2);
+        if (!grown) {
+            perror("realloc");
+            exit(1);
+        }
+        w->buf = grown;
+        w->cap *= 2;
+        return;
+    }
+
+    size_t off = 0;
+    while (off < w->len && !w->err) {
+        ssize_t n = write(w->fd, w->buf + off, w->len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            w->err = 1;
+        else
+            off += (size_t)n;
+    }
+    w->len = 0;
+}
+
+/* n must be at most OUT_BUF */
+static inline void out_bytes(Writer *w, const void *p, size_t n)
+{
+    if (w->cap - w->len < n)
+        out_flush(w);
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+}
+
+static inline void out_str(Writer *w, const char *s)
+{
+    out_bytes(w, s, strlen(s));
+}
+
+static inline void out_u64(Writer *w, uint64_t v)
+{
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    do {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    out_bytes(w, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+static void format_rows(Writer *w,
+                        Format fmt,
+                        const Entry *rows,
+                        size_t n,
+                        size_t unique,
+                        size_t total,
+                        size_t file_size,
+                        double ms)
+{
+    if (fmt == FORMAT_JSON) {
+        char ms_buf[32];
+        (void)snprintf(ms_buf, sizeof(ms_buf), "%.3f", ms);
+        out_str(w, "{\"file_size\":");
+        out_u64(w, file_size);
+        out_str(w, ",\"total\":");
+        out_u64(w, total);
+        out_str(w, ",\"unique\":");
+        out_u64(w, unique);
+        out_str(w, ",\"time_ms\":");
+        out_str(w, ms_buf);
+        out_str(w, ",\"words\":[");
+    } else if (fmt == FORMAT_BINARY) {
+        uint64_t hdr[2] = { n, total };
+        out_bytes(w, ROWS_MAGIC, 8);
+        out_bytes(w, hdr, sizeof(hdr));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        const Entry *e = &rows[i];
+        switch (fmt) {
+            case FORMAT_TSV:
+                out_bytes(w, entry_word(e), e->len);
+                out_bytes(w, "\t", 1);
+                out_u64(w, e->count);
+                out_bytes(w, "\n", 1);
+                break;
+            case FORMAT_JSON:
+                out_str(w, i ? ",[\"" : "[\"");
+                out_bytes(w, entry_word(e), e->len);
+                out_bytes(w, "\",", 2);
+                out_u64(w, e->count);
+                out_bytes(w, "]", 1);
+                break;
+            default: {
+                uint8_t len = (uint8_t)e->len;
+                uint64_t count = e->count;
+                out_bytes(w, &len, 1);
+                out_bytes(w, entry_word(e), e->len);
+                out_bytes(w, &count, sizeof(count));
+                break;
+            }
+        }
+    }
+    if (fmt == FORMAT_JSON)
+        out_str(w, "]}\n");
+}
+
+static int write_rows(Format fmt,
+                      const Entry *rows,
+                      size_t n,
+                      size_t unique,
+                      size_t total,
+                      size_t file_size,
+                      double ms)
+{
+    Writer w = {
+        .buf = malloc(OUT_BUF),
+        .cap = OUT_BUF,
+        .fd = STDOUT_FILENO,
+    };
+    if (!w.buf) {
+        perror("malloc");
+        exit(1);
+    }
+    (void)fflush(stdout);
+
+    format_rows(&w, fmt, rows, n, unique, total, file_size, ms);
+    out_flush(&w);
+    free(w.buf);
+
+    if (w.err) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+/*===========================================================================
+ * Approximate Merge (--approx)
+ *
+ * Takes the place of merge_tables(). Worker t adds the t-th slice of every
+ * Count-Min sketch into sketches[0], so the counters are summed in
+ * parallel with no overlap. The main thread then takes the maxima of the
+ * registers, and gathers the candidates of all workers, deduplicated, with
+ * their estimates from the summed sketch.
+ *===========================================================================*/
+
+static void *approx_merge_worker(void *arg)
+{
+    const MergeUnit *m = arg;
+    Sketch *dst = &sketches[0];
+    size_t n = APPROX_DEPTH * dst->width;
+    size_t lo = n * (size_t)m->id / (size_t)nthreads;
+    size_t hi = n * ((size_t)m->id + 1) / (size_t)nthreads;
+
+    pin_thread(m->id);
+    for (int t = 1; t < nthreads; t++) {
+        const uint64_t *src = sketches[t].cm;
+        for (size_t i = lo; i < hi; i++)
+            dst->cm[i] += src[i];
+    }
+    return NULL;
+}
+
+/*
+ * The top_k rows by merged estimate, ordered as select_top() orders them.
+ * Long words point into the sketches, which live until the end of main.
+ */
+static Entry *
+approx_merge(size_t *out_n, size_t *out_unique, size_t *out_total)
+{
+    for (int t = 0; t < nthreads; t++) {
+        if (!sketches[t].cm)
+            sketch_init(&sketches[t]); /* worker never started */
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        merge_units[i].id = i;
+        (void)pthread_create(&threads[i],
+                             NULL,
+                             approx_merge_worker,
+                             &merge_units[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+        (void)pthread_join(threads[i], NULL);
+
+    Sketch *s = &sketches[0];
+    size_t total = 0;
+    size_t ncand = 0;
+    for (int t = 0; t < nthreads; t++) {
+        for (size_t r = 0; t > 0 && r < APPROX_HLL_REGS; r++) {
+            if (sketches[t].hll[r] > s->hll[r])
+                s->hll[r] = sketches[t].hll[r];
+        }
+        total += tables[t].total;
+        ncand += sketches[t].ncand;
+    }
+
+    /* Open addressing by kernel hash drops the duplicates */
+    size_t cap = next_pow2(ncand * 2 + 1);
+    Entry *all = calloc(cap, sizeof(Entry));
+    size_t k = top_k < ncand ? top_k : ncand;
+    Entry *rows = malloc((k ? k : 1) * sizeof(Entry));
+    if (!all || !rows) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        for (size_t c = 0; c < sketches[t].ncand; c++)
+            (void)slice_add(all, cap - 1, &sketches[t].cand[c]);
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < cap; i++) {
+        Entry *e = &all[i];
+        if (!e->len)
+            continue;
+        e->count = cm_query(s, approx_hash(e));
+        topk_offer(rows, &n, k, e);
+    }
+    free(all);
+    qsort(rows,
+          n,
+          sizeof(Entry),
+          sort_order == SORT_WORD ? cmp_word : cmp_count_desc);
+
+    *out_n = n;
+    *out_unique = (size_t)(hll_estimate(s->hll) + 0.5);
+    *out_total = total;
+    return rows;
+}
+
+/* Error bounds of the last approx_merge() over total words */
+static void print_approx(FILE *f, size_t total)
+{
+    double eps = M_E / (double)sketches[0].width;
+
+    (void)fprintf(f,
+                  "Approximate:     counts are high by at most %.0f words "
+                  "(p = %.3f),\n"
+                  "                 unique words within %.2f%% (1 sigma); "
+                  "%zu KB per thread\n",
+                  ceil(eps * (double)total),
+                  1.0 - exp(-(double)APPROX_DEPTH),
+                  104.0 / sqrt((double)APPROX_HLL_REGS),
+                  (APPROX_DEPTH * sketches[0].width * sizeof(uint64_t) +
+                   APPROX_HLL_REGS) >>
+                          10);
+}
+
+/* Share of the input added from block caches (--dedup) */
+static void print_dedup(FILE *f)
+{
+    size_t blocks = 0, bytes = 0, hits = 0, hit_bytes = 0;
+
+    for (int i = 0; i < nthreads; i++) {
+        blocks += dedups[i].blocks;
+        bytes += dedups[i].bytes;
+        hits += dedups[i].hits;
+        hit_bytes += dedups[i].hit_bytes;
+    }
+    (void)fprintf(f,
+                  "Dedup:           %.1f%% of bytes from cache (%zu of %zu "
+                  "blocks)\n",
+                  bytes ? 100.0 * (double)hit_bytes / (double)bytes : 0.0,
+                  hits,
+                  blocks);
+}
+
+/*===========================================================================
+ * Run Statistics (--stats)
+ *
+ * Phase marks taken on the main thread between the setup, scan, merge,
+ * select and output phases, plus the per-worker figures in units[] and
+ * tables[]. The hardware counters are opened once for the whole process
+ * with inherit set, so worker threads count too: a thread's counts are
+ * folded in when it exits, and every phase joins its threads before the
+ * next mark is taken. Counters are user space only, which is what an
+ * unprivileged perf_event_paranoid allows; where perf_event_open fails
+ * (containers, VMs without a PMU) the columns are left out.
+ *===========================================================================*/
+
+enum { PHASE_SETUP, PHASE_SCAN, PHASE_MERGE, PHASE_SELECT, PHASE_OUTPUT,
+       NUM_PHASES };
+
+static const char *const phase_names[NUM_PHASES] = {
+    "setup", "scan", "merge", "select", "output",
+};
+
+#define NUM_COUNTERS 3
+
+static const struct {
+    uint64_t config;
+    const char *name;
+} counters[NUM_COUNTERS] = {
+    { PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_COUNT_HW_INSTRUCTIONS, "instr" },
+    { PERF_COUNT_HW_CACHE_MISSES, "llc-miss" },
+};
+
+typedef struct {
+    struct timespec ts;
+    uint64_t ctr[NUM_COUNTERS];
+} Mark;
+
+static int stats_enabled = 0;
+static int counter_fds[NUM_COUNTERS] = { -1, -1, -1 };
+static Mark marks[NUM_PHASES + 1];
+
+/* Returns 0 if every counter opened; otherwise none are used */
+static int counters_open(void)
+{
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = counters[i].config;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fds[i] = (int)syscall(SYS_perf_event_open,
+                                      &attr,
+                                      0,
+                                      -1,
+                                      -1,
+                                      PERF_FLAG_FD_CLOEXEC);
+        if (counter_fds[i] < 0) {
+            for (int j = 0; j <= i; j++) {
+                if (counter_fds[j] >= 0)
+                    (void)close(counter_fds[j]);
+                counter_fds[j] = -1;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void counters_close(void)
+{
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (counter_fds[i] >= 0)
+            (void)close(counter_fds[i]);
+        counter_fds[i] = -1;
+    }
+}
+
+/* Record the end of phase (or the start, for 0) */
+static void mark_phase(int phase)
+{
+    Mark *m = &marks[phase];
+    (void)clock_gettime(CLOCK_MONOTONIC, &m->ts);
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        uint64_t v = 0;
+        if (counter_fds[i] >= 0 &&
+            read(counter_fds[i], &v, sizeof(v)) != (ssize_t)sizeof(v))
+            v = 0;
+        m->ctr[i] = v;
+    }
+}
+
+/* The bracketed choice in a sysfs THP setting, e.g. "madvise" */
+static void thp_setting(const char *path, char *out, size_t n)
+{
+    char buf[128];
+    FILE *f = fopen(path, "r");
+
+    (void)snprintf(out, n, "unknown");
+    if (!f)
+        return;
+    if (fgets(buf, sizeof(buf), f)) {
+        char *a = strchr(buf, '[');
+        char *b = a ? strchr(a, ']') : NULL;
+        if (b) {
+            *b = '\0';
+            (void)snprintf(out, n, "%s", a + 1);
+        }
+    }
+    (void)fclose(f);
+}
+
+static void print_huge(FILE *f)
+{
+    static const char *const mode_names[] = { "thp", "hugetlb", "1g", "off" };
+    char thp[32];
+    HugeCoverage c;
+
+    thp_setting("/sys/kernel/mm/transparent_hugepage/enabled",
+                thp,
+                sizeof(thp));
+    (void)fprintf(f,
+                  "\n=== Huge pages ===\n"
+                  "mode %s, THP %s\n"
+                  "mapped: %zu THP (%zu MB), %zu hugetlb 2M (%zu MB), "
+                  "%zu hugetlb 1G (%zu MB), %zu fallbacks\n",
+                  mode_names[huge_mode],
+                  thp,
+                  huge_mapped[REGION_THP],
+                  huge_mapped_mb[REGION_THP],
+                  huge_mapped[REGION_TLB_2M],
+                  huge_mapped_mb[REGION_TLB_2M],
+                  huge_mapped[REGION_TLB_1G],
+                  huge_mapped_mb[REGION_TLB_1G],
+                  huge_fallbacks);
+    if (huge_fallbacks)
+        (void)fprintf(f, "first MAP_HUGETLB error: %s\n", strerror(huge_errno));
+    if (huge_coverage(&c) < 0) {
+        (void)fprintf(f, "(/proc/self/smaps unavailable)\n");
+        return;
+    }
+    (void)fprintf(f,
+                  "live: %zu regions, %.1f of %.1f MB resident on huge "
+                  "pages (%.1f%%)\n"
+                  "input: %.1f MB of file mappings on huge pages\n",
+                  huge_nregions,
+                  (double)c.huge_kb / 1024.0,
+                  (double)c.rss_kb / 1024.0,
+                  c.rss_kb ? 100.0 * (double)c.huge_kb / (double)c.rss_kb
+                           : 0.0,
+                  (double)c.file_pmd_kb / 1024.0);
+}
+
+static void print_stats(FILE *f)
+{
+    int have_ctr = counter_fds[0] >= 0;
+
+    (void)fprintf(f, "\n=== Phases ===\n%-8s %10s", "phase", "ms");
+    for (int i = 0; have_ctr && i < NUM_COUNTERS; i++)
+        (void)fprintf(f, " %14s", counters[i].name);
+    (void)fprintf(f, have_ctr ? " %6s\n" : "\n", "IPC");
+    for (int p = 0; p < NUM_PHASES; p++) {
+        const Mark *a = &marks[p];
+        const Mark *b = &marks[p + 1];
+        (void)fprintf(f,
+                      "%-8s %10.2f",
+                      phase_names[p],
+                      ms_between(&a->ts, &b->ts));
+        if (!have_ctr) {
+            (void)fprintf(f, "\n");
+            continue;
+        }
+        uint64_t d[NUM_COUNTERS];
+        for (int i = 0; i < NUM_COUNTERS; i++) {
+            d[i] = b->ctr[i] - a->ctr[i];
+            (void)fprintf(f, " %14" PRIu64, d[i]);
+        }
+        (void)fprintf(f, " %6.2f\n", d[0] ? (double)d[1] / (double)d[0] : 0.0);
+    }
+    if (!have_ctr)
+        (void)fprintf(f, "(hardware counters unavailable)\n");
+
+    (void)fprintf(f,
+                  "\n=== Threads ===\n"
+                  "%3s %9s %9s %9s %11s %9s %6s %6s %7s %5s %5s %5s\n",
+                  "id", "wall ms", "busy ms", "MB", "words", "unique",
+                  "chunks", "steals", "probes", "grows", "pool", "load");
+    for (int i = 0; i < nthreads; i++) {
+        const WorkUnit *u = &units[i];
+        const Table *t = &tables[i];
+        double probes = t->total
+                                ? 1.0 + (double)t->extra_probes /
+                                                (double)t->total
+                                : 0.0;
+        (void)fprintf(f,
+                      "%3d %9.2f %9.2f %9.2f %11zu %9zu %6zu %6zu %7.3f "
+                      "%5u %5u %5.2f\n",
+                      i,
+                      u->wall_ms,
+                      u->busy_ms,
+                      (double)u->bytes / (1024.0 * 1024.0),
+                      t->total,
+                      t->len,
+                      u->chunks,
+                      u->steals,
+                      probes,
+                      t->grows,
+                      t->pool_blocks,
+                      t->cap ? (double)t->len / (double)t->cap : 0.0);
+    }
+    if (vocab_fit.words_per_byte > 0 && units[0].table_unique)
+        (void)fprintf(f,
+                      "Sampled vocabulary: beta %.2f (falling %.2f per "
+                      "doubling), tables sized for %zu unique each\n",
+                      vocab_fit.beta,
+                      vocab_fit.decay,
+                      units[0].table_unique);
+
+    if (shards) {
+        size_t len = 0;
+        size_t cap = 0;
+        unsigned grows = 0;
+        for (int s = 0; s < SHARED_SHARDS; s++) {
+            len += shards[s].table.len;
+            cap += shards[s].table.cap;
+            grows += shards[s].table.grows;
+        }
+        (void)fprintf(f,
+                      "\n=== Shared table ===\n"
+                      "%d shards, %zu unique, load %.2f, %u grows\n",
+                      SHARED_SHARDS,
+                      len,
+                      (double)len / (double)cap,
+                      grows);
+    }
+
+    if (dedup_budget) {
+        size_t blocks = 0, bytes = 0, hits = 0, stored = 0, resets = 0;
+        size_t collisions = 0, used = 0, size = 0;
+        for (int i = 0; i < nthreads; i++) {
+            const Dedup *d = &dedups[i];
+            blocks += d->blocks;
+            bytes += d->bytes;
+            hits += d->hits;
+            stored += d->stored;
+            resets += d->resets;
+            collisions += d->collisions;
+            used += d->used * sizeof(DedupSlot) + d->arena_used;
+            size += d->nslots * sizeof(DedupSlot) + d->arena_size;
+        }
+        (void)fprintf(f,
+                      "\n=== Dedup ===\n"
+                      "%zu blocks, %.1f KB average; %zu hits (%.1f%%), "
+                      "%zu stored, %zu resets, %zu collisions\n"
+                      "cache: %.1f of %.1f MB in use\n",
+                      blocks,
+                      blocks ? (double)bytes / (double)blocks / 1024.0 : 0.0,
+                      hits,
+                      blocks ? 100.0 * (double)hits / (double)blocks : 0.0,
+                      stored,
+                      resets,
+                      collisions,
+                      (double)used / (1024.0 * 1024.0),
+                      (double)size / (1024.0 * 1024.0));
+    }
+
+    print_huge(f);
+
+    /* ru_maxrss is in KB on Linux */
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        (void)fprintf(f,
+                      "\nPeak RSS: %.1f MB\n",
+                      (double)ru.ru_maxrss / 1024.0);
+}
+
+/*===========================================================================
+ * Library API (wordcount_hyperopt.h, built with -DWORDCOUNT_LIB)
+ *
+ * Also compiled into the CLI, where it backs --serve. The CLI's per-run
+ * globals (tables[], the chunk scheduler, the merge units) are not used
+ * here; a wc_ctx carries its own copies of what the API needs. Tables,
+ * kernels and the top-K heap are shared code: they only touch the Table
+ * they are given, and the kernel is picked once per process. Feeds under
+ * LIB_SPLIT_MIN bytes run on the caller; larger ones are cut at letter
+ * boundaries and run by the context's pool with the caller as worker 0.
+ * Results are gathered into one open-addressing array the first time they
+ * are asked for after a change, or read in place when a single table
+ * holds them all.
+ *===========================================================================*/
+
+#ifndef LIB_SPLIT_MIN
+#define LIB_SPLIT_MIN (256 << 10)
+#endif
+
+typedef struct {
+    struct wc_ctx *ctx;
+    int id;
+} LibWorker;
+
+struct wc_ctx {
+    Table tables[MAX_THREADS];
+    int nthreads;
+    size_t min_cap; /* smallest table wc_reset() shrinks to */
+
+    /* Worker pool, started by the first feed that is split */
+    pthread_t threads[MAX_THREADS];
+    LibWorker workers[MAX_THREADS];
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    int pool_up;
+    int quit;
+    const char *piece[MAX_THREADS];
+    size_t piece_len[MAX_THREADS];
+
+    /* Letters of the word left open by the last feed */
+    char carry[MAX_WORD];
+    size_t carry_len;
+
+    /* Entries taken over by wc_merge; long words live in tables[0]'s pool */
+    Entry *imported;
+    size_t imported_len;
+    size_t imported_cap;
+    uint64_t imported_total;
+
+    /* Gathered results, rebuilt when dirty */
+    Entry *result;
+    size_t result_cap;
+    int result_borrowed; /* result is the only non-empty table's array */
+    size_t unique;
+    uint64_t total;
+    Entry *top;
+    int dirty;
+};
+
+static void *lib_worker(void *arg)
+{
+    const LibWorker *w = arg;
+    wc_ctx *c = w->ctx;
+
+    pin_thread(w->id); /* no-op unless --serve set up a CPU list */
+    for (;;) {
+        (void)pthread_barrier_wait(&c->start);
+        if (c->quit)
+            break;
+        process_chunk(&c->tables[w->id],
+                      c->piece[w->id],
+                      c->piece_len[w->id],
+                      0);
+        (void)pthread_barrier_wait(&c->done);
+    }
+    return NULL;
+}
+
+static void lib_pool_start(wc_ctx *c)
+{
+    (void)pthread_barrier_init(&c->start, NULL, (unsigned)c->nthreads);
+    (void)pthread_barrier_init(&c->done, NULL, (unsigned)c->nthreads);
+    for (int i = 1; i < c->nthreads; i++) {
+        c->workers[i].ctx = c;
+        c->workers[i].id = i;
+        if (pthread_create(&c->threads[i], NULL, lib_worker, &c->workers[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    c->pool_up = 1;
+}
+
+/* Count data, which ends at a word boundary */
+static void lib_run(wc_ctx *c, const char *data, size_t n)
+{
+    int nt = c->nthreads;
+
+    if (n < LIB_SPLIT_MIN || nt == 1) {
+        process_chunk(&c->tables[0], data, n, 0);
+        return;
+    }
+    if (!c->pool_up)
+        lib_pool_start(c);
+
+    size_t prev = 0;
+    for (int i = 0; i < nt; i++) {
+        size_t cut = n;
+        if (i < nt - 1) {
+            cut = n / (size_t)nt * (size_t)(i + 1);
+            if (cut < prev)
+                cut = prev;
+            cut = word_end(data, n, cut);
+        }
+        c->piece[i] = data + prev;
+        c->piece_len[i] = cut - prev;
+        prev = cut;
+    }
+
+    (void)pthread_barrier_wait(&c->start);
+    process_chunk(&c->tables[0], c->piece[0], c->piece_len[0], 0);
+    (void)pthread_barrier_wait(&c->done);
+}
+
+/* End the open word, if any */
+static void lib_flush(wc_ctx *c)
+{
+    if (c->carry_len) {
+        process_chunk(&c->tables[0], c->carry, c->carry_len, 0);
+        c->carry_len = 0;
+    }
+}
+
+static void lib_add(Entry *res, size_t mask, size_t *len, const Entry *e)
+{
+    size_t idx = e->hash & mask;
+    while (res[idx].len) {
+        if (entry_same(&res[idx], e)) {
+            res[idx].count += e->count;
+            return;
+        }
+        idx = (idx + 1) & mask;
+    }
+    res[idx] = *e;
+    (*len)++;
+}
+
+static void lib_collect(wc_ctx *c)
+{
+    lib_flush(c);
+    if (!c->dirty)
+        return;
+
+    size_t n = c->imported_len;
+    uint64_t total = c->imported_total;
+    int filled = 0;
+    const Table *only = NULL;
+    for (int i = 0; i < c->nthreads; i++) {
+        table_settle(&c->tables[i]);
+        n += c->tables[i].len;
+        total += c->tables[i].total;
+        if (c->tables[i].len) {
+            filled++;
+            only = &c->tables[i];
+        }
+    }
+
+    if (!c->result_borrowed)
+        free(c->result);
+    c->result_borrowed = 0;
+
+    /* One table holds every word (small feeds): read it in place */
+    if (filled <= 1 && c->imported_len == 0) {
+        if (!only)
+            only = &c->tables[0];
+        c->result = only->entries;
+        c->result_cap = only->cap;
+        c->result_borrowed = 1;
+        c->unique = only->len;
+        c->total = total;
+        c->dirty = 0;
+        return;
+    }
+
+    size_t cap = next_pow2(n * 2);
+    if (cap < 16)
+        cap = 16;
+    c->result = calloc(cap, sizeof(Entry));
+    if (!c->result) {
+        perror("calloc");
+        exit(1);
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < c->nthreads; i++) {
+        const Table *t = &c->tables[i];
+        for (size_t j = 0; j < t->cap; j++) {
+            if (t->entries[j].len)
+                lib_add(c->result, cap - 1, &len, &t->entries[j]);
+        }
+    }
+    for (size_t j = 0; j < c->imported_len; j++)
+        lib_add(c->result, cap - 1, &len, &c->imported[j]);
+
+    c->result_cap = cap;
+    c->unique = len;
+    c->total = total;
+    c->dirty = 0;
+}
+
+/* wc_open() with tables of at least min_cap slots */
+static wc_ctx *lib_open(const wc_options *opt, size_t min_cap)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    wc_options o = { 0 };
+    if (opt)
+        o = *opt;
+
+    (void)pthread_once(&once, select_kernel);
+
+    int n = o.threads > 0 ? o.threads : default_threads();
+    if (n > MAX_THREADS)
+        n = MAX_THREADS;
+
+    wc_ctx *c = aligned_alloc(CACHELINE, sizeof(*c));
+    if (!c)
+        return NULL;
+    memset(c, 0, sizeof(*c));
+
+    TableKind kind = o.table == WC_TABLE_SWISS ? TABLE_SWISS : TABLE_LINEAR;
+    ResizeMode resize = o.incremental ? RESIZE_INCREMENTAL : RESIZE_FULL;
+    c->min_cap = min_cap;
+    for (int i = 0; i < n; i++) {
+        c->nthreads = i + 1;
+        size_t share = o.size_hint / (size_t)n;
+        if (table_create(&c->tables[i],
+                         i,
+                         share / 50, /* table_init()'s unique estimate */
+                         min_cap,
+                         kind,
+                         resize) < 0) {
+            wc_close(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+wc_ctx *wc_open(const wc_options *opt)
+{
+    return lib_open(opt, INITIAL_CAP);
+}
+
+void wc_close(wc_ctx *c)
+{
+    if (!c)
+        return;
+    if (c->pool_up) {
+        c->quit = 1;
+        (void)pthread_barrier_wait(&c->start);
+        for (int i = 1; i < c->nthreads; i++)
+            (void)pthread_join(c->threads[i], NULL);
+        (void)pthread_barrier_destroy(&c->start);
+        (void)pthread_barrier_destroy(&c->done);
+    }
+    for (int i = 0; i < c->nthreads; i++)
+        table_free(&c->tables[i]);
+    free(c->imported);
+    if (!c->result_borrowed)
+        free(c->result);
+    free(c->top);
+    free(c);
+}
+
+void wc_reset(wc_ctx *c)
+{
+    if (!c)
+        return;
+    for (int i = 0; i < c->nthreads; i++) {
+        Table *t = &c->tables[i];
+        table_settle(t);
+        if (t->cap > c->min_cap && t->len * 8 < t->cap) {
+            /* Grown for a much larger text: clearing it would cost more
+             * than counting the next one, so start from a fitting size */
+            TableKind kind = t->ctrl ? TABLE_SWISS : TABLE_LINEAR;
+            ResizeMode resize = t->incremental ? RESIZE_INCREMENTAL
+                                               : RESIZE_FULL;
+            size_t len = t->len;
+            table_free(t);
+            if (table_create(t, i, len, c->min_cap, kind, resize) < 0)
+                exit(1);
+            continue;
+        }
+        table_clear(t);
+        t->total = 0;
+    }
+    c->carry_len = 0;
+    c->imported_len = 0;
+    c->imported_total = 0;
+    c->dirty = 1;
+}
+
+int wc_feed(wc_ctx *c, const char *buf, size_t len)
+{
+    if (!c || (!buf && len))
+        return -1;
+    if (len == 0)
+        return 0;
+    c->dirty = 1;
+
+    /* Finish the word the previous feed left open */
+    if (c->carry_len) {
+        size_t run = word_end(buf, len, 0);
+        size_t take = MAX_WORD - 1 - c->carry_len;
+        if (take > run)
+            take = run;
+        memcpy(c->carry + c->carry_len, buf, take);
+        c->carry_len += take;
+        if (run == len)
+            return 0;
+        lib_flush(c);
+        buf += run;
+        len -= run;
+    }
+
+    /* Keep the word open at the end (its first MAX_WORD - 1 letters) */
+    size_t cut = word_start(buf, len);
+    size_t tail = len - cut;
+    if (tail > MAX_WORD - 1)
+        tail = MAX_WORD - 1;
+    memcpy(c->carry, buf + cut, tail);
+    c->carry_len = tail;
+
+    if (cut)
+        lib_run(c, buf, cut);
+    return 0;
+}
+
+int wc_merge(wc_ctx *dst, wc_ctx *src)
+{
+    if (!dst || !src || dst == src)
+        return -1;
+    lib_collect(src);
+
+    if (dst->imported_cap - dst->imported_len < src->unique) {
+        size_t cap = dst->imported_cap ? dst->imported_cap : 1024;
+        while (cap - dst->imported_len < src->unique)
+            cap *= 2;
+        Entry *grown = realloc(dst->imported, cap * sizeof(Entry));
+        if (!grown) {
+            perror("realloc");
+            exit(1);
+        }
+        dst->imported = grown;
+        dst->imported_cap = cap;
+    }
+
+    for (size_t i = 0; i < src->result_cap; i++) {
+        Entry e = src->result[i];
+        if (!e.len)
+            continue;
+        if (e.len > ENTRY_INLINE) {
+            char *s = pool_alloc(&dst->tables[0], e.len);
+            memcpy(s, e.key.ptr, e.len);
+            s[e.len] = '\0';
+            e.key.ptr = s;
+        }
+        dst->imported[dst->imported_len++] = e;
+    }
+    dst->imported_total += src->total;
+    dst->dirty = 1;
+    return 0;
+}
+
+uint64_t wc_total(wc_ctx *c)
+{
+    lib_collect(c);
+    return c->total;
+}
+
+size_t wc_unique(wc_ctx *c)
+{
+    lib_collect(c);
+    return c->unique;
+}
+
+/* The k best entries, best first, in c->top; returns how many */
+static size_t lib_top(wc_ctx *c, size_t k)
+{
+    lib_collect(c);
+    if (k > c->unique)
+        k = c->unique;
+    if (k == 0)
+        return 0;
+
+    free(c->top);
+    c->top = malloc(k * sizeof(Entry));
+    if (!c->top) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < c->result_cap; i++) {
+        if (c->result[i].len)
+            topk_offer(c->top, &n, k, &c->result[i]);
+    }
+    qsort(c->top, n, sizeof(Entry), cmp_count_desc);
+    return n;
+}
+
+size_t wc_topk(wc_ctx *c, size_t k, wc_word *out)
+{
+    size_t n = lib_top(c, k);
+
+    for (size_t i = 0; i < n; i++) {
+        out[i].word = entry_word(&c->top[i]);
+        out[i].len = c->top[i].len;
+        out[i].count = c->top[i].count;
+    }
+    return n;
+}
+
+void wc_iter_init(wc_iter *it, wc_ctx *c)
+{
+    lib_collect(c);
+    it->ctx = c;
+    it->pos = 0;
+}
+
+int wc_iter_next(wc_iter *it, wc_word *out)
+{
+    const wc_ctx *c = it->ctx;
+    while (it->pos < c->result_cap) {
+        const Entry *e = &c->result[it->pos++];
+        if (e->len) {
+            out->word = entry_word(e);
+            out->len = e->len;
+            out->count = e->count;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifndef WORDCOUNT_LIB
+
+/*===========================================================================
+ * Server Mode (--serve)
+ *
+ * One process answers many small requests from a warm wc_ctx. The kernel,
+ * the CPU pinning, the tables and the worker pool are set up once, so a
+ * request pays only for counting. Texts under LIB_SPLIT_MIN bytes are
+ * counted on the main thread and larger ones are split over the pinned
+ * pool. wc_reset() clears the tables between requests without freeing
+ * them; they start at SERVE_MIN_CAP slots and keep the size of the
+ * largest text seen.
+ *
+ * --serve=PATH listens on a Unix stream socket and answers requests from
+ * up to SERVE_MAX_CLIENTS connections, one request at a time. Client
+ * sockets are non-blocking: a request whose text is still arriving waits
+ * in its connection's buffer, and unsent replies wait in its output queue
+ * until poll() reports room, so a slow or stalled peer only stalls
+ * itself. A connection is not read while a reply to it is queued, which
+ * bounds its queue. --serve=- reads requests from stdin and answers on
+ * stdout, blocking. Both use one framing:
+ *
+ *   COUNT <bytes> [<k>]\n<bytes of text>   ->  OK <n>\n<n bytes of rows>
+ *   STATS\n                                ->  OK <n>\n<n bytes of text>
+ *   anything else                          ->  ERR <reason>\n, then close
+ *
+ * Rows follow --format (text becomes tsv) and --sort; k replaces --top
+ * for one request, and 0 asks for every word. A request's latency runs
+ * from the end of its text to its reply being written. The last
+ * SERVE_SAMPLES latencies are kept, and STATS, and the summary printed on
+ * SIGINT/SIGTERM, report their p50, p99 and maximum.
+ *===========================================================================*/
+
+#ifndef SERVE_MIN_CAP
+#define SERVE_MIN_CAP 4096
+#endif
+#ifndef SERVE_SAMPLES
+#define SERVE_SAMPLES 8192
+#endif
+#define SERVE_MAX_CLIENTS 64
+#define SERVE_MAX_TEXT ((size_t)1 << 30)
+#define SERVE_LINE 64 /* longest request line */
+
+typedef struct {
+    int in;
+    int out;
+    char *buf; /* request line and text being read */
+    size_t len;
+    size_t cap;
+    size_t need; /* line + text bytes of the COUNT at buf; 0 = no line yet */
+    size_t line; /* its line bytes */
+    size_t k;    /* and its k */
+    char *obuf;  /* replies not yet written */
+    size_t olen;
+    size_t osent;
+    size_t ocap;
+    int closing; /* close once the queued replies are written */
+} Conn;
+
+typedef struct {
+    wc_ctx *ctx;
+    Format fmt;
+    Writer w;
+    double lat_us[SERVE_SAMPLES]; /* ring of the latest latencies */
+    uint64_t requests;
+    uint64_t bytes;
+} Server;
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+/* Append n bytes to c's output queue */
+static void conn_queue(Conn *c, const char *p, size_t n)
+{
+    if (c->ocap - c->olen < n) {
+        size_t cap = next_pow2(c->olen + n);
+        char *grown = realloc(c->obuf, cap);
+        if (!grown) {
+            perror("realloc");
+            exit(1);
+        }
+        c->obuf = grown;
+        c->ocap = cap;
+    }
+    memcpy(c->obuf + c->olen, p, n);
+    c->olen += n;
+}
+
+/* Write what the output queue holds, as much as the socket takes now;
+ * -1 on error */
+static int conn_flush(Conn *c)
+{
+    while (c->osent < c->olen) {
+        ssize_t k = write(c->out, c->obuf + c->osent, c->olen - c->osent);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (k <= 0)
+            return -1;
+        c->osent += (size_t)k;
+    }
+    c->olen = 0;
+    c->osent = 0;
+    return 0;
+}
+
+static int serve_reply(Conn *c, const char *body, size_t n)
+{
+    char hdr[32];
+    int h = snprintf(hdr, sizeof(hdr), "OK %zu\n", n);
+    conn_queue(c, hdr, (size_t)h);
+    conn_queue(c, body, n);
+    return conn_flush(c);
+}
+
+/* Queue ERR and close the connection once it is written */
+static int serve_error(Conn *c, const char *why)
+{
+    char line[SERVE_LINE];
+    int n = snprintf(line, sizeof(line), "ERR %s\n", why);
+    conn_queue(c, line, (size_t)n);
+    c->closing = 1;
+    return -1;
+}
+
+/* Read at least one more byte, making room for want; 0 at EOF, -1 error */
+static ssize_t conn_fill(Conn *c, size_t want)
+{
+    if (c->cap - c->len < want) {
+        size_t cap = next_pow2(c->len + want);
+        char *grown = realloc(c->buf, cap);
+        if (!grown) {
+            perror("realloc");
+            exit(1);
         }
+        c->buf = grown;
+        c->cap = cap;
     }
-
-    /* Flush remaining word */
-    if (word_len > 0) {
-        word[word_len] = '\0';
-#ifdef __SSE4_2__
-        uint32_t h = crc32c_finalize(crc);
-        uint16_t fp = (uint16_t)(h ^ (h >> 16));
-        table_insert(t, word, word_len, h, fp);
-#else
-        uint32_t h = hash_word(word, word_len);
-        uint16_t fp = (uint16_t)(h ^ (h >> 16));
-        table_insert(t, word, word_len, h, fp);
-#endif
+    for (;;) {
+        ssize_t n = read(c->in, c->buf + c->len, c->cap - c->len);
+        if (n < 0 && errno == EINTR && !serve_stop)
+            continue;
+        if (n > 0)
+            c->len += (size_t)n;
+        return n;
     }
 }
-#endif /* !__AVX512BW__ */
 
-/*===========================================================================
- * AVX-512 Tokenizer
- *===========================================================================*/
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
 
-#ifdef __AVX512BW__
-static void
-process_avx512(Table *t, const char *data, size_t size, int drop_leading)
-{
-    char word[MAX_WORD];
-    size_t word_len = 0;
-    size_t i = 0;
-    int prev_tail_letter = 0;
-#ifdef __SSE4_2__
-    uint64_t crc = 0;
-#endif
-
-    const size_t simd_end = size - (size % 64);
-
-    for (; i < simd_end; i += 64) {
-        __m512i chunk = _mm512_loadu_si512((const __m512i *)(data + i));
-
-        /* Build letter mask */
-        __mmask64 ascii =
-                _mm512_cmplt_epu8_mask(chunk, _mm512_set1_epi8((char)0x80));
-        __m512i up = _mm512_sub_epi8(chunk, _mm512_set1_epi8('A'));
-        __m512i lo = _mm512_sub_epi8(chunk, _mm512_set1_epi8('a'));
-        __mmask64 m_up = _mm512_cmplt_epu8_mask(up, _mm512_set1_epi8(26));
-        __mmask64 m_lo = _mm512_cmplt_epu8_mask(lo, _mm512_set1_epi8(26));
-        uint64_t letters = (uint64_t)((m_up | m_lo) & ascii);
-
-        /* Handle word boundary from previous chunk */
-        if (prev_tail_letter && !(letters & 1ULL)) {
-            if (word_len > 0) {
-                word[word_len] = '\0';
-#ifdef __SSE4_2__
-                uint32_t h = crc32c_finalize(crc);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
-                crc = 0;
-#else
-                uint32_t h = hash_word(word, word_len);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
-#endif
-                word_len = 0;
-            }
-            prev_tail_letter = 0;
-        }
+/* Request totals and latency percentiles over the kept samples */
+static int serve_report(const Server *s, char *out, size_t cap)
+{
+    static double sorted[SERVE_SAMPLES];
+    size_t n = s->requests < SERVE_SAMPLES ? (size_t)s->requests
+                                           : SERVE_SAMPLES;
 
-        /* Handle drop_leading */
-        if (drop_leading && (letters & 1ULL)) {
-            if ((~letters) == 0ULL)
-                continue;
-            unsigned lead = (unsigned)__builtin_ctzll(~letters);
-            letters &= (~0ULL << lead);
-            drop_leading = 0;
-        } else if (drop_leading) {
-            drop_leading = 0;
-        }
-
-        /* No letters in chunk */
-        if (letters == 0ULL) {
-            if (word_len > 0) {
-                word[word_len] = '\0';
-#ifdef __SSE4_2__
-                uint32_t h = crc32c_finalize(crc);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
-                crc = 0;
-#else
-                uint32_t h = hash_word(word, word_len);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
-#endif
-                word_len = 0;
-            }
-            prev_tail_letter = 0;
-            continue;
-        }
-
-        /* Process runs of letters */
-        uint64_t m = letters;
-        while (m) {
-            unsigned start = (unsigned)__builtin_ctzll(m);
-            uint64_t tail = m >> start;
-            unsigned run_len = ((~tail) == 0ULL)
-                                       ? (64 - start)
-                                       : (unsigned)__builtin_ctzll(~tail);
-
-            /* Flush word before gap */
-            if (start > 0 && word_len > 0) {
-                word[word_len] = '\0';
-#ifdef __SSE4_2__
-                uint32_t h = crc32c_finalize(crc);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
-                crc = 0;
-#else
-                uint32_t h = hash_word(word, word_len);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
-#endif
-                word_len = 0;
-            }
+    memcpy(sorted, s->lat_us, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), cmp_double);
+    /* Nearest rank: the smallest sample at or above p% of them */
+    double p50 = n ? sorted[(n * 50 + 99) / 100 - 1] : 0.0;
+    double p99 = n ? sorted[(n * 99 + 99) / 100 - 1] : 0.0;
+    return snprintf(out,
+                    cap,
+                    "requests %" PRIu64 "\n"
+                    "bytes %" PRIu64 "\n"
+                    "samples %zu\n"
+                    "p50_us %.1f\n"
+                    "p99_us %.1f\n"
+                    "max_us %.1f\n",
+                    s->requests,
+                    s->bytes,
+                    n,
+                    p50,
+                    p99,
+                    n ? sorted[n - 1] : 0.0);
+}
 
-            /* Accumulate characters */
-            const char *src = data + i + start;
-            for (unsigned k = 0; k < run_len && word_len < MAX_WORD - 1; k++) {
-                char lc = (char)(src[k] | 0x20);
-                word[word_len++] = lc;
-#ifdef __SSE4_2__
-                crc = _mm_crc32_u8((uint32_t)crc, (uint8_t)lc);
-#endif
-            }
+static int
+serve_count(Server *s, Conn *c, const char *text, size_t len, size_t k)
+{
+    struct timespec a, b;
+    (void)clock_gettime(CLOCK_MONOTONIC, &a);
 
-            /* Flush if run ended within chunk */
-            if (start + run_len < 64) {
-                if (word_len > 0) {
-                    word[word_len] = '\0';
-#ifdef __SSE4_2__
-                    uint32_t h = crc32c_finalize(crc);
-                    uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                    table_insert(t, word, word_len, h, fp);
-                    crc = 0;
-#else
-                    uint32_t h = hash_word(word, word_len);
-                    uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                    table_insert(t, word, word_len, h, fp);
-#endif
-                    word_len = 0;
-                }
-                prev_tail_letter = 0;
-            } else {
-                prev_tail_letter = 1;
-            }
+    wc_reset(s->ctx);
+    (void)wc_feed(s->ctx, text, len);
+    size_t n = lib_top(s->ctx, k ? k : wc_unique(s->ctx));
+    Entry *rows = s->ctx->top;
+    if (sort_order == SORT_WORD)
+        qsort(rows, n, sizeof(Entry), cmp_word);
 
-            uint64_t mask =
-                    (run_len >= 64)
-                            ? ~0ULL
-                            : (((run_len ? (1ULL << run_len) : 0ULL) - 1ULL)
-                               << start);
-            m &= ~mask;
-        }
-    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &b);
+    s->w.len = 0;
+    format_rows(&s->w,
+                s->fmt,
+                rows,
+                n,
+                s->ctx->unique,
+                s->ctx->total,
+                len,
+                ms_between(&a, &b));
+    if (serve_reply(c, s->w.buf, s->w.len) < 0)
+        return -1;
 
-    /* Process tail with scalar */
-    for (; i < size; i++) {
-        unsigned char c = (unsigned char)data[i];
+    (void)clock_gettime(CLOCK_MONOTONIC, &b);
+    s->lat_us[s->requests % SERVE_SAMPLES] = ms_between(&a, &b) * 1000.0;
+    s->requests++;
+    s->bytes += len;
+    return 0;
+}
 
-        if (drop_leading) {
-            if (!is_letter(c))
-                drop_leading = 0;
-            else
-                continue;
-        }
+/*
+ * Answer every complete request in c->buf. A COUNT whose text is still
+ * arriving is left there with its length in c->need. Returns -1 once the
+ * connection is done: a bad request (ERR is queued) or a write error.
+ */
+static int conn_requests(Server *s, Conn *c)
+{
+    for (;;) {
+        if (!c->need) {
+            char *nl = memchr(c->buf, '\n', c->len);
+            if (!nl)
+                return c->len < SERVE_LINE ? 0
+                                           : serve_error(c, "bad request");
+            *nl = '\0';
+            size_t line = (size_t)(nl - c->buf) + 1;
 
-        if (c >= 0x80) {
-            while (i + 1 < size && (data[i + 1] & 0xC0) == 0x80)
-                i++;
-            if (word_len > 0) {
-                word[word_len] = '\0';
-#ifdef __SSE4_2__
-                uint32_t h = crc32c_finalize(crc);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
-                crc = 0;
-#else
-                uint32_t h = hash_word(word, word_len);
-                uint16_t fp = (uint16_t)(h ^ (h >> 16));
-                table_insert(t, word, word_len, h, fp);
-#endif
-                word_len = 0;
+            unsigned long long len;
+            unsigned long long k = top_k;
+            int got = sscanf(c->buf, "COUNT %llu %llu", &len, &k);
+            if (got >= 1) {
+                if (len > SERVE_MAX_TEXT)
+                    return serve_error(c, "text too large");
+                c->need = line + (size_t)len;
+                c->line = line;
+                c->k = (size_t)k;
+            } else if (strcmp(c->buf, "STATS") == 0) {
+                char report[256];
+                int n = serve_report(s, report, sizeof(report));
+                c->len -= line;
+                memmove(c->buf, c->buf + line, c->len);
+                if (serve_reply(c, report, (size_t)n) < 0)
+                    return -1;
+                continue;
+            } else {
+                return serve_error(c, "bad request");
             }
-            continue;
         }
+        if (c->len < c->need)
+            return 0;
 
-        if (is_letter(c)) {
-            if (word_len < MAX_WORD - 1) {
-                char lc = (char)(c | 0x20);
-                word[word_len++] = lc;
-#ifdef __SSE4_2__
-                crc = _mm_crc32_u8((uint32_t)crc, (uint8_t)lc);
-#endif
-            }
-        } else if (word_len > 0) {
-            word[word_len] = '\0';
-#ifdef __SSE4_2__
-            uint32_t h = crc32c_finalize(crc);
-            uint16_t fp = (uint16_t)(h ^ (h >> 16));
-            table_insert(t, word, word_len, h, fp);
-            crc = 0;
-#else
-            uint32_t h = hash_word(word, word_len);
-            uint16_t fp = (uint16_t)(h ^ (h >> 16));
-            table_insert(t, word, word_len, h, fp);
-#endif
-            word_len = 0;
-        }
+        size_t used = c->need;
+        c->need = 0;
+        if (serve_count(s, c, c->buf + c->line, used - c->line, c->k) < 0)
+            return -1;
+        c->len -= used;
+        memmove(c->buf, c->buf + used, c->len);
     }
+}
 
-    /* Flush final word */
-    if (word_len > 0) {
-        word[word_len] = '\0';
-#ifdef __SSE4_2__
-        uint32_t h = crc32c_finalize(crc);
-        uint16_t fp = (uint16_t)(h ^ (h >> 16));
-        table_insert(t, word, word_len, h, fp);
-#else
-        uint32_t h = hash_word(word, word_len);
-        uint16_t fp = (uint16_t)(h ^ (h >> 16));
-        table_insert(t, word, word_len, h, fp);
-#endif
+/*
+ * Read what the peer sent and answer the requests it completes. At end
+ * of input the connection closes once its replies are out. Returns -1 on
+ * a read or write error.
+ */
+static int conn_serve(Server *s, Conn *c)
+{
+    ssize_t n = conn_fill(c, c->need ? c->need - c->len : SERVE_LINE);
+
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    if (n == 0) {
+        c->closing = 1;
+        return 0;
     }
+    if (conn_requests(s, c) < 0 && !c->closing)
+        return -1;
+    return 0;
 }
-#endif
 
-static void
-process_chunk(Table *t, const char *data, size_t size, int drop_leading)
+static void conn_close(Conn *c)
 {
-#ifdef __AVX512BW__
-    process_avx512(t, data, size, drop_leading);
-#else
-    process_scalar(t, data, size, drop_leading);
-#endif
+    if (c->in > STDIN_FILENO)
+        (void)close(c->in);
+    free(c->buf);
+    free(c->obuf);
+    *c = (Conn){ 0 };
 }
 
-/*===========================================================================
- * Worker Thread
- *===========================================================================*/
-
-typedef struct {
-    const char *data;
-    size_t start;
-    size_t end;
-    Table *table;
-    int id;
-    int drop_leading;
-} WorkUnit;
-
-static WorkUnit units[NUM_THREADS];
-
-static void *worker(void *arg)
+static int serve_listen(const char *path)
 {
-    WorkUnit *u = arg;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
 
-    /* Pin to V-Cache CCD if available */
-    if (vcache_count > 0) {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        int cpu = vcache_cpus[u->id % vcache_count];
-        CPU_SET((size_t)cpu, &cpuset);
-        (void)pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        (void)fprintf(stderr, "--serve path too long\n");
+        return -1;
     }
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    /* A socket left behind by an earlier server is replaced */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        (void)unlink(path);
 
-    (void)pthread_barrier_wait(&barrier);
-    process_chunk(
-            u->table, u->data + u->start, u->end - u->start, u->drop_leading);
-    return NULL;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        (void)close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-/*===========================================================================
- * Merge Tables
- *===========================================================================*/
-
-static Entry *
-merge_tables(size_t *out_unique, size_t *out_total, size_t *out_cap)
+/* Answer requests on the socket at path, or stdin/stdout for "-" */
+static int run_server(const char *path, Format fmt, FILE *info)
 {
-    size_t est = 0;
-    for (int i = 0; i < NUM_THREADS; i++)
-        est += tables[i].len;
+    static Server s;
+    Conn conns[SERVE_MAX_CLIENTS] = { 0 };
+    struct pollfd pfd[SERVE_MAX_CLIENTS + 1];
+    int nconn = 0;
+    int lfd = -1;
+    int rc = 1;
 
-    size_t cap = next_pow2(est * 2);
-    Entry *global = aligned_alloc(CACHELINE, cap * sizeof(Entry));
-    if (!global) {
-        perror("aligned_alloc");
+    s.fmt = fmt == FORMAT_TEXT ? FORMAT_TSV : fmt;
+    s.w = (Writer){ .buf = malloc(OUT_BUF), .cap = OUT_BUF, .fd = -1 };
+    if (!s.w.buf) {
+        perror("malloc");
         exit(1);
     }
-    memset(global, 0, cap * sizeof(Entry));
 
-    size_t glen = 0;
-    size_t gtotal = 0;
-    size_t mask = cap - 1;
+    /* The caller is worker 0: pin it before it touches the tables */
+    pin_thread(0);
+    wc_options o = {
+        .threads = nthreads,
+        .table = table_kind == TABLE_SWISS ? WC_TABLE_SWISS : WC_TABLE_LINEAR,
+        .incremental = resize_mode == RESIZE_INCREMENTAL,
+    };
+    s.ctx = lib_open(&o, SERVE_MIN_CAP);
+    if (!s.ctx)
+        goto cleanup;
+    if (s.ctx->nthreads > 1)
+        lib_pool_start(s.ctx);
 
-    for (int ti = 0; ti < NUM_THREADS; ti++) {
-        Table *tbl = &tables[ti];
-        gtotal += tbl->total;
+    struct sigaction sa = { .sa_handler = serve_signal };
+    (void)sigemptyset(&sa.sa_mask);
+    (void)sigaction(SIGINT, &sa, NULL);
+    (void)sigaction(SIGTERM, &sa, NULL);
+    (void)signal(SIGPIPE, SIG_IGN);
 
-        for (size_t i = 0; i < tbl->cap; i++) {
-            const Entry *e = &tbl->entries[i];
-            if (!e->word)
+    if (strcmp(path, "-") == 0) {
+        (void)fprintf(info, "Serving: stdin\n");
+        Conn c = { .in = STDIN_FILENO, .out = STDOUT_FILENO };
+        while (!serve_stop && !c.closing && conn_serve(&s, &c) >= 0)
+            ;
+        (void)conn_flush(&c);
+        conn_close(&c);
+        rc = 0;
+        goto cleanup;
+    }
+
+    lfd = serve_listen(path);
+    if (lfd < 0)
+        goto cleanup;
+    (void)fprintf(info, "Serving: %s\n", path);
+    (void)fflush(info);
+
+    while (!serve_stop) {
+        pfd[0] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+        for (int i = 0; i < nconn; i++) {
+            const Conn *c = &conns[i];
+            short ev = c->olen ? POLLOUT : c->closing ? 0 : POLLIN;
+            pfd[i + 1] = (struct pollfd){ .fd = c->in, .events = ev };
+        }
+        if (poll(pfd, (nfds_t)nconn + 1, -1) < 0) {
+            if (errno == EINTR)
                 continue;
+            perror("poll");
+            goto cleanup;
+        }
 
-            size_t idx = e->hash & mask;
-            while (global[idx].word) {
-                if (global[idx].hash == e->hash && global[idx].len == e->len &&
-                    global[idx].fp16 == e->fp16 &&
-                    memcmp(global[idx].word, e->word, e->len) == 0) {
-                    global[idx].count += e->count;
-                    goto next;
-                }
-                idx = (idx + 1) & mask;
+        /* Downwards, so the connection moved into a freed slot is done */
+        for (int i = nconn - 1; i >= 0; i--) {
+            Conn *c = &conns[i];
+            short ev = pfd[i + 1].revents;
+            int err = 0;
+            if (!ev)
+                continue;
+            if (c->olen)
+                err = conn_flush(c);
+            else if (!c->closing)
+                err = conn_serve(&s, c);
+            if (err < 0 || (c->closing && !c->olen)) {
+                conn_close(&conns[i]);
+                conns[i] = conns[--nconn];
+                conns[nconn] = (Conn){ 0 };
             }
-            global[idx] = *e;
-            glen++;
-next:;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd < 0)
+                continue;
+            if (nconn == SERVE_MAX_CLIENTS) {
+                Conn busy = { .in = fd, .out = fd };
+                (void)serve_error(&busy, "too many connections");
+                (void)conn_flush(&busy);
+                conn_close(&busy);
+                continue;
+            }
+            conns[nconn++] = (Conn){ .in = fd, .out = fd };
         }
     }
+    rc = 0;
 
-    *out_unique = glen;
-    *out_total = gtotal;
-    *out_cap = cap;
-    return global;
+cleanup:
+    for (int i = 0; i < nconn; i++)
+        conn_close(&conns[i]);
+    if (lfd >= 0) {
+        (void)close(lfd);
+        (void)unlink(path);
+    }
+    if (s.requests) {
+        char report[256];
+        (void)serve_report(&s, report, sizeof(report));
+        (void)fprintf(info, "\n=== Served ===\n%s", report);
+    }
+    wc_close(s.ctx);
+    free(s.w.buf);
+    return rc;
 }
 
 /*===========================================================================
- * Output
+ * Main
  *===========================================================================*/
 
-static int cmp_count_desc(const void *a, const void *b)
+typedef enum { IO_AUTO, IO_MMAP, IO_READ, IO_URING } IoMode;
+
+static void usage(FILE *out, const char *prog)
 {
-    const Entry *ea = a;
-    const Entry *eb = b;
-    if (ea->count != eb->count)
-        return (eb->count > ea->count) ? 1 : -1;
-    return strcmp(ea->word, eb->word);
+    (void)fprintf(
+            out,
+            "usage: %s [options] [FILE... | DIR... | -]\n"
+            "\n"
+            "  FILE            input file (default: book.txt, or none with\n"
+            "                  --load); '-' reads stdin\n"
+            "  --io=MODE       mmap (regular files), read (buffer ring) or\n"
+            "                  uring (io_uring reads into registered\n"
+            "                  buffers); non-regular inputs always use read\n"
+            "  --stream        same as --io=read\n"
+            "  --qd=N          io_uring queue depth (1-%d, default 8)\n"
+            "  --direct        O_DIRECT reads for --io=read/uring\n"
+            "  --chunk=SIZE    mmap scheduling chunk, K/M suffix (default\n"
+            "                  %uK)\n"
+            "  -t, --threads=N worker threads (1-%d; default: CPUs in the\n"
+            "                  affinity mask, capped by the cgroup quota,\n"
+            "                  and by one per %uM of a regular FILE)\n"
+            "  --cpus=LIST     pin workers round-robin to LIST (e.g. 0-7,16)\n"
+            "  --pin=POLICY    vcache (largest L3, default; numa when the\n"
+            "                  CPUs span several nodes), numa (interleave\n"
+            "                  nodes), all or none\n"
+            "  --top=K         print the K most frequent words (default %d)\n"
+            "  --all           print every word, fully sorted\n"
+            "  --word=RULES    what makes a word, comma-separated: letters\n"
+            "                  (the default), digits, chars=LIST (more word\n"
+            "                  bytes), apostrophe, hyphen, inner=LIST (kept\n"
+            "                  only between word bytes), min=N (shortest\n"
+            "                  word counted); e.g. letters,digits,apostrophe\n"
+            "  --utf8          UTF-8 words: Unicode letters and marks (and\n"
+            "                  digits with --word=digits) are word characters\n"
+            "                  and fold case; ASCII follows --word\n"
+            "  --table=KIND    linear (probing, default), swiss (SIMD-probed\n"
+            "                  control bytes, 7/8 load factor) or shared (one\n"
+            "                  lock-striped table fed by per-thread caches)\n"
+            "  --resize=MODE   full (rehash on growth, default) or\n"
+            "                  incremental (move %d slots per insert; linear\n"
+            "                  table only)\n"
+            "  --huge=MODE     table memory: thp (default), hugetlb (reserved\n"
+            "                  2 MB pages), 1g (1 GB pages for big tables) or\n"
+            "                  off; hugetlb falls back to thp, and --stats\n"
+            "                  shows the coverage achieved\n"
+            "  --save=PATH     write the merged counts as a saved table\n"
+            "  --load=PATH     merge a saved table into the counts\n"
+            "                  (repeatable, up to %d)\n"
+            "  --approx[=SIZE] bounded memory: top-K from Count-Min sketches\n"
+            "                  of SIZE bytes in all (K/M/G, default %uM) and\n"
+            "                  a HyperLogLog estimate of unique words\n"
+            "  --dedup[=SIZE]  cut the input into content-defined blocks and\n"
+            "                  reuse the counts of repeated ones from caches\n"
+            "                  of SIZE bytes in all (default %uM)\n"
+            "\n"
+            "Several FILEs, a directory or --files-from=LIST ('-' = stdin,\n"
+            "one path per line) count everything in one batch with one\n"
+            "result.\n"
+            "  --files-from=LIST  add the paths listed in LIST\n"
+            "  --per-file      also print every input's word total and its\n"
+            "                  own top K (or, with --all, every) words\n"
+            "\n"
+            "  --format=FMT    text (default), tsv, json or binary rows on\n"
+            "                  stdout; run details then go to stderr\n"
+            "  --sort=ORDER    count (default), word or none (table order,\n"
+            "                  --all only)\n"
+            "  --stats         per-phase and per-thread timings, table\n"
+            "                  figures and (if permitted) perf counters\n"
+            "\n"
+            "  --serve=PATH    stay up and count the texts of framed requests\n"
+            "                  (COUNT <bytes> [<k>], STATS) on the Unix\n"
+            "                  socket PATH, or on stdin/stdout for '-'\n",
+            prog,
+            URING_MAX_QD,
+            CHUNK_SIZE >> 10,
+            MAX_THREADS,
+            THREAD_MIN_BYTES >> 20,
+            TOP_N,
+            MIGRATE_STEP,
+            MAX_LOADS,
+            APPROX_BUDGET >> 20,
+            DEDUP_BUDGET >> 20);
 }
 
-static void print_top(const Entry *entries,
-                      size_t cap,
-                      size_t unique,
-                      size_t total,
-                      size_t file_size,
-                      double ms)
+/* Parse "4096", "512K", "2M", "1G"; returns 0 on malformed input */
+static size_t parse_size(const char *arg)
 {
-    Entry *arr = malloc(unique * sizeof(Entry));
-    if (!arr)
-        return;
-
-    size_t j = 0;
-    for (size_t i = 0; i < cap && j < unique; i++) {
-        if (entries[i].word)
-            arr[j++] = entries[i];
-    }
-
-    qsort(arr, unique, sizeof(Entry), cmp_count_desc);
-
-    printf("\n=== Top %d Words ===\n", TOP_N);
-    size_t n = unique < TOP_N ? unique : TOP_N;
-    for (size_t i = 0; i < n; i++) {
-        printf("%2zu. %-15s %9u  (%5.2f%%)\n",
-               i + 1,
-               arr[i].word,
-               arr[i].count,
-               100.0 * (double)arr[i].count / (double)total);
+    char *end;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (end == arg)
+        return 0;
+    if (*end == 'K' || *end == 'k') {
+        v <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        v <<= 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        v <<= 30;
+        end++;
     }
-
-    double size_mb = (double)file_size / (1024.0 * 1024.0);
-    printf("\nFile size:       %.2f MB\n", size_mb);
-    printf("Total words:     %zu\n", total);
-    printf("Unique words:    %zu\n", unique);
-    printf("Time:            %.2f ms\n", ms);
-    printf("Throughput:      %.2f MB/s\n", size_mb / (ms / 1000.0));
-
-    free(arr);
+    return *end ? 0 : (size_t)v;
 }
 
-/*===========================================================================
- * Main
- *===========================================================================*/
-
 int main(int argc, char *argv[])
 {
-    const char *path = (argc > 1) ? argv[1] : "book.txt";
+    static const struct option long_opts[] = {
+        { "io", required_argument, NULL, 'i' },
+        { "stream", no_argument, NULL, 's' },
+        { "qd", required_argument, NULL, 'q' },
+        { "direct", no_argument, NULL, 'd' },
+        { "chunk", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "cpus", required_argument, NULL, 'C' },
+        { "pin", required_argument, NULL, 'p' },
+        { "top", required_argument, NULL, 'k' },
+        { "all", no_argument, NULL, 'a' },
+        { "table", required_argument, NULL, 'T' },
+        { "resize", required_argument, NULL, 'r' },
+        { "save", required_argument, NULL, 'S' },
+        { "load", required_argument, NULL, 'L' },
+        { "files-from", required_argument, NULL, 'F' },
+        { "per-file", no_argument, NULL, 'P' },
+        { "format", required_argument, NULL, 'f' },
+        { "sort", required_argument, NULL, 'o' },
+        { "stats", no_argument, NULL, 'x' },
+        { "approx", optional_argument, NULL, 'A' },
+        { "dedup", optional_argument, NULL, 'D' },
+        { "huge", required_argument, NULL, 'H' },
+        { "word", required_argument, NULL, 'W' },
+        { "utf8", no_argument, NULL, 'U' },
+        { "serve", required_argument, NULL, 'V' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *path = "book.txt";
+    const char *save_path = NULL;
+    const char *serve_path = NULL;
+    const char *word_spec = NULL;
+    int utf8 = 0;
+    const char *load_paths[MAX_LOADS];
+    int nloads = 0;
+    const char *files_from = NULL;
+    PathList batch = { 0 };
+    Format format = FORMAT_TEXT;
+    FILE *info = stdout; /* run details; stderr for machine formats */
+    IoMode io = IO_AUTO;
+    int qd = 8;
+    int direct = 0;
+    PinPolicy pin = PIN_VCACHE;
     int rc = 1;
     int fd = -1;
-    char *data = MAP_FAILED;
     size_t file_size = 0;
     Entry *global = NULL;
+    Entry *rows = NULL;
     size_t global_cap = 0;
-    int tables_init = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "ht:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                if (strcmp(optarg, "mmap") == 0) {
+                    io = IO_MMAP;
+                } else if (strcmp(optarg, "read") == 0) {
+                    io = IO_READ;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    io = IO_URING;
+                } else {
+                    (void)fprintf(stderr, "unknown --io mode: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                io = IO_READ;
+                break;
+            case 'q':
+                qd = atoi(optarg);
+                if (qd < 1 || qd > URING_MAX_QD) {
+                    (void)fprintf(stderr,
+                                  "--qd must be between 1 and %d\n",
+                                  URING_MAX_QD);
+                    return 1;
+                }
+                break;
+            case 'd':
+                direct = 1;
+                break;
+            case 'c':
+                chunk_size = parse_size(optarg);
+                if (chunk_size < CHUNK_MIN) {
+                    (void)fprintf(stderr,
+                                  "--chunk must be at least %d bytes\n",
+                                  CHUNK_MIN);
+                    return 1;
+                }
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                if (nthreads < 1 || nthreads > MAX_THREADS) {
+                    (void)fprintf(stderr,
+                                  "--threads must be between 1 and %d\n",
+                                  MAX_THREADS);
+                    return 1;
+                }
+                break;
+            case 'C':
+                pin_count = parse_cpu_list(optarg, pin_cpus, MAX_CPUS);
+                if (pin_count <= 0) {
+                    (void)fprintf(stderr, "bad --cpus list: %s\n", optarg);
+                    return 1;
+                }
+                pin = PIN_LIST;
+                break;
+            case 'p':
+                if (strcmp(optarg, "vcache") == 0) {
+                    pin = PIN_VCACHE;
+                } else if (strcmp(optarg, "all") == 0) {
+                    pin = PIN_ALL;
+                } else if (strcmp(optarg, "numa") == 0) {
+                    pin = PIN_NUMA;
+                } else if (strcmp(optarg, "none") == 0) {
+                    pin = PIN_NONE;
+                } else {
+                    (void)fprintf(stderr, "unknown --pin policy: %s\n", optarg);
+                    return 1;
+                }
+                pin_count = 0;
+                break;
+            case 'k': {
+                char *end;
+                unsigned long long k = strtoull(optarg, &end, 10);
+                if (end == optarg || *end || k < 1) {
+                    (void)fprintf(stderr, "--top must be a positive count\n");
+                    return 1;
+                }
+                top_k = (size_t)k;
+                break;
+            }
+            case 'a':
+                top_k = 0;
+                break;
+            case 'T':
+                if (strcmp(optarg, "linear") == 0) {
+                    table_kind = TABLE_LINEAR;
+                } else if (strcmp(optarg, "swiss") == 0) {
+                    table_kind = TABLE_SWISS;
+                } else if (strcmp(optarg, "shared") == 0) {
+                    table_kind = TABLE_LINEAR;
+                    shared_table = 1;
+                } else {
+                    (void)fprintf(stderr, "unknown --table kind: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (strcmp(optarg, "full") == 0) {
+                    resize_mode = RESIZE_FULL;
+                } else if (strcmp(optarg, "incremental") == 0) {
+                    resize_mode = RESIZE_INCREMENTAL;
+                } else {
+                    (void)fprintf(
+                            stderr, "unknown --resize mode: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                if (strcmp(optarg, "thp") == 0) {
+                    huge_mode = HUGE_THP;
+                } else if (strcmp(optarg, "hugetlb") == 0) {
+                    huge_mode = HUGE_TLB;
+                } else if (strcmp(optarg, "1g") == 0) {
+                    huge_mode = HUGE_TLB_1G;
+                } else if (strcmp(optarg, "off") == 0) {
+                    huge_mode = HUGE_OFF;
+                } else {
+                    (void)fprintf(stderr, "unknown --huge mode: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'W':
+                if (rules_parse(optarg) < 0)
+                    return 1;
+                word_spec = optarg;
+                break;
+            case 'U':
+                utf8 = 1;
+                break;
+            case 'S':
+                save_path = optarg;
+                break;
+            case 'L':
+                if (nloads == MAX_LOADS) {
+                    (void)fprintf(stderr,
+                                  "at most %d --load tables\n",
+                                  MAX_LOADS);
+                    return 1;
+                }
+                load_paths[nloads++] = optarg;
+                break;
+            case 'F':
+                files_from = optarg;
+                break;
+            case 'P':
+                per_file = 1;
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") == 0) {
+                    format = FORMAT_TEXT;
+                } else if (strcmp(optarg, "tsv") == 0) {
+                    format = FORMAT_TSV;
+                } else if (strcmp(optarg, "json") == 0) {
+                    format = FORMAT_JSON;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    format = FORMAT_BINARY;
+                } else {
+                    (void)fprintf(stderr, "unknown --format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                if (strcmp(optarg, "count") == 0) {
+                    sort_order = SORT_COUNT;
+                } else if (strcmp(optarg, "word") == 0) {
+                    sort_order = SORT_WORD;
+                } else if (strcmp(optarg, "none") == 0) {
+                    sort_order = SORT_NONE;
+                } else {
+                    (void)fprintf(stderr, "unknown --sort order: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'x':
+                stats_enabled = 1;
+                break;
+            case 'V':
+                serve_path = optarg;
+                break;
+            case 'A':
+                approx_budget = optarg ? parse_size(optarg) : APPROX_BUDGET;
+                if (approx_budget < APPROX_MIN_BYTES) {
+                    (void)fprintf(stderr,
+                                  "--approx needs at least %zuK\n",
+                                  APPROX_MIN_BYTES >> 10);
+                    return 1;
+                }
+                break;
+            case 'D':
+                dedup_budget = optarg ? parse_size(optarg) : DEDUP_BUDGET;
+                if (dedup_budget < (1u << 20)) {
+                    (void)fprintf(stderr, "--dedup needs at least 1M\n");
+                    return 1;
+                }
+                break;
+            case 'h':
+                usage(stdout, argv[0]);
+                return 0;
+            default:
+                usage(stderr, argv[0]);
+                return 1;
+        }
+    }
+    if (format != FORMAT_TEXT || serve_path)
+        info = stderr;
+    if (utf8) {
+        /* The UTF-8 loops read the class table even for plain letters */
+        if (!word_spec && rules_parse("letters") < 0)
+            return 1;
+        word_rules.utf8 = 1;
+        utf8_init();
+    }
+
+    struct stat st;
+    int use_batch = files_from != NULL || argc - optind > 1 ||
+                    (optind < argc && stat(argv[optind], &st) == 0 &&
+                     S_ISDIR(st.st_mode));
+    if (use_batch && (io != IO_AUTO || direct)) {
+        (void)fprintf(stderr,
+                      "--io, --stream and --direct need a single FILE\n");
+        return 1;
+    }
+    if (approx_budget &&
+        (top_k == 0 || shared_table || save_path || nloads > 0 || per_file)) {
+        (void)fprintf(stderr,
+                      "--approx keeps only the top K: it cannot be combined "
+                      "with --all, --table=shared, --save, --load or "
+                      "--per-file\n");
+        return 1;
+    }
+    per_file = per_file && use_batch;
+    if (serve_path &&
+        (optind < argc || files_from || per_file || nloads > 0 || save_path ||
+         approx_budget || dedup_budget || shared_table || stats_enabled ||
+         io != IO_AUTO || direct)) {
+        (void)fprintf(stderr,
+                      "--serve takes its texts from requests: it cannot be "
+                      "combined with FILEs, --files-from, --per-file, "
+                      "--load, --save, --approx, --dedup, --table=shared, "
+                      "--stats or the --io options\n");
+        return 1;
+    }
+    approx_keep = top_k * APPROX_SLACK;
+    if (optind < argc)
+        path = argv[optind];
+    else if (nloads > 0 || serve_path)
+        path = NULL; /* only combine saved tables, or serve */
 
     struct timespec t0;
     (void)clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (stats_enabled) {
+        (void)counters_open();
+        mark_phase(PHASE_SETUP);
+    }
 
-    printf("Processing: %s\n", path);
-#ifdef __AVX512BW__
-    printf("Mode: AVX-512 + CRC32C\n");
-#elif defined(__SSE4_2__)
-    printf("Mode: CRC32C\n");
-#else
-    printf("Mode: Scalar + FNV-1a\n");
-#endif
+    if (use_batch) {
+        path = NULL;
+        for (int i = optind; i < argc; i++)
+            path_walk(&batch, argv[i], 1);
+        if (files_from && path_read_list(&batch, files_from) < 0)
+            goto cleanup;
+        if (batch.len == 0) {
+            (void)fprintf(stderr, "no input files\n");
+            goto cleanup;
+        }
+    }
 
-    detect_vcache();
-    if (vcache_count > 0)
-        printf("V-Cache: %d cores\n", vcache_count);
+    select_kernel();
+    if (use_batch)
+        (void)fprintf(info, "Processing: %zu files\n", batch.len);
+    else if (path)
+        (void)fprintf(info, "Processing: %s\n", path);
+    (void)fprintf(info, "Mode: %s\n", kernel->name);
+    if (word_rules.utf8)
+        (void)fprintf(info,
+                      "Words: %s, UTF-8\n",
+                      word_spec ? word_spec : "letters");
+    else if (word_rules.custom)
+        (void)fprintf(info, "Words: %s\n", word_spec);
+    if (shared_table)
+        (void)fprintf(info,
+                      "Table: shared, %d shards%s\n",
+                      SHARED_SHARDS,
+                      resize_mode == RESIZE_INCREMENTAL
+                              ? ", incremental front resize"
+                              : "");
+    else if (approx_budget)
+        (void)fprintf(info, "Table: approximate, front caches per chunk\n");
+    else if (table_kind == TABLE_LINEAR && resize_mode == RESIZE_INCREMENTAL)
+        (void)fprintf(info, "Table: linear, incremental resize\n");
+    else
+        (void)fprintf(info,
+                      "Table: %s\n",
+                      table_kind == TABLE_SWISS ? "swiss" : "linear");
 
-    /* Open and mmap file */
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        perror("open");
-        goto cleanup;
-    }
+    if (dedup_budget)
+        (void)fprintf(info,
+                      "Dedup: %zu MB of block caches, blocks of %uK to %uK\n",
+                      dedup_budget >> 20,
+                      DEDUP_MIN >> 10,
+                      DEDUP_MAX >> 10);
 
-    struct stat st;
-    if (fstat(fd, &st) < 0) {
-        perror("fstat");
-        goto cleanup;
-    }
-    if (st.st_size <= 0) {
-        (void)fprintf(stderr, "Empty file\n");
+    pin = setup_pinning(pin);
+    if (vcache_count > 0)
+        (void)fprintf(info, "V-Cache: %d cores\n", vcache_count);
+    if (nthreads == 0) {
+        /* More threads than pinned CPUs would only time-slice */
+        nthreads = default_threads();
+        if (pin_count > 0 && pin_count < nthreads)
+            nthreads = pin_count;
+        if (path && !use_batch && !serve_path)
+            nthreads = input_threads(path, nthreads);
+        /* Fewer workers rather than sketches beyond the budget */
+        if (approx_budget &&
+            approx_budget / APPROX_MIN_BYTES < (size_t)nthreads)
+            nthreads = (int)(approx_budget / APPROX_MIN_BYTES);
+    } else if (approx_budget &&
+               approx_budget / APPROX_MIN_BYTES < (size_t)nthreads) {
+        (void)fprintf(stderr,
+                      "--approx needs at least %zuK per thread: %zuK for "
+                      "%d threads\n",
+                      APPROX_MIN_BYTES >> 10,
+                      (size_t)nthreads * APPROX_MIN_BYTES >> 10,
+                      nthreads);
         goto cleanup;
     }
-    file_size = (size_t)st.st_size;
+    numa_assign();
+    if (worker_nodes > 1)
+        (void)fprintf(info, "NUMA: %d nodes\n", worker_nodes);
+    if (pin_count > 0)
+        (void)fprintf(info,
+                      "Threads: %d, pinned to %d CPUs (%s)\n",
+                      nthreads,
+                      pin_count,
+                      pin_names[pin]);
+    else
+        (void)fprintf(info, "Threads: %d, unpinned\n", nthreads);
 
-    data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (data == MAP_FAILED) {
-        perror("mmap");
+    if (serve_path) {
+        rc = run_server(serve_path, format, info);
         goto cleanup;
     }
 
-    (void)madvise(data, file_size, MADV_SEQUENTIAL);
-    (void)madvise(data, file_size, MADV_WILLNEED);
-
-    /* Compute non-overlapping partition cuts */
-    size_t cuts[NUM_THREADS + 1];
-    cuts[0] = 0;
-    cuts[NUM_THREADS] = file_size;
-    for (int i = 1; i < NUM_THREADS; i++) {
-        size_t c = (file_size * (size_t)i) / NUM_THREADS;
-        while (c < file_size && is_letter((unsigned char)data[c]))
-            c++;
-        cuts[i] = c;
+    /* Saved tables are mapped now and read during the merge */
+    for (int i = 0; i < nloads; i++) {
+        if (saved_open(&saved[saved_count], load_paths[i]) < 0)
+            goto cleanup;
+        const SaveHeader *h = saved[saved_count++].hdr;
+        (void)fprintf(info,
+                      "Loaded: %s (%" PRIu64 " words, %" PRIu64 " unique)\n",
+                      load_paths[i],
+                      h->total,
+                      h->unique);
     }
 
-    /* Initialize per-thread tables with dynamic sizing */
-    for (int i = 0; i < NUM_THREADS; i++) {
-        Table *t = &tables[i];
-        size_t chunk_size = cuts[i + 1] - cuts[i];
-        size_t estimated_words = chunk_size / 5;
-        size_t estimated_unique = estimated_words / 10;
+    if (shared_table && shared_init() < 0)
+        goto cleanup;
 
-        t->cap = next_pow2(estimated_unique * 2);
-        if (t->cap < INITIAL_CAP)
-            t->cap = INITIAL_CAP;
+    if (stats_enabled)
+        mark_phase(PHASE_SCAN);
 
-        t->entries = aligned_alloc(CACHELINE, t->cap * sizeof(Entry));
-        if (!t->entries) {
-            perror("aligned_alloc");
+    /* Open input: regular files are mmapped, everything else streams */
+    if (use_batch) {
+        if (run_batch(batch.paths, batch.len, &file_size) < 0)
             goto cleanup;
+    } else if (!path) {
+        for (int i = 0; i < nthreads; i++) {
+            if (table_init(&tables[i], i, 0, table_kind, resize_mode) < 0)
+                goto cleanup;
         }
-        memset(t->entries, 0, t->cap * sizeof(Entry));
-
-        t->pool = aligned_alloc(CACHELINE, POOL_SIZE);
-        if (!t->pool) {
-            perror("aligned_alloc");
+    } else if (strcmp(path, "-") == 0) {
+        fd = STDIN_FILENO;
+        io = IO_READ;
+    } else {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            perror("open");
             goto cleanup;
         }
 
-        t->pool_used = 0;
-        t->len = 0;
-        t->total = 0;
-        t->id = i;
-        t->overflow = NULL;
-        t->overflow_count = 0;
-        t->overflow_cap = 0;
-
-        /* Huge page hints */
-        (void)madvise(t->entries, t->cap * sizeof(Entry), MADV_HUGEPAGE);
-        (void)madvise(t->pool, POOL_SIZE, MADV_HUGEPAGE);
-
-        units[i].data = data;
-        units[i].start = cuts[i];
-        units[i].end = cuts[i + 1];
-        units[i].table = t;
-        units[i].id = i;
-        units[i].drop_leading = 0;
+        if (fstat(fd, &st) < 0) {
+            perror("fstat");
+            goto cleanup;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size <= 0)
+            io = IO_READ;
+        else
+            file_size = (size_t)st.st_size;
     }
-    tables_init = NUM_THREADS;
+    if (io == IO_AUTO)
+        io = IO_MMAP;
 
-    /* Launch workers */
-    (void)pthread_barrier_init(&barrier, NULL, NUM_THREADS + 1);
-    for (int i = 0; i < NUM_THREADS; i++) {
-        (void)pthread_create(&threads[i], NULL, worker, &units[i]);
+    if (direct && path && io != IO_MMAP) {
+        int fl = fcntl(fd, F_GETFL);
+        if (fl < 0 || fcntl(fd, F_SETFL, fl | O_DIRECT) < 0)
+            (void)fprintf(stderr, "O_DIRECT not supported, reading buffered\n");
     }
 
-    (void)pthread_barrier_wait(&barrier);
-    for (int i = 0; i < NUM_THREADS; i++) {
-        (void)pthread_join(threads[i], NULL);
+    switch (path ? io : IO_AUTO) {
+        case IO_AUTO:
+            break; /* saved tables only */
+        case IO_URING:
+            (void)fprintf(info,
+                          "I/O: io_uring, qd %d%s\n",
+                          qd,
+                          direct ? ", O_DIRECT" : "");
+            if (run_uring(fd, file_size, qd, &file_size) < 0)
+                goto cleanup;
+            break;
+        case IO_READ:
+            if (run_stream(fd, &file_size) < 0)
+                goto cleanup;
+            break;
+        default:
+            if (run_mapped(fd, file_size) < 0)
+                goto cleanup;
+            break;
     }
-    (void)pthread_barrier_destroy(&barrier);
 
     /* Merge */
+    if (stats_enabled)
+        mark_phase(PHASE_MERGE);
     size_t unique = 0;
     size_t total = 0;
-    global = merge_tables(&unique, &total, &global_cap);
+    size_t nrows = 0;
+    if (approx_budget) {
+        rows = approx_merge(&nrows, &unique, &total);
+        if (stats_enabled)
+            mark_phase(PHASE_SELECT);
+    } else {
+        global = merge_tables(&unique, &total, &global_cap);
+        if (stats_enabled)
+            mark_phase(PHASE_SELECT);
+        rows = select_top(global, global_cap, unique, &nrows);
+    }
+    if (stats_enabled)
+        mark_phase(PHASE_OUTPUT);
 
     struct timespec t1;
     (void)clock_gettime(CLOCK_MONOTONIC, &t1);
-    double ms = (double)(t1.tv_sec - t0.tv_sec) * 1000.0 +
-                (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    double ms = ms_between(&t0, &t1);
 
-    print_top(global, global_cap, unique, total, file_size, ms);
-    rc = 0;
+    if (format == FORMAT_TEXT) {
+        print_top(rows, nrows, unique, total, file_size, ms);
+    } else {
+        if (write_rows(format, rows, nrows, unique, total, file_size, ms) < 0)
+            goto cleanup;
+        print_summary(info, unique, total, file_size, ms);
+    }
+    if (approx_budget)
+        print_approx(info, total);
+    if (dedup_budget)
+        print_dedup(info);
+    if (per_file)
+        print_per_file(info, batch.len);
+    if (save_path) {
+        if (save_table(save_path, global, global_cap, unique, total) < 0)
+            goto cleanup;
+        (void)fprintf(info, "Saved:           %s\n", save_path);
+    }
+    if (stats_enabled) {
+        (void)fflush(stdout);
+        mark_phase(NUM_PHASES);
+        print_stats(info);
+        counters_close();
+    }
+    rc = input_errors;
 
 cleanup:
-    free(global);
-    for (int i = 0; i < tables_init; i++) {
-        for (size_t j = 0; j < tables[i].overflow_count; j++) {
-            free(tables[i].overflow[j]);
-        }
-        free(tables[i].overflow);
-        free(tables[i].entries);
-        free(tables[i].pool);
-    }
-    if (data != MAP_FAILED)
-        (void)munmap(data, file_size);
-    if (fd >= 0)
+    free(rows);
+    if (!merge_borrowed)
+        huge_free(global, global_cap * sizeof(Entry));
+    for (size_t i = 0; inputs && i < batch.len; i++)
+        file_rows_free(inputs[i].rows);
+    free(inputs);
+    path_list_free(&batch);
+    for (int i = 0; i < saved_count; i++)
+        saved_close(&saved[i]);
+    for (int i = 0; i < nthreads; i++)
+        table_free(&tables[i]);
+    shared_free();
+    for (int i = 0; i < nthreads; i++)
+        sketch_free(&sketches[i]);
+    for (int i = 0; i < nthreads; i++)
+        dedup_free(&dedups[i]);
+    if (fd > STDIN_FILENO)
         (void)close(fd);
     return rc;
 }
+
+#endif /* !WORDCOUNT_LIB */
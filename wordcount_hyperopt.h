@@ -0,0 +1,99 @@
+/*
+ * wordcount_hyperopt.h - Embeddable interface to the hyperopt engine
+ *
+ * Build the library from the same source as the CLI:
+ *   gcc -O3 -pthread -D_GNU_SOURCE -DWORDCOUNT_LIB -c wordcount_hyperopt.c
+ * or link the wordcount_hyperopt_lib CMake target.
+ *
+ * Every wc_ctx owns its tables, string pools and worker threads, so any
+ * number of contexts can be used side by side; a single context must not
+ * be used from two threads at once. Words follow the benchmark definition
+ * (maximal runs of ASCII letters, case-folded, truncated to 99 letters).
+ *
+ * Typical use:
+ *   wc_ctx *c = wc_open(NULL);
+ *   while ((n = read(fd, buf, sizeof(buf))) > 0)
+ *       wc_feed(c, buf, (size_t)n);
+ *   wc_word top[10];
+ *   size_t k = wc_topk(c, 10, top);
+ *   wc_close(c);
+ *
+ * Allocation failure inside the engine aborts the process, as in the CLI.
+ */
+
+#ifndef WORDCOUNT_HYPEROPT_H
+#define WORDCOUNT_HYPEROPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct wc_ctx wc_ctx;
+
+typedef enum { WC_TABLE_LINEAR, WC_TABLE_SWISS } wc_table;
+
+typedef struct {
+    int threads;      /* workers per context; 0 = CPUs in the affinity mask */
+    wc_table table;   /* hash table layout */
+    int incremental;  /* spread linear table growth over inserts */
+    size_t size_hint; /* expected input bytes, sizes the tables; 0 = small */
+} wc_options;
+
+/*
+ * A counted word. word points into the context and is valid until the next
+ * wc_feed, wc_merge or wc_close on it; it is not NUL-terminated.
+ */
+typedef struct {
+    const char *word;
+    size_t len;
+    uint64_t count;
+} wc_word;
+
+typedef struct {
+    const wc_ctx *ctx;
+    size_t pos;
+} wc_iter;
+
+/* NULL opt = defaults. Returns NULL on failure. */
+wc_ctx *wc_open(const wc_options *opt);
+void wc_close(wc_ctx *c);
+
+/*
+ * Count the words in buf, which is only read during the call. A word cut
+ * by the end of buf continues into the next call; reading results (the
+ * calls below) ends it. Large buffers are split over the context's
+ * workers. Returns 0, or -1 on bad arguments.
+ */
+int wc_feed(wc_ctx *c, const char *buf, size_t len);
+
+/*
+ * Forget every count, keeping the tables, string pools and worker threads
+ * for the next document. A table keeps the size it grew to unless the
+ * last document filled less than 1/8 of it.
+ */
+void wc_reset(wc_ctx *c);
+
+/* Add the counts of src to dst (src is unchanged). Returns 0 or -1. */
+int wc_merge(wc_ctx *dst, wc_ctx *src);
+
+uint64_t wc_total(wc_ctx *c);
+size_t wc_unique(wc_ctx *c);
+
+/*
+ * Store the k most frequent words in out, best first (ties in byte order)
+ * and return how many were stored (fewer if there are fewer words).
+ */
+size_t wc_topk(wc_ctx *c, size_t k, wc_word *out);
+
+/* Visit every word once, in no particular order, without copying */
+void wc_iter_init(wc_iter *it, wc_ctx *c);
+int wc_iter_next(wc_iter *it, wc_word *out); /* 0 when done */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WORDCOUNT_HYPEROPT_H */
@@ -0,0 +1,873 @@
+/*
+ * wordcount_hyperopt_bench.c - Microbenchmarks for the hyperopt kernels
+ *
+ * Build:
+ *   gcc -O3 -pthread -D_GNU_SOURCE wordcount_hyperopt_bench.c -o wc_bench
+ * or the wordcount_hyperopt_bench CMake target.
+ *
+ * The engine source is included directly (with WORDCOUNT_LIB, so without
+ * its main) to reach the static kernels in isolation from I/O:
+ *   - tokenize: every kernel the CPU supports, ns/byte (kernel + insert);
+ *               the -rules cases run the --word kernels on the default
+ *               rules, nibble lookups in place of constant compares, and
+ *               the -utf8 cases the --utf8 kernels
+ *   - hash:     CRC32C and FNV-1a over the corpus words, ns/word
+ *   - insert:   table_insert into a presized linear or swiss table, by
+ *               vocabulary size and word length, ns/word; the -batch cases
+ *               prefetch INSERT_BATCH words ahead as the kernels do
+ *   - grow:     one table_grow / swiss_grow at the load threshold, ns/entry
+ *   - merge:    merge_tables over per-thread tables, ns/entry
+ *
+ * Corpora are synthetic and seeded, so runs are comparable across hosts
+ * and commits: zipf (English-like lengths, Zipfian draws), unique (every
+ * word new), long (16-64 letters) and nonascii (UTF-8 runs between
+ * words). Each benchmark runs one warm-up and --reps timed repetitions on
+ * a pinned thread and reports the median, minimum, mean and coefficient
+ * of variation; --tsv prints the same rows for scripts that gate changes.
+ */
+
+#define WORDCOUNT_LIB
+#include "wordcount_hyperopt.c"
+
+#include <math.h>
+
+/*===========================================================================
+ * Configuration
+ *===========================================================================*/
+
+#ifndef BENCH_SIZE
+#define BENCH_SIZE (8u << 20)
+#endif
+
+#ifndef BENCH_REPS
+#define BENCH_REPS 11
+#endif
+
+#ifndef BENCH_MAX_REPS
+#define BENCH_MAX_REPS 1000
+#endif
+
+/* Words drawn per insert/merge stream */
+#ifndef BENCH_WORDS
+#define BENCH_WORDS (2u << 20)
+#endif
+
+#define ZIPF_S 1.07
+
+static size_t bench_size = BENCH_SIZE;
+static int bench_reps = BENCH_REPS;
+static const char *bench_filter = NULL;
+static int bench_tsv = 0;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/*===========================================================================
+ * Random Numbers and Vocabularies
+ *===========================================================================*/
+
+/* xorshift64* */
+static inline uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static inline size_t rng_below(size_t n)
+{
+    return (size_t)((rng_next() >> 11) % n);
+}
+
+static inline double rng_unit(void)
+{
+    return (double)(rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* English-like word lengths 1..14 (weights in per mille) */
+static const unsigned short english_lengths[] = {
+    30, 170, 210, 160, 110, 85, 75, 55, 40, 28, 17, 10, 6, 4,
+};
+
+static size_t english_length(void)
+{
+    size_t r = rng_below(1000);
+    size_t len = 1;
+    for (size_t i = 0; i < sizeof(english_lengths) / 2; i++) {
+        if (r < english_lengths[i])
+            return len;
+        r -= english_lengths[i];
+        len++;
+    }
+    return len;
+}
+
+typedef struct {
+    char *text;  /* words, each followed by a NUL */
+    size_t *off; /* word i starts at text + off[i] */
+    uint16_t *len;
+    double *cdf; /* Zipfian rank distribution */
+    size_t n;
+} Vocab;
+
+static void *bench_alloc(size_t n)
+{
+    void *p = malloc(n ? n : 1);
+    if (!p) {
+        perror("malloc");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * n distinct lowercase words with lengths in [lo, hi] (lo == 0: English
+ * mix). Random words are deduplicated through an open-addressing set of
+ * word indices; a length whose words run out is bumped by one.
+ */
+static void vocab_make(Vocab *v, size_t n, size_t lo, size_t hi)
+{
+    size_t mask = next_pow2(n * 2) - 1;
+    size_t *set = bench_alloc((mask + 1) * sizeof(size_t));
+
+    v->n = n;
+    v->off = bench_alloc(n * sizeof(size_t));
+    v->len = bench_alloc(n * sizeof(uint16_t));
+    v->cdf = bench_alloc(n * sizeof(double));
+    v->text = bench_alloc(n * (MAX_WORD + 1) + 8);
+    memset(set, 0xff, (mask + 1) * sizeof(size_t));
+
+    size_t pos = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = lo ? lo + rng_below(hi - lo + 1) : english_length();
+        char *w = v->text + pos;
+
+        for (int tries = 0;; tries++) {
+            if (tries == 64) {
+                len++;
+                tries = 0;
+            }
+            for (size_t k = 0; k < len; k++)
+                w[k] = (char)('a' + rng_below(26));
+            w[len] = '\0';
+
+            size_t idx = hash_fnv1a(w, len) & mask;
+            while (set[idx] != SIZE_MAX &&
+                   strcmp(v->text + v->off[set[idx]], w) != 0)
+                idx = (idx + 1) & mask;
+            if (set[idx] == SIZE_MAX) {
+                set[idx] = i;
+                break;
+            }
+        }
+        v->off[i] = pos;
+        v->len[i] = (uint16_t)len;
+        pos += len + 1;
+    }
+    memset(v->text + pos, 0, 8);
+    free(set);
+
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += 1.0 / pow((double)(i + 1), ZIPF_S);
+        v->cdf[i] = sum;
+    }
+    for (size_t i = 0; i < n; i++)
+        v->cdf[i] /= sum;
+}
+
+static void vocab_free(Vocab *v)
+{
+    free(v->text);
+    free(v->off);
+    free(v->len);
+    free(v->cdf);
+}
+
+static size_t vocab_draw(const Vocab *v)
+{
+    double u = rng_unit();
+    size_t lo = 0, hi = v->n - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (v->cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*===========================================================================
+ * Corpora (text for the tokenizers) and Token Streams (for the tables)
+ *===========================================================================*/
+
+typedef enum {
+    CORPUS_ZIPF,
+    CORPUS_UNIQUE,
+    CORPUS_LONG,
+    CORPUS_NONASCII
+} CorpusKind;
+
+static const char *const corpus_names[] = { "zipf", "unique", "long",
+                                            "nonascii" };
+
+#define NUM_CORPORA 4
+
+typedef struct {
+    char *text;
+    size_t size;
+} Corpus;
+
+/* Non-ASCII runs for CORPUS_NONASCII: Latin-1, dashes, CJK */
+static const char *const utf8_bits[] = {
+    "\xc3\xa9", "\xc3\x9f", "\xe2\x80\x94", "\xe4\xb8\xad\xe6\x96\x87",
+    "\xc3\xb1o", "\xe2\x80\x9c",
+};
+
+static void corpus_make(Corpus *c, CorpusKind kind, size_t size)
+{
+    Vocab v;
+
+    c->text = bench_alloc(size + MAX_WORD + 16);
+    c->size = 0;
+    if (kind == CORPUS_LONG)
+        vocab_make(&v, 20000, 16, 64);
+    else if (kind == CORPUS_UNIQUE)
+        vocab_make(&v, 1, 1, 1); /* unused */
+    else
+        vocab_make(&v, 50000, 0, 0);
+
+    size_t serial = 0;
+    while (c->size < size) {
+        char *p = c->text + c->size;
+        size_t n;
+
+        if (kind == CORPUS_UNIQUE) {
+            /* 5 base-26 serial digits plus random letters: all new up
+             * to 26^5 words */
+            size_t id = serial++;
+            size_t len = 7 + rng_below(6);
+            for (n = 0; n < 5; n++) {
+                p[n] = (char)('a' + id % 26);
+                id /= 26;
+            }
+            while (n < len)
+                p[n++] = (char)('a' + rng_below(26));
+        } else {
+            size_t w = vocab_draw(&v);
+            n = v.len[w];
+            memcpy(p, v.text + v.off[w], n);
+        }
+        if (rng_below(8) == 0)
+            p[0] = (char)(p[0] - 32); /* capitalized */
+
+        if (kind == CORPUS_NONASCII && rng_below(3) == 0) {
+            const char *u = utf8_bits[rng_below(sizeof(utf8_bits) /
+                                                sizeof(utf8_bits[0]))];
+            size_t un = strlen(u);
+            memcpy(p + n, u, un);
+            n += un;
+        }
+
+        size_t r = rng_below(16);
+        p[n++] = r == 0 ? ',' : r == 1 ? '.' : ' ';
+        if (r < 2)
+            p[n++] = r == 1 ? '\n' : ' ';
+        c->size += n;
+    }
+    vocab_free(&v);
+}
+
+typedef struct {
+    const char *word; /* 8 readable bytes past the end (key_inline) */
+    uint32_t hash;
+    uint16_t len;
+} Token;
+
+typedef struct {
+    Token *tok;
+    size_t n;
+    char *store;
+} TokenList;
+
+/* Words of text in order, lowercased into one NUL-separated store */
+static void tokens_from_text(TokenList *l, const char *text, size_t size)
+{
+    size_t cap = size / 2 + 1;
+    char *store = bench_alloc(size + 16);
+    size_t pos = 0;
+
+    l->tok = bench_alloc(cap * sizeof(Token));
+    l->n = 0;
+    l->store = store;
+    for (size_t i = 0; i < size;) {
+        if (!is_letter((unsigned char)text[i])) {
+            i++;
+            continue;
+        }
+        size_t start = pos;
+        while (i < size && is_letter((unsigned char)text[i]))
+            store[pos++] = (char)(text[i++] | 0x20);
+        size_t len = pos - start;
+        store[pos++] = '\0';
+        if (len >= MAX_WORD)
+            continue;
+        l->tok[l->n].word = store + start;
+        l->tok[l->n].hash = kernel->hash(store + start, len);
+        l->tok[l->n].len = (uint16_t)len;
+        l->n++;
+    }
+    memset(store + pos, 0, 16);
+}
+
+/* n Zipfian draws from v (v->n == n: n distinct words in rank order) */
+static void tokens_from_vocab(TokenList *l, const Vocab *v, size_t n)
+{
+    l->tok = bench_alloc(n * sizeof(Token));
+    l->n = n;
+    l->store = NULL;
+    for (size_t i = 0; i < n; i++) {
+        size_t w = v->n == n ? i : vocab_draw(v);
+        l->tok[i].word = v->text + v->off[w];
+        l->tok[i].len = v->len[w];
+        l->tok[i].hash = kernel->hash(l->tok[i].word, v->len[w]);
+    }
+}
+
+static void tokens_free(TokenList *l)
+{
+    free(l->tok);
+    free(l->store);
+}
+
+static inline void insert_token(Table *t, const Token *k)
+{
+    table_insert(t, k->word, k->len, k->hash,
+                 (uint16_t)(k->hash ^ (k->hash >> 16)));
+}
+
+/* n tokens in INSERT_BATCH groups, each prefetched before it is inserted */
+static void insert_batched(Table *t, const Token *tok, size_t n)
+{
+    for (size_t w = 0; w < n; w += INSERT_BATCH) {
+        size_t end = n - w > INSERT_BATCH ? w + INSERT_BATCH : n;
+        for (size_t k = w; k < end; k++)
+            table_prefetch(t, tok[k].hash);
+        for (size_t k = w; k < end; k++)
+            insert_token(t, &tok[k]);
+    }
+}
+
+/*===========================================================================
+ * Timing and Repetition Statistics
+ *===========================================================================*/
+
+typedef struct {
+    double ns[BENCH_MAX_REPS];
+    int n;
+} Samples;
+
+static inline double now_ns(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int bench_wanted(const char *group, const char *name)
+{
+    char full[128];
+    if (!bench_filter)
+        return 1;
+    (void)snprintf(full, sizeof(full), "%s/%s", group, name);
+    return strstr(full, bench_filter) != NULL;
+}
+
+static void print_header(void)
+{
+    if (bench_tsv) {
+        (void)printf("bench\tcase\tunit\tmedian\tmin\tmean\tcv_pct\treps\n");
+        return;
+    }
+    (void)printf("%-9s %-28s %-8s %9s %9s %9s %6s %5s\n",
+                 "bench",
+                 "case",
+                 "unit",
+                 "median",
+                 "min",
+                 "mean",
+                 "cv%",
+                 "reps");
+}
+
+/* One row; s holds whole-repetition times, work the units per repetition */
+static void report(const char *group,
+                   const char *name,
+                   const char *unit,
+                   Samples *s,
+                   double work)
+{
+    double sum = 0, sq = 0;
+
+    for (int i = 0; i < s->n; i++)
+        sum += s->ns[i];
+    double mean = sum / s->n;
+    for (int i = 0; i < s->n; i++)
+        sq += (s->ns[i] - mean) * (s->ns[i] - mean);
+    double sd = s->n > 1 ? sqrt(sq / (s->n - 1)) : 0;
+
+    qsort(s->ns, (size_t)s->n, sizeof(double), cmp_double);
+    double median = s->n % 2 ? s->ns[s->n / 2]
+                             : (s->ns[s->n / 2 - 1] + s->ns[s->n / 2]) / 2;
+    double cv = mean > 0 ? 100.0 * sd / mean : 0;
+
+    (void)printf(bench_tsv ? "%s\t%s\t%s\t%.4f\t%.4f\t%.4f\t%.2f\t%d\n"
+                           : "%-9s %-28s %-8s %9.4f %9.4f %9.4f %6.2f %5d\n",
+                 group,
+                 name,
+                 unit,
+                 median / work,
+                 s->ns[0] / work,
+                 mean / work,
+                 cv,
+                 s->n);
+    (void)fflush(stdout);
+}
+
+/*===========================================================================
+ * Benchmarks
+ *===========================================================================*/
+
+static void bench_tokenize(const Corpus *corp)
+{
+    static const char *const variants[] = { "", "-rules", "-utf8" };
+
+    if (rules_parse("letters") < 0)
+        exit(1);
+    utf8_init();
+    for (size_t k = 0; k < 3 * NUM_KERNELS; k++) {
+        const Kernel *kern = &kernels[k % NUM_KERNELS];
+        size_t variant = k / NUM_KERNELS;
+        ProcessFn process = variant == 2   ? kern->process_utf8
+                            : variant == 1 ? kern->process_rules
+                                           : kern->process;
+        if (!kern->supported())
+            continue;
+        for (int c = 0; c < NUM_CORPORA; c++) {
+            char name[64];
+            Samples s;
+
+            (void)snprintf(name, sizeof(name), "%s%s/%s",
+                           kern->id, variants[variant], corpus_names[c]);
+            if (!bench_wanted("tokenize", name))
+                continue;
+            s.n = 0;
+            for (int r = -1; r < bench_reps; r++) {
+                Table t;
+                if (table_init(&t, 0, corp[c].size, TABLE_LINEAR,
+                               RESIZE_FULL) != 0)
+                    exit(1);
+                double t0 = now_ns();
+                process(&t, corp[c].text, corp[c].size, 0);
+                double t1 = now_ns();
+                table_free(&t);
+                if (r >= 0)
+                    s.ns[s.n++] = t1 - t0;
+            }
+            report("tokenize", name, "ns/byte", &s, (double)corp[c].size);
+        }
+    }
+}
+
+static const char *hash_name(uint32_t (*fn)(const char *, size_t))
+{
+    return fn == hash_fnv1a ? "fnv1a" : "crc32c";
+}
+
+static void bench_hash(const TokenList *lists)
+{
+    uint32_t (*seen[NUM_KERNELS])(const char *, size_t);
+    size_t nseen = 0;
+
+    for (size_t k = 0; k < NUM_KERNELS; k++) {
+        uint32_t (*fn)(const char *, size_t) = kernels[k].hash;
+        size_t j = 0;
+
+        if (!kernels[k].supported())
+            continue;
+        while (j < nseen && seen[j] != fn)
+            j++;
+        if (j < nseen)
+            continue;
+        seen[nseen++] = fn;
+
+        for (int c = 0; c < NUM_CORPORA; c++) {
+            char name[64];
+            Samples s;
+            const TokenList *l = &lists[c];
+
+            (void)snprintf(name, sizeof(name),
+                           "%s/%s", hash_name(fn), corpus_names[c]);
+            if (!bench_wanted("hash", name))
+                continue;
+            s.n = 0;
+            for (int r = -1; r < bench_reps; r++) {
+                uint32_t acc = 0;
+                double t0 = now_ns();
+                for (size_t i = 0; i < l->n; i++)
+                    acc += fn(l->tok[i].word, l->tok[i].len);
+                double t1 = now_ns();
+                __asm__ volatile("" : : "r"(acc));
+                if (r >= 0)
+                    s.ns[s.n++] = t1 - t0;
+            }
+            report("hash", name, "ns/word", &s, (double)l->n);
+        }
+    }
+}
+
+/* Cardinality x word length streams for insert and merge */
+typedef struct {
+    const char *name;
+    size_t vocab; /* 0: every word distinct */
+    size_t lo, hi;
+} StreamSpec;
+
+static const StreamSpec stream_specs[] = {
+    { "zipf1k/short", 1000, 3, 8 },     { "zipf64k/short", 65536, 3, 8 },
+    { "zipf1m/short", 1u << 20, 5, 8 }, { "zipf1k/long", 1000, 9, 32 },
+    { "zipf64k/long", 65536, 9, 32 },   { "zipf1m/long", 1u << 20, 9, 32 },
+    { "unique/english", 0, 0, 0 },
+};
+
+#define NUM_STREAMS (sizeof(stream_specs) / sizeof(stream_specs[0]))
+
+static void stream_make(TokenList *l, Vocab *v, const StreamSpec *sp)
+{
+    vocab_make(v, sp->vocab ? sp->vocab : BENCH_WORDS, sp->lo, sp->hi);
+    tokens_from_vocab(l, v, BENCH_WORDS);
+}
+
+static size_t stream_unique(const StreamSpec *sp)
+{
+    return sp->vocab && sp->vocab < BENCH_WORDS ? sp->vocab : BENCH_WORDS;
+}
+
+static void bench_insert(void)
+{
+    /* kinds[k & 1], batched when k >= 2 */
+    static const char *const kinds[] = { "linear", "swiss", "linear-batch",
+                                         "swiss-batch" };
+
+    for (size_t i = 0; i < NUM_STREAMS; i++) {
+        const StreamSpec *sp = &stream_specs[i];
+        int any = 0;
+        for (int k = 0; k < 4; k++) {
+            char name[64];
+            (void)snprintf(name, sizeof(name), "%s/%s", kinds[k], sp->name);
+            any |= bench_wanted("insert", name);
+        }
+        if (!any)
+            continue;
+
+        TokenList l;
+        Vocab v;
+        stream_make(&l, &v, sp);
+        /* table_init sizes for bytes / 50 unique words: no grows */
+        size_t bytes = stream_unique(sp) * 50;
+
+        for (int k = 0; k < 4; k++) {
+            char name[64];
+            Samples s;
+
+            (void)snprintf(name, sizeof(name), "%s/%s", kinds[k], sp->name);
+            if (!bench_wanted("insert", name))
+                continue;
+            s.n = 0;
+            for (int r = -1; r < bench_reps; r++) {
+                Table t;
+                if (table_init(&t, 0, bytes, (TableKind)(k & 1), RESIZE_FULL) !=
+                    0)
+                    exit(1);
+                double t0 = now_ns();
+                if (k >= 2) {
+                    insert_batched(&t, l.tok, l.n);
+                } else {
+                    for (size_t w = 0; w < l.n; w++)
+                        insert_token(&t, &l.tok[w]);
+                }
+                double t1 = now_ns();
+                if (t.grows)
+                    (void)fprintf(stderr,
+                                  "insert/%s: table grew %u times\n",
+                                  name,
+                                  t.grows);
+                table_free(&t);
+                if (r >= 0)
+                    s.ns[s.n++] = t1 - t0;
+            }
+            report("insert", name, "ns/word", &s, (double)l.n);
+        }
+        tokens_free(&l);
+        vocab_free(&v);
+    }
+}
+
+/* Distinct words from the rank counter, enough to fill a table of cap */
+static void bench_grow(void)
+{
+    static const size_t caps[] = { 1u << 17, 1u << 21 };
+
+    for (size_t c = 0; c < sizeof(caps) / sizeof(caps[0]); c++) {
+        for (int k = 0; k < 2; k++) {
+            char name[64];
+            Samples s;
+            size_t cap = caps[c];
+            /* stop one short of the threshold that would grow on insert */
+            size_t fill = k == TABLE_SWISS ? cap * 7 / 8 : cap * 7 / 10;
+
+            (void)snprintf(name, sizeof(name), "%s/%zuk",
+                           k == TABLE_SWISS ? "swiss" : "linear", cap >> 10);
+            if (!bench_wanted("grow", name))
+                continue;
+
+            Vocab v;
+            TokenList l;
+            vocab_make(&v, fill, 0, 0);
+            tokens_from_vocab(&l, &v, fill);
+
+            s.n = 0;
+            for (int r = -1; r < bench_reps; r++) {
+                Table t;
+                /* table_init sizes for bytes / 50 words: 2x (linear)
+                 * or 8/7x (swiss) of that, rounded up to a power of 2 */
+                size_t bytes = k == TABLE_SWISS ? cap / 4 * 3 * 50
+                                                : cap / 2 * 50;
+                if (table_init(&t, 0, bytes, (TableKind)k, RESIZE_FULL) != 0)
+                    exit(1);
+                for (size_t w = 0; w < l.n; w++)
+                    insert_token(&t, &l.tok[w]);
+                if (t.grows || t.cap != cap)
+                    (void)fprintf(stderr,
+                                  "grow/%s: cap %zu, %u grows while filling\n",
+                                  name,
+                                  t.cap,
+                                  t.grows);
+                double t0 = now_ns();
+                if (k == TABLE_SWISS)
+                    swiss_grow(&t);
+                else
+                    table_grow(&t);
+                double t1 = now_ns();
+                table_free(&t);
+                if (r >= 0)
+                    s.ns[s.n++] = t1 - t0;
+            }
+            report("grow", name, "ns/entry", &s, (double)fill);
+            tokens_free(&l);
+            vocab_free(&v);
+        }
+    }
+}
+
+/* merge_tables over nthreads tables, each counting 1/nthreads of a stream */
+static void bench_merge(void)
+{
+    for (size_t i = 0; i < NUM_STREAMS; i++) {
+        const StreamSpec *sp = &stream_specs[i];
+        char name[64];
+        Samples s;
+
+        (void)snprintf(name, sizeof(name), "t%d/%s", nthreads, sp->name);
+        if (!bench_wanted("merge", name))
+            continue;
+
+        TokenList l;
+        Vocab v;
+        stream_make(&l, &v, sp);
+        size_t share = l.n / (size_t)nthreads;
+        size_t entries = 0;
+        for (int t = 0; t < nthreads; t++) {
+            if (table_init(&tables[t], t, stream_unique(sp) * 50,
+                           TABLE_LINEAR, RESIZE_FULL) != 0)
+                exit(1);
+            size_t end = t == nthreads - 1 ? l.n : share * (size_t)(t + 1);
+            for (size_t w = share * (size_t)t; w < end; w++)
+                insert_token(&tables[t], &l.tok[w]);
+            entries += tables[t].len;
+        }
+
+        s.n = 0;
+        for (int r = -1; r < bench_reps; r++) {
+            size_t uniq, total, cap;
+            for (int t = 0; t < nthreads; t++) {
+                merge_units[t].top = NULL;
+                merge_units[t].top_len = 0;
+            }
+            double t0 = now_ns();
+            Entry *g = merge_tables(&uniq, &total, &cap);
+            double t1 = now_ns();
+            free(g);
+            for (int t = 0; t < nthreads; t++)
+                free(merge_units[t].top);
+            if (r >= 0)
+                s.ns[s.n++] = t1 - t0;
+        }
+        report("merge", name, "ns/entry", &s, (double)entries);
+
+        for (int t = 0; t < nthreads; t++)
+            table_free(&tables[t]);
+        tokens_free(&l);
+        vocab_free(&v);
+    }
+}
+
+/*===========================================================================
+ * Main
+ *===========================================================================*/
+
+static void bench_usage(FILE *out, const char *prog)
+{
+    (void)fprintf(
+            out,
+            "usage: %s [options]\n"
+            "\n"
+            "  --size=BYTES    tokenizer corpus size, K/M/G suffix (default\n"
+            "                  %uM)\n"
+            "  --reps=N        timed repetitions per case (1-%d, default %d)\n"
+            "  --filter=TEXT   only cases whose bench/case contains TEXT\n"
+            "  -t, --threads=N merge threads (default: as wordcount_hyperopt)\n"
+            "  --seed=N        corpus seed\n"
+            "  --tsv           tab-separated rows for scripts\n"
+            "\n"
+            "WORDCOUNT_SIMD selects the hash used for insert/merge streams.\n",
+            prog,
+            BENCH_SIZE >> 20,
+            BENCH_MAX_REPS,
+            BENCH_REPS);
+}
+
+static size_t bench_parse_size(const char *arg)
+{
+    char *end;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (end == arg)
+        return 0;
+    if (*end == 'K' || *end == 'k')
+        v <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        v <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        v <<= 30;
+    else if (*end)
+        return 0;
+    return (size_t)v;
+}
+
+/* Run on one CPU so the scheduler does not move the timed loops */
+static void bench_pin(void)
+{
+    int cpus[MAX_CPUS];
+    cpu_set_t set;
+
+    if (allowed_cpus(cpus, MAX_CPUS) < 1)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET((size_t)cpus[0], &set);
+    (void)sched_setaffinity(0, sizeof(set), &set);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_opts[] = {
+        { "size", required_argument, NULL, 's' },
+        { "reps", required_argument, NULL, 'r' },
+        { "filter", required_argument, NULL, 'f' },
+        { "threads", required_argument, NULL, 't' },
+        { "seed", required_argument, NULL, 'S' },
+        { "tsv", no_argument, NULL, 'T' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int opt;
+
+    nthreads = 0;
+    while ((opt = getopt_long(argc, argv, "t:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            bench_size = bench_parse_size(optarg);
+            if (bench_size < 4096) {
+                (void)fprintf(stderr, "bad --size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            bench_reps = atoi(optarg);
+            if (bench_reps < 1 || bench_reps > BENCH_MAX_REPS) {
+                (void)fprintf(stderr, "bad --reps: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            bench_filter = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1 || nthreads > MAX_THREADS) {
+                (void)fprintf(stderr, "bad --threads: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            rng_state = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 'T':
+            bench_tsv = 1;
+            break;
+        case 'h':
+            bench_usage(stdout, argv[0]);
+            return 0;
+        default:
+            bench_usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads == 0)
+        nthreads = default_threads();
+
+    select_kernel();
+    bench_pin();
+
+    Corpus corp[NUM_CORPORA];
+    TokenList words[NUM_CORPORA];
+    for (int c = 0; c < NUM_CORPORA; c++) {
+        corpus_make(&corp[c], (CorpusKind)c, bench_size);
+        tokens_from_text(&words[c], corp[c].text, corp[c].size);
+    }
+
+    if (!bench_tsv)
+        (void)printf("# %s, corpus %zu KB, %d reps, %d merge threads\n",
+                     kernel->name,
+                     bench_size >> 10,
+                     bench_reps,
+                     nthreads);
+    print_header();
+    bench_tokenize(corp);
+    bench_hash(words);
+    bench_insert();
+    bench_grow();
+    bench_merge();
+
+    for (int c = 0; c < NUM_CORPORA; c++) {
+        free(corp[c].text);
+        tokens_free(&words[c]);
+    }
+    return 0;
+}